@@ -0,0 +1,300 @@
+// Command line front end of the conversion library, for scripts and pipelines.
+// "-" as a path reads stdin or writes stdout, so conversions can be chained without temporary files:
+//     wave2img-cli encode frame.png - | gzip > frame.wav.gz
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "wave2img.h"
+
+static void print_usage(const char *program) {
+    fprintf(stderr,
+        "Usage: %s encode [options] <input.png|-> <output.wav|output.flac|->\n"
+        "       %s decode [options] <input.wav|input.flac|-> <output.png|->\n"
+        "       %s resample -r <rate> [-b <bits>] [-c <container>] <input.wav|input.flac|-> <output.wav|output.flac|->\n"
+        "       %s verify <input.wav|input.flac|->\n"
+        "       %s pack [options] <input.png>... <output.wav>\n"
+        "       %s unpack [-i <frame>] [options] <input.wav> <output%%04d.png>\n"
+        "\n"
+        "Options:\n"
+        "  -r <rate>   sample rate of the WAV written (default %d)\n"
+        "  -m <mode>   array, list, stack, queue or pipeline (default array)\n"
+        "  -e <enc>    raw, apt, spectrogram, ofdm or rle (default raw), decode reads it from the file when recorded there\n"
+        "  -p <pps>    pixels per second (default %d for raw, %d for apt, at most %d for spectrogram)\n"
+        "  -b <bits>   16, 8 or 32 (float) bits per sample of the audio written (default 16)\n"
+        "  -c <cont>   wav or flac (default flac for a .flac output, wav otherwise)\n"
+        "  -y <color>  gray, ycbcr, ycbcr420, rgb or rgba (default gray), decode rebuilds the colours when recorded\n"
+        "  -l <layout> rows or channels: colour planes one after the other or as WAV channels (default rows)\n"
+        "  -s <rows>   raw: a sync marker and row index before every <rows> rows (default none)\n"
+        "  -f <parity> raw: Reed-Solomon parity symbols per 255 sample codeword, 32 corrects 16 (default none)\n"
+        "  -o <order>  raw: raster, adam7 (interlaced so a partial stream decodes to a preview), boustrophedon,\n"
+        "              morton or hilbert (default raster)\n"
+        "  -d <pred>   raw: none, left, up, average, paeth or adaptive, rows sent as residuals of that prediction,\n"
+        "              adaptive picking the best per row (default none)\n"
+        "  -t <secs>   encode: shrink the image until the audio plays at most this long (default no limit)\n"
+        "  -T <count>  encode: the same as a number of samples\n"
+        "  -u          decode: scale an image shrunk by -t or -T back up to its original size\n"
+        "  -R <x,y,w,h> decode: only the region from pixel x,y, w or h 0 reaches the edge, e.g. 0,100,0,50 for rows\n"
+        "              100 to 149 (default the whole image)\n"
+        "  -i <frame>  unpack: only this frame, counted from 0, to the output name as given when it holds no\n"
+        "              number (default all frames, numbered by the %%d or %%04d in the output name)\n"
+        "  -q          don't print progress\n",
+        program, program, program, program, program, program, SAMPLE_RATE, SAMPLE_RATE, APT_PIXELS_PER_SECOND,
+        SPECTROGRAM_PIXELS_PER_SECOND);
+}
+
+// Map a mode name to its MODE_ value, -1 if unknown
+static int parse_mode(const char *name) {
+    if (strcmp(name, "array") == 0) return MODE_ARRAY;
+    if (strcmp(name, "list") == 0) return MODE_LINKED_LIST;
+    if (strcmp(name, "stack") == 0) return MODE_STACK;
+    if (strcmp(name, "queue") == 0) return MODE_QUEUE;
+    if (strcmp(name, "pipeline") == 0) return MODE_PIPELINE;
+    return -1;
+}
+
+// Map an encoding name to its ENCODING_ value, -1 if unknown
+static int parse_encoding(const char *name) {
+    if (strcmp(name, "raw") == 0) return ENCODING_RAW;
+    if (strcmp(name, "apt") == 0) return ENCODING_APT;
+    if (strcmp(name, "spectrogram") == 0) return ENCODING_SPECTROGRAM;
+    if (strcmp(name, "ofdm") == 0) return ENCODING_OFDM;
+    if (strcmp(name, "rle") == 0) return ENCODING_RLE;
+    return -1;
+}
+
+// Map a container name to its CONTAINER_ value, -1 if unknown
+static int parse_container(const char *name) {
+    if (strcmp(name, "wav") == 0) return CONTAINER_WAV;
+    if (strcmp(name, "flac") == 0) return CONTAINER_FLAC;
+    return -1;
+}
+
+// Map a colour name to its COLOR_ value, -1 if unknown
+static int parse_color(const char *name) {
+    if (strcmp(name, "gray") == 0) return COLOR_GRAY;
+    if (strcmp(name, "ycbcr") == 0) return COLOR_YCBCR;
+    if (strcmp(name, "ycbcr420") == 0) return COLOR_YCBCR420;
+    if (strcmp(name, "rgb") == 0) return COLOR_RGB;
+    if (strcmp(name, "rgba") == 0) return COLOR_RGBA;
+    return -1;
+}
+
+// Map a colour layout name to its COLOR_LAYOUT_ value, -1 if unknown
+static int parse_color_layout(const char *name) {
+    if (strcmp(name, "rows") == 0) return COLOR_LAYOUT_ROWS;
+    if (strcmp(name, "channels") == 0) return COLOR_LAYOUT_CHANNELS;
+    return -1;
+}
+
+// Map a pixel order name to its ORDER_ value, -1 if unknown
+static int parse_order(const char *name) {
+    if (strcmp(name, "raster") == 0) return ORDER_RASTER;
+    if (strcmp(name, "adam7") == 0) return ORDER_ADAM7;
+    if (strcmp(name, "boustrophedon") == 0) return ORDER_BOUSTROPHEDON;
+    if (strcmp(name, "morton") == 0) return ORDER_MORTON;
+    if (strcmp(name, "hilbert") == 0) return ORDER_HILBERT;
+    return -1;
+}
+
+// Map a predictor name to its PREDICT_ value, -1 if unknown
+static int parse_predictor(const char *name) {
+    if (strcmp(name, "none") == 0) return PREDICT_NONE;
+    if (strcmp(name, "left") == 0) return PREDICT_LEFT;
+    if (strcmp(name, "up") == 0) return PREDICT_UP;
+    if (strcmp(name, "average") == 0) return PREDICT_AVERAGE;
+    if (strcmp(name, "paeth") == 0) return PREDICT_PAETH;
+    if (strcmp(name, "adaptive") == 0) return PREDICT_ADAPTIVE;
+    return -1;
+}
+
+// Progress on stderr, stdout may be carrying the converted data
+static void print_progress(double fraction, void *user_data) {
+    int *last = (int *)user_data;
+    int percent = (int)(fraction * 100.0);
+    if (percent != *last) {
+        *last = percent;
+        fprintf(stderr, "\r%3d%%", percent);
+        if (percent == 100) {
+            fprintf(stderr, "\n");
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    const char *command = argv[1];
+    bool pack = strcmp(command, "pack") == 0;
+    // Paths are gathered over the arguments already read, a pack takes any number of them
+    char **paths = argv + 2;
+    int num_paths = 0;
+    int frame = -1;
+    bool quiet = false;
+    int container = -1;
+    ConversionOptions options = { .sample_rate = SAMPLE_RATE, .mode = MODE_ARRAY };
+
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+            options.sample_rate = atoi(argv[++i]);
+            if (options.sample_rate <= 0) {
+                fprintf(stderr, "Error: Invalid sample rate %s.\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+            options.mode = parse_mode(argv[++i]);
+            if (options.mode < 0) {
+                fprintf(stderr, "Error: Unknown mode %s.\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-e") == 0 && i + 1 < argc) {
+            options.encoding = parse_encoding(argv[++i]);
+            if (options.encoding < 0) {
+                fprintf(stderr, "Error: Unknown encoding %s.\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+            options.pixels_per_second = atoi(argv[++i]);
+            if (options.pixels_per_second <= 0) {
+                fprintf(stderr, "Error: Invalid pixels per second %s.\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+            options.bits_per_sample = atoi(argv[++i]);
+            if (options.bits_per_sample != 8 && options.bits_per_sample != 16 && options.bits_per_sample != 32) {
+                fprintf(stderr, "Error: Only 8, 16 or 32 bits per sample can be written, not %s.\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+            container = parse_container(argv[++i]);
+            if (container < 0) {
+                fprintf(stderr, "Error: Unknown container %s.\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-y") == 0 && i + 1 < argc) {
+            options.color = parse_color(argv[++i]);
+            if (options.color < 0) {
+                fprintf(stderr, "Error: Unknown colour %s.\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc) {
+            options.color_layout = parse_color_layout(argv[++i]);
+            if (options.color_layout < 0) {
+                fprintf(stderr, "Error: Unknown colour layout %s.\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            options.frame_rows = atoi(argv[++i]);
+            if (options.frame_rows <= 0) {
+                fprintf(stderr, "Error: Invalid rows between sync markers %s.\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+            options.fec_parity = atoi(argv[++i]);
+            if (options.fec_parity <= 0) {
+                fprintf(stderr, "Error: Invalid parity symbols %s.\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            options.order = parse_order(argv[++i]);
+            if (options.order < 0) {
+                fprintf(stderr, "Error: Unknown pixel order %s.\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
+            options.predictor = parse_predictor(argv[++i]);
+            if (options.predictor < 0) {
+                fprintf(stderr, "Error: Unknown predictor %s.\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            options.max_seconds = atof(argv[++i]);
+            if (options.max_seconds <= 0) {
+                fprintf(stderr, "Error: Invalid duration %s.\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-T") == 0 && i + 1 < argc) {
+            options.max_samples = atoi(argv[++i]);
+            if (options.max_samples <= 0) {
+                fprintf(stderr, "Error: Invalid sample count %s.\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-u") == 0) {
+            options.upscale = 1;
+        } else if (strcmp(argv[i], "-R") == 0 && i + 1 < argc) {
+            if (sscanf(argv[++i], "%d,%d,%d,%d", &options.region_x, &options.region_y, &options.region_width,
+                       &options.region_height) != 4 || options.region_x < 0 || options.region_y < 0 ||
+                options.region_width < 0 || options.region_height < 0) {
+                fprintf(stderr, "Error: Invalid region %s, give it as x,y,width,height.\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-i") == 0 && i + 1 < argc) {
+            frame = atoi(argv[++i]);
+            if (frame < 0) {
+                fprintf(stderr, "Error: Invalid frame %s.\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-q") == 0) {
+            quiet = true;
+        } else if ((num_paths < 2 || pack) && (argv[i][0] != '-' || argv[i][1] == '\0')) {
+            paths[num_paths++] = argv[i];
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    bool verify = strcmp(command, "verify") == 0;
+    if (pack ? num_paths < 2 : num_paths != (verify ? 1 : 2)) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    if (container < 0) {
+        const char *output = paths[num_paths - 1];
+        size_t length = verify ? 0 : strlen(output);
+        container = length > 5 && strcmp(output + length - 5, ".flac") == 0 ? CONTAINER_FLAC : CONTAINER_WAV;
+    }
+    options.container = container;
+
+    int last_percent = -1;
+    ConversionContext ctx;
+    conversion_context_init(&ctx, &options, quiet ? NULL : print_progress, &last_percent);
+
+    int result;
+    if (strcmp(command, "encode") == 0) {
+        result = main_image_to_audio(&ctx, paths[0], paths[1]);
+    } else if (strcmp(command, "decode") == 0) {
+        result = main_audio_to_image(&ctx, paths[0], paths[1]);
+    } else if (strcmp(command, "resample") == 0) {
+        result = main_resample_audio(&ctx, paths[0], paths[1]);
+    } else if (pack) {
+        result = main_archive_images(&ctx, (const char *const *)paths, num_paths - 1, paths[num_paths - 1]);
+    } else if (strcmp(command, "unpack") == 0) {
+        result = main_extract_images(&ctx, paths[0], paths[1], frame);
+    } else if (verify) {
+        result = main_verify_audio(&ctx, paths[0]);
+        if (result == CONVERSION_OK) {
+            printf("%s: OK\n", paths[0]);
+        }
+    } else {
+        conversion_context_free(&ctx);
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    // The library prints nothing, its messages come back in the context
+    int warnings = atomic_load(&ctx.warnings);
+    if (warnings > 1) {
+        fprintf(stderr, "Warning: %s (%d warnings in all)\n", ctx.warning, warnings);
+    } else if (warnings == 1) {
+        fprintf(stderr, "Warning: %s\n", ctx.warning);
+    }
+    if (result == CONVERSION_ERROR) {
+        fprintf(stderr, "Error: %s\n", ctx.error);
+    }
+    conversion_context_free(&ctx);
+    return result == CONVERSION_OK ? 0 : 1;
+}
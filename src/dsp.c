@@ -0,0 +1,2155 @@
+// Wave2Image signal processing
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <math.h>
+#include <pthread.h>
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#endif
+#ifdef __SSE4_2__
+#include <nmmintrin.h>
+#endif
+
+#include "dsp.h"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+#define NCO_TABLE_SIZE (1 << NCO_TABLE_BITS)
+#define CARRIER_LEVEL 29490 // 90% of full scale, headroom for resampling and filters later on
+#define ERROR_SIZE 256      // bytes kept of an error message, as CONVERSION_ERROR_SIZE
+
+// -------------------------------------------------------------------------------------------------------- errors
+
+// The first error on this thread since dsp_clear_error
+static _Thread_local char thread_error[ERROR_SIZE];
+
+// Keep the first error for the library to pick up, nothing is printed
+static void dsp_error(const char *format, ...) {
+    va_list args;
+    if (thread_error[0] == '\0') {
+        va_start(args, format);
+        vsnprintf(thread_error, sizeof(thread_error), format, args);
+        va_end(args);
+        thread_error[strcspn(thread_error, "\n")] = '\0';
+    }
+}
+
+const char *dsp_last_error(void) {
+    return thread_error;
+}
+
+void dsp_clear_error(void) {
+    thread_error[0] = '\0';
+}
+
+// -------------------------------------------------------------------------------------------------------- nco
+
+static int16_t sine_table[NCO_TABLE_SIZE];     // carrier level, for modulating
+static float unit_sine_table[NCO_TABLE_SIZE];  // amplitude 1, for mixing down
+static pthread_once_t sine_table_once = PTHREAD_ONCE_INIT;
+
+static void fill_sine_table(void) {
+    for (int i = 0; i < NCO_TABLE_SIZE; i++) {
+        double s = sin(2.0 * M_PI * i / NCO_TABLE_SIZE);
+        sine_table[i] = (int16_t)lrint(CARRIER_LEVEL * s);
+        unit_sine_table[i] = (float)s;
+    }
+}
+
+// Start an oscillator at phase 0 for the given frequency
+void nco_init(Nco *nco, double frequency, int sample_rate) {
+    pthread_once(&sine_table_once, fill_sine_table);
+    nco->phase = 0;
+    nco->step = (uint32_t)llrint(frequency / sample_rate * 4294967296.0);
+}
+
+// Next count samples of the oscillator, the phase wraps around by itself
+void nco_generate(Nco *nco, int16_t *out, int count) {
+    uint32_t phase = nco->phase;
+    for (int i = 0; i < count; i++) {
+        out[i] = sine_table[phase >> (32 - NCO_TABLE_BITS)];
+        phase += nco->step;
+    }
+    nco->phase = phase;
+}
+
+// -------------------------------------------------------------------------------------------------------- am
+
+// Multiply the carrier by the envelope, Q15 with rounding. All three paths give identical output.
+void am_modulate(const int16_t *carrier, const int16_t *envelope, int16_t *out, int count) {
+    int i = 0;
+#if defined(__SSSE3__)
+    for (; i + 8 <= count; i += 8) {
+        __m128i c = _mm_loadu_si128((const __m128i *)(carrier + i));
+        __m128i e = _mm_loadu_si128((const __m128i *)(envelope + i));
+        _mm_storeu_si128((__m128i *)(out + i), _mm_mulhrs_epi16(c, e));
+    }
+#elif defined(__SSE2__)
+    const __m128i round = _mm_set1_epi32(0x4000);
+    for (; i + 8 <= count; i += 8) {
+        __m128i c = _mm_loadu_si128((const __m128i *)(carrier + i));
+        __m128i e = _mm_loadu_si128((const __m128i *)(envelope + i));
+        __m128i lo = _mm_mullo_epi16(c, e);
+        __m128i hi = _mm_mulhi_epi16(c, e);
+        __m128i p0 = _mm_srai_epi32(_mm_add_epi32(_mm_unpacklo_epi16(lo, hi), round), 15);
+        __m128i p1 = _mm_srai_epi32(_mm_add_epi32(_mm_unpackhi_epi16(lo, hi), round), 15);
+        _mm_storeu_si128((__m128i *)(out + i), _mm_packs_epi32(p0, p1));
+    }
+#endif
+    for (; i < count; i++) {
+        out[i] = (int16_t)(((int32_t)carrier[i] * envelope[i] + 0x4000) >> 15);
+    }
+}
+
+// -------------------------------------------------------------------------------------------------------- pcm
+
+// 16-bit samples to unsigned 8-bit PCM, rounded: (s + 128) / 256 + 128. Raw pixels, (p - 128) * 256,
+// come back as exactly p.
+void pcm_s16_to_u8(const int16_t *in, uint8_t *out, size_t count) {
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i half = _mm_set1_epi16(128);
+    const __m128i sign = _mm_set1_epi8((char)0x80);
+    for (; i + 16 <= count; i += 16) {
+        __m128i a = _mm_srai_epi16(_mm_adds_epi16(_mm_loadu_si128((const __m128i *)(in + i)), half), 8);
+        __m128i b = _mm_srai_epi16(_mm_adds_epi16(_mm_loadu_si128((const __m128i *)(in + i + 8)), half), 8);
+        _mm_storeu_si128((__m128i *)(out + i), _mm_xor_si128(_mm_packs_epi16(a, b), sign));
+    }
+#endif
+    for (; i < count; i++) {
+        int value = (in[i] + 128) >> 8;
+        out[i] = (uint8_t)((value > 127 ? 127 : value) + 128);
+    }
+}
+
+// Unsigned 8-bit PCM to 16-bit samples, (b - 128) * 256: flipping the top bit and interleaving with
+// zero bytes puts each sample in the high byte
+void pcm_u8_to_s16(const uint8_t *in, int16_t *out, size_t count) {
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i sign = _mm_set1_epi8((char)0x80);
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 16 <= count; i += 16) {
+        __m128i b = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(in + i)), sign);
+        _mm_storeu_si128((__m128i *)(out + i), _mm_unpacklo_epi8(zero, b));
+        _mm_storeu_si128((__m128i *)(out + i + 8), _mm_unpackhi_epi8(zero, b));
+    }
+#endif
+    for (; i < count; i++) {
+        out[i] = (int16_t)((in[i] - 128) * 256);
+    }
+}
+
+// 16-bit samples to IEEE float, s / 32768, eight at a time widened and scaled with SSE2
+void pcm_s16_to_f32(const int16_t *in, float *out, size_t count) {
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128 scale = _mm_set1_ps(1.0f / 32768.0f);
+    for (; i + 8 <= count; i += 8) {
+        __m128i s = _mm_loadu_si128((const __m128i *)(in + i));
+        __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(s, s), 16);
+        __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(s, s), 16);
+        _mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(lo), scale));
+        _mm_storeu_ps(out + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), scale));
+    }
+#endif
+    for (; i < count; i++) {
+        out[i] = in[i] * (1.0f / 32768.0f);
+    }
+}
+
+// IEEE float to 16-bit samples, rounded to nearest even and clamped; NaN becomes -32768 on both paths
+void pcm_f32_to_s16(const float *in, int16_t *out, size_t count) {
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128 scale = _mm_set1_ps(32768.0f);
+    const __m128 low = _mm_set1_ps(-32768.0f), high = _mm_set1_ps(32767.0f);
+    for (; i + 8 <= count; i += 8) {
+        // max_ps returns its second operand when the first is NaN
+        __m128 a = _mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_loadu_ps(in + i), scale), low), high);
+        __m128 b = _mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_loadu_ps(in + i + 4), scale), low), high);
+        _mm_storeu_si128((__m128i *)(out + i), _mm_packs_epi32(_mm_cvtps_epi32(a), _mm_cvtps_epi32(b)));
+    }
+#endif
+    for (; i < count; i++) {
+        float value = in[i] * 32768.0f;
+        out[i] = (int16_t)(value >= 32767.0f ? 32767 : value > -32768.0f ? lrintf(value) : -32768);
+    }
+}
+
+// Full range BT.601 YCbCr (as in JPEG) in 8-bit fixed point, coefficients scaled by 256:
+//     Y = (77 R + 150 G + 29 B) / 256,  Cb = 128 + (128 B - 43 R - 85 G) / 256,  Cr = 128 + (128 R - 107 G - 21 B) / 256
+// Every sum stays in 16 bits, eight pixels are converted at a time with SSE2.
+void rgba_to_ycbcr(const uint8_t *rgba, uint8_t *y, uint8_t *cb, uint8_t *cr, size_t count) {
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i byte = _mm_set1_epi32(0xFF);
+    const __m128i round = _mm_set1_epi16(128);
+    const __m128i c77 = _mm_set1_epi16(77), c150 = _mm_set1_epi16(150), c29 = _mm_set1_epi16(29);
+    const __m128i c43 = _mm_set1_epi16(43), c85 = _mm_set1_epi16(85);
+    const __m128i c107 = _mm_set1_epi16(107), c21 = _mm_set1_epi16(21);
+    for (; i + 8 <= count; i += 8) {
+        __m128i p0 = _mm_loadu_si128((const __m128i *)(rgba + i * 4));
+        __m128i p1 = _mm_loadu_si128((const __m128i *)(rgba + i * 4 + 16));
+        __m128i r = _mm_packs_epi32(_mm_and_si128(p0, byte), _mm_and_si128(p1, byte));
+        __m128i g = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(p0, 8), byte), _mm_and_si128(_mm_srli_epi32(p1, 8), byte));
+        __m128i b = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(p0, 16), byte), _mm_and_si128(_mm_srli_epi32(p1, 16), byte));
+
+        // Y sums reach 65408, read unsigned; the chroma sums stay within +-32640, rounding saturates
+        __m128i luma = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(r, c77), _mm_mullo_epi16(g, c150)),
+                                     _mm_add_epi16(_mm_mullo_epi16(b, c29), round));
+        __m128i blue = _mm_sub_epi16(_mm_slli_epi16(b, 7), _mm_add_epi16(_mm_mullo_epi16(r, c43), _mm_mullo_epi16(g, c85)));
+        __m128i red = _mm_sub_epi16(_mm_slli_epi16(r, 7), _mm_add_epi16(_mm_mullo_epi16(g, c107), _mm_mullo_epi16(b, c21)));
+        luma = _mm_srli_epi16(luma, 8);
+        blue = _mm_add_epi16(_mm_srai_epi16(_mm_adds_epi16(blue, round), 8), round);
+        red = _mm_add_epi16(_mm_srai_epi16(_mm_adds_epi16(red, round), 8), round);
+        _mm_storel_epi64((__m128i *)(y + i), _mm_packus_epi16(luma, luma));
+        _mm_storel_epi64((__m128i *)(cb + i), _mm_packus_epi16(blue, blue));
+        _mm_storel_epi64((__m128i *)(cr + i), _mm_packus_epi16(red, red));
+    }
+#endif
+    for (; i < count; i++) {
+        const uint8_t *p = rgba + i * 4;
+        int blue = 128 * p[2] - 43 * p[0] - 85 * p[1] + 128;
+        int red = 128 * p[0] - 107 * p[1] - 21 * p[2] + 128;
+        y[i] = (uint8_t)((77 * p[0] + 150 * p[1] + 29 * p[2] + 128) >> 8);
+        cb[i] = (uint8_t)(((blue > 32767 ? 32767 : blue) >> 8) + 128);
+        cr[i] = (uint8_t)(((red > 32767 ? 32767 : red) >> 8) + 128);
+    }
+}
+
+#ifdef __SSE2__
+// (a * c0 + b * c1 + 128) >> 8 for eight pairs, coefficients packed as c0 | c1 << 16
+static inline __m128i ycbcr_term(__m128i a, __m128i b, __m128i coefficients) {
+    const __m128i round = _mm_set1_epi32(128);
+    __m128i lo = _mm_madd_epi16(_mm_unpacklo_epi16(a, b), coefficients);
+    __m128i hi = _mm_madd_epi16(_mm_unpackhi_epi16(a, b), coefficients);
+    return _mm_packs_epi32(_mm_srai_epi32(_mm_add_epi32(lo, round), 8), _mm_srai_epi32(_mm_add_epi32(hi, round), 8));
+}
+#endif
+
+// YCbCr back to 8-bit RGB:  R = Y + 359 Cr' / 256,  G = Y - (88 Cb' + 183 Cr') / 256,  B = Y + 454 Cb' / 256
+// with Cb' = Cb - 128 and Cr' = Cr - 128, clamped to 0 .. 255
+void ycbcr_to_rgb(const uint8_t *y, const uint8_t *cb, const uint8_t *cr, uint8_t *rgb, size_t count) {
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i half = _mm_set1_epi16(128);
+    const __m128i red_c = _mm_set1_epi32(359), blue_c = _mm_set1_epi32(454);
+    const __m128i green_c = _mm_set1_epi32((int)((uint32_t)(-88 & 0xFFFF) | (uint32_t)(-183 & 0xFFFF) << 16));
+    uint8_t planar[3][16];
+    for (; i + 8 <= count; i += 8) {
+        __m128i luma = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(y + i)), zero);
+        __m128i blue = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(cb + i)), zero), half);
+        __m128i red = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(cr + i)), zero), half);
+        __m128i r = _mm_add_epi16(luma, ycbcr_term(red, zero, red_c));
+        __m128i g = _mm_add_epi16(luma, ycbcr_term(blue, red, green_c));
+        __m128i b = _mm_add_epi16(luma, ycbcr_term(blue, zero, blue_c));
+        _mm_storeu_si128((__m128i *)planar[0], _mm_packus_epi16(r, r));
+        _mm_storeu_si128((__m128i *)planar[1], _mm_packus_epi16(g, g));
+        _mm_storeu_si128((__m128i *)planar[2], _mm_packus_epi16(b, b));
+        for (int k = 0; k < 8; k++) {
+            rgb[(i + k) * 3] = planar[0][k];
+            rgb[(i + k) * 3 + 1] = planar[1][k];
+            rgb[(i + k) * 3 + 2] = planar[2][k];
+        }
+    }
+#endif
+    for (; i < count; i++) {
+        int blue = cb[i] - 128, red = cr[i] - 128;
+        int r = y[i] + ((359 * red + 128) >> 8);
+        int g = y[i] + ((-88 * blue - 183 * red + 128) >> 8);
+        int b = y[i] + ((454 * blue + 128) >> 8);
+        rgb[i * 3] = (uint8_t)(r < 0 ? 0 : r > 255 ? 255 : r);
+        rgb[i * 3 + 1] = (uint8_t)(g < 0 ? 0 : g > 255 ? 255 : g);
+        rgb[i * 3 + 2] = (uint8_t)(b < 0 ? 0 : b > 255 ? 255 : b);
+    }
+}
+
+// -------------------------------------------------------------------------------------------------------- channels
+
+// RGBA pixels as interleaved 16-bit samples, (v - 128) * 256 per channel: R G B A frames with four channels,
+// R G B with three. SSSE3 drops the alpha bytes with one shuffle per four pixels.
+void rgba_to_channels(const uint8_t *rgba, int16_t *out, size_t count, int channels) {
+    if (channels == 4) {
+        pcm_u8_to_s16(rgba, out, count * 4);
+        return;
+    }
+    size_t i = 0;
+#ifdef __SSSE3__
+    const __m128i drop = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    const __m128i sign = _mm_set1_epi8((char)0x80);
+    const __m128i zero = _mm_setzero_si128();
+    // The upper store runs four samples into the next pixels, which the next round writes again
+    for (; i + 8 <= count; i += 4) {
+        __m128i b = _mm_xor_si128(_mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(rgba + i * 4)), drop), sign);
+        _mm_storeu_si128((__m128i *)(out + i * 3), _mm_unpacklo_epi8(zero, b));
+        _mm_storeu_si128((__m128i *)(out + i * 3 + 8), _mm_unpackhi_epi8(zero, b));
+    }
+#endif
+    for (; i < count; i++) {
+        for (int c = 0; c < 3; c++) {
+            out[i * 3 + c] = (int16_t)((rgba[i * 4 + c] - 128) * 256);
+        }
+    }
+}
+
+// Three planes as interleaved 16-bit samples, eight frames (three vectors) per round with SSSE3:
+// every output vector gathers its lanes from the three plane vectors with one shuffle each
+void planes_to_channels(const uint8_t *a, const uint8_t *b, const uint8_t *c, int16_t *out, size_t count) {
+    size_t i = 0;
+#ifdef __SSSE3__
+    int8_t masks[3][3][16]; // [output vector][plane][byte]
+    for (int v = 0; v < 3; v++) {
+        for (int j = 0; j < 16; j++) {
+            int lane = v * 8 + j / 2;
+            for (int p = 0; p < 3; p++) {
+                masks[v][p][j] = (int8_t)(lane % 3 == p ? 2 * (lane / 3) + (j & 1) : -1);
+            }
+        }
+    }
+    const __m128i sign = _mm_set1_epi8((char)0x80);
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 8 <= count; i += 8) {
+        __m128i planes[3] = {
+            _mm_unpacklo_epi8(zero, _mm_xor_si128(_mm_loadl_epi64((const __m128i *)(a + i)), sign)),
+            _mm_unpacklo_epi8(zero, _mm_xor_si128(_mm_loadl_epi64((const __m128i *)(b + i)), sign)),
+            _mm_unpacklo_epi8(zero, _mm_xor_si128(_mm_loadl_epi64((const __m128i *)(c + i)), sign)),
+        };
+        for (int v = 0; v < 3; v++) {
+            __m128i lanes = zero;
+            for (int p = 0; p < 3; p++) {
+                lanes = _mm_or_si128(lanes, _mm_shuffle_epi8(planes[p], _mm_loadu_si128((const __m128i *)masks[v][p])));
+            }
+            _mm_storeu_si128((__m128i *)(out + i * 3 + v * 8), lanes);
+        }
+    }
+#endif
+    for (; i < count; i++) {
+        out[i * 3] = (int16_t)((a[i] - 128) * 256);
+        out[i * 3 + 1] = (int16_t)((b[i] - 128) * 256);
+        out[i * 3 + 2] = (int16_t)((c[i] - 128) * 256);
+    }
+}
+
+// Interleaved byte triples back to three planes, sixteen frames per round with SSSE3
+void split_channels(const uint8_t *in, uint8_t *a, uint8_t *b, uint8_t *c, size_t count) {
+    size_t i = 0;
+#ifdef __SSSE3__
+    int8_t masks[3][3][16]; // [plane][input vector][byte]
+    for (int p = 0; p < 3; p++) {
+        for (int x = 0; x < 16; x++) {
+            int byte = 3 * x + p;
+            for (int v = 0; v < 3; v++) {
+                masks[p][v][x] = (int8_t)(byte / 16 == v ? byte % 16 : -1);
+            }
+        }
+    }
+    uint8_t *planes[3] = { a, b, c };
+    for (; i + 16 <= count; i += 16) {
+        __m128i bytes[3];
+        for (int v = 0; v < 3; v++) {
+            bytes[v] = _mm_loadu_si128((const __m128i *)(in + i * 3 + v * 16));
+        }
+        for (int p = 0; p < 3; p++) {
+            __m128i plane = _mm_setzero_si128();
+            for (int v = 0; v < 3; v++) {
+                plane = _mm_or_si128(plane, _mm_shuffle_epi8(bytes[v], _mm_loadu_si128((const __m128i *)masks[p][v])));
+            }
+            _mm_storeu_si128((__m128i *)(planes[p] + i), plane);
+        }
+    }
+#endif
+    for (; i < count; i++) {
+        a[i] = in[i * 3];
+        b[i] = in[i * 3 + 1];
+        c[i] = in[i * 3 + 2];
+    }
+}
+
+// -------------------------------------------------------------------------------------------------------- predict
+
+static uint8_t paeth(int a, int b, int c) {
+    int pa = abs(b - c), pb = abs(a - c), pc = abs(a + b - 2 * c);
+    return (uint8_t)(pa <= pb && pa <= pc ? a : pb <= pc ? b : c);
+}
+
+#ifdef __SSE2__
+// Paeth predictions of eight pixels from their left (a), upper (b) and upper left (c) neighbours in 16 bits
+static __m128i paeth_epi16(__m128i a, __m128i b, __m128i c) {
+    __m128i zero = _mm_setzero_si128();
+    __m128i pa = _mm_sub_epi16(b, c), pb = _mm_sub_epi16(a, c);
+    __m128i pc = _mm_add_epi16(pa, pb);
+    pa = _mm_max_epi16(pa, _mm_sub_epi16(zero, pa));
+    pb = _mm_max_epi16(pb, _mm_sub_epi16(zero, pb));
+    pc = _mm_max_epi16(pc, _mm_sub_epi16(zero, pc));
+    __m128i take_a = _mm_and_si128(_mm_cmpgt_epi16(_mm_add_epi16(pb, _mm_set1_epi16(1)), pa),
+                                   _mm_cmpgt_epi16(_mm_add_epi16(pc, _mm_set1_epi16(1)), pa));
+    __m128i take_b = _mm_cmpgt_epi16(_mm_add_epi16(pc, _mm_set1_epi16(1)), pb);
+    __m128i bc = _mm_or_si128(_mm_and_si128(take_b, b), _mm_andnot_si128(take_b, c));
+    return _mm_or_si128(_mm_and_si128(take_a, a), _mm_andnot_si128(take_a, bc));
+}
+#endif
+
+// Every prediction is made from the original pixels, so all 16 lanes of a round are independent
+void predict_row(int filter, const uint8_t *row, const uint8_t *prev, uint8_t *residuals, size_t width) {
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i sign = _mm_set1_epi8((char)0x80);
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 16 <= width; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(row + i));
+        __m128i up = _mm_loadu_si128((const __m128i *)(prev + i));
+        __m128i left = i > 0 ? _mm_loadu_si128((const __m128i *)(row + i - 1)) : _mm_slli_si128(x, 1);
+        __m128i predicted = zero;
+        if (filter == 1) {
+            predicted = left;
+        } else if (filter == 2) {
+            predicted = up;
+        } else if (filter == 3) {
+            // Rounding average less the carried bit: floor((a + b) / 2)
+            predicted = _mm_sub_epi8(_mm_avg_epu8(left, up), _mm_and_si128(_mm_xor_si128(left, up), _mm_set1_epi8(1)));
+        } else if (filter == 4) {
+            __m128i upleft = i > 0 ? _mm_loadu_si128((const __m128i *)(prev + i - 1)) : _mm_slli_si128(up, 1);
+            __m128i lo = paeth_epi16(_mm_unpacklo_epi8(left, zero), _mm_unpacklo_epi8(up, zero),
+                                     _mm_unpacklo_epi8(upleft, zero));
+            __m128i hi = paeth_epi16(_mm_unpackhi_epi8(left, zero), _mm_unpackhi_epi8(up, zero),
+                                     _mm_unpackhi_epi8(upleft, zero));
+            predicted = _mm_packus_epi16(lo, hi);
+        }
+        _mm_storeu_si128((__m128i *)(residuals + i), _mm_add_epi8(_mm_sub_epi8(x, predicted), sign));
+    }
+#endif
+    for (; i < width; i++) {
+        int a = i > 0 ? row[i - 1] : 0, b = prev[i], c = i > 0 ? prev[i - 1] : 0;
+        int predicted = filter == 1 ? a : filter == 2 ? b : filter == 3 ? (a + b) >> 1 : filter == 4 ? paeth(a, b, c) : 0;
+        residuals[i] = (uint8_t)(row[i] - predicted + 128);
+    }
+}
+
+void unpredict_row(int filter, const uint8_t *residuals, const uint8_t *prev, uint8_t *row, size_t width) {
+    size_t i = 0;
+    if (filter == 3 || filter == 4) {
+        for (; i < width; i++) {
+            int a = i > 0 ? row[i - 1] : 0, b = prev[i], c = i > 0 ? prev[i - 1] : 0;
+            row[i] = (uint8_t)(residuals[i] - 128 + (filter == 3 ? (a + b) >> 1 : paeth(a, b, c)));
+        }
+        return;
+    }
+#ifdef __SSE2__
+    const __m128i sign = _mm_set1_epi8((char)0x80);
+    __m128i carry = _mm_setzero_si128();    // the last pixel rebuilt, in every lane
+    for (; i + 16 <= width; i += 16) {
+        __m128i x = _mm_sub_epi8(_mm_loadu_si128((const __m128i *)(residuals + i)), sign);
+        if (filter == 2) {
+            x = _mm_add_epi8(x, _mm_loadu_si128((const __m128i *)(prev + i)));
+        } else if (filter == 1) {
+            // Running sum over the 16 lanes in four shifted adds, then the pixel before them
+            x = _mm_add_epi8(x, _mm_slli_si128(x, 1));
+            x = _mm_add_epi8(x, _mm_slli_si128(x, 2));
+            x = _mm_add_epi8(x, _mm_slli_si128(x, 4));
+            x = _mm_add_epi8(x, _mm_slli_si128(x, 8));
+            x = _mm_add_epi8(x, carry);
+            carry = _mm_set1_epi8((char)(_mm_extract_epi16(x, 7) >> 8));
+        }
+        _mm_storeu_si128((__m128i *)(row + i), x);
+    }
+#endif
+    for (; i < width; i++) {
+        int predicted = filter == 1 ? (i > 0 ? row[i - 1] : 0) : filter == 2 ? prev[i] : 0;
+        row[i] = (uint8_t)(residuals[i] - 128 + predicted);
+    }
+}
+
+uint32_t residual_cost(const uint8_t *residuals, size_t width) {
+    uint32_t cost = 0;
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i sign = _mm_set1_epi8((char)0x80);
+    __m128i sums = _mm_setzero_si128();
+    for (; i + 16 <= width; i += 16) {
+        sums = _mm_add_epi64(sums, _mm_sad_epu8(_mm_loadu_si128((const __m128i *)(residuals + i)), sign));
+    }
+    cost = (uint32_t)(_mm_cvtsi128_si32(sums) + _mm_cvtsi128_si32(_mm_srli_si128(sums, 8)));
+#endif
+    for (; i < width; i++) {
+        cost += (uint32_t)abs(residuals[i] - 128);
+    }
+    return cost;
+}
+
+// -------------------------------------------------------------------------------------------------------- runs
+
+size_t byte_run(const uint8_t *bytes, size_t count) {
+    if (count == 0) {
+        return 0;
+    }
+    size_t i = 1;
+#ifdef __SSE2__
+    const __m128i value = _mm_set1_epi8((char)bytes[0]);
+    for (; i + 16 <= count; i += 16) {
+        unsigned differ = ~(unsigned)_mm_movemask_epi8(
+            _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(bytes + i)), value)) & 0xFFFF;
+        if (differ) {
+            return i + __builtin_ctz(differ);
+        }
+    }
+#endif
+    while (i < count && bytes[i] == bytes[0]) {
+        i++;
+    }
+    return i;
+}
+
+size_t byte_repeat(const uint8_t *bytes, size_t count) {
+    size_t i = 0;
+#ifdef __SSE2__
+    for (; i + 17 <= count; i += 16) {
+        unsigned same = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(bytes + i)),
+                                                                   _mm_loadu_si128((const __m128i *)(bytes + i + 1))));
+        if (same) {
+            return i + __builtin_ctz(same);
+        }
+    }
+#endif
+    for (; i + 1 < count; i++) {
+        if (bytes[i] == bytes[i + 1]) {
+            return i;
+        }
+    }
+    return count;
+}
+
+// -------------------------------------------------------------------------------------------------------- area
+
+int area_axis_init(AreaAxis *axis, int size, int scaled) {
+    double ratio = (double)size / scaled;
+    axis->taps = (int)ceil(ratio) + 1;
+    axis->first = (int *)malloc((size_t)scaled * sizeof(int));
+    axis->weights = (float *)calloc((size_t)scaled * axis->taps, sizeof(float));
+    if (axis->first == NULL || axis->weights == NULL) {
+        area_axis_free(axis);
+        return -1;
+    }
+    for (int i = 0; i < scaled; i++) {
+        double from = i * ratio, to = (i + 1) * ratio;
+        int first = (int)from;
+        axis->first[i] = first;
+        for (int k = 0; k < axis->taps && first + k < size && first + k < to; k++) {
+            double low = first + k > from ? first + k : from;
+            double high = first + k + 1 < to ? first + k + 1 : to;
+            axis->weights[(size_t)i * axis->taps + k] = (float)((high - low) / ratio);
+        }
+    }
+    return 0;
+}
+
+void area_axis_free(AreaAxis *axis) {
+    free(axis->first);
+    free(axis->weights);
+    axis->first = NULL;
+    axis->weights = NULL;
+}
+
+void accumulate_row_u8(const uint8_t *row, float weight, float *sums, size_t count) {
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128 w = _mm_set1_ps(weight);
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 16 <= count; i += 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i *)(row + i));
+        __m128i low = _mm_unpacklo_epi8(bytes, zero), high = _mm_unpackhi_epi8(bytes, zero);
+        __m128i words[4] = { _mm_unpacklo_epi16(low, zero), _mm_unpackhi_epi16(low, zero),
+                             _mm_unpacklo_epi16(high, zero), _mm_unpackhi_epi16(high, zero) };
+        for (int k = 0; k < 4; k++) {
+            __m128 sum = _mm_loadu_ps(sums + i + 4 * k);
+            _mm_storeu_ps(sums + i + 4 * k, _mm_add_ps(sum, _mm_mul_ps(_mm_cvtepi32_ps(words[k]), w)));
+        }
+    }
+#endif
+    for (; i < count; i++) {
+        sums[i] += weight * row[i];
+    }
+}
+
+void area_filter_row(const AreaAxis *axis, const float *sums, int channels, uint8_t *out, int scaled) {
+    for (int i = 0; i < scaled; i++) {
+        const float *weights = axis->weights + (size_t)i * axis->taps;
+        const float *in = sums + (size_t)axis->first[i] * channels;
+#ifdef __SSE2__
+        if (channels == 4) {
+            __m128 sum = _mm_setzero_ps();
+            for (int k = 0; k < axis->taps && weights[k] != 0.0f; k++) {
+                sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(in + 4 * k), _mm_set1_ps(weights[k])));
+            }
+            __m128i values = _mm_cvtps_epi32(sum);
+            values = _mm_packs_epi32(values, values);
+            int32_t pixel = _mm_cvtsi128_si32(_mm_packus_epi16(values, values));
+            memcpy(out + 4 * (size_t)i, &pixel, 4);
+            continue;
+        }
+#endif
+        for (int c = 0; c < channels; c++) {
+            float sum = 0.0f;
+            for (int k = 0; k < axis->taps && weights[k] != 0.0f; k++) {
+                sum += weights[k] * in[k * channels + c];
+            }
+            out[(size_t)i * channels + c] = (uint8_t)(sum >= 255.0f ? 255 : (int)(sum + 0.5f));
+        }
+    }
+}
+
+// -------------------------------------------------------------------------------------------------------- crc
+
+#define CRC32C_POLYNOMIAL 0x82F63B78u // reflected
+
+#ifndef __SSE4_2__
+static uint32_t crc32c_table[8][256]; // slicing by eight: [k][b] is b followed by k zero bytes
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+static void crc32c_fill_table(void) {
+    for (int b = 0; b < 256; b++) {
+        uint32_t crc = (uint32_t)b;
+        for (int i = 0; i < 8; i++) {
+            crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLYNOMIAL : crc >> 1;
+        }
+        crc32c_table[0][b] = crc;
+    }
+    for (int b = 0; b < 256; b++) {
+        for (int k = 1; k < 8; k++) {
+            uint32_t previous = crc32c_table[k - 1][b];
+            crc32c_table[k][b] = (previous >> 8) ^ crc32c_table[0][previous & 0xFF];
+        }
+    }
+}
+#endif
+
+// Eight bytes per instruction with SSE4.2, eight bytes per round of table lookups otherwise
+uint32_t crc32c_update(uint32_t crc, const void *data, size_t size) {
+    const uint8_t *p = (const uint8_t *)data;
+    crc = ~crc;
+#ifdef __SSE4_2__
+    uint64_t wide = crc;
+    for (; size >= 8; size -= 8, p += 8) {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        wide = _mm_crc32_u64(wide, word);
+    }
+    crc = (uint32_t)wide;
+    for (; size > 0; size--) {
+        crc = _mm_crc32_u8(crc, *p++);
+    }
+#else
+    pthread_once(&crc32c_once, crc32c_fill_table);
+    for (; size >= 8; size -= 8, p += 8) {
+        uint32_t low = crc ^ ((uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24);
+        crc = crc32c_table[7][low & 0xFF] ^ crc32c_table[6][(low >> 8) & 0xFF] ^
+              crc32c_table[5][(low >> 16) & 0xFF] ^ crc32c_table[4][low >> 24] ^
+              crc32c_table[3][p[4]] ^ crc32c_table[2][p[5]] ^ crc32c_table[1][p[6]] ^ crc32c_table[0][p[7]];
+    }
+    for (; size > 0; size--) {
+        crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *p++) & 0xFF];
+    }
+#endif
+    return ~crc;
+}
+
+// -------------------------------------------------------------------------------------------------------- sync
+
+int32_t correlate_s16(const int16_t *samples, const int16_t *pattern, int length) {
+    int i = 0;
+    int32_t sum = 0;
+#ifdef __SSE2__
+    __m128i acc = _mm_setzero_si128();
+    for (; i + 8 <= length; i += 8) {
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_loadu_si128((const __m128i *)(samples + i)),
+                                                _mm_loadu_si128((const __m128i *)(pattern + i))));
+    }
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2, 3, 0, 1)));
+    sum = _mm_cvtsi128_si32(acc);
+#endif
+    for (; i < length; i++) {
+        sum += samples[i] * pattern[i];
+    }
+    return sum;
+}
+
+// -------------------------------------------------------------------------------------------------------- fec
+
+static uint8_t rs_mul(const RsCode *code, uint8_t a, uint8_t b) {
+    return a && b ? code->exp[code->log[a] + code->log[b]] : 0;
+}
+
+static void rs_nibble_table(const RsCode *code, uint8_t factor, uint8_t table[32]) {
+    for (int x = 0; x < 16; x++) {
+        table[x] = rs_mul(code, factor, (uint8_t)x);
+        table[16 + x] = rs_mul(code, factor, (uint8_t)(x << 4));
+    }
+}
+
+int rs_init(RsCode *code, int parity) {
+    memset(code, 0, sizeof(*code));
+    if (parity < 1 || parity > RS_MAX_PARITY) {
+        dsp_error("Reed-Solomon codes take 1 to %d parity symbols, not %d.\n", RS_MAX_PARITY, parity);
+        return -1;
+    }
+    code->parity = parity;
+    int x = 1;
+    for (int i = 0; i < 255; i++) {
+        code->exp[i] = code->exp[i + 255] = (uint8_t)x;
+        code->log[x] = (uint8_t)i;
+        x = x & 0x80 ? (x << 1) ^ 0x11D : x << 1;
+    }
+    code->exp[510] = code->exp[0];
+    code->exp[511] = code->exp[1];
+
+    // g(x) = (x - alpha^0) ... (x - alpha^(parity - 1)), built up one root at a time
+    uint8_t g[RS_MAX_PARITY + 1] = { 1 };
+    for (int r = 0; r < parity; r++) {
+        for (int j = r + 1; j > 0; j--) {
+            g[j] = g[j - 1] ^ rs_mul(code, g[j], code->exp[r]);
+        }
+        g[0] = rs_mul(code, g[0], code->exp[r]);
+    }
+    for (int j = 0; j < parity; j++) {
+        code->generator[j] = g[j];
+        rs_nibble_table(code, g[j], code->generator_tables[j]);
+        rs_nibble_table(code, code->exp[j], code->root_tables[j]);
+    }
+    return 0;
+}
+
+#ifdef __SSSE3__
+static inline __m128i rs_mul_vector(__m128i v, const uint8_t table[32]) {
+    const __m128i low = _mm_set1_epi8(0x0F);
+    __m128i lo = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)table), _mm_and_si128(v, low));
+    __m128i hi = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(table + 16)),
+                                  _mm_and_si128(_mm_srli_epi16(v, 4), low));
+    return _mm_xor_si128(lo, hi);
+}
+#endif
+
+// Parity rows of a block of rows data rows: the remainder of every lane's data times x^parity divided by g(x),
+// one division step per row shifting all lanes through the feedback register at once
+void rs_encode(const RsCode *code, const uint8_t *data, int rows, uint8_t *parity) {
+    int n = code->parity;
+#ifdef __SSSE3__
+    __m128i reg[RS_MAX_PARITY];
+    for (int j = 0; j < n; j++) {
+        reg[j] = _mm_setzero_si128();
+    }
+    for (int i = 0; i < rows; i++) {
+        __m128i feedback = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(data + (size_t)i * RS_LANES)), reg[0]);
+        for (int j = 0; j < n - 1; j++) {
+            reg[j] = _mm_xor_si128(reg[j + 1], rs_mul_vector(feedback, code->generator_tables[n - 1 - j]));
+        }
+        reg[n - 1] = rs_mul_vector(feedback, code->generator_tables[0]);
+    }
+    for (int j = 0; j < n; j++) {
+        _mm_storeu_si128((__m128i *)(parity + (size_t)j * RS_LANES), reg[j]);
+    }
+#else
+    memset(parity, 0, (size_t)n * RS_LANES);
+    for (int i = 0; i < rows; i++) {
+        for (int c = 0; c < RS_LANES; c++) {
+            uint8_t feedback = data[(size_t)i * RS_LANES + c] ^ parity[c];
+            for (int j = 0; j < n - 1; j++) {
+                parity[j * RS_LANES + c] = parity[(j + 1) * RS_LANES + c] ^
+                                           rs_mul(code, feedback, code->generator[n - 1 - j]);
+            }
+            parity[(n - 1) * RS_LANES + c] = rs_mul(code, feedback, code->generator[0]);
+        }
+    }
+#endif
+}
+
+// Berlekamp-Massey for the error locator, Chien search for its roots and Forney for the values, on one
+// lane of a block of length symbols. -1 when there are more errors than the code corrects.
+static int rs_correct_lane(const RsCode *code, uint8_t *block, int length, const uint8_t *syndromes) {
+    int n = code->parity;
+    uint8_t locator[RS_MAX_PARITY + 1] = { 1 }, previous[RS_MAX_PARITY + 1] = { 1 }, saved[RS_MAX_PARITY + 1];
+    int errors = 0, shift = 1;
+    uint8_t last = 1;
+    for (int k = 0; k < n; k++) {
+        uint8_t discrepancy = syndromes[k];
+        for (int i = 1; i <= errors; i++) {
+            discrepancy ^= rs_mul(code, locator[i], syndromes[k - i]);
+        }
+        if (discrepancy == 0) {
+            shift++;
+            continue;
+        }
+        uint8_t scale = code->exp[code->log[discrepancy] + 255 - code->log[last]];
+        memcpy(saved, locator, sizeof(saved));
+        for (int i = 0; i + shift <= n; i++) {
+            locator[i + shift] ^= rs_mul(code, scale, previous[i]);
+        }
+        if (2 * errors <= k) {
+            errors = k + 1 - errors;
+            memcpy(previous, saved, sizeof(previous));
+            last = discrepancy;
+            shift = 1;
+        } else {
+            shift++;
+        }
+    }
+    if (2 * errors > n) {
+        return -1;
+    }
+
+    // Evaluator: syndromes times locator, below x^parity
+    uint8_t evaluator[RS_MAX_PARITY] = { 0 };
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j <= errors && j <= i; j++) {
+            evaluator[i] ^= rs_mul(code, syndromes[i - j], locator[j]);
+        }
+    }
+
+    int found = 0;
+    int positions[RS_MAX_PARITY / 2];
+    uint8_t values[RS_MAX_PARITY / 2];
+    for (int p = 0; p < length && found < errors; p++) {
+        int degree = length - 1 - p;
+        int inverse = (255 - degree) % 255; // log of X^-1
+        uint8_t value = 0, derivative = 0, omega = 0;
+        for (int j = 0; j <= errors; j++) {
+            value ^= rs_mul(code, locator[j], code->exp[inverse * j % 255]);
+            if (j & 1) {
+                derivative ^= rs_mul(code, locator[j], code->exp[inverse * (j - 1) % 255]);
+            }
+        }
+        if (value != 0) {
+            continue;
+        }
+        if (derivative == 0) {
+            return -1;
+        }
+        for (int j = 0; j < n; j++) {
+            omega ^= rs_mul(code, evaluator[j], code->exp[inverse * j % 255]);
+        }
+        // Y = X * omega(X^-1) / locator'(X^-1) for roots from alpha^0
+        positions[found] = p;
+        values[found++] = omega ? code->exp[(degree + code->log[omega] + 255 - code->log[derivative]) % 255] : 0;
+    }
+    if (found != errors) {
+        return -1;
+    }
+    for (int i = 0; i < found; i++) {
+        block[(size_t)positions[i] * RS_LANES] ^= values[i];
+    }
+    return 0;
+}
+
+// Correct a block of rows rows, data and parity, in place. Syndromes of all lanes come from one pass of
+// Horner's rule over the rows; only lanes with errors go through the scalar search. Returns the lanes
+// with more errors than parity / 2, which are left as they are.
+int rs_decode(const RsCode *code, uint8_t *block, int rows) {
+    int n = code->parity;
+    uint8_t syndromes[RS_MAX_PARITY][RS_LANES];
+#ifdef __SSSE3__
+    __m128i s[RS_MAX_PARITY];
+    for (int j = 0; j < n; j++) {
+        s[j] = _mm_setzero_si128();
+    }
+    for (int i = 0; i < rows; i++) {
+        __m128i row = _mm_loadu_si128((const __m128i *)(block + (size_t)i * RS_LANES));
+        for (int j = 0; j < n; j++) {
+            s[j] = _mm_xor_si128(rs_mul_vector(s[j], code->root_tables[j]), row);
+        }
+    }
+    __m128i any = _mm_setzero_si128();
+    for (int j = 0; j < n; j++) {
+        _mm_storeu_si128((__m128i *)syndromes[j], s[j]);
+        any = _mm_or_si128(any, s[j]);
+    }
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(any, _mm_setzero_si128())) == 0xFFFF) {
+        return 0;
+    }
+#else
+    memset(syndromes, 0, sizeof(syndromes));
+    for (int i = 0; i < rows; i++) {
+        for (int j = 0; j < n; j++) {
+            for (int c = 0; c < RS_LANES; c++) {
+                syndromes[j][c] = rs_mul(code, syndromes[j][c], code->exp[j]) ^ block[(size_t)i * RS_LANES + c];
+            }
+        }
+    }
+#endif
+
+    int failed = 0;
+    for (int c = 0; c < RS_LANES; c++) {
+        uint8_t lane[RS_MAX_PARITY];
+        bool clean = true;
+        for (int j = 0; j < n; j++) {
+            lane[j] = syndromes[j][c];
+            clean = clean && lane[j] == 0;
+        }
+        if (!clean && rs_correct_lane(code, block + c, rows, lane) != 0) {
+            failed++;
+        }
+    }
+    return failed;
+}
+
+// -------------------------------------------------------------------------------------------------------- apt
+
+// Sync A of a NOAA APT line: a 1040 Hz square wave at the standard 4160 words per second
+static const uint8_t apt_sync[APT_SYNC_WORDS] = {
+    0, 0, 0, 0,
+    255, 255, 0, 0, 255, 255, 0, 0, 255, 255, 0, 0, 255, 255, 0, 0,
+    255, 255, 0, 0, 255, 255, 0, 0, 255, 255, 0, 0,
+    0, 0, 0, 0, 0, 0, 0,
+};
+
+const uint8_t *apt_sync_words(void) {
+    return apt_sync;
+}
+
+// Prepare a modulator, -1 if the rates can't carry the subcarrier or the words
+int apt_modulator_init(AptModulator *mod, int sample_rate, int pixels_per_second) {
+    if (sample_rate < 2 * APT_CARRIER_HZ + 1) {
+        dsp_error("APT needs a sample rate above %d Hz.\n", 2 * APT_CARRIER_HZ);
+        return -1;
+    }
+    if (pixels_per_second <= 0 || pixels_per_second > sample_rate) {
+        dsp_error("APT needs between 1 and %d pixels per second at %d Hz.\n",
+                  sample_rate, sample_rate);
+        return -1;
+    }
+
+    memset(mod, 0, sizeof(*mod));
+    nco_init(&mod->carrier, APT_CARRIER_HZ, sample_rate);
+    mod->sample_rate = sample_rate;
+    mod->pixels_per_second = pixels_per_second;
+
+    // White is full carrier, black keeps the unmodulated part
+    for (int v = 0; v < 256; v++) {
+        double level = (100 - APT_MODULATION_PERCENT) + APT_MODULATION_PERCENT * v / 255.0;
+        mod->envelope[v] = (int16_t)lrint(32767.0 * level / 100.0);
+    }
+    return 0;
+}
+
+// Number of samples the modulator produces for a whole stream of words
+size_t apt_modulated_samples(uint64_t words, int sample_rate, int pixels_per_second) {
+    return (size_t)((words * sample_rate + pixels_per_second - 1) / pixels_per_second);
+}
+
+// Modulate count words into out and return the number of samples written.
+// out needs room for apt_modulated_samples(count, ...) + 1 samples.
+int apt_modulate(AptModulator *mod, const uint8_t *words, int count, int16_t *out) {
+    const uint32_t rate = (uint32_t)mod->sample_rate;
+    const uint32_t step = (uint32_t)mod->pixels_per_second;
+    uint32_t phase = mod->word_phase;
+    int produced = 0;
+    int word = 0;
+
+    while (word < count) {
+        // Hold each word for its share of samples, then modulate the whole block at once
+        int n = 0;
+        while (n < APT_BLOCK_SAMPLES && word < count) {
+            mod->envelope_block[n++] = mod->envelope[words[word]];
+            phase += step;
+            if (phase >= rate) {
+                phase -= rate;
+                word++;
+            }
+        }
+        nco_generate(&mod->carrier, mod->carrier_block, n);
+        am_modulate(mod->carrier_block, mod->envelope_block, out + produced, n);
+        produced += n;
+    }
+
+    mod->word_phase = phase;
+    return produced;
+}
+
+// -------------------------------------------------------------------------------------------------------- apt demodulator
+
+// Windowed sinc low-pass, x in samples from the center, cutoff as a fraction of the sample rate
+static double lowpass_tap(double x, double cutoff, int taps) {
+    double sinc = x == 0.0 ? 1.0 : sin(2.0 * M_PI * cutoff * x) / (2.0 * M_PI * cutoff * x);
+    double w = (x + taps / 2.0) / taps; // 0 .. 1 across the filter
+    double blackman = 0.42 - 0.5 * cos(2.0 * M_PI * w) + 0.08 * cos(4.0 * M_PI * w);
+    return 2.0 * cutoff * sinc * blackman;
+}
+
+// Prepare a demodulator, -1 if the rates can't carry APT or memory runs out
+int apt_demodulator_init(AptDemodulator *demod, int sample_rate, int pixels_per_second) {
+    if (sample_rate < 2 * APT_CARRIER_HZ + 1 || pixels_per_second <= 0 || pixels_per_second > sample_rate) {
+        dsp_error("Can't demodulate APT at %d Hz with %d pixels per second.\n",
+                  sample_rate, pixels_per_second);
+        return -1;
+    }
+
+    memset(demod, 0, sizeof(*demod));
+    nco_init(&demod->carrier, APT_CARRIER_HZ, sample_rate);
+    demod->sample_rate = sample_rate;
+    demod->pixels_per_second = pixels_per_second;
+
+    // Pass the envelope up to half the word rate, stop before the mixing image at twice the carrier
+    double cutoff = pixels_per_second / 2.0;
+    if (cutoff > 0.85 * APT_CARRIER_HZ) {
+        cutoff = 0.85 * APT_CARRIER_HZ;
+    }
+    double transition = 2.0 * APT_CARRIER_HZ - 2.0 * cutoff;
+    int taps = ((int)ceil(5.5 * sample_rate / transition) + 3) & ~3; // Blackman: 5.5 / taps wide
+    if (taps > DEMOD_MAX_TAPS) {
+        taps = DEMOD_MAX_TAPS;
+    }
+    demod->taps = taps;
+
+    demod->capacity = (size_t)taps * 4;
+    demod->bank = (float *)malloc((size_t)DEMOD_PHASES * taps * sizeof(float));
+    demod->i = (float *)calloc(demod->capacity, sizeof(float));
+    demod->q = (float *)calloc(demod->capacity, sizeof(float));
+    if (demod->bank == NULL || demod->i == NULL || demod->q == NULL) {
+        apt_demodulator_free(demod);
+        dsp_error("Couldn't allocate memory for the APT demodulator.\n");
+        return -1;
+    }
+
+    // One filter per fractional output position, each normalized to unity gain
+    for (int j = 0; j < DEMOD_PHASES; j++) {
+        float *h = demod->bank + (size_t)j * taps;
+        double sum = 0.0;
+        for (int k = 0; k < taps; k++) {
+            h[k] = (float)lowpass_tap(k - (taps / 2 - 1) - (double)j / DEMOD_PHASES, cutoff / sample_rate, taps);
+            sum += h[k];
+        }
+        for (int k = 0; k < taps; k++) {
+            h[k] = (float)(h[k] / sum);
+        }
+    }
+
+    // The first output is centered on sample 0, so the filter starts on zeros before it
+    demod->count = taps / 2 - 1;
+    demod->base = -(int64_t)demod->count;
+    return 0;
+}
+
+void apt_demodulator_free(AptDemodulator *demod) {
+    free(demod->bank);
+    free(demod->i);
+    free(demod->q);
+    demod->bank = demod->i = demod->q = NULL;
+}
+
+// Upper bound of envelope values produced from count input samples
+size_t apt_envelope_capacity(const AptDemodulator *demod, int count) {
+    return (size_t)count * 2 * demod->pixels_per_second / demod->sample_rate + 2;
+}
+
+// Filter I and Q with the same taps, the multiply-adds run four lanes wide with SSE
+static void fir_iq(const float *h, const float *i, const float *q, int taps, float *out_i, float *out_q) {
+#ifdef __SSE__
+    __m128 acc_i = _mm_setzero_ps();
+    __m128 acc_q = _mm_setzero_ps();
+    for (int k = 0; k < taps; k += 4) {
+        __m128 c = _mm_loadu_ps(h + k);
+        acc_i = _mm_add_ps(acc_i, _mm_mul_ps(c, _mm_loadu_ps(i + k)));
+        acc_q = _mm_add_ps(acc_q, _mm_mul_ps(c, _mm_loadu_ps(q + k)));
+    }
+    float lanes_i[4], lanes_q[4];
+    _mm_storeu_ps(lanes_i, acc_i);
+    _mm_storeu_ps(lanes_q, acc_q);
+    *out_i = (lanes_i[0] + lanes_i[1]) + (lanes_i[2] + lanes_i[3]);
+    *out_q = (lanes_q[0] + lanes_q[1]) + (lanes_q[2] + lanes_q[3]);
+#else
+    float acc_i[4] = { 0 }, acc_q[4] = { 0 };
+    for (int k = 0; k < taps; k += 4) {
+        for (int l = 0; l < 4; l++) {
+            acc_i[l] += h[k + l] * i[k + l];
+            acc_q[l] += h[k + l] * q[k + l];
+        }
+    }
+    *out_i = (acc_i[0] + acc_i[1]) + (acc_i[2] + acc_i[3]);
+    *out_q = (acc_q[0] + acc_q[1]) + (acc_q[2] + acc_q[3]);
+#endif
+}
+
+// Mix count samples down to I/Q and return every envelope value whose filter window is now complete.
+// envelope needs room for apt_envelope_capacity(demod, count) values.
+int apt_demodulate(AptDemodulator *demod, const int16_t *samples, int count, float *envelope) {
+    if (demod->count + count > demod->capacity) {
+        size_t capacity = demod->count + count + demod->taps;
+        float *i = (float *)realloc(demod->i, capacity * sizeof(float));
+        float *q = i ? (float *)realloc(demod->q, capacity * sizeof(float)) : NULL;
+        if (i) {
+            demod->i = i;
+        }
+        if (q == NULL) {
+            dsp_error("Couldn't allocate memory for the APT demodulator.\n");
+            return -1;
+        }
+        demod->q = q;
+        demod->capacity = capacity;
+    }
+
+    float *mixed_i = demod->i + demod->count;
+    float *mixed_q = demod->q + demod->count;
+    uint32_t phase = demod->carrier.phase;
+    for (int n = 0; n < count; n++) {
+        uint32_t index = phase >> (32 - NCO_TABLE_BITS);
+        mixed_i[n] = samples[n] * unit_sine_table[(index + NCO_TABLE_SIZE / 4) & (NCO_TABLE_SIZE - 1)];
+        mixed_q[n] = samples[n] * unit_sine_table[index];
+        phase += demod->carrier.step;
+    }
+    demod->carrier.phase = phase;
+    demod->count += count;
+
+    // Envelope value h sits at h / (2 * pixels per second) seconds, kept as an exact fraction
+    const uint64_t rate = (uint64_t)demod->sample_rate;
+    const uint64_t per_second = 2 * (uint64_t)demod->pixels_per_second;
+    const int half = demod->taps / 2;
+    const float scale = 2.0f / CARRIER_LEVEL; // mixing halves the amplitude
+    int64_t end = demod->base + (int64_t)demod->count;
+    int produced = 0;
+
+    for (;;) {
+        uint64_t position = demod->next * rate;
+        int64_t center = (int64_t)(position / per_second);
+        int phase_index = (int)(((position % per_second) * DEMOD_PHASES + per_second / 2) / per_second);
+        if (phase_index == DEMOD_PHASES) {
+            center++;
+            phase_index = 0;
+        }
+        // The taps reach from center - (half - 1) to center + half, the last input is end - 1
+        if (center + half >= end) {
+            break;
+        }
+
+        size_t first = (size_t)(center - (half - 1) - demod->base);
+        float out_i, out_q;
+        fir_iq(demod->bank + (size_t)phase_index * demod->taps, demod->i + first, demod->q + first,
+               demod->taps, &out_i, &out_q);
+        envelope[produced++] = scale * sqrtf(out_i * out_i + out_q * out_q);
+        demod->next++;
+    }
+
+    // Drop the input no later output will need
+    int64_t keep_from = (int64_t)(demod->next * rate / per_second) - (half - 1);
+    if (keep_from > demod->base) {
+        size_t drop = (size_t)(keep_from - demod->base);
+        if (drop > demod->count) {
+            drop = demod->count;
+        }
+        memmove(demod->i, demod->i + drop, (demod->count - drop) * sizeof(float));
+        memmove(demod->q, demod->q + drop, (demod->count - drop) * sizeof(float));
+        demod->count -= drop;
+        demod->base += (int64_t)drop;
+    }
+    return produced;
+}
+
+// Push zeros through the filter so the last real samples come out.
+// envelope needs room for apt_envelope_capacity(demod, demod->taps) values.
+int apt_demodulate_flush(AptDemodulator *demod, float *envelope) {
+    int16_t zeros[256] = { 0 };
+    int produced = 0;
+    for (int left = demod->taps / 2; left > 0; left -= 256) {
+        int result = apt_demodulate(demod, zeros, left < 256 ? left : 256, envelope + produced);
+        if (result < 0) {
+            return -1;
+        }
+        produced += result;
+    }
+    return produced;
+}
+
+// The sync pulse on the envelope grid: odd values are the middles of its words, even values the boundaries
+// between two words, halfway between them. The boundary ahead of the first word borders the previous line
+// and is left out. Zero mean, so the match doesn't depend on signal level or offset.
+static void apt_sync_pattern(float *pattern) {
+    float mean = 0.0f;
+    pattern[0] = 0.0f;
+    for (int k = 1; k < 2 * APT_SYNC_WORDS; k++) {
+        float word = apt_sync[k / 2] ? 1.0f : -1.0f;
+        pattern[k] = k % 2 ? word : (word + (apt_sync[k / 2 - 1] ? 1.0f : -1.0f)) / 2.0f;
+        mean += pattern[k];
+    }
+    mean /= 2 * APT_SYNC_WORDS - 1;
+    for (int k = 1; k < 2 * APT_SYNC_WORDS; k++) {
+        pattern[k] -= mean;
+    }
+}
+
+static float sync_score(const float *pattern, const float *envelope) {
+    float score = 0.0f;
+    for (int k = 0; k < 2 * APT_SYNC_WORDS; k++) {
+        score += pattern[k] * envelope[k];
+    }
+    return score;
+}
+
+// Envelope between two of its values, read on the straight line joining them
+static float envelope_at(const float *envelope, double position) {
+    int i = (int)floor(position);
+    float f = (float)(position - i);
+    return f == 0.0f ? envelope[i] : envelope[i] + f * (envelope[i + 1] - envelope[i]);
+}
+
+// Position in [from, to] where the envelope (two values per word) best matches the sync pulse, refined to
+// a fraction of a value by the parabola through the scores on either side, and that score.
+// The envelope needs values from from - 1 (when above 0) to to + 2 * APT_SYNC_WORDS.
+double apt_find_sync(const float *envelope, int from, int to, float *score) {
+    float pattern[2 * APT_SYNC_WORDS];
+    apt_sync_pattern(pattern);
+
+    int best = from;
+    float best_score = -INFINITY;
+    for (int p = from; p <= to; p++) {
+        float s = sync_score(pattern, envelope + p);
+        if (s > best_score) {
+            best_score = s;
+            best = p;
+        }
+    }
+    *score = best_score;
+    if (best == 0) {
+        return best;
+    }
+
+    float before = sync_score(pattern, envelope + best - 1);
+    float after = sync_score(pattern, envelope + best + 1);
+    float curve = before - 2.0f * best_score + after;
+    double offset = curve < 0.0f ? 0.5 * (before - after) / curve : 0.0;
+    return best + (offset < -0.5 ? -0.5 : offset > 0.5 ? 0.5 : offset);
+}
+
+// How well the envelope matches the sync pulse starting at position, on the scale of apt_find_sync.
+// The envelope needs values up to position + 2 * APT_SYNC_WORDS.
+float apt_sync_score(const float *envelope, double position) {
+    float pattern[2 * APT_SYNC_WORDS];
+    apt_sync_pattern(pattern);
+    float score = 0.0f;
+    for (int k = 0; k < 2 * APT_SYNC_WORDS; k++) {
+        score += pattern[k] * envelope_at(envelope, position + k);
+    }
+    return score;
+}
+
+// The pixels of a line whose sync starts at start, each read in the middle of its word, between envelope
+// values when start falls between them. The envelope needs values up to start + 2 * (APT_SYNC_WORDS + width).
+void apt_read_line(const float *envelope, double start, int width, float *row) {
+    for (int x = 0; x < width; x++) {
+        row[x] = envelope_at(envelope, start + 2 * (APT_SYNC_WORDS + x) + 1);
+    }
+}
+
+// Envelope (fraction of the full carrier) back to the word value the modulator started from
+uint8_t apt_envelope_to_pixel(float envelope) {
+    float black = (100 - APT_MODULATION_PERCENT) / 100.0f;
+    float value = (envelope - black) / (1.0f - black) * 255.0f + 0.5f;
+    return value <= 0.0f ? 0 : value >= 255.0f ? 255 : (uint8_t)value;
+}
+
+// -------------------------------------------------------------------------------------------------------- resampler
+
+struct ResampleBank {
+    int in_rate;            // the ratio as given, to find the bank again
+    int out_rate;
+    uint64_t up;            // out_rate / gcd
+    uint64_t down;          // in_rate / gcd
+    int phases;             // up, or RESAMPLE_MAX_PHASES for ratios with more
+    int taps;               // a multiple of 4
+    int users;              // resamplers holding the bank, guarded by bank_cache_lock
+    float coefficients[];   // phases filters of taps coefficients
+};
+
+static ResampleBank *bank_cache[RESAMPLE_CACHE_SIZE];
+static pthread_mutex_t bank_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t gcd(uint64_t a, uint64_t b) {
+    while (b != 0) {
+        uint64_t t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+// Design the filters for one ratio: a low-pass below the lower of the two Nyquist frequencies,
+// sampled at every fractional position an output can fall on
+static ResampleBank *create_bank(int in_rate, int out_rate) {
+    uint64_t g = gcd((uint64_t)in_rate, (uint64_t)out_rate);
+    uint64_t up = out_rate / g;
+    int phases = up > RESAMPLE_MAX_PHASES ? RESAMPLE_MAX_PHASES : (int)up;
+
+    double nyquist = 0.5 * (out_rate < in_rate ? (double)out_rate / in_rate : 1.0); // of the input rate
+    double cutoff = nyquist * RESAMPLE_PASSBAND;
+    int taps = ((int)ceil(5.5 / (nyquist - cutoff)) + 3) & ~3;
+    if (taps > RESAMPLE_MAX_TAPS) {
+        taps = RESAMPLE_MAX_TAPS;
+    }
+
+    ResampleBank *bank = (ResampleBank *)malloc(sizeof(ResampleBank) + (size_t)phases * taps * sizeof(float));
+    if (bank == NULL) {
+        return NULL;
+    }
+    bank->in_rate = in_rate;
+    bank->out_rate = out_rate;
+    bank->up = up;
+    bank->down = in_rate / g;
+    bank->phases = phases;
+    bank->taps = taps;
+    bank->users = 0;
+
+    for (int p = 0; p < phases; p++) {
+        float *h = bank->coefficients + (size_t)p * taps;
+        double sum = 0.0;
+        for (int k = 0; k < taps; k++) {
+            h[k] = (float)lowpass_tap(k - (taps / 2 - 1) - (double)p / phases, cutoff, taps);
+            sum += h[k];
+        }
+        for (int k = 0; k < taps; k++) {
+            h[k] = (float)(h[k] / sum);
+        }
+    }
+    return bank;
+}
+
+// Bank for a ratio from the cache, designed on first use. Unused banks make room for new ratios.
+static ResampleBank *acquire_bank(int in_rate, int out_rate) {
+    pthread_mutex_lock(&bank_cache_lock);
+    ResampleBank *bank = NULL;
+    int free_slot = -1;
+    for (int i = 0; i < RESAMPLE_CACHE_SIZE && bank == NULL; i++) {
+        if (bank_cache[i] && bank_cache[i]->in_rate == in_rate && bank_cache[i]->out_rate == out_rate) {
+            bank = bank_cache[i];
+        } else if (free_slot < 0 && (bank_cache[i] == NULL || bank_cache[i]->users == 0)) {
+            free_slot = i;
+        }
+    }
+
+    if (bank == NULL) {
+        bank = create_bank(in_rate, out_rate);
+        if (bank && free_slot >= 0) {
+            free(bank_cache[free_slot]);
+            bank_cache[free_slot] = bank;
+        }
+    }
+    if (bank) {
+        bank->users++;
+    }
+    pthread_mutex_unlock(&bank_cache_lock);
+    return bank;
+}
+
+static void release_bank(ResampleBank *bank) {
+    pthread_mutex_lock(&bank_cache_lock);
+    bool cached = false;
+    for (int i = 0; i < RESAMPLE_CACHE_SIZE; i++) {
+        cached = cached || bank_cache[i] == bank;
+    }
+    bank->users--;
+    if (!cached && bank->users == 0) {
+        free(bank); // designed while the cache was full of busy banks
+    }
+    pthread_mutex_unlock(&bank_cache_lock);
+}
+
+// Prepare a converter from in_rate to out_rate, -1 on invalid rates or no memory
+int resampler_init(Resampler *resampler, int in_rate, int out_rate) {
+    memset(resampler, 0, sizeof(*resampler));
+    if (in_rate <= 0 || out_rate <= 0) {
+        dsp_error("Can't resample from %d Hz to %d Hz.\n", in_rate, out_rate);
+        return -1;
+    }
+
+    resampler->bank = acquire_bank(in_rate, out_rate);
+    if (resampler->bank) {
+        resampler->taps = resampler->bank->taps;
+        resampler->capacity = (size_t)resampler->bank->taps * 4;
+        resampler->history = (float *)calloc(resampler->capacity, sizeof(float));
+    }
+    if (resampler->history == NULL) {
+        resampler_free(resampler);
+        dsp_error("Couldn't allocate memory for the resampler.\n");
+        return -1;
+    }
+
+    // The first output is centered on input sample 0, so the filter starts on zeros before it
+    resampler->count = resampler->bank->taps / 2 - 1;
+    resampler->base = -(int64_t)resampler->count;
+    resampler->limit = UINT64_MAX;
+    return 0;
+}
+
+void resampler_free(Resampler *resampler) {
+    if (resampler->bank) {
+        release_bank(resampler->bank);
+    }
+    free(resampler->history);
+    resampler->bank = NULL;
+    resampler->history = NULL;
+}
+
+// Number of output samples for a whole stream of count input samples
+size_t resampled_samples(uint64_t count, int in_rate, int out_rate) {
+    return (size_t)((count * out_rate + in_rate - 1) / in_rate);
+}
+
+// Upper bound of output samples produced from count more input samples
+size_t resampler_capacity(const Resampler *resampler, int count) {
+    return (size_t)((uint64_t)count * resampler->bank->up / resampler->bank->down) + 2;
+}
+
+// One filter over one channel, four lanes at a time
+static float fir_dot(const float *h, const float *x, int taps) {
+#ifdef __SSE__
+    __m128 acc = _mm_setzero_ps();
+    for (int k = 0; k < taps; k += 4) {
+        acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(h + k), _mm_loadu_ps(x + k)));
+    }
+    float lanes[4];
+    _mm_storeu_ps(lanes, acc);
+    return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+#else
+    float acc[4] = { 0 };
+    for (int k = 0; k < taps; k += 4) {
+        for (int l = 0; l < 4; l++) {
+            acc[l] += h[k + l] * x[k + l];
+        }
+    }
+    return (acc[0] + acc[1]) + (acc[2] + acc[3]);
+#endif
+}
+
+// Feed count input samples and return every output whose filter window is now complete.
+// out needs room for resampler_capacity(resampler, count) samples.
+int resampler_process(Resampler *resampler, const int16_t *in, int count, int16_t *out) {
+    const ResampleBank *bank = resampler->bank;
+    if (resampler->count + count > resampler->capacity) {
+        size_t capacity = resampler->count + count + bank->taps;
+        float *history = (float *)realloc(resampler->history, capacity * sizeof(float));
+        if (history == NULL) {
+            dsp_error("Couldn't allocate memory for the resampler.\n");
+            return -1;
+        }
+        resampler->history = history;
+        resampler->capacity = capacity;
+    }
+
+    float *tail = resampler->history + resampler->count;
+    for (int n = 0; n < count; n++) {
+        tail[n] = in[n];
+    }
+    resampler->count += count;
+
+    const int half = bank->taps / 2;
+    int64_t end = resampler->base + (int64_t)resampler->count;
+    int produced = 0;
+
+    while (resampler->next < resampler->limit) {
+        uint64_t position = resampler->next * bank->down;
+        int64_t center = (int64_t)(position / bank->up);
+        uint64_t fraction = position % bank->up;
+        int phase = bank->phases == (int)bank->up
+            ? (int)fraction
+            : (int)((fraction * bank->phases + bank->up / 2) / bank->up);
+        if (phase == bank->phases) {
+            center++;
+            phase = 0;
+        }
+        // The taps reach from center - (half - 1) to center + half, the last input is end - 1
+        if (center + half >= end) {
+            break;
+        }
+
+        const float *x = resampler->history + (center - (half - 1) - resampler->base);
+        float y = fir_dot(bank->coefficients + (size_t)phase * bank->taps, x, bank->taps);
+        long rounded = lrintf(y);
+        out[produced++] = (int16_t)(rounded > 32767 ? 32767 : rounded < -32768 ? -32768 : rounded);
+        resampler->next++;
+    }
+
+    // Drop the input no later output will need
+    int64_t keep_from = (int64_t)(resampler->next * bank->down / bank->up) - (half - 1);
+    if (keep_from > resampler->base) {
+        size_t drop = (size_t)(keep_from - resampler->base);
+        if (drop > resampler->count) {
+            drop = resampler->count;
+        }
+        memmove(resampler->history, resampler->history + drop, (resampler->count - drop) * sizeof(float));
+        resampler->count -= drop;
+        resampler->base += (int64_t)drop;
+    }
+    resampler->consumed += count;
+    return produced;
+}
+
+// End of input: push zeros through the filter for the outputs still owed, and no more.
+// out needs room for resampler_capacity(resampler, resampler->taps) samples.
+int resampler_flush(Resampler *resampler, int16_t *out) {
+    int16_t zeros[256] = { 0 };
+    const ResampleBank *bank = resampler->bank;
+    resampler->limit = resampled_samples(resampler->consumed, bank->down, bank->up);
+    uint64_t consumed = resampler->consumed;
+    int produced = 0;
+    for (int left = bank->taps / 2 + 1; left > 0; left -= 256) {
+        int result = resampler_process(resampler, zeros, left < 256 ? left : 256, out + produced);
+        if (result < 0) {
+            return -1;
+        }
+        produced += result;
+    }
+    resampler->consumed = consumed;
+    return produced;
+}
+
+// -------------------------------------------------------------------------------------------------------- fft
+
+struct FftPlan {
+    int size;
+    int users;              // holders of the plan, guarded by plan_cache_lock
+    float *twiddles;        // per radix-4 stage of length n: w^p, w^2p, w^3p for p < n / 4, as 6 rows
+    float storage[];
+};
+
+static FftPlan *plan_cache[FFT_CACHE_SIZE];
+static pthread_mutex_t plan_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static FftPlan *create_plan(int size) {
+    size_t twiddle_count = 0;
+    for (int n = size; n >= 4; n /= 4) {
+        twiddle_count += 6 * (size_t)(n / 4);
+    }
+    FftPlan *plan = (FftPlan *)malloc(sizeof(FftPlan) + twiddle_count * sizeof(float));
+    if (plan == NULL) {
+        return NULL;
+    }
+    plan->size = size;
+    plan->users = 0;
+    plan->twiddles = plan->storage;
+
+    float *w = plan->twiddles;
+    for (int n = size; n >= 4; n /= 4) {
+        int quarter = n / 4;
+        for (int p = 0; p < quarter; p++) {
+            for (int m = 1; m <= 3; m++) {
+                double angle = -2.0 * M_PI * m * p / n;
+                w[(2 * m - 2) * quarter + p] = (float)cos(angle);
+                w[(2 * m - 1) * quarter + p] = (float)sin(angle);
+            }
+        }
+        w += 6 * quarter;
+    }
+    return plan;
+}
+
+// Plan for a power of two size from the cache, built on first use. Unused plans make room for new sizes.
+FftPlan *fft_plan_acquire(int size) {
+    if (size < FFT_MIN_SIZE || size > FFT_MAX_SIZE || (size & (size - 1)) != 0) {
+        dsp_error("Invalid FFT size %d.\n", size);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&plan_cache_lock);
+    FftPlan *plan = NULL;
+    int free_slot = -1;
+    for (int i = 0; i < FFT_CACHE_SIZE && plan == NULL; i++) {
+        if (plan_cache[i] && plan_cache[i]->size == size) {
+            plan = plan_cache[i];
+        } else if (free_slot < 0 && (plan_cache[i] == NULL || plan_cache[i]->users == 0)) {
+            free_slot = i;
+        }
+    }
+
+    if (plan == NULL) {
+        plan = create_plan(size);
+        if (plan && free_slot >= 0) {
+            free(plan_cache[free_slot]);
+            plan_cache[free_slot] = plan;
+        }
+    }
+    if (plan) {
+        plan->users++;
+    } else {
+        dsp_error("Couldn't allocate memory for the FFT.\n");
+    }
+    pthread_mutex_unlock(&plan_cache_lock);
+    return plan;
+}
+
+void fft_plan_release(FftPlan *plan) {
+    if (plan == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&plan_cache_lock);
+    bool cached = false;
+    for (int i = 0; i < FFT_CACHE_SIZE; i++) {
+        cached = cached || plan_cache[i] == plan;
+    }
+    plan->users--;
+    if (!cached && plan->users == 0) {
+        free(plan); // built while the cache was full of busy plans
+    }
+    pthread_mutex_unlock(&plan_cache_lock);
+}
+
+int fft_plan_size(const FftPlan *plan) {
+    return plan->size;
+}
+
+// One radix-4 butterfly of a Stockham stage, a b c d a quarter of the stage apart
+#define FFT_BUTTERFLY(ar, ai, br, bi, cr, ci, dr, di, w, quarter, p, y0r, y0i, y1r, y1i, y2r, y2i, y3r, y3i) do { \
+        float apcr = ar + cr, apci = ai + ci, amcr = ar - cr, amci = ai - ci;                                   \
+        float bpdr = br + dr, bpdi = bi + di, bmdr = br - dr, bmdi = bi - di;                                   \
+        float t1r = amcr + bmdi, t1i = amci - bmdr, t2r = apcr - bpdr, t2i = apci - bpdi;                       \
+        float t3r = amcr - bmdi, t3i = amci + bmdr;                                                             \
+        const float *tw = (w);                                                                                  \
+        float w1r = tw[(p)], w1i = tw[(quarter) + (p)];                                                         \
+        float w2r = tw[2 * (quarter) + (p)], w2i = tw[3 * (quarter) + (p)];                                     \
+        float w3r = tw[4 * (quarter) + (p)], w3i = tw[5 * (quarter) + (p)];                                     \
+        y0r = apcr + bpdr;                                                                                      \
+        y0i = apci + bpdi;                                                                                      \
+        y1r = w1r * t1r - w1i * t1i;                                                                            \
+        y1i = w1r * t1i + w1i * t1r;                                                                            \
+        y2r = w2r * t2r - w2i * t2i;                                                                            \
+        y2i = w2r * t2i + w2i * t2r;                                                                            \
+        y3r = w3r * t3r - w3i * t3i;                                                                            \
+        y3i = w3r * t3i + w3i * t3r;                                                                            \
+    } while (0)
+
+#ifdef __SSE__
+// Four butterflies at once, w1 w2 w3 given as vectors
+static inline void fft_butterfly4(__m128 ar, __m128 ai, __m128 br, __m128 bi, __m128 cr, __m128 ci,
+                                  __m128 dr, __m128 di, const __m128 w[6], __m128 y[8]) {
+    __m128 apcr = _mm_add_ps(ar, cr), apci = _mm_add_ps(ai, ci);
+    __m128 amcr = _mm_sub_ps(ar, cr), amci = _mm_sub_ps(ai, ci);
+    __m128 bpdr = _mm_add_ps(br, dr), bpdi = _mm_add_ps(bi, di);
+    __m128 bmdr = _mm_sub_ps(br, dr), bmdi = _mm_sub_ps(bi, di);
+    __m128 t1r = _mm_add_ps(amcr, bmdi), t1i = _mm_sub_ps(amci, bmdr);
+    __m128 t2r = _mm_sub_ps(apcr, bpdr), t2i = _mm_sub_ps(apci, bpdi);
+    __m128 t3r = _mm_sub_ps(amcr, bmdi), t3i = _mm_add_ps(amci, bmdr);
+    y[0] = _mm_add_ps(apcr, bpdr);
+    y[1] = _mm_add_ps(apci, bpdi);
+    y[2] = _mm_sub_ps(_mm_mul_ps(w[0], t1r), _mm_mul_ps(w[1], t1i));
+    y[3] = _mm_add_ps(_mm_mul_ps(w[0], t1i), _mm_mul_ps(w[1], t1r));
+    y[4] = _mm_sub_ps(_mm_mul_ps(w[2], t2r), _mm_mul_ps(w[3], t2i));
+    y[5] = _mm_add_ps(_mm_mul_ps(w[2], t2i), _mm_mul_ps(w[3], t2r));
+    y[6] = _mm_sub_ps(_mm_mul_ps(w[4], t3r), _mm_mul_ps(w[5], t3i));
+    y[7] = _mm_add_ps(_mm_mul_ps(w[4], t3i), _mm_mul_ps(w[5], t3r));
+}
+#endif
+
+// Radix-4 stage of length n over stride s: x[q + s*(p + k*n/4)] -> y[q + s*(4p + k)]
+static void fft_stage(const float *w, int n, int s, const float *xr, const float *xi, float *yr, float *yi) {
+    int quarter = n / 4;
+    size_t step = (size_t)s * quarter;
+#ifdef __SSE__
+    if (s == 1 && quarter >= 4) {
+        // First stage: four consecutive p, transposed so each p writes its four outputs together
+        for (int p = 0; p < quarter; p += 4) {
+            __m128 tw[6], y[8];
+            for (int m = 0; m < 6; m++) {
+                tw[m] = _mm_loadu_ps(w + m * quarter + p);
+            }
+            fft_butterfly4(_mm_loadu_ps(xr + p), _mm_loadu_ps(xi + p),
+                           _mm_loadu_ps(xr + p + step), _mm_loadu_ps(xi + p + step),
+                           _mm_loadu_ps(xr + p + 2 * step), _mm_loadu_ps(xi + p + 2 * step),
+                           _mm_loadu_ps(xr + p + 3 * step), _mm_loadu_ps(xi + p + 3 * step), tw, y);
+            _MM_TRANSPOSE4_PS(y[0], y[2], y[4], y[6]);
+            _MM_TRANSPOSE4_PS(y[1], y[3], y[5], y[7]);
+            for (int k = 0; k < 4; k++) {
+                _mm_storeu_ps(yr + 4 * (p + k), y[2 * k]);
+                _mm_storeu_ps(yi + 4 * (p + k), y[2 * k + 1]);
+            }
+        }
+        return;
+    }
+    if (s >= 4) {
+        for (int p = 0; p < quarter; p++) {
+            __m128 tw[6], y[8];
+            for (int m = 0; m < 6; m++) {
+                tw[m] = _mm_set1_ps(w[m * quarter + p]);
+            }
+            const float *ar = xr + (size_t)s * p, *ai = xi + (size_t)s * p;
+            float *outr = yr + (size_t)s * 4 * p, *outi = yi + (size_t)s * 4 * p;
+            for (int q = 0; q < s; q += 4) {
+                fft_butterfly4(_mm_loadu_ps(ar + q), _mm_loadu_ps(ai + q),
+                               _mm_loadu_ps(ar + q + step), _mm_loadu_ps(ai + q + step),
+                               _mm_loadu_ps(ar + q + 2 * step), _mm_loadu_ps(ai + q + 2 * step),
+                               _mm_loadu_ps(ar + q + 3 * step), _mm_loadu_ps(ai + q + 3 * step), tw, y);
+                for (int k = 0; k < 4; k++) {
+                    _mm_storeu_ps(outr + (size_t)k * s + q, y[2 * k]);
+                    _mm_storeu_ps(outi + (size_t)k * s + q, y[2 * k + 1]);
+                }
+            }
+        }
+        return;
+    }
+#endif
+    for (int p = 0; p < quarter; p++) {
+        for (int q = 0; q < s; q++) {
+            size_t at = q + (size_t)s * p, out = q + (size_t)s * 4 * p;
+            FFT_BUTTERFLY(xr[at], xi[at], xr[at + step], xi[at + step],
+                          xr[at + 2 * step], xi[at + 2 * step], xr[at + 3 * step], xi[at + 3 * step],
+                          w, quarter, p,
+                          yr[out], yi[out], yr[out + s], yi[out + s],
+                          yr[out + 2 * s], yi[out + 2 * s], yr[out + 3 * s], yi[out + 3 * s]);
+        }
+    }
+}
+
+// Last stage of sizes with an odd power of two: x[q] +- x[q + s]
+static void fft_radix2(int s, const float *xr, const float *xi, float *yr, float *yi) {
+    int q = 0;
+#ifdef __SSE__
+    for (; q + 4 <= s; q += 4) {
+        __m128 ar = _mm_loadu_ps(xr + q), ai = _mm_loadu_ps(xi + q);
+        __m128 br = _mm_loadu_ps(xr + q + s), bi = _mm_loadu_ps(xi + q + s);
+        _mm_storeu_ps(yr + q, _mm_add_ps(ar, br));
+        _mm_storeu_ps(yi + q, _mm_add_ps(ai, bi));
+        _mm_storeu_ps(yr + q + s, _mm_sub_ps(ar, br));
+        _mm_storeu_ps(yi + q + s, _mm_sub_ps(ai, bi));
+    }
+#endif
+    for (; q < s; q++) {
+        float ar = xr[q], ai = xi[q], br = xr[q + s], bi = xi[q + s];
+        yr[q] = ar + br;
+        yi[q] = ai + bi;
+        yr[q + s] = ar - br;
+        yi[q + s] = ai - bi;
+    }
+}
+
+// In place forward transform, X[k] = sum x[n] e^(-2 pi i k n / size), of split real and imaginary parts.
+// Stockham order: every stage reads one buffer and writes the other, so no bit reversal pass is needed.
+// work holds 2 * size floats, one per thread.
+void fft_forward(const FftPlan *plan, float *re, float *im, float *work) {
+    float *xr = re, *xi = im;
+    float *yr = work, *yi = work + plan->size;
+    const float *w = plan->twiddles;
+    int n = plan->size, s = 1;
+    for (; n >= 4; n /= 4, s *= 4) {
+        fft_stage(w, n, s, xr, xi, yr, yi);
+        w += 6 * (n / 4);
+        float *t = xr; xr = yr; yr = t;
+        t = xi; xi = yi; yi = t;
+    }
+    if (n == 2) {
+        fft_radix2(s, xr, xi, yr, yi);
+        float *t = xr; xr = yr; yr = t;
+        t = xi; xi = yi; yi = t;
+    }
+    if (xr != re) {
+        memcpy(re, xr, plan->size * sizeof(float));
+        memcpy(im, xi, plan->size * sizeof(float));
+    }
+}
+
+// Unscaled inverse, x[n] = sum X[k] e^(2 pi i k n / size): the forward transform with re and im swapped
+void fft_inverse(const FftPlan *plan, float *re, float *im, float *work) {
+    fft_forward(plan, im, re, work);
+}
+
+// Two real signals share one complex transform as its real and imaginary parts. Adding the value v at
+// bin k of signal A (or B) sets Z[k] += v (i v) and Z[-k] += conj(v) (i conj(v)), so both stay real.
+static void fft_pair_add(float *re, float *im, int size, int k, float vr, float vi, bool second) {
+    if (second) {
+        re[k] -= vi;
+        im[k] += vr;
+        re[size - k] += vi;
+        im[size - k] += vr;
+    } else {
+        re[k] += vr;
+        im[k] += vi;
+        re[size - k] += vr;
+        im[size - k] -= vi;
+    }
+}
+
+// Bin k of signal A or B out of their joint transform Z, times two:
+// A[k] = (Z[k] + conj(Z[-k])) / 2, B[k] = (Z[k] - conj(Z[-k])) / 2i
+static void fft_pair_get(const float *re, const float *im, int size, int k, bool second, float *vr, float *vi) {
+    float zr = re[k], zi = im[k], cr = re[size - k], ci = -im[size - k];
+    *vr = second ? zi - ci : zr + cr;
+    *vi = second ? cr - zr : zi + ci;
+}
+
+// -------------------------------------------------------------------------------------------------------- spectrogram
+
+static int spectrogram_pilot_bin(int size, int sample_rate) {
+    int pilot = (int)ceil((double)SPECTROGRAM_LOW_HZ * size / sample_rate);
+    return pilot < 1 ? 1 : pilot;
+}
+
+// Frame length for an image: the smallest transform that puts the pilot at SPECTROGRAM_LOW_HZ and every
+// row below the band edge, or a longer one when pixels_per_second leaves time for it. Longer frames
+// average more noise out of every pixel.
+int spectrogram_layout(SpectrogramLayout *layout, int sample_rate, int height, int pixels_per_second) {
+    memset(layout, 0, sizeof(*layout));
+    if (sample_rate <= 0 || height <= 0 || pixels_per_second <= 0) {
+        return -1;
+    }
+    int size = SPECTROGRAM_MIN_FFT;
+    while (size <= SPECTROGRAM_MAX_FFT &&
+           spectrogram_pilot_bin(size, sample_rate) + SPECTROGRAM_PILOT_GAP + height > (int)(size / 2 * SPECTROGRAM_BAND)) {
+        size *= 2;
+    }
+    if (size > SPECTROGRAM_MAX_FFT) {
+        dsp_error("An image %d pixels high doesn't fit in a spectrogram at %d Hz.\n", height, sample_rate);
+        return -1;
+    }
+    double column_samples = (double)sample_rate * height / pixels_per_second;
+    while (size < SPECTROGRAM_MAX_FFT && 2.0 * size * (1.0 + 1.0 / SPECTROGRAM_GUARD_DIVISOR) <= column_samples) {
+        size *= 2;
+    }
+
+    layout->sample_rate = sample_rate;
+    layout->height = height;
+    layout->fft_size = size;
+    layout->first_bin = spectrogram_pilot_bin(size, sample_rate) + SPECTROGRAM_PILOT_GAP;
+    layout->guard = size / SPECTROGRAM_GUARD_DIVISOR;
+    return 0;
+}
+
+// Tallest image a spectrogram at sample_rate holds, at the longest frame
+int spectrogram_max_height(int sample_rate) {
+    return (int)(SPECTROGRAM_MAX_FFT / 2 * SPECTROGRAM_BAND) - spectrogram_pilot_bin(SPECTROGRAM_MAX_FFT, sample_rate) -
+           SPECTROGRAM_PILOT_GAP;
+}
+
+// Layout read back from a file, -1 if it can't have come from spectrogram_layout
+int spectrogram_layout_check(const SpectrogramLayout *layout) {
+    int size = layout->fft_size;
+    if (layout->sample_rate <= 0 || layout->height <= 0 || size < SPECTROGRAM_MIN_FFT ||
+        size > SPECTROGRAM_MAX_FFT || (size & (size - 1)) != 0 || layout->guard < 0 || layout->guard > size ||
+        layout->first_bin < SPECTROGRAM_PILOT_GAP + 1 || layout->first_bin + layout->height > size / 2) {
+        dsp_error("Invalid spectrogram description in the WAV file.\n");
+        return -1;
+    }
+    return 0;
+}
+
+int spectrogram_init(Spectrogram *sg, const SpectrogramLayout *layout) {
+    memset(sg, 0, sizeof(*sg));
+    sg->layout = *layout;
+    int size = layout->fft_size;
+    int tones = layout->height + SPECTROGRAM_PILOT_GAP;
+
+    sg->plan = fft_plan_acquire(size);
+    sg->phasor = (float *)malloc(2 * (size_t)tones * sizeof(float));
+    sg->ramp = (float *)malloc(((size_t)layout->guard + 1) * sizeof(float));
+    if (sg->plan == NULL || sg->phasor == NULL || sg->ramp == NULL) {
+        spectrogram_free(sg);
+        dsp_error("Couldn't allocate memory for the spectrogram.\n");
+        return -1;
+    }
+
+    // Each tone (pilot, gap, rows) gets a unit amplitude at full white, scaled for a fixed RMS level, and
+    // a Newman phase, pi m^2 / tones, which keeps the peak of the summed tones low
+    double amplitude = SPECTROGRAM_RMS * sqrt(2.0 / (layout->height + 1));
+    for (int m = 0; m < tones; m++) {
+        double phase = M_PI * m * m / tones;
+        sg->phasor[2 * m] = (float)(0.5 * amplitude * cos(phase));
+        sg->phasor[2 * m + 1] = (float)(0.5 * amplitude * sin(phase));
+    }
+    for (int n = 0; n < layout->guard; n++) {
+        sg->ramp[n] = (float)(0.5 - 0.5 * cos(M_PI * (n + 0.5) / layout->guard));
+    }
+    return 0;
+}
+
+void spectrogram_free(Spectrogram *sg) {
+    fft_plan_release(sg->plan);
+    free(sg->phasor);
+    free(sg->ramp);
+    sg->plan = NULL;
+    sg->phasor = NULL;
+    sg->ramp = NULL;
+}
+
+// Scratch floats one thread needs for spectrogram_synthesize or spectrogram_analyze
+size_t spectrogram_work_size(const Spectrogram *sg) {
+    return 4 * (size_t)sg->layout.fft_size;
+}
+
+// Tone amplitudes of one column: the pilot at full scale, the gap silent, then the rows from the bottom up
+static void spectrogram_column(const Spectrogram *sg, const uint8_t *column, int stride, float *re, float *im,
+                               bool second) {
+    const SpectrogramLayout *layout = &sg->layout;
+    int size = layout->fft_size;
+    int pilot = layout->first_bin - SPECTROGRAM_PILOT_GAP;
+    int tones = layout->height + SPECTROGRAM_PILOT_GAP;
+    for (int m = 0; m < tones; m++) {
+        float level;
+        if (m == 0) {
+            level = column ? 1.0f : 0.0f;
+        } else if (m < SPECTROGRAM_PILOT_GAP || column == NULL) {
+            level = 0.0f;
+        } else {
+            level = column[(size_t)(layout->height - 1 - (m - SPECTROGRAM_PILOT_GAP)) * stride] / 255.0f;
+        }
+        fft_pair_add(re, im, size, pilot + m, level * sg->phasor[2 * m], level * sg->phasor[2 * m + 1], second);
+    }
+}
+
+// One column as a windowed frame of fft_size + 2 * guard samples: a ramp in, fft_size samples of
+// constant tones and a ramp out. Overlap-adding frames guard samples apart from each other
+// (column c starting at c * (fft_size + guard)) crossfades the columns without clicks.
+static void spectrogram_frame(const Spectrogram *sg, const float *period, uint64_t column, float *frame) {
+    const SpectrogramLayout *layout = &sg->layout;
+    int size = layout->fft_size, guard = layout->guard;
+
+    // The tones run on the global sample clock, so a column only starts somewhere in its period
+    // and equal neighbours join without a seam
+    int offset = (int)((column * (uint64_t)(size + guard)) % (uint64_t)size);
+
+    // Columns whose tones add up too high are turned down, the pilot with them
+    float peak = 0.0f;
+    for (int n = 0; n < size; n++) {
+        float magnitude = fabsf(period[n]);
+        peak = magnitude > peak ? magnitude : peak;
+    }
+    float gain = peak > SPECTROGRAM_PEAK ? SPECTROGRAM_PEAK / peak : 1.0f;
+
+    int length = size + 2 * guard;
+    for (int n = 0; n < length; n++) {
+        float weight = n < guard ? sg->ramp[n] : n >= size + guard ? sg->ramp[length - 1 - n] : 1.0f;
+        frame[n] = gain * weight * period[(offset + n) % size];
+    }
+}
+
+// Frames for two columns with one inverse transform, two real signals packed as real and imaginary parts.
+// column_b may be NULL for the last column of an odd width; frames are spectrogram_frame_size floats.
+void spectrogram_synthesize(const Spectrogram *sg, const uint8_t *column_a, const uint8_t *column_b, int stride,
+                            uint64_t index_a, float *frame_a, float *frame_b, float *work) {
+    int size = sg->layout.fft_size;
+    float *re = work, *im = work + size;
+    memset(re, 0, 2 * (size_t)size * sizeof(float));
+    spectrogram_column(sg, column_a, stride, re, im, false);
+    spectrogram_column(sg, column_b, stride, re, im, true);
+    fft_inverse(sg->plan, re, im, work + 2 * size);
+
+    spectrogram_frame(sg, re, index_a, frame_a);
+    if (column_b) {
+        spectrogram_frame(sg, im, index_a + 1, frame_b);
+    }
+}
+
+size_t spectrogram_frame_size(const Spectrogram *sg) {
+    return (size_t)sg->layout.fft_size + 2 * (size_t)sg->layout.guard;
+}
+
+// Pixels of two columns from the fft_size constant samples of each, one forward transform for both.
+// Every tone is measured against the pilot, so the overall level of the audio doesn't matter.
+void spectrogram_analyze(const Spectrogram *sg, const int16_t *samples_a, const int16_t *samples_b,
+                         uint8_t *column_a, uint8_t *column_b, int stride, float *work) {
+    const SpectrogramLayout *layout = &sg->layout;
+    int size = layout->fft_size;
+    float *re = work, *im = work + size;
+    for (int n = 0; n < size; n++) {
+        re[n] = samples_a[n];
+        im[n] = samples_b ? samples_b[n] : 0.0f;
+    }
+    fft_forward(sg->plan, re, im, work + 2 * size);
+
+    for (int half = 0; half < 2; half++) {
+        uint8_t *column = half == 0 ? column_a : column_b;
+        if (column == NULL) {
+            continue;
+        }
+        int pilot = layout->first_bin - SPECTROGRAM_PILOT_GAP;
+        float reference = 0.0f;
+        for (int y = -1; y < layout->height; y++) {
+            int k = y < 0 ? pilot : layout->first_bin + layout->height - 1 - y;
+            float ar, ai;
+            fft_pair_get(re, im, size, k, half == 1, &ar, &ai);
+            float magnitude = sqrtf(ar * ar + ai * ai);
+            if (y < 0) {
+                reference = magnitude > 0.0f ? 255.0f / magnitude : 0.0f;
+            } else {
+                float value = magnitude * reference + 0.5f;
+                column[(size_t)y * stride] = value >= 255.0f ? 255 : (uint8_t)value;
+            }
+        }
+    }
+}
+
+// -------------------------------------------------------------------------------------------------------- ofdm
+
+// Subcarriers for a sample rate: spaced at most OFDM_MAX_SPACING_HZ apart, from OFDM_LOW_HZ up to the
+// band edge, so higher rates get more of them and carry more pixels per second
+int ofdm_layout(OfdmLayout *layout, int sample_rate) {
+    memset(layout, 0, sizeof(*layout));
+    int size = OFDM_MIN_FFT;
+    while (size < OFDM_MAX_FFT && (double)sample_rate / size > OFDM_MAX_SPACING_HZ) {
+        size *= 2;
+    }
+    int first = (int)ceil((double)OFDM_LOW_HZ * size / sample_rate);
+    int last = (int)(size / 2 * OFDM_BAND);
+    if (sample_rate <= 0 || first < 1 || last - first + 1 < OFDM_MIN_CARRIERS) {
+        dsp_error("%d Hz is too low a sample rate for OFDM.\n", sample_rate);
+        return -1;
+    }
+    layout->sample_rate = sample_rate;
+    layout->fft_size = size;
+    layout->first_bin = first;
+    layout->carriers = last - first + 1;
+    layout->prefix = size / OFDM_PREFIX_DIVISOR;
+    layout->training_interval = OFDM_TRAINING_INTERVAL;
+    return 0;
+}
+
+// Layout read back from a file, -1 if it can't be demodulated. Decoders allocate batches of whole groups of
+// a training symbol and its data symbols, so a group is bounded too.
+int ofdm_layout_check(const OfdmLayout *layout) {
+    int size = layout->fft_size;
+    if (layout->sample_rate <= 0 || size < OFDM_MIN_FFT || size > OFDM_MAX_FFT || (size & (size - 1)) != 0 ||
+        layout->first_bin < 1 || layout->first_bin > size / 2 || layout->carriers < 1 ||
+        layout->carriers > size / 2 - layout->first_bin || layout->prefix < 0 || layout->prefix > size ||
+        layout->training_interval < 1 || layout->training_interval > OFDM_MAX_TRAINING_INTERVAL ||
+        (uint64_t)(layout->training_interval + 1) * (size + layout->prefix) > OFDM_MAX_GROUP_SAMPLES) {
+        dsp_error("Invalid OFDM description in the WAV file.\n");
+        return -1;
+    }
+    return 0;
+}
+
+int ofdm_init(Ofdm *ofdm, const OfdmLayout *layout) {
+    memset(ofdm, 0, sizeof(*ofdm));
+    ofdm->layout = *layout;
+    ofdm->plan = fft_plan_acquire(layout->fft_size);
+    ofdm->training = (float *)malloc(2 * (size_t)layout->carriers * sizeof(float));
+    if (ofdm->plan == NULL || ofdm->training == NULL) {
+        ofdm_free(ofdm);
+        dsp_error("Couldn't allocate memory for OFDM.\n");
+        return -1;
+    }
+
+    // Training values: unit amplitude at a pseudo-random quarter turn per carrier. Data values are turned
+    // the same way, so images with smooth or repeating rows still add up like noise rather than to a
+    // single peak.
+    uint32_t seed = OFDM_SCRAMBLE_SEED;
+    for (int m = 0; m < layout->carriers; m++) {
+        seed = seed * 1664525u + 1013904223u;
+        static const float turns[4][2] = { { 1.0f, 0.0f }, { 0.0f, 1.0f }, { -1.0f, 0.0f }, { 0.0f, -1.0f } };
+        ofdm->training[2 * m] = turns[seed >> 30][0];
+        ofdm->training[2 * m + 1] = turns[seed >> 30][1];
+    }
+    // Half amplitude per carrier for OFDM_RMS over the whole symbol, a value of magnitude 1 being full scale
+    ofdm->amplitude = (float)(0.5 * OFDM_RMS * sqrt(2.0 / layout->carriers));
+    return 0;
+}
+
+void ofdm_free(Ofdm *ofdm) {
+    fft_plan_release(ofdm->plan);
+    free(ofdm->training);
+    ofdm->plan = NULL;
+    ofdm->training = NULL;
+}
+
+// Samples of one symbol, cyclic prefix included
+size_t ofdm_symbol_samples(const Ofdm *ofdm) {
+    return (size_t)ofdm->layout.fft_size + ofdm->layout.prefix;
+}
+
+// Pixels carried by one data symbol, two per carrier
+size_t ofdm_symbol_pixels(const Ofdm *ofdm) {
+    return 2 * (size_t)ofdm->layout.carriers;
+}
+
+size_t ofdm_work_size(const Ofdm *ofdm) {
+    return 4 * (size_t)ofdm->layout.fft_size;
+}
+
+static void ofdm_load(const Ofdm *ofdm, const uint8_t *pixels, float *re, float *im, bool second) {
+    const OfdmLayout *layout = &ofdm->layout;
+    float scale = ofdm->amplitude / 127.5f;
+    for (int m = 0; m < layout->carriers; m++) {
+        float tr = ofdm->training[2 * m], ti = ofdm->training[2 * m + 1];
+        float vr = ofdm->amplitude, vi = 0.0f;
+        if (pixels) {
+            vr = (pixels[2 * m] - 127.5f) * scale;
+            vi = (pixels[2 * m + 1] - 127.5f) * scale;
+        }
+        fft_pair_add(re, im, layout->fft_size, layout->first_bin + m, vr * tr - vi * ti, vr * ti + vi * tr, second);
+    }
+}
+
+static void ofdm_store(const Ofdm *ofdm, const float *period, int16_t *symbol) {
+    int size = ofdm->layout.fft_size, prefix = ofdm->layout.prefix;
+    for (int n = 0; n < size + prefix; n++) {
+        long rounded = lrintf(period[(n + size - prefix) % size]);
+        symbol[n] = (int16_t)(rounded > 32767 ? 32767 : rounded < -32768 ? -32768 : rounded);
+    }
+}
+
+// Two symbols with one inverse transform. Each pixel pair is one carrier's in-phase and quadrature value;
+// NULL pixels send the training symbol instead. Without pair only symbol A is made.
+void ofdm_modulate(const Ofdm *ofdm, const uint8_t *pixels_a, const uint8_t *pixels_b, bool pair,
+                   int16_t *symbol_a, int16_t *symbol_b, float *work) {
+    int size = ofdm->layout.fft_size;
+    float *re = work, *im = work + size;
+    memset(re, 0, 2 * (size_t)size * sizeof(float));
+    ofdm_load(ofdm, pixels_a, re, im, false);
+    if (pair) {
+        ofdm_load(ofdm, pixels_b, re, im, true);
+    }
+    fft_inverse(ofdm->plan, re, im, work + 2 * size);
+
+    ofdm_store(ofdm, re, symbol_a);
+    if (pair) {
+        ofdm_store(ofdm, im, symbol_b);
+    }
+}
+
+// Carrier values (re / im pairs, 2 * carriers floats) of two received symbols, the prefix skipped.
+// symbol_b may be NULL when there is only one.
+void ofdm_demodulate(const Ofdm *ofdm, const int16_t *symbol_a, const int16_t *symbol_b,
+                     float *values_a, float *values_b, float *work) {
+    const OfdmLayout *layout = &ofdm->layout;
+    int size = layout->fft_size;
+    float *re = work, *im = work + size;
+    for (int n = 0; n < size; n++) {
+        re[n] = symbol_a[layout->prefix + n];
+        im[n] = symbol_b ? symbol_b[layout->prefix + n] : 0.0f;
+    }
+    fft_forward(ofdm->plan, re, im, work + 2 * size);
+
+    for (int m = 0; m < layout->carriers; m++) {
+        int k = layout->first_bin + m;
+        fft_pair_get(re, im, size, k, false, &values_a[2 * m], &values_a[2 * m + 1]);
+        if (symbol_b) {
+            fft_pair_get(re, im, size, k, true, &values_b[2 * m], &values_b[2 * m + 1]);
+        }
+    }
+}
+
+// Channel correction from a received training symbol: the factor that turns what each carrier
+// received back into what was sent (gain, phase, the transform's scale and the scrambling turn),
+// 1 / y = conj(y) / |y|^2. Dead carriers get 0.
+void ofdm_train(const Ofdm *ofdm, const float *values, float *correction) {
+    for (int m = 0; m < ofdm->layout.carriers; m++) {
+        float yr = values[2 * m], yi = values[2 * m + 1];
+        float power = yr * yr + yi * yi;
+        correction[2 * m] = power > 0.0f ? yr / power : 0.0f;
+        correction[2 * m + 1] = power > 0.0f ? -yi / power : 0.0f;
+    }
+}
+
+// Pixels of a received data symbol, after the correction of the last training symbol
+void ofdm_equalize(const Ofdm *ofdm, const float *values, const float *correction, uint8_t *pixels) {
+    for (int m = 0; m < ofdm->layout.carriers; m++) {
+        float yr = values[2 * m], yi = values[2 * m + 1];
+        float cr = correction[2 * m], ci = correction[2 * m + 1];
+        float vr = (yr * cr - yi * ci) * 127.5f + 128.0f;
+        float vi = (yr * ci + yi * cr) * 127.5f + 128.0f;
+        pixels[2 * m] = vr <= 0.0f ? 0 : vr >= 255.0f ? 255 : (uint8_t)vr;
+        pixels[2 * m + 1] = vi <= 0.0f ? 0 : vi >= 255.0f ? 255 : (uint8_t)vi;
+    }
+}
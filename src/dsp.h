@@ -0,0 +1,288 @@
+// Wave2Image signal processing
+// Oscillators and modulators used by the encodings that turn pixels into real radio-style audio.
+// Internal to the library, the app and the CLI only go through wave2img.h.
+#ifndef DSP_H
+#define DSP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define NCO_TABLE_BITS 12 // 4096 entry sine table, about -70 dB of phase noise
+
+#define APT_CARRIER_HZ 2400
+#define APT_SYNC_WORDS 39           // 4 black, 7 cycles of 2 white / 2 black, 7 black
+#define APT_MODULATION_PERCENT 87   // black still carries 13% of the carrier, as on the satellites
+#define APT_BLOCK_SAMPLES 1024      // samples modulated per SIMD pass
+#define APT_LINE_WORDS 2080         // words per line of a satellite recording without a "w2im" chunk
+
+#define DEMOD_PHASES 64             // fractional positions of the polyphase low-pass bank
+#define DEMOD_MAX_TAPS 4096
+#define DEMOD_TRACK_WINDOW 6        // half words the sync may move from one line to the next
+#define DEMOD_RELOCK 0.75f          // a file keeps its line timing while its sync scores this much of the best near it
+
+#define RESAMPLE_MAX_PHASES 1024    // ratios needing more phases round to the nearest one
+#define RESAMPLE_MAX_TAPS 1024
+#define RESAMPLE_PASSBAND 0.9       // fraction of the lower Nyquist frequency kept flat
+#define RESAMPLE_CACHE_SIZE 8       // filter banks kept for reuse
+
+#define FFT_MIN_SIZE 4
+#define FFT_MAX_SIZE (1 << 20)
+#define FFT_CACHE_SIZE 8            // plans kept for reuse
+
+#define SPECTROGRAM_LOW_HZ 200      // lowest tone, the pilot, sits at or just above this
+#define SPECTROGRAM_PILOT_GAP 2     // bins from the pilot to the bottom row
+#define SPECTROGRAM_BAND 0.9        // fraction of Nyquist the top row stays below
+#define SPECTROGRAM_MIN_FFT 256
+#define SPECTROGRAM_MAX_FFT (1 << 16)
+#define SPECTROGRAM_GUARD_DIVISOR 8 // columns crossfade over fft_size / 8 samples
+#define SPECTROGRAM_RMS 8192.0      // level of a white column, -12 dB below full scale
+#define SPECTROGRAM_PEAK 32000.0f   // columns adding up above this are turned down
+
+#define OFDM_LOW_HZ 300             // lowest subcarrier
+#define OFDM_MAX_SPACING_HZ 50      // subcarrier spacing, the transform grows with the sample rate
+#define OFDM_BAND 0.85              // fraction of Nyquist the top subcarrier stays below, clear of resampling filters
+#define OFDM_MIN_FFT 64
+#define OFDM_MAX_FFT (1 << 16)
+#define OFDM_MIN_CARRIERS 8
+#define OFDM_PREFIX_DIVISOR 8       // cyclic prefix of fft_size / 8 samples absorbs echoes and offsets
+#define OFDM_TRAINING_INTERVAL 16   // data symbols between two training symbols
+#define OFDM_MAX_TRAINING_INTERVAL 256 // most data symbols a file may put between training symbols
+#define OFDM_MAX_GROUP_SAMPLES (1 << 21) // samples of a training symbol and its data symbols read from a file
+#define OFDM_RMS 6000.0             // about -15 dB below full scale, peaks stay clear of clipping
+#define OFDM_SCRAMBLE_SEED 0x4f464d44u
+
+#define PREDICT_FILTERS 5           // none, left, up, average and Paeth, numbered as PNG's filter types
+
+#define RS_LANES 16                 // codewords coded side by side, one per byte of an SSE register
+#define RS_MAX_PARITY 64
+
+// Numerically controlled oscillator: a 32-bit phase accumulator indexing a sine table
+typedef struct {
+    uint32_t phase;
+    uint32_t step;      // phase increment per sample, frequency * 2^32 / sample rate
+} Nco;
+
+// AM modulator for one APT stream. Words (pixels or sync) are clocked at pixels_per_second,
+// the fractional position carries over from one line to the next so timing never drifts.
+typedef struct {
+    Nco carrier;
+    int sample_rate;
+    int pixels_per_second;
+    uint32_t word_phase;    // position inside the current word, 0 .. sample_rate - 1
+    int16_t envelope[256];  // word value -> carrier amplitude, Q15
+    int16_t carrier_block[APT_BLOCK_SAMPLES];
+    int16_t envelope_block[APT_BLOCK_SAMPLES];
+} AptModulator;
+
+// Envelope detector for APT audio. The input is mixed down to I/Q by the 2400 Hz oscillator, then a
+// polyphase low-pass bank filters and decimates both in one step to two envelope values per word.
+// Output times are exact fractions of the input rate, so hours of audio never drift.
+typedef struct {
+    Nco carrier;
+    int sample_rate;
+    int pixels_per_second;
+    int taps;               // filter length, a multiple of 4
+    float *bank;            // DEMOD_PHASES filters of taps coefficients
+    float *i;               // mixed input not consumed yet
+    float *q;
+    size_t count;
+    size_t capacity;
+    int64_t base;           // input sample index of i[0] and q[0]
+    uint64_t next;          // index of the next envelope value
+} AptDemodulator;
+
+// Functions failing with -1 or NULL keep why for dsp_last_error, the first failure on the thread since
+// dsp_clear_error, empty if there was none
+const char *dsp_last_error(void);
+void dsp_clear_error(void);
+
+void nco_init(Nco *nco, double frequency, int sample_rate);
+void nco_generate(Nco *nco, int16_t *out, int count);
+
+// out[i] = carrier[i] * envelope[i] in Q15, vectorized when SSE2 / SSSE3 is available
+void am_modulate(const int16_t *carrier, const int16_t *envelope, int16_t *out, int count);
+
+// 16-bit samples to and from unsigned 8-bit PCM, vectorized with SSE2
+void pcm_s16_to_u8(const int16_t *in, uint8_t *out, size_t count);
+void pcm_u8_to_s16(const uint8_t *in, int16_t *out, size_t count);
+
+// 16-bit samples to and from IEEE float at full scale +-1.0, vectorized with SSE2
+void pcm_s16_to_f32(const int16_t *in, float *out, size_t count);
+void pcm_f32_to_s16(const float *in, int16_t *out, size_t count);
+
+// 8-bit RGBA to full range YCbCr planes and back to RGB, vectorized with SSE2
+void rgba_to_ycbcr(const uint8_t *rgba, uint8_t *y, uint8_t *cb, uint8_t *cr, size_t count);
+void ycbcr_to_rgb(const uint8_t *y, const uint8_t *cb, const uint8_t *cr, uint8_t *rgb, size_t count);
+
+// Colour planes as the interleaved channels of a multi-channel WAV and back, vectorized with SSSE3
+void rgba_to_channels(const uint8_t *rgba, int16_t *out, size_t count, int channels);
+void planes_to_channels(const uint8_t *a, const uint8_t *b, const uint8_t *c, int16_t *out, size_t count);
+void split_channels(const uint8_t *in, uint8_t *a, uint8_t *b, uint8_t *c, size_t count);
+
+// PNG style prediction of a row of pixels from its left neighbours and the row above, prev (zeros above the
+// first row). Residuals are 128 + (pixel - prediction) mod 256, so a perfect prediction is a mid-gray byte, a
+// silent sample. Predicting works on 16 pixels at a time with SSE2 for every filter; reconstruction too for
+// none, up and left (a prefix sum), average and Paeth depend on the pixel just rebuilt and go one at a time.
+void predict_row(int filter, const uint8_t *row, const uint8_t *prev, uint8_t *residuals, size_t width);
+void unpredict_row(int filter, const uint8_t *residuals, const uint8_t *prev, uint8_t *row, size_t width);
+// Sum of |residual - 128| over a row, the cost the filter of a row is chosen by, with SSE2 PSADBW
+uint32_t residual_cost(const uint8_t *residuals, size_t width);
+
+// Run finding for run-length coding, 16 bytes compared at a time with SSE2 and PMOVMSKB: the number of bytes
+// equal to bytes[0] at the start (0 for an empty range), and the index of the first byte equal to the one after
+// it, count when there is none
+size_t byte_run(const uint8_t *bytes, size_t count);
+size_t byte_repeat(const uint8_t *bytes, size_t count);
+
+// Area filter along one axis shrinking size pixels to scaled ones: output pixel i is the mean of the source
+// pixels it covers, from first[i] on with weights [i * taps] onward, the partly covered ones at its ends
+// weighted by how much of them it covers. Unused taps weigh 0.
+typedef struct {
+    int taps;
+    int *first;
+    float *weights;
+} AreaAxis;
+
+int area_axis_init(AreaAxis *axis, int size, int scaled);
+void area_axis_free(AreaAxis *axis);
+// sums[i] += weight * row[i], 16 bytes at a time with SSE2
+void accumulate_row_u8(const uint8_t *row, float weight, float *sums, size_t count);
+// A row of sums, channels per pixel, filtered along x and rounded to bytes; four channels go as one SSE vector
+void area_filter_row(const AreaAxis *axis, const float *sums, int channels, uint8_t *out, int scaled);
+
+// CRC-32C (Castagnoli) of size bytes continuing crc, 0 to start, with the SSE4.2 instruction when available
+uint32_t crc32c_update(uint32_t crc, const void *data, size_t size);
+
+// Sum of samples[k] * pattern[k], pattern of small values such as +-1, eight products at a time with SSE2
+int32_t correlate_s16(const int16_t *samples, const int16_t *pattern, int length);
+
+// Reed-Solomon code over GF(256): polynomial 0x11D, roots alpha^0 .. alpha^(parity - 1), codewords of at
+// most 255 symbols with the data first. RS_LANES codewords are coded at once: a block is rows of RS_LANES
+// bytes, row i holding symbol i of every codeword, so a burst of wrong bytes spreads over all of them.
+// Constants are multiplied with two 16 entry tables, one per nibble, looked up with PSHUFB under SSSE3.
+typedef struct {
+    int parity;
+    uint8_t exp[512];       // alpha^i, twice over so sums of two logarithms need no reduction
+    uint8_t log[256];
+    uint8_t generator[RS_MAX_PARITY];           // g(x) below its leading x^parity, [j] multiplies x^j
+    uint8_t generator_tables[RS_MAX_PARITY][32]; // products of generator[j] with low then high nibbles
+    uint8_t root_tables[RS_MAX_PARITY][32];      // the same for alpha^j, syndromes by Horner's rule
+} RsCode;
+
+int rs_init(RsCode *code, int parity);
+void rs_encode(const RsCode *code, const uint8_t *data, int rows, uint8_t *parity);
+int rs_decode(const RsCode *code, uint8_t *block, int rows);
+
+int apt_modulator_init(AptModulator *mod, int sample_rate, int pixels_per_second);
+const uint8_t *apt_sync_words(void);
+size_t apt_modulated_samples(uint64_t words, int sample_rate, int pixels_per_second);
+int apt_modulate(AptModulator *mod, const uint8_t *words, int count, int16_t *out);
+
+// Polyphase filters for one rational ratio, shared read-only by every resampler using it
+typedef struct ResampleBank ResampleBank;
+
+// Streaming sample rate converter. Output sample m sits at m * in_rate / out_rate input samples,
+// kept as an exact fraction, and is filtered with the bank phase closest to that position.
+typedef struct {
+    ResampleBank *bank;
+    int taps;               // filter length, a flush needs room for resampler_capacity(taps)
+    float *history;         // input not consumed yet
+    size_t count;
+    size_t capacity;
+    int64_t base;           // input sample index of history[0]
+    uint64_t next;          // index of the next output sample
+    uint64_t consumed;      // input samples seen so far
+    uint64_t limit;         // outputs that exist once the input has ended, UINT64_MAX before that
+} Resampler;
+
+// Radix-4 FFT tables for one power of two size, shared read-only by every transform of that size
+typedef struct FftPlan FftPlan;
+
+// Where an image sits in the spectrum: every column is one frame of fft_size samples, row y of
+// the image is bin first_bin + height - 1 - y and a pilot tone of full white level sits
+// SPECTROGRAM_PILOT_GAP bins below the bottom row
+typedef struct {
+    int sample_rate;
+    int height;
+    int fft_size;
+    int first_bin;
+    int guard;              // crossfade samples between two columns
+} SpectrogramLayout;
+
+typedef struct {
+    SpectrogramLayout layout;
+    FftPlan *plan;
+    float *phasor;          // half amplitude and phase of every tone from the pilot up, re / im pairs
+    float *ramp;            // crossfade from 0 to 1 over guard samples
+} Spectrogram;
+
+// OFDM symbols: carriers subcarriers from first_bin up, every symbol fft_size samples behind a cyclic
+// prefix. A training symbol of known values leads every training_interval data symbols.
+typedef struct {
+    int sample_rate;
+    int fft_size;
+    int first_bin;
+    int carriers;
+    int prefix;
+    int training_interval;
+} OfdmLayout;
+
+typedef struct {
+    OfdmLayout layout;
+    FftPlan *plan;
+    float *training;        // value of every carrier in a training symbol, re / im pairs; data values
+                            // are turned by the same phase
+    float amplitude;        // half amplitude of a carrier at full scale
+} Ofdm;
+
+int apt_demodulator_init(AptDemodulator *demod, int sample_rate, int pixels_per_second);
+void apt_demodulator_free(AptDemodulator *demod);
+size_t apt_envelope_capacity(const AptDemodulator *demod, int count);
+int apt_demodulate(AptDemodulator *demod, const int16_t *samples, int count, float *envelope);
+int apt_demodulate_flush(AptDemodulator *demod, float *envelope);
+double apt_find_sync(const float *envelope, int from, int to, float *score);
+float apt_sync_score(const float *envelope, double position);
+void apt_read_line(const float *envelope, double start, int width, float *row);
+uint8_t apt_envelope_to_pixel(float envelope);
+
+int resampler_init(Resampler *resampler, int in_rate, int out_rate);
+void resampler_free(Resampler *resampler);
+size_t resampled_samples(uint64_t count, int in_rate, int out_rate);
+size_t resampler_capacity(const Resampler *resampler, int count);
+int resampler_process(Resampler *resampler, const int16_t *in, int count, int16_t *out);
+int resampler_flush(Resampler *resampler, int16_t *out);
+
+FftPlan *fft_plan_acquire(int size);
+void fft_plan_release(FftPlan *plan);
+int fft_plan_size(const FftPlan *plan);
+void fft_forward(const FftPlan *plan, float *re, float *im, float *work);
+void fft_inverse(const FftPlan *plan, float *re, float *im, float *work);
+
+int spectrogram_layout(SpectrogramLayout *layout, int sample_rate, int height, int pixels_per_second);
+int spectrogram_max_height(int sample_rate);
+int spectrogram_layout_check(const SpectrogramLayout *layout);
+int spectrogram_init(Spectrogram *sg, const SpectrogramLayout *layout);
+void spectrogram_free(Spectrogram *sg);
+size_t spectrogram_work_size(const Spectrogram *sg);
+size_t spectrogram_frame_size(const Spectrogram *sg);
+void spectrogram_synthesize(const Spectrogram *sg, const uint8_t *column_a, const uint8_t *column_b, int stride,
+                            uint64_t index_a, float *frame_a, float *frame_b, float *work);
+void spectrogram_analyze(const Spectrogram *sg, const int16_t *samples_a, const int16_t *samples_b,
+                         uint8_t *column_a, uint8_t *column_b, int stride, float *work);
+
+int ofdm_layout(OfdmLayout *layout, int sample_rate);
+int ofdm_layout_check(const OfdmLayout *layout);
+int ofdm_init(Ofdm *ofdm, const OfdmLayout *layout);
+void ofdm_free(Ofdm *ofdm);
+size_t ofdm_symbol_samples(const Ofdm *ofdm);
+size_t ofdm_symbol_pixels(const Ofdm *ofdm);
+size_t ofdm_work_size(const Ofdm *ofdm);
+void ofdm_modulate(const Ofdm *ofdm, const uint8_t *pixels_a, const uint8_t *pixels_b, bool pair,
+                   int16_t *symbol_a, int16_t *symbol_b, float *work);
+void ofdm_demodulate(const Ofdm *ofdm, const int16_t *symbol_a, const int16_t *symbol_b,
+                     float *values_a, float *values_b, float *work);
+void ofdm_train(const Ofdm *ofdm, const float *values, float *correction);
+void ofdm_equalize(const Ofdm *ofdm, const float *values, const float *correction, uint8_t *pixels);
+
+#endif // DSP_H
@@ -0,0 +1,988 @@
+// Wave2Image FLAC codec
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "flac.h"
+
+#define FLAC_SYNC 0x3FFE                // 14 bit frame sync code
+#define SUBFRAME_CONSTANT 0
+#define SUBFRAME_VERBATIM 1
+#define SUBFRAME_FIXED 8                // + order, 0 .. 4
+#define SUBFRAME_LPC 32                 // + order - 1
+#define FIXED_MAX_ORDER 4
+#define RESIDUAL_LIMIT (1 << 30)        // larger residuals leave the block to a simpler predictor
+
+// -------------------------------------------------------------------------------------------------------- crc
+
+static uint8_t crc8_table[256];         // frame headers, polynomial x^8 + x^2 + x + 1
+static uint16_t crc16_table[256];       // whole frames, polynomial x^16 + x^15 + x^2 + 1
+static pthread_once_t crc_tables_once = PTHREAD_ONCE_INIT;
+
+static void fill_crc_tables(void) {
+    for (int i = 0; i < 256; i++) {
+        uint8_t c8 = (uint8_t)i;
+        uint16_t c16 = (uint16_t)(i << 8);
+        for (int bit = 0; bit < 8; bit++) {
+            c8 = (uint8_t)(c8 & 0x80 ? (c8 << 1) ^ 0x07 : c8 << 1);
+            c16 = (uint16_t)(c16 & 0x8000 ? (c16 << 1) ^ 0x8005 : c16 << 1);
+        }
+        crc8_table[i] = c8;
+        crc16_table[i] = c16;
+    }
+}
+
+static uint8_t crc8(const uint8_t *data, size_t size) {
+    uint8_t crc = 0;
+    for (size_t i = 0; i < size; i++) {
+        crc = crc8_table[crc ^ data[i]];
+    }
+    return crc;
+}
+
+static uint16_t crc16(const uint8_t *data, size_t size) {
+    uint16_t crc = 0;
+    for (size_t i = 0; i < size; i++) {
+        crc = (uint16_t)((crc << 8) ^ crc16_table[(crc >> 8) ^ data[i]]);
+    }
+    return crc;
+}
+
+// -------------------------------------------------------------------------------------------------------- streaminfo
+
+// Pack STREAMINFO into its 34 bytes, the MD5 signature is left zero (not computed)
+void flac_write_streaminfo(const FlacStreamInfo *info, uint8_t *out) {
+    uint64_t total = info->total_samples & 0xFFFFFFFFFull;
+    memset(out, 0, FLAC_STREAMINFO_SIZE);
+    out[0] = (uint8_t)(info->min_block >> 8);
+    out[1] = (uint8_t)info->min_block;
+    out[2] = (uint8_t)(info->max_block >> 8);
+    out[3] = (uint8_t)info->max_block;
+    out[4] = (uint8_t)(info->min_frame >> 16);
+    out[5] = (uint8_t)(info->min_frame >> 8);
+    out[6] = (uint8_t)info->min_frame;
+    out[7] = (uint8_t)(info->max_frame >> 16);
+    out[8] = (uint8_t)(info->max_frame >> 8);
+    out[9] = (uint8_t)info->max_frame;
+    out[10] = (uint8_t)(info->sample_rate >> 12);
+    out[11] = (uint8_t)(info->sample_rate >> 4);
+    out[12] = (uint8_t)((info->sample_rate & 0xF) << 4 | (info->channels - 1) << 1 | (info->bits - 1) >> 4);
+    out[13] = (uint8_t)(((info->bits - 1) & 0xF) << 4 | (uint8_t)(total >> 32));
+    out[14] = (uint8_t)(total >> 24);
+    out[15] = (uint8_t)(total >> 16);
+    out[16] = (uint8_t)(total >> 8);
+    out[17] = (uint8_t)total;
+}
+
+int flac_read_streaminfo(FlacStreamInfo *info, const uint8_t *in) {
+    info->min_block = in[0] << 8 | in[1];
+    info->max_block = in[2] << 8 | in[3];
+    info->min_frame = (uint32_t)in[4] << 16 | in[5] << 8 | in[6];
+    info->max_frame = (uint32_t)in[7] << 16 | in[8] << 8 | in[9];
+    info->sample_rate = in[10] << 12 | in[11] << 4 | in[12] >> 4;
+    info->channels = ((in[12] >> 1) & 7) + 1;
+    info->bits = ((in[12] & 1) << 4 | in[13] >> 4) + 1;
+    info->total_samples = (uint64_t)(in[13] & 0xF) << 32 | (uint64_t)in[14] << 24 | (uint32_t)in[15] << 16 |
+                          in[16] << 8 | in[17];
+    return info->sample_rate > 0 && info->max_block >= 16 ? 0 : -1;
+}
+
+// -------------------------------------------------------------------------------------------------------- bit writer
+
+typedef struct {
+    uint8_t *out;
+    size_t bytes;
+    uint64_t cache;         // the low bits pending bits are not written yet
+    int pending;
+} BitWriter;
+
+// Append the low count bits of value, count at most 32
+static inline void put_bits(BitWriter *w, uint32_t value, int count) {
+    w->cache = (w->cache << count) | (value & (uint32_t)((1ull << count) - 1));
+    w->pending += count;
+    while (w->pending >= 8) {
+        w->pending -= 8;
+        w->out[w->bytes++] = (uint8_t)(w->cache >> w->pending);
+    }
+}
+
+static inline void put_signed(BitWriter *w, int32_t value, int count) {
+    put_bits(w, (uint32_t)value, count);
+}
+
+static void put_unary_rice(BitWriter *w, uint32_t value, int k) {
+    uint32_t quotient = value >> k;
+    while (quotient >= 32) {
+        put_bits(w, 0, 32);
+        quotient -= 32;
+    }
+    if (quotient + 1 + k <= 32) {
+        put_bits(w, (1u << k) | (value & ((1u << k) - 1)), (int)quotient + 1 + k);
+    } else {
+        put_bits(w, 1, (int)quotient + 1);
+        put_bits(w, value, k);
+    }
+}
+
+static void align_bits(BitWriter *w) {
+    if (w->pending > 0) {
+        put_bits(w, 0, 8 - w->pending);
+    }
+}
+
+// Frame and sample numbers, coded like UTF-8 stretched to 36 bits
+static void put_utf8(BitWriter *w, uint64_t value) {
+    if (value < 0x80) {
+        put_bits(w, (uint32_t)value, 8);
+        return;
+    }
+    int extra = value < 0x800 ? 1 : value < 0x10000 ? 2 : value < 0x200000 ? 3 :
+                value < 0x4000000 ? 4 : value < 0x80000000ull ? 5 : 6;
+    uint32_t lead = (0xFF00u >> (extra + 1)) & 0xFF;
+    put_bits(w, lead | (uint32_t)(value >> (6 * extra)), 8);
+    for (int i = extra - 1; i >= 0; i--) {
+        put_bits(w, 0x80 | (uint32_t)((value >> (6 * i)) & 0x3F), 8);
+    }
+}
+
+// -------------------------------------------------------------------------------------------------------- rice
+
+// How one residual is split into partitions and coded
+typedef struct {
+    int partition_order;
+    int parameter_bits;                         // 4, or 5 when a parameter exceeds 14
+    int parameter[1 << FLAC_MAX_PARTITION_ORDER];
+    int raw_bits[1 << FLAC_MAX_PARTITION_ORDER]; // escaped partitions: bits per residual, otherwise -1
+    uint64_t bits;                              // size of the residual coding
+} RicePlan;
+
+static int bit_length(uint64_t value) {
+    int bits = 0;
+    while (value) {
+        bits++;
+        value >>= 1;
+    }
+    return bits;
+}
+
+// Best Rice parameter for count values adding up to sum: the floor of log2 of their mean
+static int rice_parameter(uint64_t sum, uint32_t count) {
+    int k = 0;
+    while (k < 30 && ((uint64_t)count << (k + 1)) <= sum) {
+        k++;
+    }
+    return k;
+}
+
+// Zigzag the residual of samples order .. block - 1 into u and choose partitions and parameters.
+// Partition orders are compared on estimated sizes, then the chosen one is costed exactly and any
+// partition that Rice codes badly (outliers) is escaped to plain binary.
+static void rice_plan(const int32_t *residual, int block, int order, uint32_t *u, RicePlan *plan) {
+    int count = block - order;
+    for (int i = 0; i < count; i++) {
+        u[i] = ((uint32_t)residual[i] << 1) ^ (uint32_t)(residual[i] >> 31);
+    }
+
+    int max_order = 0;
+    while (max_order < FLAC_MAX_PARTITION_ORDER && block % (2 << max_order) == 0 &&
+           (block >> (max_order + 1)) > order) {
+        max_order++;
+    }
+
+    uint64_t sums[1 << FLAC_MAX_PARTITION_ORDER];
+    int parts = 1 << max_order;
+    int part_size = block >> max_order;
+    for (int p = 0, i = 0; p < parts; p++) {
+        int end = (p + 1) * part_size - order;
+        uint64_t sum = 0;
+        for (; i < end; i++) {
+            sum += u[i];
+        }
+        sums[p] = sum;
+    }
+
+    uint64_t best_bits = UINT64_MAX;
+    for (int level = max_order; level >= 0; level--) {
+        int level_parts = 1 << level;
+        uint64_t bits = 0;
+        for (int p = 0; p < level_parts; p++) {
+            uint32_t n = (uint32_t)((block >> level) - (p == 0 ? order : 0));
+            int k = rice_parameter(sums[p], n);
+            bits += 4 + (uint64_t)n * (k + 1) + (sums[p] >> k);
+        }
+        if (bits < best_bits) {
+            best_bits = bits;
+            plan->partition_order = level;
+            for (int p = 0; p < level_parts; p++) {
+                uint32_t n = (uint32_t)((block >> level) - (p == 0 ? order : 0));
+                plan->parameter[p] = rice_parameter(sums[p], n);
+            }
+        }
+        for (int p = 0; p < level_parts / 2; p++) {
+            sums[p] = sums[2 * p] + sums[2 * p + 1];
+        }
+    }
+
+    // Exact sizes of the chosen partitions
+    parts = 1 << plan->partition_order;
+    part_size = block >> plan->partition_order;
+    plan->parameter_bits = 4;
+    for (int p = 0; p < parts; p++) {
+        if (plan->parameter[p] > 14) {
+            plan->parameter_bits = 5;
+        }
+    }
+    plan->bits = 2 + 4;
+    for (int p = 0, i = 0; p < parts; p++) {
+        int end = (p + 1) * part_size - order;
+        int n = end - i;
+        int k = plan->parameter[p];
+        uint64_t rice = (uint64_t)n * (k + 1);
+        uint32_t largest = 0;
+        for (; i < end; i++) {
+            rice += u[i] >> k;
+            largest = u[i] > largest ? u[i] : largest;
+        }
+        uint64_t escaped = 5 + (uint64_t)n * bit_length(largest);
+        if (escaped < rice) {
+            plan->raw_bits[p] = bit_length(largest);
+            plan->bits += plan->parameter_bits + escaped;
+        } else {
+            plan->raw_bits[p] = -1;
+            plan->bits += plan->parameter_bits + rice;
+        }
+    }
+}
+
+static void put_residual(BitWriter *w, const int32_t *residual, const uint32_t *u, int block, int order,
+                         const RicePlan *plan) {
+    put_bits(w, plan->parameter_bits == 5 ? 1 : 0, 2);
+    put_bits(w, plan->partition_order, 4);
+    int parts = 1 << plan->partition_order;
+    int part_size = block >> plan->partition_order;
+    int escape = (1 << plan->parameter_bits) - 1;
+    for (int p = 0, i = 0; p < parts; p++) {
+        int end = (p + 1) * part_size - order;
+        if (plan->raw_bits[p] >= 0) {
+            put_bits(w, escape, plan->parameter_bits);
+            put_bits(w, plan->raw_bits[p], 5);
+            for (; i < end; i++) {
+                put_signed(w, residual[i], plan->raw_bits[p]);
+            }
+        } else {
+            int k = plan->parameter[p];
+            put_bits(w, k, plan->parameter_bits);
+            for (; i < end; i++) {
+                put_unary_rice(w, u[i], k);
+            }
+        }
+    }
+}
+
+// -------------------------------------------------------------------------------------------------------- predictors
+
+// Fixed polynomial predictor with the smallest residual, judged by the sum of its magnitudes
+static int fixed_best_order(const int32_t *x, int count) {
+    uint64_t total[FIXED_MAX_ORDER + 1] = { 0 };
+    if (count <= FIXED_MAX_ORDER) {
+        return 0;
+    }
+    for (int i = FIXED_MAX_ORDER; i < count; i++) {
+        int32_t e0 = x[i];
+        int32_t e1 = e0 - x[i - 1];
+        int32_t e2 = e1 - (x[i - 1] - x[i - 2]);
+        int32_t e3 = e2 - (x[i - 1] - 2 * x[i - 2] + x[i - 3]);
+        int32_t e4 = e3 - (x[i - 1] - 3 * x[i - 2] + 3 * x[i - 3] - x[i - 4]);
+        total[0] += (uint32_t)abs(e0);
+        total[1] += (uint32_t)abs(e1);
+        total[2] += (uint32_t)abs(e2);
+        total[3] += (uint32_t)abs(e3);
+        total[4] += (uint32_t)abs(e4);
+    }
+    int best = 0;
+    for (int order = 1; order <= FIXED_MAX_ORDER; order++) {
+        best = total[order] < total[best] ? order : best;
+    }
+    return best;
+}
+
+static void fixed_residual(const int32_t *x, int count, int order, int32_t *residual) {
+    for (int i = order; i < count; i++) {
+        int32_t r;
+        switch (order) {
+        case 0: r = x[i]; break;
+        case 1: r = x[i] - x[i - 1]; break;
+        case 2: r = x[i] - 2 * x[i - 1] + x[i - 2]; break;
+        case 3: r = x[i] - 3 * x[i - 1] + 3 * x[i - 2] - x[i - 3]; break;
+        default: r = x[i] - 4 * x[i - 1] + 6 * x[i - 2] - 4 * x[i - 3] + x[i - 4]; break;
+        }
+        residual[i - order] = r;
+    }
+}
+
+// LPC coefficients for every order up to max_order from the Welch windowed block (Levinson-Durbin).
+// error[o - 1] is the prediction error left at order o. Returns the highest usable order.
+static int lpc_analyze(const int32_t *x, int count, int max_order, float *windowed,
+                       double coefficients[FLAC_MAX_LPC_ORDER][FLAC_MAX_LPC_ORDER], double *error) {
+    double half = count / 2.0;
+    for (int i = 0; i < count; i++) {
+        double t = (i - half + 0.5) / half;
+        windowed[i] = (float)(x[i] * (1.0 - t * t));
+    }
+
+    double autocorrelation[FLAC_MAX_LPC_ORDER + 1];
+    for (int lag = 0; lag <= max_order; lag++) {
+        double sum = 0.0;
+        for (int i = lag; i < count; i++) {
+            sum += (double)windowed[i] * windowed[i - lag];
+        }
+        autocorrelation[lag] = sum;
+    }
+    if (autocorrelation[0] <= 0.0) {
+        return 0;
+    }
+
+    double lpc[FLAC_MAX_LPC_ORDER];
+    double err = autocorrelation[0];
+    for (int i = 0; i < max_order; i++) {
+        double r = -autocorrelation[i + 1];
+        for (int j = 0; j < i; j++) {
+            r -= lpc[j] * autocorrelation[i - j];
+        }
+        r /= err;
+        lpc[i] = r;
+        int j;
+        for (j = 0; j < i / 2; j++) {
+            double t = lpc[j];
+            lpc[j] += r * lpc[i - 1 - j];
+            lpc[i - 1 - j] += r * t;
+        }
+        if (i & 1) {
+            lpc[j] += lpc[j] * r;
+        }
+        err *= 1.0 - r * r;
+        for (j = 0; j <= i; j++) {
+            coefficients[i][j] = -lpc[j];
+        }
+        error[i] = err;
+        if (err <= 0.0) {
+            return i + 1;
+        }
+    }
+    return max_order;
+}
+
+// Order whose estimated residual plus coefficients takes the fewest bits
+static int lpc_best_order(const double *error, int orders, int count, int bits) {
+    double best_bits = 0.0;
+    int best = 0;
+    for (int order = 1; order <= orders; order++) {
+        double per_sample = error[order - 1] > 0.0 ? 0.5 * log2(error[order - 1] * 0.5 / count) : 0.0;
+        per_sample = per_sample < 0.0 ? 0.0 : per_sample;
+        double total = per_sample * (count - order) + order * (bits + FLAC_LPC_PRECISION);
+        if (best == 0 || total < best_bits) {
+            best_bits = total;
+            best = order;
+        }
+    }
+    return best;
+}
+
+// Quantize to FLAC_LPC_PRECISION bits with error feedback, returns the shift or -1 if none fits
+static int lpc_quantize(const double *coefficients, int order, int32_t *quantized) {
+    double largest = 0.0;
+    for (int i = 0; i < order; i++) {
+        largest = fabs(coefficients[i]) > largest ? fabs(coefficients[i]) : largest;
+    }
+    if (largest <= 0.0) {
+        return -1;
+    }
+    int exponent;
+    frexp(largest, &exponent);
+    int shift = FLAC_LPC_PRECISION - 1 - exponent;
+    shift = shift > 15 ? 15 : shift;
+    if (shift < 0) {
+        return -1;
+    }
+
+    int32_t high = (1 << (FLAC_LPC_PRECISION - 1)) - 1, low = -(1 << (FLAC_LPC_PRECISION - 1));
+    double carried = 0.0;
+    for (int i = 0; i < order; i++) {
+        carried += coefficients[i] * (1 << shift);
+        long q = lround(carried);
+        q = q > high ? high : q < low ? low : q;
+        carried -= q;
+        quantized[i] = (int32_t)q;
+    }
+    return shift;
+}
+
+// Residual of the quantized filter, false if it grows too large to code
+static bool lpc_residual(const int32_t *x, int count, const int32_t *quantized, int order, int shift,
+                         int32_t *residual) {
+    for (int i = order; i < count; i++) {
+        int64_t sum = 0;
+        for (int j = 0; j < order; j++) {
+            sum += (int64_t)quantized[j] * x[i - 1 - j];
+        }
+        int64_t r = x[i] - (sum >> shift);
+        if (r >= RESIDUAL_LIMIT || r <= -RESIDUAL_LIMIT) {
+            return false;
+        }
+        residual[i - order] = (int32_t)r;
+    }
+    return true;
+}
+
+// -------------------------------------------------------------------------------------------------------- encoder
+
+size_t flac_frame_capacity(int block_size) {
+    return (size_t)block_size * 4 + 1024;
+}
+
+// Scratch of one encoder: the samples widened, the window, two residuals and the zigzagged residual
+size_t flac_work_size(int block_size) {
+    return (size_t)block_size * (sizeof(int32_t) * 3 + sizeof(float) + sizeof(uint32_t) * 2);
+}
+
+static int block_size_code(int count, int *extra_bits) {
+    static const int sizes[16] = { 0, 192, 576, 1152, 2304, 4608, 0, 0,
+                                   256, 512, 1024, 2048, 4096, 8192, 16384, 32768 };
+    *extra_bits = 0;
+    for (int code = 1; code < 16; code++) {
+        if (sizes[code] == count) {
+            return code;
+        }
+    }
+    *extra_bits = count <= 256 ? 8 : 16;
+    return count <= 256 ? 6 : 7;
+}
+
+static int sample_rate_code(int rate, int *extra_bits, int *extra) {
+    static const int rates[12] = { 0, 88200, 176400, 192000, 8000, 16000, 22050, 24000, 32000, 44100, 48000, 96000 };
+    *extra_bits = 0;
+    for (int code = 1; code < 12; code++) {
+        if (rates[code] == rate) {
+            return code;
+        }
+    }
+    if (rate % 1000 == 0 && rate / 1000 <= 255) {
+        *extra_bits = 8;
+        *extra = rate / 1000;
+        return 12;
+    }
+    if (rate <= 65535) {
+        *extra_bits = 16;
+        *extra = rate;
+        return 13;
+    }
+    if (rate % 10 == 0 && rate / 10 <= 65535) {
+        *extra_bits = 16;
+        *extra = rate / 10;
+        return 14;
+    }
+    return 0; // taken from STREAMINFO
+}
+
+static void put_frame_header(BitWriter *w, const FlacStreamInfo *info, int count, uint64_t frame_number) {
+    int size_bits, rate_bits, rate_extra = 0;
+    int size_code = block_size_code(count, &size_bits);
+    int rate_code = sample_rate_code(info->sample_rate, &rate_bits, &rate_extra);
+
+    put_bits(w, FLAC_SYNC, 14);
+    put_bits(w, 0, 1);                          // reserved
+    put_bits(w, 0, 1);                          // fixed block size, frames are numbered
+    put_bits(w, size_code, 4);
+    put_bits(w, rate_code, 4);
+    put_bits(w, 0, 4);                          // mono
+    put_bits(w, info->bits == 8 ? 1 : 4, 3);
+    put_bits(w, 0, 1);
+    put_utf8(w, frame_number);
+    if (size_bits) {
+        put_bits(w, count - 1, size_bits);
+    }
+    if (rate_bits) {
+        put_bits(w, rate_extra, rate_bits);
+    }
+    put_bits(w, crc8(w->out, w->bytes), 8);
+}
+
+// Encode one block as a complete frame into out, returns its size in bytes.
+// The subframe is the smallest of constant, fixed polynomial, LPC and verbatim.
+size_t flac_encode_frame(const FlacStreamInfo *info, const int16_t *samples, int count, uint64_t frame_number,
+                         uint8_t *out, void *work) {
+    pthread_once(&crc_tables_once, fill_crc_tables);
+    int bits = info->bits;
+    int32_t *x = (int32_t *)work;
+    int32_t *fixed = x + count;
+    int32_t *lpc = fixed + count;
+    float *windowed = (float *)(lpc + count);
+    uint32_t *u_fixed = (uint32_t *)(windowed + count);
+    uint32_t *u_lpc = u_fixed + count;
+
+    bool constant = true;
+    for (int i = 0; i < count; i++) {
+        x[i] = samples[i];
+        constant = constant && x[i] == x[0];
+    }
+
+    BitWriter w = { out, 0, 0, 0 };
+    put_frame_header(&w, info, count, frame_number);
+    uint64_t verbatim_bits = 8 + (uint64_t)count * bits;
+
+    if (constant) {
+        put_bits(&w, SUBFRAME_CONSTANT << 1, 8);
+        put_signed(&w, x[0], bits);
+    } else {
+        RicePlan fixed_plan, lpc_plan;
+        int fixed_order = fixed_best_order(x, count);
+        fixed_residual(x, count, fixed_order, fixed);
+        rice_plan(fixed, count, fixed_order, u_fixed, &fixed_plan);
+        uint64_t fixed_bits = 8 + (uint64_t)fixed_order * bits + fixed_plan.bits;
+
+        uint64_t lpc_bits = UINT64_MAX;
+        int lpc_order = 0, shift = -1;
+        int32_t quantized[FLAC_MAX_LPC_ORDER];
+        if (count > 4 * FLAC_MAX_LPC_ORDER) {
+            double coefficients[FLAC_MAX_LPC_ORDER][FLAC_MAX_LPC_ORDER], error[FLAC_MAX_LPC_ORDER];
+            int orders = lpc_analyze(x, count, FLAC_MAX_LPC_ORDER, windowed, coefficients, error);
+            lpc_order = orders > 0 ? lpc_best_order(error, orders, count, bits) : 0;
+            shift = lpc_order > 0 ? lpc_quantize(coefficients[lpc_order - 1], lpc_order, quantized) : -1;
+            if (shift >= 0 && lpc_residual(x, count, quantized, lpc_order, shift, lpc)) {
+                rice_plan(lpc, count, lpc_order, u_lpc, &lpc_plan);
+                lpc_bits = 8 + (uint64_t)lpc_order * (bits + FLAC_LPC_PRECISION) + 4 + 5 + lpc_plan.bits;
+            }
+        }
+
+        if (lpc_bits < fixed_bits && lpc_bits < verbatim_bits) {
+            put_bits(&w, (SUBFRAME_LPC + lpc_order - 1) << 1, 8);
+            for (int i = 0; i < lpc_order; i++) {
+                put_signed(&w, x[i], bits);
+            }
+            put_bits(&w, FLAC_LPC_PRECISION - 1, 4);
+            put_signed(&w, shift, 5);
+            for (int i = 0; i < lpc_order; i++) {
+                put_signed(&w, quantized[i], FLAC_LPC_PRECISION);
+            }
+            put_residual(&w, lpc, u_lpc, count, lpc_order, &lpc_plan);
+        } else if (fixed_bits < verbatim_bits) {
+            put_bits(&w, (SUBFRAME_FIXED + fixed_order) << 1, 8);
+            for (int i = 0; i < fixed_order; i++) {
+                put_signed(&w, x[i], bits);
+            }
+            put_residual(&w, fixed, u_fixed, count, fixed_order, &fixed_plan);
+        } else {
+            put_bits(&w, SUBFRAME_VERBATIM << 1, 8);
+            for (int i = 0; i < count; i++) {
+                put_signed(&w, x[i], bits);
+            }
+        }
+    }
+
+    align_bits(&w);
+    uint16_t crc = crc16(out, w.bytes);
+    put_bits(&w, crc, 16);
+    return w.bytes;
+}
+
+// -------------------------------------------------------------------------------------------------------- bit reader
+
+typedef struct {
+    const uint8_t *data;
+    size_t size;
+    size_t next;            // next byte to load into the cache
+    uint64_t cache;         // left aligned, the top available bits are unread
+    int available;
+    int beyond;             // zero bytes loaded past the end
+} BitReader;
+
+static inline void reader_fill(BitReader *r) {
+    if (r->next + 8 <= r->size) {
+        // Whole bytes of a big endian 64-bit load
+        uint64_t word;
+        memcpy(&word, r->data + r->next, 8);
+        word = __builtin_bswap64(word);
+        int bytes = (64 - r->available) / 8;
+        if (bytes < 8) {
+            word &= ~(UINT64_MAX >> (bytes * 8));
+        }
+        r->cache |= word >> r->available;
+        r->available += bytes * 8;
+        r->next += bytes;
+        return;
+    }
+    while (r->available <= 56) {
+        uint64_t byte = 0;
+        if (r->next < r->size) {
+            byte = r->data[r->next];
+        } else {
+            r->beyond++;
+        }
+        r->next++;
+        r->cache |= byte << (56 - r->available);
+        r->available += 8;
+    }
+}
+
+// Next count bits, count at most 32
+static inline uint32_t get_bits(BitReader *r, int count) {
+    if (count == 0) {
+        return 0;
+    }
+    if (r->available < count) {
+        reader_fill(r);
+    }
+    uint32_t value = (uint32_t)(r->cache >> (64 - count));
+    r->cache <<= count;
+    r->available -= count;
+    return value;
+}
+
+static inline int32_t get_signed(BitReader *r, int count) {
+    if (count == 0) {
+        return 0;
+    }
+    return (int32_t)(get_bits(r, count) << (32 - count)) >> (32 - count);
+}
+
+// Zero bits before the next one, -1 if the data ends first
+static inline int get_unary(BitReader *r) {
+    int zeros = 0;
+    for (;;) {
+        if (r->available == 0 || r->cache == 0) {
+            zeros += r->available;
+            r->cache = 0;
+            r->available = 0;
+            reader_fill(r);
+            if (r->beyond > 8) {
+                return -1;
+            }
+            continue;
+        }
+        int leading = __builtin_clzll(r->cache);
+        if (leading >= r->available) {
+            zeros += r->available;
+            r->cache = 0;
+            r->available = 0;
+            continue;
+        }
+        r->cache <<= leading + 1;
+        r->available -= leading + 1;
+        return zeros + leading;
+    }
+}
+
+// Bytes consumed so far, the reader is byte aligned
+static inline size_t reader_position(const BitReader *r) {
+    return r->next - (size_t)(r->available / 8);
+}
+
+static inline bool reader_overrun(const BitReader *r) {
+    return reader_position(r) > r->size;
+}
+
+// -------------------------------------------------------------------------------------------------------- decoder
+
+static bool get_residual(BitReader *r, int block, int order, int32_t *residual) {
+    int method = (int)get_bits(r, 2);
+    if (method > 1) {
+        return false;
+    }
+    int parameter_bits = method == 0 ? 4 : 5;
+    int escape = (1 << parameter_bits) - 1;
+    int partition_order = (int)get_bits(r, 4);
+    int parts = 1 << partition_order;
+    int part_size = block >> partition_order;
+    if (block % parts != 0 || part_size < order) {
+        return false;
+    }
+
+    for (int p = 0, i = 0; p < parts; p++) {
+        int end = (p + 1) * part_size - order;
+        int k = (int)get_bits(r, parameter_bits);
+        if (k == escape) {
+            int raw = (int)get_bits(r, 5);
+            for (; i < end; i++) {
+                residual[i] = get_signed(r, raw);
+            }
+            continue;
+        }
+        for (; i < end; i++) {
+            uint32_t u;
+            if (r->available < 48) {
+                reader_fill(r);
+            }
+            int quotient = r->cache ? __builtin_clzll(r->cache) : 64;
+            int length = quotient + 1 + k;
+            if (length <= r->available) {
+                // Quotient and remainder both in the cache, the usual case
+                u = ((uint32_t)quotient << k) | (k ? (uint32_t)((r->cache << quotient << 1) >> (64 - k)) : 0);
+                r->cache = length < 64 ? r->cache << length : 0;
+                r->available -= length;
+            } else {
+                quotient = get_unary(r);
+                if (quotient < 0) {
+                    return false;
+                }
+                u = ((uint32_t)quotient << k) | get_bits(r, k);
+            }
+            residual[i] = (int32_t)(u >> 1) ^ -(int32_t)(u & 1);
+        }
+        if (r->beyond > 8) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Predictions wrap around in 32 bits instead of overflowing: a damaged frame gives samples out of range,
+// which get_subframe rejects, rather than undefined behaviour before its CRC is reached
+static void fixed_restore(int32_t *x, int count, int order) {
+    if (order == 0 || count <= order) {
+        return;
+    }
+    uint32_t a = (uint32_t)x[order - 1];
+    uint32_t b = order >= 2 ? (uint32_t)x[order - 2] : 0;
+    uint32_t c = order >= 3 ? (uint32_t)x[order - 3] : 0;
+    uint32_t d = order >= 4 ? (uint32_t)x[order - 4] : 0;
+    for (int i = order; i < count; i++) {
+        uint32_t value;
+        switch (order) {
+        case 1: value = (uint32_t)x[i] + a; break;
+        case 2: value = (uint32_t)x[i] + 2 * a - b; break;
+        case 3: value = (uint32_t)x[i] + 3 * a - 3 * b + c; break;
+        default: value = (uint32_t)x[i] + 4 * a - 6 * b + 4 * c - d; break;
+        }
+        x[i] = (int32_t)value;
+        d = c;
+        c = b;
+        b = a;
+        a = value;
+    }
+}
+
+// Prediction with a filter of taps coefficients (zero padded past the order). taps is known at compile
+// time, so the loops unroll and the history stays in registers instead of going through memory.
+static inline void lpc_restore_taps(int32_t *x, int from, int count, const int32_t *padded, int shift, int taps) {
+    int32_t history[32];
+    for (int j = 0; j < taps; j++) {
+        history[j] = x[from - 1 - j];
+    }
+    for (int i = from; i < count; i++) {
+        uint32_t sum = 0;
+#pragma GCC unroll 32
+        for (int j = taps - 1; j >= 0; j--) {
+            sum += (uint32_t)padded[j] * (uint32_t)history[j];
+        }
+        int32_t value = (int32_t)((uint32_t)x[i] + (uint32_t)((int32_t)sum >> shift));
+#pragma GCC unroll 32
+        for (int j = taps - 1; j > 0; j--) {
+            history[j] = history[j - 1];
+        }
+        history[0] = value;
+        x[i] = value;
+    }
+}
+
+// Undo the LPC filter in place. When bits + precision + log2(order) stay within 32 the sums fit in
+// 32 bits, which covers 16-bit audio at the precision the encoder uses. Like fixed_restore, a damaged
+// frame wraps around instead of overflowing.
+static void lpc_restore(int32_t *x, int count, const int32_t *quantized, int order, int shift, bool wide) {
+    if (wide) {
+        for (int i = order; i < count; i++) {
+            int64_t sum = 0;
+            for (int j = 0; j < order; j++) {
+                sum += (int64_t)quantized[j] * x[i - 1 - j];
+            }
+            x[i] = (int32_t)((uint32_t)x[i] + (uint32_t)(sum >> shift));
+        }
+        return;
+    }
+
+    int32_t padded[32] = { 0 };
+    memcpy(padded, quantized, (size_t)order * sizeof(int32_t));
+    int taps = order <= 4 ? 4 : order <= 8 ? 8 : order <= 12 ? 12 : 32;
+    int from = taps < count ? taps : count;
+    for (int i = order; i < from; i++) {
+        uint32_t sum = 0;
+        for (int j = 0; j < order; j++) {
+            sum += (uint32_t)quantized[j] * (uint32_t)x[i - 1 - j];
+        }
+        x[i] = (int32_t)((uint32_t)x[i] + (uint32_t)((int32_t)sum >> shift));
+    }
+    switch (taps) {
+    case 4: lpc_restore_taps(x, from, count, padded, shift, 4); break;
+    case 8: lpc_restore_taps(x, from, count, padded, shift, 8); break;
+    case 12: lpc_restore_taps(x, from, count, padded, shift, 12); break;
+    default: lpc_restore_taps(x, from, count, padded, shift, 32); break;
+    }
+}
+
+static bool get_subframe(BitReader *r, int block, int bits, int32_t *x) {
+    int sample_bits = bits;
+    if (get_bits(r, 1) != 0) {
+        return false;
+    }
+    int type = (int)get_bits(r, 6);
+    int wasted = 0;
+    if (get_bits(r, 1)) {
+        int zeros = get_unary(r);
+        if (zeros < 0) {
+            return false;
+        }
+        wasted = zeros + 1;
+    }
+    if (wasted >= bits) {
+        return false;
+    }
+    bits -= wasted;
+
+    if (type == SUBFRAME_CONSTANT) {
+        int32_t value = get_signed(r, bits);
+        for (int i = 0; i < block; i++) {
+            x[i] = value;
+        }
+    } else if (type == SUBFRAME_VERBATIM) {
+        for (int i = 0; i < block; i++) {
+            x[i] = get_signed(r, bits);
+        }
+    } else if (type >= SUBFRAME_FIXED && type <= SUBFRAME_FIXED + FIXED_MAX_ORDER) {
+        int order = type - SUBFRAME_FIXED;
+        if (order > block) {
+            return false;
+        }
+        for (int i = 0; i < order; i++) {
+            x[i] = get_signed(r, bits);
+        }
+        if (!get_residual(r, block, order, x + order)) {
+            return false;
+        }
+        fixed_restore(x, block, order);
+    } else if (type >= SUBFRAME_LPC) {
+        int order = type - SUBFRAME_LPC + 1;
+        if (order > block) {
+            return false;
+        }
+        for (int i = 0; i < order; i++) {
+            x[i] = get_signed(r, bits);
+        }
+        int precision = (int)get_bits(r, 4) + 1;
+        int shift = get_signed(r, 5);
+        if (precision == 16 || shift < 0) {
+            return false;
+        }
+        int32_t quantized[32];
+        for (int i = 0; i < order; i++) {
+            quantized[i] = get_signed(r, precision);
+        }
+        if (!get_residual(r, block, order, x + order)) {
+            return false;
+        }
+        lpc_restore(x, block, quantized, order, shift, bits + precision + bit_length(order) - 1 > 32);
+    } else {
+        return false;
+    }
+
+    if (wasted) {
+        for (int i = 0; i < block; i++) {
+            x[i] = (int32_t)((uint32_t)x[i] << wasted);
+        }
+    }
+
+    // Damaged frames predict samples beyond the sample size, caught here before they reach the CRC
+    if (sample_bits < 32) {
+        int32_t low = -(int32_t)(1u << (sample_bits - 1)), high = (int32_t)(1u << (sample_bits - 1)) - 1;
+        int32_t out = 0;
+        for (int i = 0; i < block; i++) {
+            out |= (x[i] < low) | (x[i] > high);
+        }
+        if (out) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Parse and check a frame header, the reader is left on the first subframe
+static bool get_frame_header(BitReader *r, FlacFrameHeader *header) {
+    static const int sample_sizes[8] = { 0, 8, 12, 0, 16, 20, 24, 32 };
+    if (get_bits(r, 14) != FLAC_SYNC || get_bits(r, 1) != 0) {
+        return false;
+    }
+    header->variable = get_bits(r, 1) != 0;
+    int size_code = (int)get_bits(r, 4);
+    int rate_code = (int)get_bits(r, 4);
+    int channels = (int)get_bits(r, 4);
+    int size_bits = (int)get_bits(r, 3);
+    if (get_bits(r, 1) != 0 || channels != 0 || size_code == 0 || rate_code == 15 || size_bits == 3) {
+        return false;
+    }
+    header->bits = sample_sizes[size_bits];
+
+    uint32_t lead = get_bits(r, 8);
+    int extra = lead < 0x80 ? 0 : lead == 0xFF ? -1 : lead == 0xFE ? 6 : lead >= 0xFC ? 5 : lead >= 0xF8 ? 4 :
+                lead >= 0xF0 ? 3 : lead >= 0xE0 ? 2 : lead >= 0xC0 ? 1 : -1;
+    if (extra < 0) {
+        return false;
+    }
+    uint64_t number = extra == 0 ? lead : lead & (0x3F >> extra);
+    for (int i = 0; i < extra; i++) {
+        uint32_t next = get_bits(r, 8);
+        if ((next & 0xC0) != 0x80) {
+            return false;
+        }
+        number = number << 6 | (next & 0x3F);
+    }
+    header->number = number;
+
+    header->block_size = size_code == 1 ? 192 : size_code <= 5 ? 576 << (size_code - 2) :
+                         size_code == 6 ? (int)get_bits(r, 8) + 1 : size_code == 7 ? (int)get_bits(r, 16) + 1 :
+                         256 << (size_code - 8);
+    if (rate_code == 12) {
+        get_bits(r, 8);
+    } else if (rate_code == 13 || rate_code == 14) {
+        get_bits(r, 16);
+    }
+    size_t length = reader_position(r);
+    if (reader_overrun(r) || length >= r->size || crc8(r->data, length) != get_bits(r, 8)) {
+        return false;
+    }
+    header->size = length + 1;
+    return true;
+}
+
+int flac_frame_header(const uint8_t *data, size_t size, FlacFrameHeader *header) {
+    pthread_once(&crc_tables_once, fill_crc_tables);
+    BitReader r = { data, size, 0, 0, 0, 0 };
+    return get_frame_header(&r, header) ? 0 : -1;
+}
+
+int flac_decode_frame(const FlacStreamInfo *info, const uint8_t *data, size_t size, int32_t *samples,
+                      size_t *used) {
+    pthread_once(&crc_tables_once, fill_crc_tables);
+    BitReader r = { data, size, 0, 0, 0, 0 };
+    FlacFrameHeader header;
+    if (!get_frame_header(&r, &header)) {
+        return -1;
+    }
+    int bits = header.bits ? header.bits : info->bits;
+    int block = header.block_size;
+    if (bits < 4 || bits > 32 || block > FLAC_MAX_BLOCK_SIZE) {
+        return -1;
+    }
+
+    if (!get_subframe(&r, block, bits, samples)) {
+        return -1;
+    }
+    if (r.available % 8) {
+        get_bits(&r, r.available % 8);
+    }
+    size_t end = reader_position(&r);
+    if (end + 2 > size || crc16(data, end) != get_bits(&r, 16)) {
+        return -1;
+    }
+    *used = end + 2;
+    return block;
+}
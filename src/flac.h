@@ -0,0 +1,63 @@
+// Wave2Image FLAC codec
+// Lossless compression of mono 8 and 16-bit audio as FLAC: fixed size blocks, each predicted by a
+// fixed polynomial or an LPC filter with the residual Rice coded. Frames don't depend on each other,
+// so blocks are encoded on several threads. The decoder reads any mono FLAC of those sample sizes.
+// Internal to the library, the app and the CLI only go through wave2img.h.
+#ifndef FLAC_H
+#define FLAC_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define FLAC_BLOCK_SIZE 4096            // samples per frame written
+#define FLAC_MAX_BLOCK_SIZE 65535       // largest frame the format allows
+#define FLAC_MAX_LPC_ORDER 12           // orders the encoder tries, the decoder takes up to 32
+#define FLAC_LPC_PRECISION 13           // bits of a quantized LPC coefficient
+#define FLAC_MAX_PARTITION_ORDER 8      // residuals are Rice coded in up to 2^8 partitions
+#define FLAC_STREAMINFO_SIZE 34
+#define FLAC_APPLICATION_ID "w2im"      // APPLICATION block carrying the ImageMetadata
+
+// Metadata block types
+#define FLAC_BLOCK_STREAMINFO 0
+#define FLAC_BLOCK_APPLICATION 2
+
+// Contents of the STREAMINFO block
+typedef struct {
+    int min_block;
+    int max_block;
+    uint32_t min_frame;         // bytes, 0 when not known
+    uint32_t max_frame;
+    int sample_rate;
+    int channels;
+    int bits;
+    uint64_t total_samples;     // 0 when not known, streams written to a pipe
+} FlacStreamInfo;
+
+// Header of one frame, enough to find where frames start without decoding them
+typedef struct {
+    int block_size;
+    int bits;                   // 0 when given by STREAMINFO
+    bool variable;              // number counts samples instead of frames
+    uint64_t number;
+    size_t size;                // bytes, CRC included
+} FlacFrameHeader;
+
+void flac_write_streaminfo(const FlacStreamInfo *info, uint8_t *out);
+int flac_read_streaminfo(FlacStreamInfo *info, const uint8_t *in);
+
+// Encoding: samples are signed, -128 .. 127 for 8-bit streams. A frame never needs more than
+// flac_frame_capacity bytes, work holds flac_work_size bytes for one encoder at a time.
+size_t flac_frame_capacity(int block_size);
+size_t flac_work_size(int block_size);
+size_t flac_encode_frame(const FlacStreamInfo *info, const int16_t *samples, int count, uint64_t frame_number,
+                         uint8_t *out, void *work);
+
+// Decoding: flac_frame_header checks a possible frame start (sync code, fields and CRC).
+// flac_decode_frame decodes the frame at the start of data, returning its sample count (at most
+// FLAC_MAX_BLOCK_SIZE) and the bytes it took, or -1 when the frame is damaged or cut short.
+int flac_frame_header(const uint8_t *data, size_t size, FlacFrameHeader *header);
+int flac_decode_frame(const FlacStreamInfo *info, const uint8_t *data, size_t size, int32_t *samples,
+                      size_t *used);
+
+#endif // FLAC_H
@@ -9,24 +9,18 @@
 #include <stdbool.h>
 
 // for conversion
-#include <stdint.h>
-#include <png.h>
-
-#define SAMPLE_RATE 44100
-#define DURATION 0.05 // Duration for each pixel in seconds
-#define BUFFER_SIZE 4096 // Buffer size for writing samples
-#define BITS_PER_SAMPLE 32
-
-// Global variable for the progress bar
-GtkProgressBar *progress_bar;
-int g_selected_sample_rate = 44100;
-int g_selected_mode = 0;
+#include "wave2img.h"
 
 // Define the AppData structure
 typedef struct {
     GtkLabel *error_label;
     GtkComboBoxText *samplerate_combo_sample;
     GtkComboBoxText *samplerate_combo_mode;
+    GtkComboBoxText *samplerate_combo_encoding;
+    GtkLabel *sample_rate_label;
+    GtkLabel *mode_label;
+    GtkLabel *encoding_label;
+    ConversionOptions options; // filled by the combo box callbacks
 } AppData;
 
 typedef struct {
@@ -35,79 +29,9 @@ typedef struct {
     GtkLabel *con_progress_text; // covert status
     GtkLabel *output_box_audio; // output box
     GtkBuilder *builder;
+    ConversionOptions *options; // options selected in the UI
 } Status_img_wav, Status_wav_img;
 
-// --------------------------------------------------------------------------------------------------------
-// WAV file header structure
-typedef struct {
-    char riff[4];
-    uint32_t file_size;
-    char wave[4];
-    char fmt[4];
-    uint32_t fmt_size;
-    uint16_t fmt_tag;
-    uint16_t channels;
-    uint32_t sample_rate;
-    uint32_t byte_rate;
-    uint16_t block_align;
-    uint16_t bits_per_sample;
-    char data[4];
-    uint32_t data_size;
-} WavHeader;
-
-// WAV file header structure
-typedef struct {
-    char chunkID[4];         // "RIFF"
-    uint32_t chunkSize;      // File size - 8 bytes
-    char format[4];          // "WAVE"
-    char subchunk1ID[4];     // "fmt "
-    uint32_t subchunk1Size;  // Size of fmt chunk (16 for PCM)
-    uint16_t audioFormat;    // Audio format (1 = PCM, others = compressed)
-    uint16_t numChannels;    // Number of channels
-    uint32_t sampleRate;     // Sampling frequency
-    uint32_t byteRate;       // Bytes per second
-    uint16_t blockAlign;     // Bytes per sample slice
-    uint16_t bitsPerSample;  // Bits per sample
-    char subchunk2ID[4];     // "data"
-    uint32_t subchunk2Size;  // Size of the data chunk
-} WAVHeader;
-// --------------------------------------------------------------------------------------------------------
-
-// Function to read the WAV file header
-void read_wav_header(FILE *file, WavHeader *header) {
-    fread(header, sizeof(WavHeader), 1, file);
-}
-
-// Function to write a WAV file header
-void write_wav_header(FILE *file, int num_samples) {
-    WavHeader header;
-    int file_size = num_samples * sizeof(int16_t) + sizeof(WavHeader) - 8;
-    int data_size = num_samples * sizeof(int16_t);
-
-    // Fill WAV header
-    memcpy(header.riff, "RIFF", 4);
-    header.file_size = file_size;
-    memcpy(header.wave, "WAVE", 4);
-    memcpy(header.fmt, "fmt ", 4);
-    header.fmt_size = 16;
-    header.fmt_tag = 1; // PCM
-    header.channels = 1; // Mono
-    header.sample_rate = g_selected_sample_rate; // SAMPLE_RATE
-    header.byte_rate = g_selected_sample_rate * sizeof(int16_t); //SAMPLE_RATE
-    header.block_align = sizeof(int16_t);
-    header.bits_per_sample = 16;
-    memcpy(header.data, "data", 4);
-    header.data_size = data_size;
-
-    // Write header
-    fwrite(&header, sizeof(WavHeader), 1, file);
-}
-
-// Function to write pixel intensity as audio sample
-void generate_audio_samples(FILE *file, int16_t *samples, int num_samples) {
-    fwrite(samples, sizeof(int16_t), num_samples, file); // Write all samples at once
-}
-
 // Function to update the GTK progress bar
 void update_progress_bar(GtkProgressBar *progress_bar, gpointer user_data, double fraction) {
     // Ensure the progress value is between 0.0 and 1.0
@@ -127,130 +51,15 @@ void update_progress_bar(GtkProgressBar *progress_bar, gpointer user_data, doubl
     gtk_widget_queue_draw(GTK_WIDGET(progress_bar));    // Cast to GtkWidget*
 }
 
-// Function to read PNG file and convert to grayscale intensity - img - wav -
-int read_png_file(const char *filename, int *width, int *height, uint8_t **pixels) {
-    FILE *fp = fopen(filename, "rb");
-    if (!fp) {
-        fprintf(stderr, "Error: Couldn't open file %s for reading.\n", filename);
-        return -1;
-    }
-
-    png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-    if (!png) {
-        fclose(fp);
-        fprintf(stderr, "Error: Couldn't initialize PNG read struct.\n");
-        return -1;
-    }
-
-    png_infop info = png_create_info_struct(png);
-    if (!info) {
-        png_destroy_read_struct(&png, NULL, NULL);
-        fclose(fp);
-        fprintf(stderr, "Error: Couldn't initialize PNG info struct.\n");
-        return -1;
-    }
-
-    if (setjmp(png_jmpbuf(png))) {
-        png_destroy_read_struct(&png, &info, NULL);
-        fclose(fp);
-        fprintf(stderr, "Error: Couldn't set PNG jump buffer.\n");
-        return -1;
-    }
-
-    png_init_io(png, fp);
-    png_read_info(png, info);
-
-    *width = png_get_image_width(png, info);
-    *height = png_get_image_height(png, info);
-    png_byte color_type = png_get_color_type(png, info);
-    png_byte bit_depth = png_get_bit_depth(png, info);
-
-    if (bit_depth == 16)
-        png_set_strip_16(png);
-
-    if (color_type == PNG_COLOR_TYPE_PALETTE)
-        png_set_palette_to_rgb(png);
-
-    if (color_type == PNG_COLOR_TYPE_GRAY && bit_depth < 8)
-        png_set_expand_gray_1_2_4_to_8(png);
-
-    if (png_get_valid(png, info, PNG_INFO_tRNS))
-        png_set_tRNS_to_alpha(png);
-
-    if (color_type == PNG_COLOR_TYPE_RGB || color_type == PNG_COLOR_TYPE_GRAY_ALPHA || color_type == PNG_COLOR_TYPE_RGBA)
-        png_set_filler(png, 0xFF, PNG_FILLER_AFTER);
-
-    png_set_gray_to_rgb(png);
-
-    png_read_update_info(png, info);
-
-    *pixels = (uint8_t *)malloc(*width * *height * 4);
-    if (*pixels == NULL) {
-        png_destroy_read_struct(&png, &info, NULL);
-        fclose(fp);
-        fprintf(stderr, "Error: Couldn't allocate memory for pixels.\n");
-        return -1;
-    }
-
-    png_bytep rows[*height];
-    for (int y = 0; y < *height; y++) {
-        rows[y] = (*pixels) + y * (*width) * 4;
-    }
-
-    png_read_image(png, rows);
-
-    png_destroy_read_struct(&png, &info, NULL);
-    fclose(fp);
-
-    return 0;
-}
-
-// Function to write a PNG file from pixel data - wav - img -
-void write_png_file(const char *filename, int width, int height, uint8_t *pixels) {
-    FILE *fp = fopen(filename, "wb");
-    if (!fp) {
-        fprintf(stderr, "Error: Couldn't open file %s for writing.\n", filename);
-        return;
-    }
-
-    png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-    if (!png) {
-        fclose(fp);
-        fprintf(stderr, "Error: Couldn't initialize PNG write struct.\n");
-        return;
-    }
-
-    png_infop info = png_create_info_struct(png);
-    if (!info) {
-        png_destroy_write_struct(&png, NULL);
-        fclose(fp);
-        fprintf(stderr, "Error: Couldn't initialize PNG info struct.\n");
-        return;
-    }
-
-    if (setjmp(png_jmpbuf(png))) {
-        png_destroy_write_struct(&png, &info);
-        fclose(fp);
-        fprintf(stderr, "Error: Couldn't set PNG jump buffer.\n");
-        return;
-    }
-
-    png_init_io(png, fp);
-    png_set_IHDR(png, info, width, height, 8, PNG_COLOR_TYPE_GRAY, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
-    png_write_info(png, info);
+// Progress callback used by the GTK app, user_data is the GtkProgressBar
+void gtk_progress_callback(double fraction, void *user_data) {
+    GtkProgressBar *progress_bar = GTK_PROGRESS_BAR(user_data);
+    update_progress_bar(progress_bar, NULL, fraction);
 
-    png_bytep row = (png_bytep)malloc(width);
-    for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width; x++) {
-            row[x] = pixels[y * width + x]; // Use grayscale intensity directly
-        }
-        png_write_row(png, row);
+    // Process pending GTK events to update the UI
+    while (gtk_events_pending()) {
+        gtk_main_iteration();
     }
-
-    free(row);
-    png_write_end(png, NULL);
-    png_destroy_write_struct(&png, &info);
-    fclose(fp);
 }
 
 // -------------------------------------------------------------------------------------------------------- png
@@ -400,7 +209,8 @@ void on_file_selected_wav(GtkFileChooserButton *chooser, GtkLabel *error_label)
 }
 
 // Callback to update the label with the selected sample rate
-void update_sample_rate_label(GtkComboBoxText *combo_box, GtkLabel *label) {
+void update_sample_rate_label(GtkComboBoxText *combo_box, AppData *app_data) {
+    GtkLabel *label = app_data->sample_rate_label;
     const char *selected_sample_rate = gtk_combo_box_text_get_active_text(combo_box);
     if (selected_sample_rate != NULL) {
         // Buffer to hold the numeric part of the sample rate
@@ -417,7 +227,7 @@ void update_sample_rate_label(GtkComboBoxText *combo_box, GtkLabel *label) {
         number[i] = '\0'; // Null-terminate the string
 
         // Convert the extracted number string to an integer
-        g_selected_sample_rate = atoi(number);
+        app_data->options.sample_rate = atoi(number);
 
         // Update the label text to show the selected sample rate
         char label_text[128];
@@ -425,29 +235,32 @@ void update_sample_rate_label(GtkComboBoxText *combo_box, GtkLabel *label) {
         gtk_label_set_text(label, label_text);
 
         // Print to console for debugging
-        g_print("Updated label with sample rate: %d\n", g_selected_sample_rate);
+        g_print("Updated label with sample rate: %d\n", app_data->options.sample_rate);
     } else {
         gtk_label_set_text(label, "No sample rate selected");
     }
 }
 
 // Callback to update the mode with the selected mod
-void update_mode_label(GtkComboBoxText *combo_box, GtkLabel *label) {
+void update_mode_label(GtkComboBoxText *combo_box, AppData *app_data) {
+    GtkLabel *label = app_data->mode_label;
     // Get the selected text from the combo box
     const char *selected_mode = gtk_combo_box_text_get_active_text(combo_box);
 
     if (selected_mode != NULL) {
         // Map the selected mode to the corresponding value
         if (strcmp(selected_mode, "Array") == 0) {
-            g_selected_mode = 4;
+            app_data->options.mode = MODE_ARRAY;
         } else if (strcmp(selected_mode, "Linked List") == 0) {
-            g_selected_mode = 1;
+            app_data->options.mode = MODE_LINKED_LIST;
         } else if (strcmp(selected_mode, "Stack") == 0) {
-            g_selected_mode = 2;
+            app_data->options.mode = MODE_STACK;
         } else if (strcmp(selected_mode, "Queue") == 0) {
-            g_selected_mode = 3;
+            app_data->options.mode = MODE_QUEUE;
+        } else if (strcmp(selected_mode, "Pipeline") == 0) {
+            app_data->options.mode = MODE_PIPELINE;
         } else {
-            g_selected_mode = 0; // Default value if mode is unknown
+            app_data->options.mode = MODE_NONE; // Default value if mode is unknown
         }
 
         // Update the label text to show the selected mode
@@ -456,38 +269,48 @@ void update_mode_label(GtkComboBoxText *combo_box, GtkLabel *label) {
         gtk_label_set_text(label, label_text);
 
         // Print to console for debugging
-        g_print("Updated label with mode: %s (Code: %d)\n", selected_mode, g_selected_mode);
+        g_print("Updated label with mode: %s (Code: %d)\n", selected_mode, app_data->options.mode);
     } else {
         // Handle the case where no mode is selected
         gtk_label_set_text(label, "No mode selected");
-        g_selected_mode = 0;
+        app_data->options.mode = MODE_NONE;
     }
 }
 
-// =========================================================================================================== img - wav
-void set_text(GtkBuilder *builder) {
-    FILE *file = fopen("assets/output/audio/output.wav", "rb");
-    if (!file) {
-        printf("Error: Could not open file 'assets/output/audio/output.wav'.\n");
-        return;
-    }
-
-    WAVHeader header;
+// Callback to update the encoding with the selected one
+void update_encoding_label(GtkComboBoxText *combo_box, AppData *app_data) {
+    GtkLabel *label = app_data->encoding_label;
+    const char *selected_encoding = gtk_combo_box_text_get_active_text(combo_box);
+
+    if (selected_encoding != NULL) {
+        // Map the selected encoding to the corresponding value
+        if (strcmp(selected_encoding, "APT") == 0) {
+            app_data->options.encoding = ENCODING_APT;
+        } else if (strcmp(selected_encoding, "Spectrogram") == 0) {
+            app_data->options.encoding = ENCODING_SPECTROGRAM;
+        } else if (strcmp(selected_encoding, "OFDM") == 0) {
+            app_data->options.encoding = ENCODING_OFDM;
+        } else if (strcmp(selected_encoding, "Run-length") == 0) {
+            app_data->options.encoding = ENCODING_RLE;
+        } else {
+            app_data->options.encoding = ENCODING_RAW;
+        }
 
-    // Read the WAV header
-    if (fread(&header, sizeof(WAVHeader), 1, file) != 1) {
-        printf("Error: Could not read WAV header.\n");
-        fclose(file);
-        return;
-    }
+        // Update the label text to show the selected encoding
+        char label_text[128];
+        snprintf(label_text, sizeof(label_text), "Selected Encoding: %s.", selected_encoding);
+        gtk_label_set_text(label, label_text);
 
-    // Validate that the file is a WAV file
-    if (strncmp(header.chunkID, "RIFF", 4) != 0 || strncmp(header.format, "WAVE", 4) != 0) {
-        printf("Error: The file is not a valid WAV file.\n");
-        fclose(file);
-        return;
+        g_print("Updated label with encoding: %s (Code: %d)\n", selected_encoding, app_data->options.encoding);
+    } else {
+        gtk_label_set_text(label, "No encoding selected");
+        app_data->options.encoding = ENCODING_RAW;
     }
+}
 
+// =========================================================================================================== img - wav
+// Show the header of the WAV that was just written, taken from the conversion context
+void set_text(GtkBuilder *builder, const WavHeader *header) {
     // Prepare the text to be displayed in the GtkTextView
     char text[1024];
     snprintf(text, sizeof(text),
@@ -505,18 +328,18 @@ void set_text(GtkBuilder *builder) {
         "| %-20s \t| %u\t\t\t\t|\n"
         "| %-20s \t| %.4s\t\t\t|\n"
         "| %-20s \t\t| %u bytes\t|\n",
-        "Chunk ID", header.chunkID,
-        "File Size", header.chunkSize + 8,
-        "Format", header.format,
-        "Subchunk1 ID", header.subchunk1ID,
-        "Audio Format", header.audioFormat,
-        "Channels", header.numChannels,
-        "Sample Rate", header.sampleRate,
-        "Byte Rate", header.byteRate,
-        "Block Align", header.blockAlign,
-        "Bits Per Sample", header.bitsPerSample,
-        "Subchunk2 ID", header.subchunk2ID,
-        "Data Size", header.subchunk2Size);
+        "Chunk ID", header->riff,
+        "File Size", header->file_size + 8,
+        "Format", header->wave,
+        "Subchunk1 ID", header->fmt,
+        "Audio Format", header->fmt_tag,
+        "Channels", header->channels,
+        "Sample Rate", header->sample_rate,
+        "Byte Rate", header->byte_rate,
+        "Block Align", header->block_align,
+        "Bits Per Sample", header->bits_per_sample,
+        "Subchunk2 ID", header->data,
+        "Data Size", header->data_size);
 
     // Get the text view widget by its ID from the builder
     GtkWidget *text_view = GTK_WIDGET(gtk_builder_get_object(builder, "text_vew_data"));
@@ -532,255 +355,6 @@ void set_text(GtkBuilder *builder) {
     gtk_text_view_set_cursor_visible(GTK_TEXT_VIEW(text_view), FALSE);
 }
 
-// Image to audio ==========================================================================================
-
-// Node for Linked List, Stack, and Queue
-typedef struct Node {
-    int16_t data;
-    struct Node *next;
-} Node;
-
-// Linked List functions
-void append_to_list(Node **head, int16_t value) {
-    Node *new_node = (Node *)malloc(sizeof(Node));
-    new_node->data = value;
-    new_node->next = NULL;
-
-    if (*head == NULL) {
-        *head = new_node;
-    } else {
-        Node *temp = *head;
-        while (temp->next) {
-            temp = temp->next;
-        }
-        temp->next = new_node;
-    }
-}
-
-// Stack functions
-void push_to_stack(Node **stack, int16_t value) {
-    Node *new_node = (Node *)malloc(sizeof(Node));
-    new_node->data = value;
-    new_node->next = *stack;
-    *stack = new_node;
-}
-
-// Queue functions
-void enqueue_to_queue(Node **rear, Node **front, int16_t value) {
-    Node *new_node = (Node *)malloc(sizeof(Node));
-    new_node->data = value;
-    new_node->next = NULL;
-
-    if (*rear == NULL) {
-        *front = *rear = new_node;
-    } else {
-        (*rear)->next = new_node;
-        *rear = new_node;
-    }
-}
-
-// Write all samples from a structure to the file
-void write_samples_from_structure(FILE *audio_file, Node *head, int mode) {
-    Node *current = head;
-    if (mode == 2) { // If stack, reverse the order
-        Node *prev = NULL, *next = NULL;
-        while (current) {
-            next = current->next;
-            current->next = prev;
-            prev = current;
-            current = next;
-        }
-        current = prev;
-    }
-
-    while (current) {
-        fwrite(&(current->data), sizeof(int16_t), 1, audio_file);
-        Node *temp = current;
-        current = current->next;
-        free(temp); // Free memory
-    }
-}
-
-int main_image_to_audio(GtkProgressBar *progress_bar, gpointer user_data, GtkBuilder *builder){
-    // convert with mode
-    // Check if progress_bar is valid
-    if (!GTK_IS_PROGRESS_BAR(progress_bar)) {
-        g_warning("User data is not a valid progress bar");
-    }
-
-    int width, height;
-    uint8_t *pixels;
-
-    if (read_png_file("assets/input/image/image.png", &width, &height, &pixels) != 0) {
-        return 1;
-    }
-
-    FILE *audio_file = fopen("assets/output/audio/output.wav", "wb");
-    if (!audio_file) {
-        fprintf(stderr, "Failed to open output WAV file.\n");
-        free(pixels);
-        return 1;
-    }
-
-    int num_pixels = width * height;
-    write_wav_header(audio_file, num_pixels);
-
-    // Store width and height after writing the WAV header
-    fwrite(&width, sizeof(int), 1, audio_file);
-    fwrite(&height, sizeof(int), 1, audio_file);
-
-    if(g_selected_mode > 3){
-        // Allocate a buffer for audio samples
-        int16_t *samples = (int16_t *)malloc(num_pixels * sizeof(int16_t));
-        if (samples == NULL) {
-            fclose(audio_file);
-            free(pixels);
-            fprintf(stderr, "Error: Couldn't allocate memory for audio samples.\n");
-            return 1;
-        }
-
-        // Convert each pixel to an audio sample with progress bar
-        for (int i = 0; i < num_pixels; i++) {
-            int r = pixels[4 * i];       // Red channel
-            int g = pixels[4 * i + 1];   // Green channel
-            int b = pixels[4 * i + 2];   // Blue channel
-            int intensity = (r + g + b) / 3; // Grayscale intensity
-
-            samples[i] = (int16_t)((intensity - 128) * 256); // Map intensity 0-255 to signed 16-bit audio
-
-            // Update progress bar
-            if (i % (num_pixels / 50) == 0 || i == num_pixels - 1) { // Update progress bar every 2% of the total
-                float progress = (float)i / num_pixels;
-                update_progress_bar(progress_bar, user_data, progress); // Use the GTK progress bar function
-            }
-        }
-
-        // Write all samples to the WAV file at once
-        generate_audio_samples(audio_file, samples, num_pixels);
-
-        fclose(audio_file);
-        free(pixels);
-        free(samples);
-
-        update_progress_bar(progress_bar, user_data, 1.0); // Final update to 100%
-        printf("\nConversion to audio completed successfully!\n");
-
-        set_text(builder);
-
-        return 0;
-    }else{
-        // Initialize data structure
-        Node *head = NULL, 
-            *stack = NULL, 
-            *queue_front = NULL, 
-            *queue_rear = NULL;
-
-        printf("Start --\n");
-
-        for (int i = 0; i < width * height; i++) {
-            int r = pixels[4 * i];       
-            int g = pixels[4 * i + 1];
-            int b = pixels[4 * i + 2];
-            int intensity = (r + g + b) / 3;
-
-            int16_t sample = (int16_t)((intensity - 128) * 256);
-
-            if (g_selected_mode == 1) { 
-                append_to_list(&head, sample);  // Linked List
-            } else if (g_selected_mode == 2) {
-                push_to_stack(&stack, sample); // Stack
-            } else if (g_selected_mode == 3) {
-                enqueue_to_queue(&queue_rear, &queue_front, sample); // Queue
-            }
-
-            // Update progress bar every 2% or at the last iteration
-            if (i % (width * height / 50) == 0 || i == width * height - 1) {
-                float progress = (float)(i + 1) / (width * height); // Progress as a fraction (0.0 - 1.0)
-                gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(progress_bar), progress);
-
-                // Process pending GTK events to update the UI
-                while (gtk_events_pending()) {
-                    gtk_main_iteration();
-                }
-
-                printf("%f", progress);
-            }
-        }
-
-        // Write data to file from the chosen structure
-        if (g_selected_mode == 1) {
-            write_samples_from_structure(audio_file, head, g_selected_mode);  // Linked List
-        } else if (g_selected_mode == 2) {
-            write_samples_from_structure(audio_file, stack, g_selected_mode); // Stack
-        } else if (g_selected_mode == 3) {
-            write_samples_from_structure(audio_file, queue_front, g_selected_mode); // Queue
-        }
-
-        fclose(audio_file);
-        free(pixels);
-
-        update_progress_bar(progress_bar, user_data, 1.0); // Final update to 100%
-        printf("Conversion to audio completed successfully using mode %d!\n", g_selected_mode);
-
-        set_text(builder);
-
-        return 0;
-    }
-}
-
-// =========================================================================================================== wav - img
-int main_audio_to_image(GtkProgressBar *progress_bar, gpointer user_data) {
-    FILE *audio_file = fopen("assets/input/audio/input.wav", "rb");
-    if (!audio_file) {
-        fprintf(stderr, "Failed to open input WAV file.\n");
-        return 1;
-    }
-
-    WavHeader header;
-    read_wav_header(audio_file, &header);
-
-    int num_samples = header.data_size / sizeof(int16_t);
-    int width = 0, height = 0;
-
-    // Read width and height from the end of the WAV file
-    fread(&width, sizeof(int), 1, audio_file);
-    fread(&height, sizeof(int), 1, audio_file);
-
-    // Allocate memory for audio samples and pixels
-    int16_t *samples = (int16_t *)malloc(num_samples * sizeof(int16_t));
-    uint8_t *pixels = (uint8_t *)malloc(width * height * sizeof(uint8_t));
-    if (samples == NULL || pixels == NULL) {
-        fclose(audio_file);
-        free(samples);
-        free(pixels);
-        fprintf(stderr, "Error: Couldn't allocate memory for samples or pixels.\n");
-        return 1;
-    }
-
-    // Read samples from the WAV file
-    fread(samples, sizeof(int16_t), num_samples, audio_file);
-    fclose(audio_file);
-
-    // Convert audio samples back to grayscale intensities
-    for (int i = 0; i < num_samples; i++) {
-        // Map signed 16-bit audio sample back to grayscale intensity
-        int intensity = (samples[i] / 256) + 128; // Revert mapping
-        // Clamp the intensity to [0, 255]
-        if (intensity < 0) intensity = 0;
-        if (intensity > 255) intensity = 255;
-        pixels[i] = (uint8_t)intensity;
-    }
-
-    // Write the grayscale image to a PNG file
-    write_png_file("assets/output/image/output.png", width, height, pixels);
-
-    free(samples);
-    free(pixels);
-
-    gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(progress_bar), 1.0);
-    printf("Conversion back to image completed successfully!\n");
-}
-
 // ===========================================================================================================
 // rist_wav_page
 static void riset_wav(GtkBuilder *builder){
@@ -797,6 +371,7 @@ static void riset_wav(GtkBuilder *builder){
         printf("Error: Could not find file chooser button with ID 'input_img_input'.\n");
     }
 
+    GtkProgressBar *progress_bar = GTK_PROGRESS_BAR(gtk_builder_get_object(builder, "progress_bar_img"));
     gtk_progress_bar_set_fraction(progress_bar, 0.0); // Update progress to 0
 
     // Get the error label (img)
@@ -860,6 +435,7 @@ static void riset_img(GtkBuilder *builder){
         printf("Error: Could not find file chooser button with ID 'input_img_input'.\n");
     }
 
+    GtkProgressBar *progress_bar = GTK_PROGRESS_BAR(gtk_builder_get_object(builder, "progress_bar_wav"));
     gtk_progress_bar_set_fraction(progress_bar, 0.0); // Update progress to 0
 
     // Get the error label (img)
@@ -1046,6 +622,8 @@ void on_conversion_button_clicked_img_wav(GtkWidget *widget, gpointer user_data)
         fclose(file); // Close the file
 
         Status_img_wav *progress = (Status_img_wav *)user_data; // Cast user_data to Progress struct
+        int result = CONVERSION_ERROR;
+        char error[CONVERSION_ERROR_SIZE] = "The conversion didn't finish.";
 
         char *alert_converting = g_strdup_printf("<span foreground=\"#c7bd02\">Converting...</span>");
         gtk_label_set_markup(progress->con_progress_text, alert_converting);
@@ -1064,11 +642,29 @@ void on_conversion_button_clicked_img_wav(GtkWidget *widget, gpointer user_data)
 
             // Call the img - wav conversion function
             g_print("Conversion started...\n");
-            main_image_to_audio(progress->progress_bar_img, progress->conversion_label, progress->builder);
+            ConversionContext ctx;
+            conversion_context_init(&ctx, progress->options, gtk_progress_callback, progress->progress_bar_img);
+            result = main_image_to_audio(&ctx, file_path, "assets/output/audio/output.wav");
+            if (result == CONVERSION_OK) {
+                printf("\nConversion to audio completed successfully using mode %d!\n", ctx.options.mode);
+                set_text(progress->builder, &ctx.header);
+            }
+            if (ctx.error[0] != '\0') {
+                memcpy(error, ctx.error, sizeof(error));
+            }
+            conversion_context_free(&ctx);
         } else {
             g_warning("Invalid progress bar or label");
         }
 
+        if (result != CONVERSION_OK) {
+            // Show the library's message in red, there is no output to show
+            char *error_message = g_markup_printf_escaped("<span foreground=\"#f51818\">%s</span>", error);
+            gtk_label_set_markup(progress->con_progress_text, error_message);
+            g_free(error_message);
+            return;
+        }
+
         // Show success message with colored text
         char *success_message = g_strdup_printf("<span foreground=\"#007a0e\">Conversion to audio completed successfully!</span>");
         gtk_label_set_markup(progress->con_progress_text, success_message);
@@ -1092,6 +688,9 @@ void on_conversion_button_clicked_img_wav(GtkWidget *widget, gpointer user_data)
 // audio to image convertion button clicked
 void on_conversion_button_clicked_wav_img(GtkWidget *widget, gpointer user_data) {
     Status_wav_img *progress = (Status_wav_img *)user_data; // Cast user_data to Progress struct
+    int result = CONVERSION_ERROR;
+    char error[CONVERSION_ERROR_SIZE] = "The conversion didn't finish.";
+    char warning[CONVERSION_ERROR_SIZE] = "";
 
     char *alert_converting = g_strdup_printf("<span foreground=\"#c7bd02\">Converting...</span>");
     gtk_label_set_markup(progress->con_progress_text, alert_converting);
@@ -1110,13 +709,35 @@ void on_conversion_button_clicked_wav_img(GtkWidget *widget, gpointer user_data)
 
         // Call the wav - img conversion function
         g_print("Conversion started...\n");
-        main_audio_to_image(progress->progress_bar_img, progress->conversion_label);
+        ConversionContext ctx;
+        conversion_context_init(&ctx, progress->options, gtk_progress_callback, progress->progress_bar_img);
+        result = main_audio_to_image(&ctx, "assets/input/audio/input.wav", "assets/output/image/output.png");
+        if (result == CONVERSION_OK) {
+            printf("Conversion back to image completed successfully!\n");
+        }
+        if (ctx.error[0] != '\0') {
+            memcpy(error, ctx.error, sizeof(error));
+        }
+        if (result == CONVERSION_OK && atomic_load(&ctx.warnings) > 0) {
+            memcpy(warning, ctx.warning, sizeof(warning));
+        }
+        conversion_context_free(&ctx);
     } else {
         g_warning("Invalid progress bar or label");
     }
 
-    // Show success message with colored text
-    char *success_message = g_strdup_printf("<span foreground=\"#007a0e\">Conversion to audio completed successfully!</span>");
+    if (result != CONVERSION_OK) {
+        // Show the library's message in red, there is no output to show
+        char *error_message = g_markup_printf_escaped("<span foreground=\"#f51818\">%s</span>", error);
+        gtk_label_set_markup(progress->con_progress_text, error_message);
+        g_free(error_message);
+        return;
+    }
+
+    // Show success message with colored text, in yellow with the first warning when the audio was damaged
+    char *success_message = warning[0] != '\0'
+        ? g_markup_printf_escaped("<span foreground=\"#c7bd02\">Conversion to image completed: %s</span>", warning)
+        : g_strdup_printf("<span foreground=\"#007a0e\">Conversion to image completed successfully!</span>");
     gtk_label_set_markup(progress->con_progress_text, success_message);
     g_free(success_message);
 
@@ -1178,12 +799,21 @@ int main(int argc, char *argv[]) {
     GtkComboBoxText *samplerate_combo_mode = GTK_COMBO_BOX_TEXT(gtk_builder_get_object(builder, "conversion_samplr_mode"));
     GtkLabel *mode_label = GTK_LABEL(gtk_builder_get_object(builder, "conversion_mode_name"));
 
+    // select Encoding
+    GtkComboBoxText *samplerate_combo_encoding = GTK_COMBO_BOX_TEXT(gtk_builder_get_object(builder, "conversion_samplr_encoding"));
+    GtkLabel *encoding_label = GTK_LABEL(gtk_builder_get_object(builder, "conversion_encoding_name"));
+
 
     // Initialize AppData structure
     AppData app_data = {
         .error_label = error_label_img,
         .samplerate_combo_sample = samplerate_combo_sample,
-        .samplerate_combo_mode = samplerate_combo_mode
+        .samplerate_combo_mode = samplerate_combo_mode,
+        .samplerate_combo_encoding = samplerate_combo_encoding,
+        .sample_rate_label = sample_rate_label,
+        .mode_label = mode_label,
+        .encoding_label = encoding_label,
+        .options = { .sample_rate = SAMPLE_RATE, .mode = MODE_ARRAY, .encoding = ENCODING_RAW }
     };
 
     // -----------------------------------------------------------------
@@ -1214,6 +844,7 @@ int main(int argc, char *argv[]) {
     statusImageWav.con_progress_text = GTK_LABEL(gtk_builder_get_object(builder, "lebel_img_status"));              // Covert status
     statusImageWav.output_box_audio = GTK_LABEL(gtk_builder_get_object(builder, "output_audio"));                   // Output box
     statusImageWav.builder = builder;
+    statusImageWav.options = &app_data.options;
 
     // Connect signal for the conversion button - image to audio -
     g_signal_connect(conversion_button_img, "clicked", G_CALLBACK(on_conversion_button_clicked_img_wav), &statusImageWav);
@@ -1225,6 +856,8 @@ int main(int argc, char *argv[]) {
     statusWavImg.conversion_label = GTK_LABEL(gtk_builder_get_object(builder, "conversion_wav_progress_box"));    // Progress box
     statusWavImg.con_progress_text = GTK_LABEL(gtk_builder_get_object(builder, "lebel_wav_status"));              // Covert status
     statusWavImg.output_box_audio = GTK_LABEL(gtk_builder_get_object(builder, "output_image"));                   // Output box
+    statusWavImg.builder = builder;
+    statusWavImg.options = &app_data.options;
 
     // Connect signal for the conversion button - audio to image -
     g_signal_connect(conversion_button_wav, "clicked", G_CALLBACK(on_conversion_button_clicked_wav_img), &statusWavImg);
@@ -1242,8 +875,9 @@ int main(int argc, char *argv[]) {
     g_signal_connect(file_chooser_img, "file-set", G_CALLBACK(on_file_selected_img), error_label_img);
 
     // In any change selectior
-    g_signal_connect(samplerate_combo_sample, "changed", G_CALLBACK(update_sample_rate_label), sample_rate_label);
-    g_signal_connect(samplerate_combo_mode, "changed", G_CALLBACK(update_mode_label), mode_label);
+    g_signal_connect(samplerate_combo_sample, "changed", G_CALLBACK(update_sample_rate_label), &app_data);
+    g_signal_connect(samplerate_combo_mode, "changed", G_CALLBACK(update_mode_label), &app_data);
+    g_signal_connect(samplerate_combo_encoding, "changed", G_CALLBACK(update_encoding_label), &app_data);
 
     // Connect the file chooser to the file selection callback
     g_signal_connect(file_chooser_wav, "file-set", G_CALLBACK(on_file_selected_wav), error_label_wav);
@@ -1261,7 +895,7 @@ int main(int argc, char *argv[]) {
 // ===========================================================================================================
 
 
-// for Linux            -- gcc -o Wave2Image main.c -lpng -lm `pkg-config --cflags --libs gtk+-3.0`
+// for Linux            -- gcc -o Wave2Image main.c wave2img.c dsp.c flac.c -lpng -lm -lpthread `pkg-config --cflags --libs gtk+-3.0`
 // for static_linking   -- 
 
 /*
@@ -0,0 +1,100 @@
+// APT encode -> decode round trips without noise, the decoded pixels checked against the source.
+// The demodulator passes the envelope up to about half the word rate, so a pixel next to a sharp edge
+// (the sync porch at either end of a line, or a stripe) keeps part of its neighbour; pixels away from
+// them come back within a few levels. A sync locked half a word off shows as far larger errors.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "wave2img.h"
+
+#define IMAGE_HEIGHT 24
+#define EDGE_WORDS 4            // pixels this close to either end of a line sit next to the sync porch
+#define SMOOTH_TOLERANCE 8      // away from sharp edges
+#define EDGE_TOLERANCE 112      // next to one, most at 8 kHz where a word is under two samples
+
+typedef enum { IMAGE_GRADIENT, IMAGE_FLAT, IMAGE_STRIPES } TestImage;
+
+static const char *image_names[] = { "gradient", "flat 200", "4-pixel stripes" };
+
+static uint8_t test_pixel(TestImage image, int width, int x, int y) {
+    switch (image) {
+    case IMAGE_GRADIENT: {
+        int value = x * 215 / (width - 1);
+        return (uint8_t)(y % 2 ? value : 215 - value); // both ends of a line bright in turn
+    }
+    case IMAGE_FLAT:
+        return 200;
+    default:
+        return (x / 4) % 2 ? 255 : 0;
+    }
+}
+
+// Encode the image at rate, decode it back and count the pixels out of tolerance
+static int loopback(TestImage image, int width, int rate) {
+    uint8_t *source = (uint8_t *)malloc((size_t)width * IMAGE_HEIGHT);
+    for (int y = 0; y < IMAGE_HEIGHT; y++) {
+        for (int x = 0; x < width; x++) {
+            source[y * width + x] = test_pixel(image, width, x, y);
+        }
+    }
+
+    uint8_t *png = NULL, *wav = NULL, *decoded_png = NULL, *decoded = NULL;
+    size_t png_size, wav_size, decoded_size;
+    int decoded_width = 0, decoded_height = 0;
+    ConversionOptions options = { .sample_rate = rate, .mode = MODE_ARRAY, .encoding = ENCODING_APT };
+    ConversionContext ctx;
+    conversion_context_init(&ctx, &options, NULL, NULL);
+
+    int failures = 1;
+    if (write_png_buffer(width, IMAGE_HEIGHT, source, &png, &png_size) != 0 ||
+        image_to_audio_buffer(&ctx, png, png_size, &wav, &wav_size) != CONVERSION_OK ||
+        audio_to_image_buffer(&ctx, wav, wav_size, &decoded_png, &decoded_size) != CONVERSION_OK ||
+        read_png_buffer(decoded_png, decoded_size, &decoded_width, &decoded_height, &decoded) != 0) {
+        printf("FAIL %s at %d Hz: %s\n", image_names[image], rate, ctx.error);
+    } else if (decoded_width != width || decoded_height != IMAGE_HEIGHT) {
+        printf("FAIL %s at %d Hz: decoded as %dx%d\n", image_names[image], rate, decoded_width, decoded_height);
+    } else {
+        failures = 0;
+        int worst = 0;
+        for (int y = 0; y < IMAGE_HEIGHT; y++) {
+            for (int x = 0; x < width; x++) {
+                int want = source[y * width + x];
+                int got = decoded[((size_t)y * width + x) * 4]; // RGBA
+                int error = abs(got - want);
+                bool smooth = image != IMAGE_STRIPES && x >= EDGE_WORDS && x < width - EDGE_WORDS;
+                bool flipped = image == IMAGE_STRIPES && (got < 128) != (want < 128);
+                if (error > (smooth ? SMOOTH_TOLERANCE : EDGE_TOLERANCE) || flipped) {
+                    if (failures++ < 4) {
+                        printf("FAIL %s at %d Hz: pixel %d,%d is %d, not %d\n", image_names[image], rate,
+                               x, y, got, want);
+                    }
+                }
+                worst = error > worst ? error : worst;
+            }
+        }
+        printf("%s %s at %d Hz, largest error %d\n", failures ? "FAIL" : "ok  ", image_names[image], rate, worst);
+    }
+
+    conversion_context_free(&ctx);
+    free(source);
+    free(png);
+    free(wav);
+    free(decoded_png);
+    free(decoded);
+    return failures;
+}
+
+int main(void) {
+    static const int rates[] = { 8000, 11025, 22050, 44100, 48000, 96000, 384000 };
+    static const int widths[] = { 256, 203 };
+    int failed = 0;
+    for (int image = IMAGE_GRADIENT; image <= IMAGE_STRIPES; image++) {
+        for (size_t w = 0; w < sizeof(widths) / sizeof(widths[0]); w++) {
+            for (size_t r = 0; r < sizeof(rates) / sizeof(rates[0]); r++) {
+                failed += loopback((TestImage)image, widths[w], rates[r]) != 0;
+            }
+        }
+    }
+    printf(failed ? "%d APT round trips failed\n" : "All APT round trips passed\n", failed);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,277 @@
+// Archives of frames of different sizes, one archive per encoding. Every frame extracted by its index with
+// extract_stream, and all of them at once by main_extract_images on as many workers as there are cores, has
+// to be pixel-identical to the same image encoded and decoded on its own. Then single bytes are damaged: a
+// frame's data has to be decoded with a warning, the "w2ar" index has to be rejected.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "wave2img.h"
+
+#define FRAMES 5
+#define ARCHIVE_PATH "archive_test.wav"
+#define FRAME_PATTERN "archive_test_%02d.png"
+
+typedef struct {
+    const char *name;
+    ConversionOptions options;
+} Encoding;
+
+static const Encoding encodings[] = {
+    { "raw 16-bit", { .mode = MODE_ARRAY, .encoding = ENCODING_RAW } },
+    { "raw 8-bit framed", { .mode = MODE_ARRAY, .encoding = ENCODING_RAW, .bits_per_sample = 8, .frame_rows = 8 } },
+    { "raw with FEC", { .mode = MODE_ARRAY, .encoding = ENCODING_RAW, .fec_parity = 16 } },
+    { "raw Paeth-predicted", { .mode = MODE_ARRAY, .encoding = ENCODING_RAW, .predictor = PREDICT_PAETH } },
+    { "raw Hilbert order", { .mode = MODE_ARRAY, .encoding = ENCODING_RAW, .order = ORDER_HILBERT } },
+    { "run-length", { .mode = MODE_ARRAY, .encoding = ENCODING_RLE } },
+    { "APT", { .mode = MODE_ARRAY, .encoding = ENCODING_APT, .sample_rate = 11025 } },
+};
+
+static const int frame_sizes[FRAMES][2] = { { 64, 48 }, { 17, 5 }, { 130, 70 }, { 1, 1 }, { 40, 90 } };
+
+typedef struct {
+    uint8_t *png;                  // the source image
+    size_t png_size;
+    uint8_t *pixels;               // the RGBA pixels it decodes to on its own
+    int width, height;
+} Frame;
+
+static uint32_t random_state = 1;
+
+// Random pixels in flat runs, so run-length coding has runs to find
+static uint8_t *make_image(int width, int height) {
+    uint8_t *pixels = (uint8_t *)malloc((size_t)width * height);
+    uint8_t value = 0;
+    for (int i = 0; i < width * height; i++) {
+        random_state = random_state * 1103515245u + 12345u;
+        if ((random_state >> 16) % 4 == 0) {
+            value = (uint8_t)(random_state >> 8);
+        }
+        pixels[i] = value;
+    }
+    return pixels;
+}
+
+// Whether PNG bytes decode to the size of the frame, *wrong counting the RGBA bytes that differ from it
+static bool same_size(const Frame *frame, const uint8_t *png, size_t png_size, int *wrong) {
+    int width = 0, height = 0;
+    uint8_t *pixels = NULL;
+    if (read_png_buffer(png, png_size, &width, &height, &pixels) != 0 || width != frame->width ||
+        height != frame->height) {
+        free(pixels);
+        return false;
+    }
+    *wrong = 0;
+    for (size_t i = 0; i < (size_t)width * height * 4; i++) {
+        *wrong += pixels[i] != frame->pixels[i];
+    }
+    free(pixels);
+    return true;
+}
+
+// The whole of a file in memory
+static uint8_t *read_file(const char *path, size_t *size) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        return NULL;
+    }
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    uint8_t *data = (uint8_t *)malloc(length > 0 ? (size_t)length : 1);
+    *size = fread(data, 1, (size_t)length, file);
+    fclose(file);
+    return data;
+}
+
+// Contents of the first chunk tagged tag in a WAV in memory, NULL when there is none
+static uint8_t *find_chunk(uint8_t *wav, size_t size, const char *tag) {
+    size_t offset = 12;
+    while (offset + 8 <= size) {
+        uint32_t chunk;
+        memcpy(&chunk, wav + offset + 4, 4);
+        if (memcmp(wav + offset, tag, 4) == 0) {
+            return wav + offset + 8;
+        }
+        offset += 8 + (size_t)chunk + (chunk & 1);
+    }
+    return NULL;
+}
+
+// Extract one frame of an archive in memory, returning the result, the PNG and the warnings in ctx
+static int extract(ConversionContext *ctx, const uint8_t *wav, size_t wav_size, int frame, ByteSink *png) {
+    ByteSource source;
+    byte_source_memory(&source, wav, wav_size);
+    byte_sink_memory(png);
+    return extract_stream(ctx, &source, frame, png);
+}
+
+// Damage to the archive: a byte of frame 2's data, then fields of the index
+static int damage_checks(const Encoding *encoding, uint8_t *wav, size_t wav_size) {
+    uint8_t *data = find_chunk(wav, wav_size, "data"), *index = find_chunk(wav, wav_size, "w2ar");
+    if (data == NULL || index == NULL) {
+        printf("FAIL %s: the archive has no data or w2ar chunk\n", encoding->name);
+        return 1;
+    }
+    // The entries follow the header, not aligned for a struct
+    uint8_t *entries = index + sizeof(ArchiveHeader);
+    ArchiveEntry entry;
+    memcpy(&entry, entries + 2 * sizeof(ArchiveEntry), sizeof(entry));
+    int failures = 0;
+
+    // A damaged frame still decodes, with a warning
+    uint8_t *byte = data + entry.data_offset + entry.data_bytes / 2;
+    *byte ^= 0x01;
+    ConversionContext ctx;
+    ByteSink png;
+    conversion_context_init(&ctx, &encoding->options, NULL, NULL);
+    int result = extract(&ctx, wav, wav_size, 2, &png);
+    const char *expected = "Frame 2 doesn't match its checksum, it may be damaged.";
+    if (result != CONVERSION_OK || atomic_load(&ctx.warnings) < 1 || strcmp(ctx.warning, expected) != 0) {
+        printf("FAIL %s, damaged frame: result %d, %d warnings, \"%s\"\n", encoding->name, result,
+               atomic_load(&ctx.warnings), ctx.warning);
+        failures++;
+    }
+    conversion_context_free(&ctx);
+    free(png.data);
+    *byte ^= 0x01;
+
+    // A damaged index is refused
+    struct {
+        const char *what;
+        uint8_t *byte;
+        uint8_t flip;
+        const char *error;
+    } damage[] = {
+        { "frame count", index + offsetof(ArchiveHeader, frames), 0x02, "The archive index is damaged." },
+        { "entry size", index + offsetof(ArchiveHeader, entry_size) + 3, 0x40, "The archive index is damaged." },
+        { "frame offset", entries + 3 * sizeof(ArchiveEntry) + offsetof(ArchiveEntry, data_offset) + 3, 0x10,
+          "The archive index is damaged at frame 3." },
+        { "frame description", entries + sizeof(ArchiveEntry) + offsetof(ArchiveEntry, metadata), 0x0B,
+          "The archive index is damaged at frame 1." },
+    };
+    for (size_t d = 0; d < sizeof(damage) / sizeof(damage[0]); d++) {
+        *damage[d].byte ^= damage[d].flip;
+        conversion_context_init(&ctx, &encoding->options, NULL, NULL);
+        result = extract(&ctx, wav, wav_size, 0, &png);
+        if (result != CONVERSION_ERROR || strcmp(ctx.error, damage[d].error) != 0) {
+            printf("FAIL %s, damaged %s: result %d, \"%s\"\n", encoding->name, damage[d].what, result, ctx.error);
+            failures++;
+        }
+        conversion_context_free(&ctx);
+        free(png.data);
+        *damage[d].byte ^= damage[d].flip;
+    }
+    if (failures == 0) {
+        printf("ok   %s: a damaged frame decodes with a warning, a damaged index is refused\n", encoding->name);
+    }
+    return failures;
+}
+
+// Pack the frames with one encoding, extract them and compare
+static int archive_checks(const Encoding *encoding, Frame *frames) {
+    ConversionContext ctx;
+    int failures = 0;
+
+    // Every frame on its own first
+    for (int f = 0; f < FRAMES; f++) {
+        uint8_t *wav = NULL, *png = NULL;
+        size_t wav_size, png_size;
+        conversion_context_init(&ctx, &encoding->options, NULL, NULL);
+        frames[f].pixels = NULL;
+        if (image_to_audio_buffer(&ctx, frames[f].png, frames[f].png_size, &wav, &wav_size) != CONVERSION_OK ||
+            audio_to_image_buffer(&ctx, wav, wav_size, &png, &png_size) != CONVERSION_OK ||
+            read_png_buffer(png, png_size, &frames[f].width, &frames[f].height, &frames[f].pixels) != 0) {
+            printf("FAIL %s, frame %d on its own: %s\n", encoding->name, f, ctx.error);
+            failures++;
+        }
+        conversion_context_free(&ctx);
+        free(wav);
+        free(png);
+    }
+
+    ByteSource inputs[FRAMES];
+    for (int f = 0; f < FRAMES; f++) {
+        byte_source_memory(&inputs[f], frames[f].png, frames[f].png_size);
+    }
+    ByteSink archive;
+    byte_sink_memory(&archive);
+    conversion_context_init(&ctx, &encoding->options, NULL, NULL);
+    if (failures == 0 && archive_stream(&ctx, inputs, FRAMES, &archive) != CONVERSION_OK) {
+        printf("FAIL %s: couldn't pack the archive, %s\n", encoding->name, ctx.error);
+        failures++;
+    }
+    conversion_context_free(&ctx);
+
+    // Each frame by its index
+    for (int f = 0; f < FRAMES && failures == 0; f++) {
+        ByteSink png;
+        int wrong = 0;
+        conversion_context_init(&ctx, &encoding->options, NULL, NULL);
+        if (extract(&ctx, archive.data, archive.size, f, &png) != CONVERSION_OK ||
+            !same_size(&frames[f], png.data, png.size, &wrong) || wrong > 0 || atomic_load(&ctx.warnings) > 0) {
+            printf("FAIL %s, frame %d extracted: %s, %d bytes differ, %d warnings\n", encoding->name, f, ctx.error,
+                   wrong, atomic_load(&ctx.warnings));
+            failures++;
+        }
+        conversion_context_free(&ctx);
+        free(png.data);
+    }
+
+    // All frames at once, through a file
+    FILE *file = failures == 0 ? fopen(ARCHIVE_PATH, "wb") : NULL;
+    if (file) {
+        bool written = fwrite(archive.data, 1, archive.size, file) == archive.size;
+        written = fclose(file) == 0 && written;
+        conversion_context_init(&ctx, &encoding->options, NULL, NULL);
+        if (!written || main_extract_images(&ctx, ARCHIVE_PATH, FRAME_PATTERN, -1) != CONVERSION_OK) {
+            printf("FAIL %s, all frames extracted: %s\n", encoding->name, ctx.error);
+            failures++;
+        }
+        conversion_context_free(&ctx);
+        for (int f = 0; f < FRAMES; f++) {
+            char path[64];
+            snprintf(path, sizeof(path), FRAME_PATTERN, f);
+            size_t size = 0;
+            int wrong = 0;
+            uint8_t *png = read_file(path, &size);
+            if (failures == 0 && (png == NULL || !same_size(&frames[f], png, size, &wrong) || wrong > 0)) {
+                printf("FAIL %s, frame %d of all extracted: %d bytes differ\n", encoding->name, f, wrong);
+                failures++;
+            }
+            free(png);
+            remove(path);
+        }
+        remove(ARCHIVE_PATH);
+    }
+    if (failures == 0) {
+        printf("ok   %s: %d frames extracted one by one and all at once as they decode on their own\n",
+               encoding->name, FRAMES);
+        failures += damage_checks(encoding, archive.data, archive.size);
+    }
+    free(archive.data);
+    for (int f = 0; f < FRAMES; f++) {
+        free(frames[f].pixels);
+    }
+    return failures;
+}
+
+int main(void) {
+    Frame frames[FRAMES];
+    int failed = 0;
+    for (int f = 0; f < FRAMES; f++) {
+        uint8_t *pixels = make_image(frame_sizes[f][0], frame_sizes[f][1]);
+        if (write_png_buffer(frame_sizes[f][0], frame_sizes[f][1], pixels, &frames[f].png, &frames[f].png_size) != 0) {
+            printf("FAIL couldn't write test image %d\n", f);
+            failed++;
+        }
+        free(pixels);
+    }
+    for (size_t e = 0; e < sizeof(encodings) / sizeof(encodings[0]) && failed == 0; e++) {
+        failed += archive_checks(&encodings[e], frames) != 0;
+    }
+    for (int f = 0; f < FRAMES; f++) {
+        free(frames[f].png);
+    }
+    printf(failed ? "%d archive checks failed\n" : "All archive checks passed\n", failed);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,187 @@
+// FLAC frames encoded by flac_encode_frame and decoded back by flac_decode_frame, 8 and 16-bit. The signals
+// are chosen so every kind of subframe the encoder writes comes out at least once: constant, fixed, LPC,
+// verbatim, and residual partitions escaped to plain binary. Every byte of one frame is then flipped in turn
+// and the damaged frame has to be rejected by its CRC.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "flac.h"
+
+#define SUBFRAME_CONSTANT 0
+#define SUBFRAME_VERBATIM 1
+#define SUBFRAME_FIXED 8                // + order
+#define SUBFRAME_LPC 32                 // + order - 1
+
+typedef enum { SIGNAL_CONSTANT, SIGNAL_RAMP, SIGNAL_SINE, SIGNAL_NOISE, SIGNAL_FULL_NOISE } Signal;
+
+static const char *signal_names[] = { "constant", "ramp", "sine", "quiet noise", "full-scale noise" };
+
+typedef enum { KIND_CONSTANT, KIND_VERBATIM, KIND_FIXED, KIND_LPC, KIND_ESCAPED, KIND_COUNT } SubframeKind;
+
+static const char *kind_names[] = { "constant", "verbatim", "fixed", "LPC", "escaped partition" };
+
+// Deterministic noise, uniform over -amplitude .. amplitude - 1
+static int noise(uint32_t *state, int amplitude) {
+    *state = *state * 1103515245u + 12345u;
+    return (int)((*state >> 8) % (uint32_t)(2 * amplitude)) - amplitude;
+}
+
+static void make_signal(Signal signal, int bits, int16_t *samples, int count) {
+    int top = bits == 8 ? 127 : 32767;
+    uint32_t state = 1;
+    for (int i = 0; i < count; i++) {
+        switch (signal) {
+        case SIGNAL_CONSTANT:
+            samples[i] = (int16_t)(bits == 8 ? -128 : -12345);
+            break;
+        case SIGNAL_RAMP:
+            samples[i] = (int16_t)(i % 256 - 128); // exact for a fixed predictor but at the wrap
+            break;
+        case SIGNAL_SINE:
+            samples[i] = (int16_t)lrint(0.7 * top * sin(i * 0.061) + 0.2 * top * sin(i * 0.0173));
+            break;
+        case SIGNAL_NOISE:
+            samples[i] = (int16_t)noise(&state, bits == 8 ? 8 : 64);
+            break;
+        default:
+            samples[i] = (int16_t)noise(&state, top + 1);
+            break;
+        }
+    }
+}
+
+// Minimal MSB-first reader over a frame
+typedef struct {
+    const uint8_t *data;
+    size_t bit;
+} Bits;
+
+static uint32_t read_bits(Bits *b, int count) {
+    uint32_t value = 0;
+    for (int i = 0; i < count; i++, b->bit++) {
+        value = value << 1 | ((b->data[b->bit / 8] >> (7 - b->bit % 8)) & 1);
+    }
+    return value;
+}
+
+// Kind of the subframe after the frame header, escaped when its first residual partition is plain binary
+static SubframeKind subframe_kind(const uint8_t *frame, size_t header_size, int bits) {
+    Bits b = { frame, header_size * 8 };
+    int type = (int)read_bits(&b, 8) >> 1;
+    int order;
+    if (type == SUBFRAME_CONSTANT) {
+        return KIND_CONSTANT;
+    } else if (type == SUBFRAME_VERBATIM) {
+        return KIND_VERBATIM;
+    } else if (type >= SUBFRAME_LPC) {
+        order = type - SUBFRAME_LPC + 1;
+        b.bit += (size_t)order * bits;
+        int precision = (int)read_bits(&b, 4) + 1;
+        b.bit += 5 + (size_t)order * precision;
+    } else {
+        order = type - SUBFRAME_FIXED;
+        b.bit += (size_t)order * bits;
+    }
+    int parameter_bits = read_bits(&b, 2) ? 5 : 4;
+    read_bits(&b, 4); // partition order
+    bool escaped = read_bits(&b, parameter_bits) == (1u << parameter_bits) - 1;
+    return escaped ? KIND_ESCAPED : type >= SUBFRAME_LPC ? KIND_LPC : KIND_FIXED;
+}
+
+// Encode and decode one block, noting the kind of subframe it became
+static int round_trip(Signal signal, int bits, int count, bool *seen) {
+    FlacStreamInfo info = { count, count, 0, 0, 44100, 1, bits, 0 };
+    int16_t *samples = (int16_t *)malloc((size_t)count * sizeof(int16_t));
+    int32_t *decoded = (int32_t *)malloc(FLAC_MAX_BLOCK_SIZE * sizeof(int32_t));
+    uint8_t *frame = (uint8_t *)malloc(flac_frame_capacity(count));
+    void *work = malloc(flac_work_size(count));
+    make_signal(signal, bits, samples, count);
+
+    int failures = 0;
+    size_t size = flac_encode_frame(&info, samples, count, 7, frame, work);
+    FlacFrameHeader header;
+    size_t used = 0;
+    if (flac_frame_header(frame, size, &header) != 0 || header.block_size != count || header.number != 7) {
+        printf("FAIL %d-bit %s, %d samples: the frame header doesn't read back\n", bits, signal_names[signal], count);
+        failures++;
+    } else if (flac_decode_frame(&info, frame, size, decoded, &used) != count || used != size) {
+        printf("FAIL %d-bit %s, %d samples: the frame doesn't decode\n", bits, signal_names[signal], count);
+        failures++;
+    } else {
+        for (int i = 0; i < count && failures < 4; i++) {
+            if (decoded[i] != samples[i]) {
+                printf("FAIL %d-bit %s, %d samples: sample %d is %d, not %d\n", bits, signal_names[signal], count,
+                       i, decoded[i], samples[i]);
+                failures++;
+            }
+        }
+        SubframeKind kind = subframe_kind(frame, header.size, bits);
+        seen[kind] = true;
+        if (failures == 0) {
+            printf("ok   %d-bit %s, %d samples: %s subframe, %zu bytes\n", bits, signal_names[signal], count,
+                   kind_names[kind], size);
+        }
+    }
+
+    free(samples);
+    free(decoded);
+    free(frame);
+    free(work);
+    return failures;
+}
+
+// Flip every byte of a frame in turn, each damaged copy has to fail to decode
+static int damaged_frames(int bits) {
+    int count = 1024;
+    FlacStreamInfo info = { count, count, 0, 0, 44100, 1, bits, 0 };
+    int16_t *samples = (int16_t *)malloc((size_t)count * sizeof(int16_t));
+    int32_t *decoded = (int32_t *)malloc(FLAC_MAX_BLOCK_SIZE * sizeof(int32_t));
+    uint8_t *frame = (uint8_t *)malloc(flac_frame_capacity(count));
+    void *work = malloc(flac_work_size(count));
+    make_signal(SIGNAL_SINE, bits, samples, count);
+    size_t size = flac_encode_frame(&info, samples, count, 0, frame, work);
+
+    int accepted = 0;
+    for (size_t i = 0; i < size; i++) {
+        size_t used;
+        frame[i] ^= 0x10;
+        if (flac_decode_frame(&info, frame, size, decoded, &used) >= 0) {
+            if (accepted++ < 4) {
+                printf("FAIL %d-bit frame with byte %zu of %zu flipped decodes\n", bits, i, size);
+            }
+        }
+        frame[i] ^= 0x10;
+    }
+    printf("%s %d-bit frame of %zu bytes, each byte flipped: %d of them accepted\n", accepted ? "FAIL" : "ok  ",
+           bits, size, accepted);
+
+    free(samples);
+    free(decoded);
+    free(frame);
+    free(work);
+    return accepted;
+}
+
+int main(void) {
+    static const int bit_sizes[] = { 8, 16 };
+    static const int counts[] = { FLAC_BLOCK_SIZE, 1000, 17 }; // a full block, the last block of a stream
+    bool seen[KIND_COUNT] = { false };
+    int failed = 0;
+    for (size_t b = 0; b < sizeof(bit_sizes) / sizeof(bit_sizes[0]); b++) {
+        for (int signal = SIGNAL_CONSTANT; signal <= SIGNAL_FULL_NOISE; signal++) {
+            for (size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+                failed += round_trip((Signal)signal, bit_sizes[b], counts[c], seen) != 0;
+            }
+        }
+        failed += damaged_frames(bit_sizes[b]) != 0;
+    }
+    for (int kind = 0; kind < KIND_COUNT; kind++) {
+        if (!seen[kind]) {
+            printf("FAIL no block was coded as a %s subframe\n", kind_names[kind]);
+            failed++;
+        }
+    }
+    printf(failed ? "%d FLAC checks failed\n" : "All FLAC checks passed\n", failed);
+    return failed ? 1 : 0;
+}
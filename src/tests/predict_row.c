@@ -0,0 +1,113 @@
+// PNG style row prediction: predict_row, vectorized 16 pixels at a time with SSE2, against a plain reference
+// written from the PNG filter definitions, then unpredict_row has to rebuild the row and residual_cost has to
+// add up the residuals. Widths around 16 put pixels in the vector loop, in the scalar tail or both, and the
+// rows are random, or all black or white with white or black above, where averages carry and Paeth ties.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "dsp.h"
+
+#define MAX_WIDTH 1000
+#define RANDOM_ROWS 200
+
+typedef enum { ROWS_RANDOM, ROWS_EXTREME, ROWS_FIRST } Rows;
+
+static const char *filter_names[] = { "none", "left", "up", "average", "Paeth" };
+
+static uint32_t random_state = 1;
+
+static uint8_t random_byte(void) {
+    random_state = random_state * 1103515245u + 12345u;
+    return (uint8_t)(random_state >> 16);
+}
+
+// The predictor of the PNG specification from the left (a), upper (b) and upper left (c) pixels
+static int reference_prediction(int filter, int a, int b, int c) {
+    switch (filter) {
+    case 1:
+        return a;
+    case 2:
+        return b;
+    case 3:
+        return (a + b) / 2;
+    case 4: {
+        int p = a + b - c, pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+        return pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+    }
+    default:
+        return 0;
+    }
+}
+
+// One row through predict_row, unpredict_row and residual_cost, compared with the reference
+static int row_check(int filter, const uint8_t *row, const uint8_t *prev, size_t width) {
+    uint8_t residuals[MAX_WIDTH], rebuilt[MAX_WIDTH], expected[MAX_WIDTH];
+    uint32_t cost = 0;
+    for (size_t i = 0; i < width; i++) {
+        int a = i > 0 ? row[i - 1] : 0, b = prev[i], c = i > 0 ? prev[i - 1] : 0;
+        expected[i] = (uint8_t)(row[i] - reference_prediction(filter, a, b, c) + 128);
+        cost += (uint32_t)abs(expected[i] - 128);
+    }
+    predict_row(filter, row, prev, residuals, width);
+    unpredict_row(filter, residuals, prev, rebuilt, width);
+    for (size_t i = 0; i < width; i++) {
+        if (residuals[i] != expected[i]) {
+            printf("FAIL %s, width %zu: residual %zu is %d, not %d\n", filter_names[filter], width, i, residuals[i],
+                   expected[i]);
+            return 1;
+        }
+        if (rebuilt[i] != row[i]) {
+            printf("FAIL %s, width %zu: pixel %zu rebuilt as %d, not %d\n", filter_names[filter], width, i,
+                   rebuilt[i], row[i]);
+            return 1;
+        }
+    }
+    if (residual_cost(residuals, width) != cost) {
+        printf("FAIL %s, width %zu: residual cost %u, not %u\n", filter_names[filter], width,
+               residual_cost(residuals, width), cost);
+        return 1;
+    }
+    return 0;
+}
+
+// Every kind of row for one filter and width
+static int width_checks(int filter, size_t width) {
+    uint8_t row[MAX_WIDTH], prev[MAX_WIDTH];
+    int failures = 0;
+    for (int rows = ROWS_RANDOM; rows <= ROWS_FIRST && failures == 0; rows++) {
+        int count = rows == ROWS_EXTREME ? 4 : RANDOM_ROWS;
+        for (int r = 0; r < count && failures == 0; r++) {
+            for (size_t i = 0; i < width; i++) {
+                if (rows == ROWS_EXTREME) {
+                    row[i] = r & 1 ? 255 : 0;
+                    prev[i] = r & 2 ? 255 : 0;
+                } else {
+                    row[i] = random_byte();
+                    prev[i] = rows == ROWS_FIRST ? 0 : random_byte();
+                }
+            }
+            failures += row_check(filter, row, prev, width);
+        }
+    }
+    if (failures == 0) {
+        printf("ok   %s, width %zu\n", filter_names[filter], width);
+    }
+    return failures;
+}
+
+int main(void) {
+    static const size_t widths[] = { 1, 15, 16, 17, 33, MAX_WIDTH };
+#ifdef __SSE2__
+    printf("Row prediction with SSE2\n");
+#else
+    printf("Row prediction without SSE2\n");
+#endif
+    int failed = 0;
+    for (int filter = 0; filter < PREDICT_FILTERS; filter++) {
+        for (size_t w = 0; w < sizeof(widths) / sizeof(widths[0]); w++) {
+            failed += width_checks(filter, widths[w]);
+        }
+    }
+    printf(failed ? "%d row prediction checks failed\n" : "All row prediction checks passed\n", failed);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,273 @@
+// Reed-Solomon coding of RS_LANES interleaved codewords. rs_encode is compared with a plain polynomial
+// division here, rs_decode has to correct up to parity / 2 wrong symbols in every lane exactly, bursts across
+// the lanes included, and report parity / 2 + 1 of them as failures. No decoder can tell every such word from
+// one within parity / 2 of another codeword, which small codes meet about once in (parity / 2)! lanes: a lane
+// not reported has to hold a valid codeword then, and from RS_MISCORRECT_PARITY on none may. The Makefile
+// builds this test with and without SSSE3 on x86, so the PSHUFB tables and the scalar path are both held to
+// the same reference.
+// Last, raw pixels sent with FEC go through image_to_audio_buffer and back with a burst of damaged samples.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "wave2img.h"
+#include "dsp.h"
+
+#define IMAGE_WIDTH 64
+#define IMAGE_HEIGHT 48
+#define RS_MISCORRECT_PARITY 16 // from this parity up one error too many is always reported
+
+static uint8_t gf_exp[512];
+static uint8_t gf_log[256];
+
+static void gf_init(void) {
+    int x = 1;
+    for (int i = 0; i < 255; i++) {
+        gf_exp[i] = gf_exp[i + 255] = (uint8_t)x;
+        gf_log[x] = (uint8_t)i;
+        x = x & 0x80 ? (x << 1) ^ 0x11D : x << 1;
+    }
+}
+
+static uint8_t gf_mul(uint8_t a, uint8_t b) {
+    return a && b ? gf_exp[gf_log[a] + gf_log[b]] : 0;
+}
+
+static uint32_t random_state = 1;
+
+static uint8_t random_byte(void) {
+    random_state = random_state * 1103515245u + 12345u;
+    return (uint8_t)(random_state >> 16);
+}
+
+// Parity of one lane: the remainder of data(x) x^parity divided by (x - alpha^0) ... (x - alpha^(parity - 1))
+static void reference_parity(const uint8_t *data, int rows, int parity, uint8_t *remainder) {
+    uint8_t g[RS_MAX_PARITY + 1] = { 1 };
+    for (int r = 0; r < parity; r++) {
+        for (int j = r + 1; j > 0; j--) {
+            g[j] = g[j - 1] ^ gf_mul(g[j], gf_exp[r]);
+        }
+        g[0] = gf_mul(g[0], gf_exp[r]);
+    }
+    uint8_t work[255] = { 0 };
+    for (int i = 0; i < rows; i++) {
+        work[i] = data[(size_t)i * RS_LANES];
+    }
+    for (int i = 0; i < rows; i++) {
+        uint8_t factor = work[i];
+        for (int j = 1; j <= parity && factor; j++) {
+            work[i + j] ^= gf_mul(factor, g[parity - j]);
+        }
+    }
+    memcpy(remainder, work + rows, parity);
+}
+
+// A block of data rows followed by the parity rows rs_encode gives it, checked against the reference
+static int encode_block(const RsCode *code, int data_rows, uint8_t *block) {
+    int parity = code->parity;
+    for (size_t i = 0; i < (size_t)data_rows * RS_LANES; i++) {
+        block[i] = random_byte();
+    }
+    rs_encode(code, block, data_rows, block + (size_t)data_rows * RS_LANES);
+    int wrong = 0;
+    for (int c = 0; c < RS_LANES; c++) {
+        uint8_t expected[RS_MAX_PARITY];
+        reference_parity(block + c, data_rows, parity, expected);
+        for (int j = 0; j < parity; j++) {
+            wrong += block[((size_t)data_rows + j) * RS_LANES + c] != expected[j];
+        }
+    }
+    if (wrong > 0) {
+        printf("FAIL parity %d, %d data rows: %d parity symbols differ from the reference\n", parity, data_rows,
+               wrong);
+    }
+    return wrong;
+}
+
+// errors distinct rows of every lane get a nonzero error
+static void damage_lanes(uint8_t *block, int rows, int errors) {
+    for (int c = 0; c < RS_LANES; c++) {
+        bool hit[255] = { false };
+        for (int e = 0; e < errors; e++) {
+            int row;
+            do {
+                row = random_byte() % rows;
+            } while (hit[row]);
+            hit[row] = true;
+            uint8_t error;
+            do {
+                error = random_byte();
+            } while (error == 0);
+            block[(size_t)row * RS_LANES + c] ^= error;
+        }
+    }
+}
+
+// Encoding, then correction of scattered errors, bursts and one error too many per lane
+static int code_checks(int parity, int data_rows) {
+    RsCode code;
+    if (rs_init(&code, parity) != 0) {
+        printf("FAIL parity %d: %s\n", parity, dsp_last_error());
+        return 1;
+    }
+    int rows = data_rows + parity, t = parity / 2;
+    size_t size = (size_t)rows * RS_LANES;
+    uint8_t *block = (uint8_t *)malloc(size), *sent = (uint8_t *)malloc(size), *damaged = (uint8_t *)malloc(size);
+    int failures = encode_block(&code, data_rows, block) != 0;
+    memcpy(sent, block, size);
+
+    for (int errors = 1; errors <= t && failures == 0; errors++) {
+        damage_lanes(block, rows, errors);
+        int failed = rs_decode(&code, block, rows);
+        if (failed != 0 || memcmp(block, sent, size) != 0) {
+            printf("FAIL parity %d, %d rows: %d errors per lane not corrected (%d lanes failed)\n", parity, rows,
+                   errors, failed);
+            failures++;
+        }
+        memcpy(block, sent, size);
+    }
+
+    // A burst of t rows across all lanes, as a run of damaged samples in the audio
+    if (failures == 0) {
+        size_t start = (size_t)(random_byte() % (rows - t + 1)) * RS_LANES + random_byte() % RS_LANES;
+        size_t length = (size_t)t * RS_LANES < size - start ? (size_t)t * RS_LANES : size - start;
+        for (size_t i = start; i < start + length; i++) {
+            block[i] ^= 0xA5;
+        }
+        if (rs_decode(&code, block, rows) != 0 || memcmp(block, sent, size) != 0) {
+            printf("FAIL parity %d, %d rows: a burst of %zu symbols not corrected\n", parity, rows, length);
+            failures++;
+        }
+        memcpy(block, sent, size);
+    }
+
+    // One error too many: a lane reported as failed is left as it came, any other became another codeword
+    int miscorrected = 0;
+    if (failures == 0) {
+        damage_lanes(block, rows, t + 1);
+        memcpy(damaged, block, size);
+        int failed = rs_decode(&code, block, rows);
+        int unchanged = 0, codewords = 0;
+        for (int c = 0; c < RS_LANES; c++) {
+            bool same = true;
+            for (int i = 0; i < rows; i++) {
+                same = same && block[(size_t)i * RS_LANES + c] == damaged[(size_t)i * RS_LANES + c];
+            }
+            uint8_t expected[RS_MAX_PARITY];
+            reference_parity(block + c, data_rows, parity, expected);
+            bool codeword = true;
+            for (int j = 0; j < parity; j++) {
+                codeword = codeword && block[((size_t)data_rows + j) * RS_LANES + c] == expected[j];
+            }
+            unchanged += same;
+            codewords += !same && codeword;
+        }
+        miscorrected = RS_LANES - failed;
+        if (unchanged != failed || codewords != miscorrected ||
+            (parity >= RS_MISCORRECT_PARITY && miscorrected > 0)) {
+            printf("FAIL parity %d, %d rows: %d errors per lane, %d of %d lanes reported as failed, %d left as "
+                   "they were, %d corrected to another codeword\n", parity, rows, t + 1, failed, RS_LANES,
+                   unchanged, codewords);
+            failures++;
+        }
+    }
+    if (failures == 0) {
+        printf("ok   parity %d, %d rows: encoded, up to %d errors per lane and a burst corrected, %d reported in "
+               "%d of %d lanes\n", parity, rows, t, t + 1, RS_LANES - miscorrected, RS_LANES);
+    }
+    free(block);
+    free(sent);
+    free(damaged);
+    return failures;
+}
+
+// The data chunk of a WAV in memory, NULL when there is none
+static uint8_t *wav_data(uint8_t *wav, size_t size, size_t *data_size) {
+    size_t offset = 12;
+    while (offset + 8 <= size) {
+        uint32_t chunk;
+        memcpy(&chunk, wav + offset + 4, 4);
+        if (memcmp(wav + offset, "data", 4) == 0) {
+            *data_size = chunk;
+            return wav + offset + 8;
+        }
+        offset += 8 + chunk + (chunk & 1);
+    }
+    return NULL;
+}
+
+// Raw pixels with FEC through the library, a burst of burst_rows rows of symbols damaged at the start of
+// the data. Up to parity / 2 rows the image comes back exactly, beyond that with a warning.
+static int image_check(int parity, int burst_rows) {
+    uint8_t source[IMAGE_WIDTH * IMAGE_HEIGHT];
+    for (int i = 0; i < IMAGE_WIDTH * IMAGE_HEIGHT; i++) {
+        source[i] = random_byte();
+    }
+    uint8_t *png = NULL, *wav = NULL, *decoded_png = NULL, *decoded = NULL;
+    size_t png_size, wav_size, decoded_size, data_size = 0;
+    int width = 0, height = 0;
+    ConversionOptions options = { .mode = MODE_ARRAY, .encoding = ENCODING_RAW, .fec_parity = parity };
+    ConversionContext ctx;
+    conversion_context_init(&ctx, &options, NULL, NULL);
+
+    int failures = 1;
+    bool correctable = burst_rows <= parity / 2;
+    uint8_t *data;
+    if (write_png_buffer(IMAGE_WIDTH, IMAGE_HEIGHT, source, &png, &png_size) != 0 ||
+        image_to_audio_buffer(&ctx, png, png_size, &wav, &wav_size) != CONVERSION_OK ||
+        (data = wav_data(wav, wav_size, &data_size)) == NULL) {
+        printf("FAIL FEC parity %d: couldn't encode, %s\n", parity, ctx.error);
+    } else {
+        for (int i = 0; i < burst_rows * RS_LANES; i++) {
+            data[2 * i + 1] ^= 0x5A; // the high byte of a 16-bit sample carries the symbol
+        }
+        if (audio_to_image_buffer(&ctx, wav, wav_size, &decoded_png, &decoded_size) != CONVERSION_OK ||
+            read_png_buffer(decoded_png, decoded_size, &width, &height, &decoded) != 0 ||
+            width != IMAGE_WIDTH || height != IMAGE_HEIGHT) {
+            printf("FAIL FEC parity %d, burst of %d rows: couldn't decode, %s\n", parity, burst_rows, ctx.error);
+        } else {
+            int wrong = 0;
+            for (int i = 0; i < IMAGE_WIDTH * IMAGE_HEIGHT; i++) {
+                wrong += decoded[(size_t)i * 4] != source[i];
+            }
+            int warnings = atomic_load(&ctx.warnings);
+            if (correctable ? wrong != 0 || warnings != 0 : wrong == 0 || warnings == 0) {
+                printf("FAIL FEC parity %d, burst of %d rows: %d wrong pixels, %d warnings\n", parity, burst_rows,
+                       wrong, warnings);
+            } else {
+                failures = 0;
+                printf("ok   FEC parity %d, burst of %d rows: %s\n", parity, burst_rows,
+                       correctable ? "the image came back exactly" : ctx.warning);
+            }
+        }
+    }
+
+    conversion_context_free(&ctx);
+    free(png);
+    free(wav);
+    free(decoded_png);
+    free(decoded);
+    return failures;
+}
+
+int main(void) {
+    static const int parities[] = { 2, 4, 8, 16, 32, 63, 64 };
+#ifdef __SSSE3__
+    printf("Reed-Solomon with SSSE3\n");
+#else
+    printf("Reed-Solomon without SSSE3\n");
+#endif
+    gf_init();
+    int failed = 0;
+    for (size_t p = 0; p < sizeof(parities) / sizeof(parities[0]); p++) {
+        int parity = parities[p];
+        int sizes[] = { 1, 17, 255 - parity };
+        for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+            failed += code_checks(parity, sizes[s]) != 0;
+        }
+    }
+    failed += image_check(16, 8) != 0;
+    failed += image_check(16, 9) != 0;
+    failed += image_check(32, 16) != 0;
+    printf(failed ? "%d Reed-Solomon checks failed\n" : "All Reed-Solomon checks passed\n", failed);
+    return failed ? 1 : 0;
+}
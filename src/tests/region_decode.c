@@ -0,0 +1,210 @@
+// Regions decoded from raw grayscale WAVs at the pixel rate, 8, 16 and 32-bit, with their "w2ix" row index
+// and with it renamed away. Each region has to match the same crop of the whole image decoded, regions on
+// the right and bottom edges and reaching past them included, and ctx->num_samples shows that only the rows
+// and columns under the region were read: the region itself without the index, its whole tiles with it.
+// Last, a damaged sample under a region has to be reported by the index through ctx->warnings.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "wave2img.h"
+
+#define IMAGE_WIDTH 200                // neither side a whole number of INDEX_TILE tiles
+#define IMAGE_HEIGHT 150
+
+typedef struct {
+    int x, y, width, height;           // as the options take them, 0 reaching to the edge
+} Region;
+
+static const Region regions[] = {
+    { 10, 20, 50, 40 },                // inside one row of tiles
+    { 64, 64, 64, 64 },                // exactly one tile
+    { 150, 30, 0, 0 },                 // to the right and bottom edges
+    { 5, 100, 60, 0 },                 // to the bottom edge
+    { 130, 10, 500, 20 },              // wider than the image, cut at the right edge
+    { 199, 149, 1, 1 },                // the last pixel
+    { 0, 0, IMAGE_WIDTH, 1 },          // the first row
+};
+
+// Contents of the first chunk tagged tag in a WAV in memory, NULL when there is none. A raw 16-bit WAV in
+// the original layout has the width and height ahead of its samples, 8 data bytes its size doesn't count.
+static uint8_t *find_chunk(uint8_t *wav, size_t size, const char *tag, bool legacy) {
+    size_t offset = 12;
+    while (offset + 8 <= size) {
+        uint32_t chunk;
+        memcpy(&chunk, wav + offset + 4, 4);
+        if (memcmp(wav + offset, tag, 4) == 0) {
+            return wav + offset + 8;
+        }
+        offset += 8 + (size_t)chunk + (chunk & 1) + (legacy && memcmp(wav + offset, "data", 4) == 0 ? 8 : 0);
+    }
+    return NULL;
+}
+
+// Decode the region of wav to gray pixels, NULL with a message when it fails
+static uint8_t *decode(const uint8_t *wav, size_t wav_size, const Region *region, int *width, int *height,
+                       int64_t *samples, int *warnings, char *warning) {
+    ConversionOptions options = { .mode = MODE_ARRAY, .region_x = region->x, .region_y = region->y,
+                                  .region_width = region->width, .region_height = region->height };
+    ConversionContext ctx;
+    conversion_context_init(&ctx, &options, NULL, NULL);
+    uint8_t *png = NULL, *rgba = NULL, *gray = NULL;
+    size_t png_size;
+    if (audio_to_image_buffer(&ctx, wav, wav_size, &png, &png_size) != CONVERSION_OK ||
+        read_png_buffer(png, png_size, width, height, &rgba) != 0) {
+        printf("FAIL region %d,%d %dx%d: %s\n", region->x, region->y, region->width, region->height, ctx.error);
+    } else {
+        gray = (uint8_t *)malloc((size_t)*width * *height);
+        for (size_t i = 0; i < (size_t)*width * *height; i++) {
+            gray[i] = rgba[i * 4];
+        }
+        *samples = ctx.num_samples;
+        *warnings = atomic_load(&ctx.warnings);
+        memcpy(warning, ctx.warning, CONVERSION_ERROR_SIZE);
+    }
+    conversion_context_free(&ctx);
+    free(png);
+    free(rgba);
+    return gray;
+}
+
+// The region against the crop of the full decode, and the samples read for it
+static int region_check(const uint8_t *wav, size_t wav_size, const uint8_t *full, int bits, bool indexed,
+                        const Region *region) {
+    int x1 = region->width > 0 && region->x + region->width < IMAGE_WIDTH ? region->x + region->width : IMAGE_WIDTH;
+    int y1 = region->height > 0 && region->y + region->height < IMAGE_HEIGHT ? region->y + region->height
+                                                                             : IMAGE_HEIGHT;
+    int width = 0, height = 0, warnings = 0;
+    int64_t samples = 0;
+    char warning[CONVERSION_ERROR_SIZE];
+    uint8_t *pixels = decode(wav, wav_size, region, &width, &height, &samples, &warnings, warning);
+    if (pixels == NULL) {
+        return 1;
+    }
+
+    // Whole tiles are read with the index, clipped to the image
+    int tile = indexed ? INDEX_TILE : 1;
+    int read_x0 = region->x / tile * tile, read_y0 = region->y / tile * tile;
+    int read_x1 = (x1 + tile - 1) / tile * tile, read_y1 = (y1 + tile - 1) / tile * tile;
+    read_x1 = read_x1 < IMAGE_WIDTH ? read_x1 : IMAGE_WIDTH;
+    read_y1 = read_y1 < IMAGE_HEIGHT ? read_y1 : IMAGE_HEIGHT;
+    int64_t expected = (int64_t)(read_x1 - read_x0) * (read_y1 - read_y0);
+
+    int wrong = 0;
+    if (width == x1 - region->x && height == y1 - region->y) {
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                wrong += pixels[(size_t)y * width + x] != full[(size_t)(region->y + y) * IMAGE_WIDTH + region->x + x];
+            }
+        }
+    }
+    int failures = 0;
+    const char *index = indexed ? "with w2ix" : "without w2ix";
+    if (width != x1 - region->x || height != y1 - region->y || wrong > 0 || samples != expected || warnings > 0) {
+        printf("FAIL %d-bit %s, region %d,%d %dx%d: %dx%d, %d pixels differ from the full decode, %lld samples "
+               "read of %lld, %d warnings\n", bits, index, region->x, region->y, region->width, region->height,
+               width, height, wrong, (long long)samples, (long long)expected, warnings);
+        failures++;
+    } else {
+        printf("ok   %d-bit %s, region %d,%d %dx%d: %dx%d from %lld samples\n", bits, index, region->x, region->y,
+               region->width, region->height, width, height, (long long)samples);
+    }
+    free(pixels);
+    return failures;
+}
+
+// A byte flipped under the region, the index has to report its tile
+static int damage_check(uint8_t *wav, size_t wav_size, int bits) {
+    bool legacy = bits == 16;
+    int sample_bytes = bits / 8;
+    uint8_t *data = find_chunk(wav, wav_size, "data", legacy);
+    size_t row_offset = legacy ? 2 * sizeof(int) : 0;
+    Region region = { 70, 80, 40, 30 };
+    int x = 100, y = 100;              // in the tile at 64,64
+    size_t byte = row_offset + ((size_t)y * IMAGE_WIDTH + x) * sample_bytes + sample_bytes - 1;
+    data[byte] ^= 0x10;
+
+    int width = 0, height = 0, warnings = 0;
+    int64_t samples = 0;
+    char warning[CONVERSION_ERROR_SIZE];
+    uint8_t *pixels = decode(wav, wav_size, &region, &width, &height, &samples, &warnings, warning);
+    data[byte] ^= 0x10;
+    if (pixels == NULL) {
+        return 1;
+    }
+    free(pixels);
+    const char *expected = "1 tiles of the region don't match their checksums, the first at pixels 64,64.";
+    if (warnings != 1 || strcmp(warning, expected) != 0) {
+        printf("FAIL %d-bit damaged tile: %d warnings, \"%s\"\n", bits, warnings, warning);
+        return 1;
+    }
+    printf("ok   %d-bit damaged tile: %s\n", bits, warning);
+    return 0;
+}
+
+// Encode the image at bits, then decode regions of it with and without its index
+static int bits_checks(const uint8_t *png, size_t png_size, int bits) {
+    ConversionOptions options = { .mode = MODE_ARRAY, .encoding = ENCODING_RAW, .bits_per_sample = bits };
+    ConversionContext ctx;
+    conversion_context_init(&ctx, &options, NULL, NULL);
+    uint8_t *wav = NULL;
+    size_t wav_size;
+    int result = image_to_audio_buffer(&ctx, png, png_size, &wav, &wav_size);
+    if (result != CONVERSION_OK) {
+        printf("FAIL %d-bit: couldn't encode, %s\n", bits, ctx.error);
+    }
+    conversion_context_free(&ctx);
+    if (result != CONVERSION_OK) {
+        return 1;
+    }
+
+    int failures = 0, width = 0, height = 0, warnings = 0;
+    int64_t samples = 0;
+    char warning[CONVERSION_ERROR_SIZE];
+    Region whole = { 0, 0, 0, 0 };
+    uint8_t *full = decode(wav, wav_size, &whole, &width, &height, &samples, &warnings, warning);
+    uint8_t *index = find_chunk(wav, wav_size, "w2ix", bits == 16);
+    if (full == NULL || index == NULL || width != IMAGE_WIDTH || height != IMAGE_HEIGHT) {
+        printf("FAIL %d-bit: the whole image doesn't decode or the WAV has no w2ix chunk\n", bits);
+        free(full);
+        free(wav);
+        return 1;
+    }
+    for (int indexed = 1; indexed >= 0; indexed--) {
+        if (!indexed) {
+            memcpy(index - 8, "junk", 4); // an unknown chunk, skipped by the reader
+        }
+        for (size_t r = 0; r < sizeof(regions) / sizeof(regions[0]); r++) {
+            failures += region_check(wav, wav_size, full, bits, indexed, &regions[r]);
+        }
+        if (indexed) {
+            failures += damage_check(wav, wav_size, bits);
+        }
+    }
+    free(full);
+    free(wav);
+    return failures;
+}
+
+int main(void) {
+    static const int bit_sizes[] = { 8, 16, 32 };
+    uint8_t *pixels = (uint8_t *)malloc((size_t)IMAGE_WIDTH * IMAGE_HEIGHT);
+    uint32_t state = 1;
+    for (size_t i = 0; i < (size_t)IMAGE_WIDTH * IMAGE_HEIGHT; i++) {
+        state = state * 1103515245u + 12345u;
+        pixels[i] = (uint8_t)(state >> 16);
+    }
+    uint8_t *png = NULL;
+    size_t png_size;
+    int failed = 0;
+    if (write_png_buffer(IMAGE_WIDTH, IMAGE_HEIGHT, pixels, &png, &png_size) != 0) {
+        printf("FAIL couldn't write the test image\n");
+        failed++;
+    }
+    for (size_t b = 0; b < sizeof(bit_sizes) / sizeof(bit_sizes[0]) && failed == 0; b++) {
+        failed += bits_checks(png, png_size, bit_sizes[b]);
+    }
+    free(pixels);
+    free(png);
+    printf(failed ? "%d region checks failed\n" : "All region checks passed\n", failed);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,158 @@
+// verify_stream on WAVs encoded to memory at 8, 16 and 32 bits, raw and framed. 16-bit raw keeps the original
+// layout without a "w2im" chunk, everything else has one. A clean file has to pass, then one byte is flipped
+// at a time: in the data, in the "w2im" chunk, and in the "w2ck" chunk's version, whole-data checksum and
+// block checksums. Each has to fail with the message naming what was damaged. The images take at least two
+// checksum blocks at every bit size, the damage goes in the second.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "wave2img.h"
+
+#define IMAGE_WIDTH 1100
+#define IMAGE_HEIGHT 1000
+#define FRAME_ROWS 50
+
+typedef enum { DAMAGE_NONE, DAMAGE_DATA, DAMAGE_METADATA, DAMAGE_CHECK_VERSION, DAMAGE_DATA_CRC,
+               DAMAGE_BLOCK_CRC, DAMAGE_COUNT } Damage;
+
+static const char *damage_names[] = { "clean", "data byte", "w2im byte", "w2ck version", "w2ck data checksum",
+                                      "w2ck block checksum" };
+
+// Contents of the first chunk tagged tag in a WAV in memory, NULL when there is none. A raw 16-bit WAV in
+// the original layout has the width and height ahead of its samples, 8 data bytes its size doesn't count.
+static uint8_t *find_chunk(uint8_t *wav, size_t size, const char *tag, bool legacy, uint32_t *chunk_size) {
+    size_t offset = 12;
+    while (offset + 8 <= size) {
+        uint32_t chunk;
+        memcpy(&chunk, wav + offset + 4, 4);
+        if (memcmp(wav + offset, tag, 4) == 0) {
+            *chunk_size = chunk;
+            return wav + offset + 8;
+        }
+        offset += 8 + (size_t)chunk + (chunk & 1) + (legacy && memcmp(wav + offset, "data", 4) == 0 ? 8 : 0);
+    }
+    return NULL;
+}
+
+// The WAV of a random image, encoded from a PNG source to a memory sink
+static int encode_wav(int bits, bool framed, const uint8_t *png, size_t png_size, ByteSink *wav) {
+    ConversionOptions options = { .mode = MODE_ARRAY, .encoding = ENCODING_RAW, .bits_per_sample = bits,
+                                  .frame_rows = framed ? FRAME_ROWS : 0 };
+    ConversionContext ctx;
+    conversion_context_init(&ctx, &options, NULL, NULL);
+    ByteSource source;
+    byte_source_memory(&source, png, png_size);
+    byte_sink_memory(wav);
+    int result = encode_stream(&ctx, &source, wav);
+    if (result != CONVERSION_OK) {
+        printf("FAIL %d-bit %s: couldn't encode, %s\n", bits, framed ? "framed" : "raw", ctx.error);
+    }
+    conversion_context_free(&ctx);
+    return result;
+}
+
+// Flip one byte of a copy of the WAV for damage and check what verify_stream makes of it
+static int verify_check(const ByteSink *wav, int bits, bool framed, Damage damage) {
+    const char *layout = framed ? "framed" : "raw";
+    uint8_t *copy = (uint8_t *)malloc(wav->size);
+    memcpy(copy, wav->data, wav->size);
+    uint32_t data_size = 0, metadata_size = 0, check_size = 0;
+    bool legacy = !framed && bits == 16;
+    uint8_t *data = find_chunk(copy, wav->size, "data", legacy, &data_size);
+    uint8_t *metadata = find_chunk(copy, wav->size, "w2im", legacy, &metadata_size);
+    uint8_t *check = find_chunk(copy, wav->size, "w2ck", legacy, &check_size);
+    if (data == NULL || check == NULL || (legacy ? metadata != NULL : metadata == NULL)) {
+        printf("FAIL %d-bit %s: the WAV has the wrong chunks\n", bits, layout);
+        free(copy);
+        return 1;
+    }
+    if (damage == DAMAGE_METADATA && metadata == NULL) {
+        free(copy);
+        return 0; // the original layout has no "w2im" chunk to damage
+    }
+    ChecksumHeader header;
+    memcpy(&header, check, sizeof(header));
+    // The damage is put in the second block, which is cut short at the end of the data
+    unsigned long long second = CHECKSUM_BLOCK_SIZE;
+    unsigned long long last = header.data_bytes < 2 * second ? header.data_bytes - 1 : 2 * second - 1;
+
+    char expected[CONVERSION_ERROR_SIZE] = "";
+    switch (damage) {
+    case DAMAGE_DATA:
+        data[CHECKSUM_BLOCK_SIZE + 12345] ^= 0x01;
+        snprintf(expected, sizeof(expected), "Data bytes %llu to %llu are damaged.", second, last);
+        break;
+    case DAMAGE_METADATA:
+        metadata[offsetof(ImageMetadata, height)] ^= 0x80;
+        snprintf(expected, sizeof(expected), "The \"w2im\" description is damaged.");
+        break;
+    case DAMAGE_CHECK_VERSION:
+        check[offsetof(ChecksumHeader, version)] ^= 0x01;
+        snprintf(expected, sizeof(expected), "The checksum chunk is damaged.");
+        break;
+    case DAMAGE_DATA_CRC:
+        check[offsetof(ChecksumHeader, data_crc) + 2] ^= 0x40;
+        snprintf(expected, sizeof(expected), "The WAV data is damaged.");
+        break;
+    case DAMAGE_BLOCK_CRC:
+        check[sizeof(ChecksumHeader) + sizeof(uint32_t)] ^= 0x04;
+        snprintf(expected, sizeof(expected), "Data bytes %llu to %llu are damaged.", second, last);
+        break;
+    default:
+        break;
+    }
+
+    ConversionOptions options = { 0 };
+    ConversionContext ctx;
+    conversion_context_init(&ctx, &options, NULL, NULL);
+    ByteSource source;
+    byte_source_memory(&source, copy, wav->size);
+    int result = verify_stream(&ctx, &source);
+    int want = damage == DAMAGE_NONE ? CONVERSION_OK : CONVERSION_ERROR;
+    int failures = 0;
+    if (result != want || strcmp(ctx.error, expected) != 0) {
+        printf("FAIL %d-bit %s, %s: result %d, \"%s\", expected %d, \"%s\"\n", bits, layout,
+               damage_names[damage], result, ctx.error, want, expected);
+        failures++;
+    } else {
+        printf("ok   %d-bit %s, %s: %s\n", bits, layout, damage_names[damage],
+               damage == DAMAGE_NONE ? "passed" : ctx.error);
+    }
+    conversion_context_free(&ctx);
+    free(copy);
+    return failures;
+}
+
+int main(void) {
+    static const int bit_sizes[] = { 8, 16, 32 };
+    uint8_t *pixels = (uint8_t *)malloc((size_t)IMAGE_WIDTH * IMAGE_HEIGHT);
+    uint32_t state = 1;
+    for (size_t i = 0; i < (size_t)IMAGE_WIDTH * IMAGE_HEIGHT; i++) {
+        state = state * 1103515245u + 12345u;
+        pixels[i] = (uint8_t)(state >> 16);
+    }
+    uint8_t *png = NULL;
+    size_t png_size;
+    int failed = 0;
+    if (write_png_buffer(IMAGE_WIDTH, IMAGE_HEIGHT, pixels, &png, &png_size) != 0) {
+        printf("FAIL couldn't write the test image\n");
+        failed++;
+    }
+    for (size_t b = 0; b < sizeof(bit_sizes) / sizeof(bit_sizes[0]) && failed == 0; b++) {
+        for (int framed = 0; framed <= 1; framed++) {
+            ByteSink wav;
+            if (encode_wav(bit_sizes[b], framed, png, png_size, &wav) != CONVERSION_OK) {
+                failed++;
+            } else {
+                for (int damage = DAMAGE_NONE; damage < DAMAGE_COUNT; damage++) {
+                    failed += verify_check(&wav, bit_sizes[b], framed, (Damage)damage) != 0;
+                }
+            }
+            free(wav.data);
+        }
+    }
+    free(pixels);
+    free(png);
+    printf(failed ? "%d verify checks failed\n" : "All verify checks passed\n", failed);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,6580 @@
+// Wave2Image conversion library
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <math.h>
+#include <setjmp.h>
+#include <pthread.h>
+#include <sched.h>
+#include <png.h>
+#ifdef _WIN32
+#include <io.h>    // _setmode for binary stdin / stdout
+#include <fcntl.h>
+#include <windows.h>
+#define fseek64 _fseeki64
+#define ftell64 _ftelli64
+#else
+#include <unistd.h>
+#define fseek64 fseeko
+#define ftell64 ftello
+#endif
+
+#include "wave2img.h"
+#include "dsp.h"
+#include "flac.h"
+
+// Prepare a context for one conversion with the given options
+void conversion_context_init(ConversionContext *ctx, const ConversionOptions *options,
+                             ProgressCallback progress, void *progress_data) {
+    memset(ctx, 0, sizeof(*ctx));
+    if (options) {
+        ctx->options = *options;
+    }
+    if (ctx->options.sample_rate <= 0) {
+        ctx->options.sample_rate = SAMPLE_RATE;
+    }
+    if (ctx->options.mode == MODE_NONE) {
+        ctx->options.mode = MODE_ARRAY;
+    }
+    if (ctx->options.color < COLOR_GRAY || ctx->options.color > COLOR_RGBA) {
+        ctx->options.color = COLOR_GRAY;
+    }
+    if (ctx->options.color_layout != COLOR_LAYOUT_CHANNELS) {
+        ctx->options.color_layout = COLOR_LAYOUT_ROWS;
+    }
+    if (ctx->options.pixels_per_second <= 0) {
+        // Colour channels go out a frame per pixel, they aren't resampled
+        ctx->options.pixels_per_second = ctx->options.encoding == ENCODING_APT ? APT_PIXELS_PER_SECOND
+                                       : ctx->options.encoding == ENCODING_SPECTROGRAM ? SPECTROGRAM_PIXELS_PER_SECOND
+                                       : ctx->options.color_layout == COLOR_LAYOUT_CHANNELS ? ctx->options.sample_rate
+                                       : SAMPLE_RATE;
+    }
+    if (ctx->options.frame_rows < 0) {
+        ctx->options.frame_rows = 0;
+    }
+    if (ctx->options.fec_parity < 0) {
+        ctx->options.fec_parity = 0;
+    }
+    if (ctx->options.order < ORDER_RASTER || ctx->options.order > ORDER_HILBERT) {
+        ctx->options.order = ORDER_RASTER;
+    }
+    if (ctx->options.predictor < PREDICT_NONE || ctx->options.predictor > PREDICT_ADAPTIVE) {
+        ctx->options.predictor = PREDICT_NONE;
+    }
+    if (ctx->options.max_seconds < 0) {
+        ctx->options.max_seconds = 0;
+    }
+    if (ctx->options.max_samples < 0) {
+        ctx->options.max_samples = 0;
+    }
+    if (ctx->options.region_x < 0 || ctx->options.region_y < 0 || ctx->options.region_width < 0 ||
+        ctx->options.region_height < 0) {
+        ctx->options.region_x = ctx->options.region_y = ctx->options.region_width = ctx->options.region_height = 0;
+    }
+    if (ctx->options.bits_per_sample != 8 && ctx->options.bits_per_sample != 32) {
+        ctx->options.bits_per_sample = 16;
+    }
+    ctx->progress = progress;
+    ctx->progress_data = progress_data;
+    atomic_init(&ctx->cancel_requested, 0);
+    atomic_init(&ctx->warnings, 0);
+}
+
+// Release the buffers held by a context
+void conversion_context_free(ConversionContext *ctx) {
+    free(ctx->pixels);
+    free(ctx->samples);
+    ctx->pixels = NULL;
+    ctx->samples = NULL;
+    ctx->width = ctx->height = ctx->num_samples = 0;
+}
+
+// Ask a running conversion to stop, safe to call from another thread
+void conversion_cancel(ConversionContext *ctx) {
+    atomic_store(&ctx->cancel_requested, 1);
+}
+
+static bool conversion_cancelled(ConversionContext *ctx) {
+    return atomic_load(&ctx->cancel_requested) != 0;
+}
+
+// The first error of the conversion running on this thread, handed to its context when it fails
+static _Thread_local char thread_error[CONVERSION_ERROR_SIZE];
+
+// A failure in dsp.c comes before the errors of the callers it makes fail, so its message is the first one
+static void conversion_take_dsp_error(void) {
+    if (thread_error[0] == '\0' && dsp_last_error()[0] != '\0') {
+        snprintf(thread_error, sizeof(thread_error), "%s", dsp_last_error());
+    }
+}
+
+// Keep the first error of the conversion for its context, the library itself prints nothing
+static void conversion_error(const char *format, ...) {
+    va_list args;
+    conversion_take_dsp_error();
+    if (thread_error[0] == '\0') {
+        va_start(args, format);
+        vsnprintf(thread_error, sizeof(thread_error), format, args);
+        va_end(args);
+        thread_error[strcspn(thread_error, "\n")] = '\0';
+    }
+}
+
+// Damage a conversion gets past, counted in the context with the first message kept. Safe from workers.
+static void conversion_warning(ConversionContext *ctx, const char *format, ...) {
+    if (atomic_fetch_add(&ctx->warnings, 1) == 0) {
+        va_list args;
+        va_start(args, format);
+        vsnprintf(ctx->warning, sizeof(ctx->warning), format, args);
+        va_end(args);
+        ctx->warning[strcspn(ctx->warning, "\n")] = '\0';
+    }
+}
+
+// Start of a conversion called by the application, errors and warnings are collected from here on
+static void conversion_begin(ConversionContext *ctx) {
+    thread_error[0] = '\0';
+    dsp_clear_error();
+    ctx->error[0] = '\0';
+    atomic_store(&ctx->warnings, 0);
+    ctx->warning[0] = '\0';
+}
+
+// End of a conversion called by the application: a failure leaves its message in the context. Errors of
+// worker threads stay on their thread, those conversions get a general message.
+static int conversion_end(ConversionContext *ctx, int result) {
+    conversion_take_dsp_error();
+    if (result == CONVERSION_ERROR && ctx->error[0] == '\0') {
+        snprintf(ctx->error, sizeof(ctx->error), "%s", thread_error[0] ? thread_error : "The conversion failed.");
+    }
+    return result;
+}
+
+static void conversion_report(ConversionContext *ctx, double fraction) {
+    if (ctx->progress) {
+        ctx->progress(fraction, ctx->progress_data);
+    }
+}
+
+// -------------------------------------------------------------------------------------------------------- streams
+
+// Open a file for reading, "-" means stdin
+FILE *open_input_file(const char *path) {
+    if (strcmp(path, "-") == 0) {
+#ifdef _WIN32
+        _setmode(_fileno(stdin), _O_BINARY);
+#endif
+        return stdin;
+    }
+    return fopen(path, "rb");
+}
+
+// Open a file for writing, "-" means stdout
+FILE *open_output_file(const char *path) {
+    if (strcmp(path, "-") == 0) {
+#ifdef _WIN32
+        _setmode(_fileno(stdout), _O_BINARY);
+#endif
+        return stdout;
+    }
+    return fopen(path, "wb");
+}
+
+// Close a file from open_input_file / open_output_file, stdin and stdout are only flushed
+int close_file(FILE *file) {
+    if (file == stdin) {
+        return 0;
+    }
+    if (file == stdout) {
+        return fflush(file);
+    }
+    return fclose(file);
+}
+
+// Close an output from open_output_file, a failed close failing the conversion. A file the conversion
+// failed or was cancelled on is removed, so no truncated output is left behind under the name asked for.
+static int close_output_file(FILE *file, const char *path, int result) {
+    if (close_file(file) != 0 && result == CONVERSION_OK) {
+        conversion_error("Couldn't write %s.\n", path);
+        result = CONVERSION_ERROR;
+    }
+    if (result != CONVERSION_OK && file != stdout) {
+        remove(path);
+    }
+    return result;
+}
+
+void byte_source_file(ByteSource *source, FILE *file) {
+    memset(source, 0, sizeof(*source));
+    source->file = file;
+}
+
+void byte_source_memory(ByteSource *source, const uint8_t *data, size_t size) {
+    memset(source, 0, sizeof(*source));
+    source->data = data;
+    source->size = size;
+}
+
+// Read up to size bytes, returns how many were read (short only at the end of the stream)
+size_t byte_source_read(ByteSource *source, void *out, size_t size) {
+    size_t count;
+    if (source->read) {
+        count = source->read(source->state, out, size);
+    } else if (source->file) {
+        count = fread(out, 1, size, source->file);
+    } else {
+        count = source->size - source->offset < size ? source->size - source->offset : size;
+        memcpy(out, source->data + source->offset, count);
+    }
+    source->offset += count;
+    return count;
+}
+
+// Skip bytes by reading them, so pipes work too
+bool byte_source_skip(ByteSource *source, size_t size) {
+    uint8_t scratch[BUFFER_SIZE];
+    while (size > 0) {
+        size_t chunk = size < sizeof(scratch) ? size : sizeof(scratch);
+        if (byte_source_read(source, scratch, chunk) != chunk) {
+            return false;
+        }
+        size -= chunk;
+    }
+    return true;
+}
+
+// Move to offset bytes from where the source started. Files and memory only, false for pipes and decoders.
+bool byte_source_seek(ByteSource *source, size_t offset) {
+    if (source->read) {
+        return false;
+    }
+    if (source->file) {
+        if (fseek64(source->file, (int64_t)offset - (int64_t)source->offset, SEEK_CUR) != 0) {
+            return false;
+        }
+    } else if (offset > source->size) {
+        return false;
+    }
+    source->offset = offset;
+    return true;
+}
+
+void byte_sink_file(ByteSink *sink, FILE *file) {
+    memset(sink, 0, sizeof(*sink));
+    sink->file = file;
+    // Pipes and terminals can't seek, their headers are left provisional
+    sink->seekable = ftell64(file) >= 0 && fseek64(file, 0, SEEK_CUR) == 0;
+}
+
+void byte_sink_memory(ByteSink *sink) {
+    memset(sink, 0, sizeof(*sink));
+    sink->seekable = true;
+}
+
+int byte_sink_write(ByteSink *sink, const void *data, size_t size) {
+    if (sink->failed) {
+        return -1;
+    }
+    if (sink->file) {
+        if (fwrite(data, 1, size, sink->file) != size) {
+            sink->failed = true;
+            return -1;
+        }
+    } else {
+        if (sink->size + size > sink->capacity) {
+            size_t capacity = sink->capacity ? sink->capacity * 2 : 8192;
+            while (capacity < sink->size + size) {
+                capacity *= 2;
+            }
+            uint8_t *grown = (uint8_t *)realloc(sink->data, capacity);
+            if (grown == NULL) {
+                sink->failed = true;
+                return -1;
+            }
+            sink->data = grown;
+            sink->capacity = capacity;
+        }
+        memcpy(sink->data + sink->size, data, size);
+    }
+    sink->size += size;
+    return 0;
+}
+
+// Overwrite bytes that were already written, used to fix up headers at the end
+int byte_sink_patch(ByteSink *sink, size_t offset, const void *data, size_t size) {
+    if (!sink->seekable || offset + size > sink->size) {
+        return -1;
+    }
+    if (!sink->file) {
+        memcpy(sink->data + offset, data, size);
+        return 0;
+    }
+    // Relative to the end of what was written, 64-bit so files past 2 GB are patched where long is 32-bit
+    int64_t back = (int64_t)(sink->size - offset);
+    if (fseek64(sink->file, -back, SEEK_CUR) != 0 || fwrite(data, 1, size, sink->file) != size) {
+        sink->failed = true;
+        return -1;
+    }
+    return fseek64(sink->file, back - (int64_t)size, SEEK_CUR);
+}
+
+// -------------------------------------------------------------------------------------------------------- wav header
+
+// Size of the "w2im" chunk in the file, 0 when there is none
+static size_t metadata_chunk_size(const ImageMetadata *metadata) {
+    return metadata && metadata->version != 0 ? 8 + sizeof(ImageMetadata) : 0;
+}
+
+// Size of the "w2ck" chunk after data_bytes of WAV data, with the pad byte keeping it at an even offset
+static size_t checksum_chunk_size(size_t data_bytes) {
+    size_t blocks = (data_bytes + CHECKSUM_BLOCK_SIZE - 1) / CHECKSUM_BLOCK_SIZE;
+    return (data_bytes & 1) + 8 + sizeof(ChecksumHeader) + blocks * sizeof(uint32_t);
+}
+
+// Whether num_samples fit the container of the options: a WAV keeps its RIFF size, "w2im" and "w2ck" chunks
+// included, in 32 bits, FLAC counts samples in 36
+static bool audio_size_fits(const ConversionOptions *options, uint64_t num_samples) {
+    int bytes = options->bits_per_sample / 8;
+    if (options->container == CONTAINER_FLAC) {
+        return num_samples < (uint64_t)1 << 36;
+    }
+    if (num_samples > UINT32_MAX / bytes) {
+        return false;
+    }
+    uint64_t data_bytes = num_samples * bytes;
+    return sizeof(WavHeader) - 8 + 8 + sizeof(ImageMetadata) + data_bytes + checksum_chunk_size((size_t)data_bytes)
+           <= UINT32_MAX;
+}
+
+// Checksums of WAV data as it goes by, whole and per block of CHECKSUM_BLOCK_SIZE bytes
+typedef struct {
+    ChecksumHeader check;   // data bytes, checksum of all of them and finished blocks so far
+    uint32_t block_crc;     // of the block not finished yet
+    uint32_t *block_crcs;
+    size_t capacity;
+} ChecksumState;
+
+static int checksum_end_block(ChecksumState *state) {
+    if (state->check.blocks == state->capacity) {
+        size_t capacity = state->capacity ? state->capacity * 2 : 64;
+        uint32_t *grown = (uint32_t *)realloc(state->block_crcs, capacity * sizeof(uint32_t));
+        if (grown == NULL) {
+            conversion_error("Couldn't allocate memory for checksums.\n");
+            return -1;
+        }
+        state->block_crcs = grown;
+        state->capacity = capacity;
+    }
+    state->block_crcs[state->check.blocks++] = state->block_crc;
+    state->block_crc = 0;
+    return 0;
+}
+
+static int checksum_update(ChecksumState *state, const void *data, size_t size) {
+    const uint8_t *bytes = (const uint8_t *)data;
+    state->check.data_crc = crc32c_update(state->check.data_crc, bytes, size);
+    while (size > 0) {
+        size_t room = CHECKSUM_BLOCK_SIZE - state->check.data_bytes % CHECKSUM_BLOCK_SIZE;
+        size_t take = size < room ? size : room;
+        state->block_crc = crc32c_update(state->block_crc, bytes, take);
+        state->check.data_bytes += (uint32_t)take;
+        bytes += take;
+        size -= take;
+        if (take == room && checksum_end_block(state) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Close the last, shorter block once all the data went by
+static int checksum_finish(ChecksumState *state) {
+    state->check.version = CHECKSUM_VERSION;
+    state->check.block_size = CHECKSUM_BLOCK_SIZE;
+    return state->check.data_bytes % CHECKSUM_BLOCK_SIZE != 0 ? checksum_end_block(state) : 0;
+}
+
+// Tile checksums of raw rows as they go by, for the "w2ix" chunk
+typedef struct {
+    RowIndexHeader index;
+    uint64_t position;      // image bytes so far
+    uint32_t *tile_crcs;    // all tiles, those of the current row of tiles still being added to
+} RowIndexState;
+
+// The index of width x height pixels of sample_bytes each, behind row_offset bytes of the data
+static void row_index_header(RowIndexHeader *index, int width, int height, int sample_bytes, uint32_t row_offset) {
+    index->version = INDEX_VERSION;
+    index->width = width;
+    index->height = height;
+    index->row_offset = row_offset;
+    index->row_bytes = (uint32_t)width * sample_bytes;
+    index->sample_bytes = sample_bytes;
+    index->tile = INDEX_TILE;
+    index->tiles = (uint32_t)(((width + INDEX_TILE - 1) / INDEX_TILE) * ((height + INDEX_TILE - 1) / INDEX_TILE));
+}
+
+static int row_index_init(RowIndexState *state, int width, int height, int sample_bytes, uint32_t row_offset) {
+    const RowIndexHeader *index = &state->index;
+    row_index_header(&state->index, width, height, sample_bytes, row_offset);
+    state->position = 0;
+    state->tile_crcs = (uint32_t *)calloc(index->tiles, sizeof(uint32_t));
+    if (state->tile_crcs == NULL) {
+        conversion_error("Couldn't allocate memory for the row index.\n");
+        return -1;
+    }
+    return 0;
+}
+
+static void row_index_update(RowIndexState *state, const void *data, size_t size) {
+    const RowIndexHeader *index = &state->index;
+    const uint8_t *bytes = (const uint8_t *)data;
+    uint64_t end = (uint64_t)index->row_bytes * index->height;
+    size_t tile_bytes = (size_t)index->tile * index->sample_bytes;
+    size_t tiles_across = (index->width + index->tile - 1) / index->tile;
+    while (size > 0 && state->position < end) {
+        size_t row = (size_t)(state->position / index->row_bytes);
+        size_t column = (size_t)(state->position % index->row_bytes);
+        size_t room = tile_bytes - column % tile_bytes;
+        if (room > index->row_bytes - column) {
+            room = index->row_bytes - column;
+        }
+        size_t take = size < room ? size : room;
+        uint32_t *crc = &state->tile_crcs[row / index->tile * tiles_across + column / tile_bytes];
+        *crc = crc32c_update(*crc, bytes, take);
+        state->position += take;
+        bytes += take;
+        size -= take;
+    }
+}
+
+// The rest of a RIFF/WAVE header once its "RIFF" tag has been read, up to the start of the data chunk.
+// metadata_crc (may be NULL) receives the CRC-32C of the whole "w2im" chunk, newer fields included.
+static int read_wav_chunks(ByteSource *source, WavHeader *header, ImageMetadata *metadata, uint32_t *metadata_crc) {
+    uint8_t chunk[8];
+    bool have_fmt = false;
+
+    memcpy(header->riff, "RIFF", 4);
+    if (byte_source_read(source, &header->file_size, 4) != 4 ||
+        byte_source_read(source, header->wave, 4) != 4 || memcmp(header->wave, "WAVE", 4) != 0) {
+        conversion_error("The input is not a valid WAV file.\n");
+        return -1;
+    }
+
+    while (byte_source_read(source, chunk, 8) == 8) {
+        uint32_t size;
+        memcpy(&size, chunk + 4, 4);
+
+        if (memcmp(chunk, "fmt ", 4) == 0) {
+            uint8_t fmt[26];    // WAVEFORMATEXTENSIBLE up to the format code of its subformat GUID
+            size_t known = size < sizeof(fmt) ? size : sizeof(fmt);
+            if (size < 16 || byte_source_read(source, fmt, known) != known ||
+                !byte_source_skip(source, size - known + (size & 1))) {
+                break;
+            }
+            memcpy(header->fmt, chunk, 4);
+            header->fmt_size = size;
+            memcpy(&header->fmt_tag, fmt, 2);
+            memcpy(&header->channels, fmt + 2, 2);
+            memcpy(&header->sample_rate, fmt + 4, 4);
+            memcpy(&header->byte_rate, fmt + 8, 4);
+            memcpy(&header->block_align, fmt + 12, 2);
+            memcpy(&header->bits_per_sample, fmt + 14, 2);
+            if (header->fmt_tag == WAV_FORMAT_EXTENSIBLE && known == sizeof(fmt)) {
+                memcpy(&header->fmt_tag, fmt + 24, 2);
+            }
+            have_fmt = true;
+        } else if (memcmp(chunk, "w2im", 4) == 0 && metadata) {
+            // Older writers know fewer fields, newer ones more: keep the common part
+            size_t known = size < sizeof(ImageMetadata) ? size : sizeof(ImageMetadata);
+            if (byte_source_read(source, metadata, known) != known) {
+                break;
+            }
+            if (metadata_crc) {
+                // Fields of newer writers are read rather than skipped, the checksum covers them too
+                *metadata_crc = crc32c_update(0, metadata, known);
+                uint8_t newer[64];
+                size_t left = size - known;
+                while (left > 0) {
+                    size_t part = left < sizeof(newer) ? left : sizeof(newer);
+                    if (byte_source_read(source, newer, part) != part) {
+                        break;
+                    }
+                    *metadata_crc = crc32c_update(*metadata_crc, newer, part);
+                    left -= part;
+                }
+                if (left > 0 || !byte_source_skip(source, size & 1)) {
+                    break;
+                }
+            } else if (!byte_source_skip(source, size - known + (size & 1))) {
+                break;
+            }
+        } else if (memcmp(chunk, "data", 4) == 0) {
+            if (!have_fmt) {
+                break;
+            }
+            memcpy(header->data, chunk, 4);
+            header->data_size = size == 0 ? WAV_SIZE_UNKNOWN : size;
+            return 0;
+        } else if (!byte_source_skip(source, size + (size & 1))) {
+            break;
+        }
+    }
+
+    conversion_error("Couldn't find the WAV format and data chunks.\n");
+    return -1;
+}
+
+// Read a RIFF/WAVE header chunk by chunk up to the start of the data chunk, without seeking.
+// Unknown chunks are skipped. data_size is WAV_SIZE_UNKNOWN for streams written to a pipe.
+// metadata (may be NULL) receives the "w2im" chunk, or zeros if the file has none.
+int read_wav_stream_header(ByteSource *source, WavHeader *header, ImageMetadata *metadata) {
+    memset(header, 0, sizeof(*header));
+    if (metadata) {
+        memset(metadata, 0, sizeof(*metadata));
+    }
+    if (byte_source_read(source, header->riff, 4) != 4 || memcmp(header->riff, "RIFF", 4) != 0) {
+        conversion_error("The input is not a valid WAV file.\n");
+        return -1;
+    }
+    return read_wav_chunks(source, header, metadata, NULL);
+}
+
+// Samples in the data chunk, UINT64_MAX when its size isn't known
+static uint64_t wav_data_samples(const WavHeader *header) {
+    return header->data_size == WAV_SIZE_UNKNOWN ? UINT64_MAX : header->data_size / (header->bits_per_sample / 8);
+}
+
+// PCM of 8 or 16 bits or 32-bit float with the expected channels: mono for every decoder except raw
+// colour channels
+static bool wav_format_supported(const WavHeader *header, int channels) {
+    bool pcm = header->fmt_tag == WAV_FORMAT_PCM && (header->bits_per_sample == 16 || header->bits_per_sample == 8);
+    bool ieee_float = header->fmt_tag == WAV_FORMAT_IEEE_FLOAT && header->bits_per_sample == 32;
+    if (!pcm && !ieee_float) {
+        conversion_error("Only 8-bit or 16-bit PCM and 32-bit float audio is supported.\n");
+        return false;
+    }
+    if (header->channels != channels) {
+        if (channels == 1) {
+            conversion_error("Only mono audio is supported here.\n");
+        } else {
+            conversion_error("The audio has %d channels where %d colour channels are described.\n",
+                    header->channels, channels);
+        }
+        return false;
+    }
+    return true;
+}
+
+// Function to read the WAV file header
+int read_wav_header(FILE *file, WavHeader *header) {
+    ByteSource source;
+    byte_source_file(&source, file);
+    return read_wav_stream_header(&source, header, NULL);
+}
+
+// Fill a WAV header for mono 16-bit PCM, a negative num_samples leaves the sizes provisional
+void fill_wav_header(WavHeader *header, int64_t num_samples, int sample_rate) {
+    fill_wav_header_bits(header, num_samples, sample_rate, 16);
+}
+
+// Header for mono PCM of 16 bits per sample, 8 (unsigned) or 32 (IEEE float). Sizes past the 32-bit RIFF
+// fields are left provisional like those of a negative num_samples.
+void fill_wav_header_bits(WavHeader *header, int64_t num_samples, int sample_rate, int bits_per_sample) {
+    int bytes = bits_per_sample / 8;
+    uint64_t data_size = num_samples < 0 || (uint64_t)num_samples > UINT32_MAX ? UINT64_MAX
+                                                                                : (uint64_t)num_samples * bytes;
+    bool known = data_size < UINT32_MAX - (sizeof(WavHeader) - 8);
+
+    memcpy(header->riff, "RIFF", 4);
+    header->file_size = known ? (uint32_t)(data_size + sizeof(WavHeader) - 8) : WAV_SIZE_UNKNOWN;
+    memcpy(header->wave, "WAVE", 4);
+    memcpy(header->fmt, "fmt ", 4);
+    header->fmt_size = 16;
+    header->fmt_tag = bits_per_sample == 32 ? WAV_FORMAT_IEEE_FLOAT : WAV_FORMAT_PCM;
+    header->channels = 1; // Mono
+    header->sample_rate = sample_rate;
+    header->byte_rate = sample_rate * bytes;
+    header->block_align = bytes;
+    header->bits_per_sample = bits_per_sample;
+    memcpy(header->data, "data", 4);
+    header->data_size = known ? (uint32_t)data_size : WAV_SIZE_UNKNOWN;
+}
+
+// Interleave several channels in a header filled for mono, num_samples counting the samples of all of them
+static void wav_header_set_channels(WavHeader *header, int channels) {
+    header->channels = (uint16_t)channels;
+    header->block_align = (uint16_t)(channels * (header->bits_per_sample / 8));
+    header->byte_rate = header->sample_rate * header->block_align;
+}
+
+// Function to write a WAV file header
+void write_wav_header(FILE *file, int64_t num_samples, int sample_rate) {
+    WavHeader header;
+    fill_wav_header(&header, num_samples, sample_rate);
+    fwrite(&header, sizeof(WavHeader), 1, file);
+}
+
+// Write a header filled by fill_wav_header, with the "w2im" chunk between "fmt " and "data"
+// when metadata is given. Without metadata the bytes are exactly the classic 44 byte header.
+int write_wav_stream_header(ByteSink *sink, WavHeader *header, const ImageMetadata *metadata) {
+    size_t extra = metadata_chunk_size(metadata);
+    if (extra == 0) {
+        return byte_sink_write(sink, header, sizeof(WavHeader));
+    }
+
+    if (header->file_size != WAV_SIZE_UNKNOWN) {
+        header->file_size += (uint32_t)extra;
+    }
+    uint32_t size = sizeof(ImageMetadata);
+    byte_sink_write(sink, header, offsetof(WavHeader, data));
+    byte_sink_write(sink, "w2im", 4);
+    byte_sink_write(sink, &size, 4);
+    byte_sink_write(sink, metadata, sizeof(ImageMetadata));
+    return byte_sink_write(sink, header->data, sizeof(WavHeader) - offsetof(WavHeader, data));
+}
+
+// Fix the sizes of a header written earlier at header_offset once the real sample count is known.
+// On a pipe this is not possible and the provisional sizes stay, readers then read until the end.
+void finish_wav_header(ByteSink *sink, WavHeader *header, size_t header_offset,
+                       const ImageMetadata *metadata, int64_t num_samples) {
+    int bits = header->bits_per_sample;
+    if (header->data_size == (uint64_t)num_samples * (bits / 8)) {
+        return;
+    }
+    if (!sink->seekable) {
+        return;
+    }
+    size_t extra = metadata_chunk_size(metadata);
+    int channels = header->channels;
+    fill_wav_header_bits(header, num_samples, header->sample_rate, bits);
+    wav_header_set_channels(header, channels);
+    if (header->file_size != WAV_SIZE_UNKNOWN) {
+        header->file_size += (uint32_t)extra;
+    }
+    byte_sink_patch(sink, header_offset + offsetof(WavHeader, file_size), &header->file_size, 4);
+    byte_sink_patch(sink, header_offset + extra + offsetof(WavHeader, data_size), &header->data_size, 4);
+}
+
+// Function to write pixel intensity as audio sample
+void generate_audio_samples(FILE *file, int16_t *samples, int num_samples) {
+    fwrite(samples, sizeof(int16_t), num_samples, file); // Write all samples at once
+}
+
+// -------------------------------------------------------------------------------------------------------- png
+
+// PNG decoder reading one RGBA row at a time from a byte source
+struct ImageReader {
+    png_structp png;
+    png_infop info;
+    int width;
+    int height;
+    int channels;      // bytes per pixel of the rows handed out
+    bool keep_layout;  // gray, gray + alpha, RGB or RGBA as stored instead of always RGBA
+    uint8_t *whole;    // interlaced PNGs are decoded whole up front and handed out row by row
+    int next_row;
+    int color;         // COLOR_GRAY, or colour plane rows are handed out instead of the pixels
+    int plane_width;
+    int plane_height;
+    int rows_read;     // image rows turned into planes so far
+    uint8_t *rgba;     // one image row
+    uint8_t *chroma;   // full resolution Cb and Cr of two image rows
+    uint8_t *planes;   // plane rows of the current group, [planes_next, planes_ready) not handed out
+    int planes_ready;
+    int planes_next;
+};
+
+// Part of an image in pixels
+typedef struct {
+    int x, y, width, height;
+} ImageRegion;
+
+// PNG encoder writing one grayscale row at a time to a byte sink
+struct ImageWriter {
+    png_structp png;
+    png_infop info;
+    int width;
+    int height;
+    ImageRegion region; // what goes into the PNG, rows and columns outside it are dropped
+    int rows_seen;     // image rows handed to the PNG part so far, in the region or not
+    int channels;      // bytes per pixel of the PNG rows: gray, RGB or RGBA
+    int color;         // COLOR_GRAY, or colour plane rows are taken and rebuilt into RGB(A) rows
+    int plane_width;
+    int rows_written;  // image rows
+    uint8_t *planes;   // plane rows of the current group
+    int planes_count;
+    uint8_t *rgb;      // one RGB(A) row
+    uint8_t *chroma;   // Cb and Cr of one image row
+    int full_width;    // size of the PNG when the image rows are upscaled to it bilinearly, the region is
+    int full_height;   // part of it; width and height otherwise
+    int rows_taken;    // image rows upscaled from so far
+    uint8_t *above;    // the last two image rows
+    uint8_t *below;
+    uint8_t *upscaled; // one row at full size
+    int *x_first;      // left image pixel of every upscaled one
+    int *x_weight;     // weight of the pixel right of it, of 256
+};
+
+// Planes of a COLOR_ value, the channels they take side by side
+int color_planes(int color) {
+    return color == COLOR_GRAY ? 1 : color == COLOR_RGBA ? 4 : 3;
+}
+
+// Rows the audio carries for an image in a COLOR_ layout, -1 when that would be too large
+int color_plane_size(int color, int width, int height, int *plane_width, int *plane_height) {
+    int64_t w = width, h = height;
+    if (color == COLOR_YCBCR420) {
+        w += w & 1;
+        h += (h + 1) / 2;
+    } else {
+        h *= color_planes(color);
+    }
+    if (w <= 0 || h <= 0 || w * h > INT32_MAX) {
+        return -1;
+    }
+    *plane_width = (int)w;
+    *plane_height = (int)h;
+    return 0;
+}
+
+static void png_read_from_source(png_structp png, png_bytep out, png_size_t length) {
+    ByteSource *source = (ByteSource *)png_get_io_ptr(png);
+    if (byte_source_read(source, out, length) != length) {
+        png_error(png, "Unexpected end of PNG data");
+    }
+}
+
+static void png_write_to_sink(png_structp png, png_bytep in, png_size_t length) {
+    ByteSink *sink = (ByteSink *)png_get_io_ptr(png);
+    if (byte_sink_write(sink, in, length) != 0) {
+        png_error(png, "Couldn't write PNG data");
+    }
+}
+
+static void png_flush_sink(png_structp png) {
+    ByteSink *sink = (ByteSink *)png_get_io_ptr(png);
+    if (sink->file) {
+        fflush(sink->file);
+    }
+}
+
+// Read the PNG header and set up the transformations, libpng errors jump back here
+static int image_reader_start(ImageReader *reader, ByteSource *source) {
+    png_structp png = reader->png;
+    png_infop info = reader->info;
+
+    if (setjmp(png_jmpbuf(png))) {
+        conversion_error("Couldn't decode PNG data.\n");
+        return -1;
+    }
+
+    png_set_read_fn(png, source, png_read_from_source);
+    png_read_info(png, info);
+
+    reader->width = png_get_image_width(png, info);
+    reader->height = png_get_image_height(png, info);
+    png_byte color_type = png_get_color_type(png, info);
+    png_byte bit_depth = png_get_bit_depth(png, info);
+
+    if (bit_depth == 16)
+        png_set_strip_16(png);
+
+    if (color_type == PNG_COLOR_TYPE_PALETTE)
+        png_set_palette_to_rgb(png);
+
+    if (color_type == PNG_COLOR_TYPE_GRAY && bit_depth < 8)
+        png_set_expand_gray_1_2_4_to_8(png);
+
+    if (png_get_valid(png, info, PNG_INFO_tRNS))
+        png_set_tRNS_to_alpha(png);
+
+    if (!reader->keep_layout) {
+        // Every layout ends up as 4 bytes per pixel, the filler is ignored when there already is alpha
+        png_set_filler(png, 0xFF, PNG_FILLER_AFTER);
+
+        png_set_gray_to_rgb(png);
+    }
+
+    int passes = png_set_interlace_handling(png);
+
+    png_read_update_info(png, info);
+    reader->channels = png_get_channels(png, info);
+
+    // The passes of an interlaced PNG only form rows once all of them are read
+    if (passes > 1) {
+        size_t stride = (size_t)reader->width * reader->channels;
+        png_bytep *rows = (png_bytep *)malloc(reader->height * sizeof(png_bytep));
+        reader->whole = (uint8_t *)malloc(stride * reader->height);
+        if (rows == NULL || reader->whole == NULL) {
+            free(rows);
+            png_error(png, "Out of memory");
+        }
+        for (int y = 0; y < reader->height; y++) {
+            rows[y] = reader->whole + y * stride;
+        }
+        png_read_image(png, rows);
+        free(rows);
+    }
+    return 0;
+}
+
+static ImageReader *image_reader_create(ByteSource *source, bool keep_layout) {
+    ImageReader *reader = (ImageReader *)calloc(1, sizeof(ImageReader));
+    if (!reader) {
+        conversion_error("Couldn't allocate memory for the PNG reader.\n");
+        return NULL;
+    }
+    reader->keep_layout = keep_layout;
+
+    reader->png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    if (!reader->png) {
+        free(reader);
+        conversion_error("Couldn't initialize PNG read struct.\n");
+        return NULL;
+    }
+
+    reader->info = png_create_info_struct(reader->png);
+    if (!reader->info) {
+        png_destroy_read_struct(&reader->png, NULL, NULL);
+        free(reader);
+        conversion_error("Couldn't initialize PNG info struct.\n");
+        return NULL;
+    }
+
+    if (image_reader_start(reader, source) != 0) {
+        png_destroy_read_struct(&reader->png, &reader->info, NULL);
+        free(reader->whole);
+        free(reader);
+        return NULL;
+    }
+    return reader;
+}
+
+// Start decoding a PNG, every layout is expanded to 8-bit RGBA
+ImageReader *image_reader_open(ByteSource *source) {
+    return image_reader_create(source, false);
+}
+
+// Start decoding a PNG keeping its channel layout: 1 (gray), 2 (gray + alpha), 3 (RGB) or 4 (RGBA)
+// bytes per pixel at 8 bits. Palettes become RGB(A).
+ImageReader *image_reader_open_native(ByteSource *source) {
+    return image_reader_create(source, true);
+}
+
+// Hand out the colour planes of an RGBA reader (COLOR_ layout) as grayscale rows instead of its pixels,
+// before any row is read. The reader's size becomes that of the planes.
+int image_reader_set_color(ImageReader *reader, int color) {
+    int plane_width, plane_height;
+    if (color == COLOR_GRAY) {
+        return 0;
+    }
+    if (reader->channels != 4 || reader->color != COLOR_GRAY ||
+        color_plane_size(color, reader->width, reader->height, &plane_width, &plane_height) != 0) {
+        conversion_error("Can't split this image into colour planes.\n");
+        return -1;
+    }
+    reader->rgba = (uint8_t *)malloc((size_t)reader->width * 4);
+    reader->chroma = (uint8_t *)malloc((size_t)reader->width * 4);
+    reader->planes = (uint8_t *)malloc((size_t)plane_width * 4);
+    if (reader->rgba == NULL || reader->chroma == NULL || reader->planes == NULL) {
+        conversion_error("Couldn't allocate memory for colour planes.\n");
+        return -1;
+    }
+    reader->color = color;
+    reader->plane_width = plane_width;
+    reader->plane_height = plane_height;
+    return 0;
+}
+
+void image_reader_size(const ImageReader *reader, int *width, int *height) {
+    *width = reader->color != COLOR_GRAY ? reader->plane_width : reader->width;
+    *height = reader->color != COLOR_GRAY ? reader->plane_height : reader->height;
+}
+
+int image_reader_channels(const ImageReader *reader) {
+    return reader->color != COLOR_GRAY ? 1 : reader->channels;
+}
+
+static int image_reader_read_pixels(ImageReader *reader, uint8_t *row) {
+    if (reader->whole) {
+        size_t stride = (size_t)reader->width * reader->channels;
+        if (reader->next_row >= reader->height) {
+            return -1;
+        }
+        memcpy(row, reader->whole + (size_t)reader->next_row++ * stride, stride);
+        return 0;
+    }
+    if (setjmp(png_jmpbuf(reader->png))) {
+        conversion_error("Couldn't decode PNG row.\n");
+        return -1;
+    }
+    png_read_row(reader->png, row, NULL);
+    return 0;
+}
+
+// Turn the next image rows into a group of plane rows: Y, Cb and Cr (or R, G, B and maybe alpha) of one
+// row, or for 4:2:0 the Y rows of two (the last may be alone) followed by their chroma, every value the
+// rounded mean of 2x2 pixels
+static int image_reader_read_planes(ImageReader *reader) {
+    int width = reader->width, plane_width = reader->plane_width;
+    if (reader->rows_read >= reader->height) {
+        return -1;
+    }
+    if (reader->color != COLOR_YCBCR420) {
+        if (image_reader_read_pixels(reader, reader->rgba) != 0) {
+            return -1;
+        }
+        int planes = color_planes(reader->color);
+        if (reader->color == COLOR_YCBCR) {
+            rgba_to_ycbcr(reader->rgba, reader->planes, reader->planes + plane_width,
+                          reader->planes + 2 * plane_width, width);
+        } else {
+            for (int p = 0; p < planes; p++) {
+                uint8_t *plane = reader->planes + (size_t)p * plane_width;
+                for (int x = 0; x < width; x++) {
+                    plane[x] = reader->rgba[x * 4 + p];
+                }
+            }
+        }
+        reader->rows_read++;
+        reader->planes_ready = planes;
+        reader->planes_next = 0;
+        return 0;
+    }
+
+    int rows = reader->height - reader->rows_read >= 2 ? 2 : 1;
+    uint8_t *cb = reader->chroma, *cr = reader->chroma + 2 * width;
+    for (int r = 0; r < rows; r++) {
+        uint8_t *luma = reader->planes + (size_t)r * plane_width;
+        if (image_reader_read_pixels(reader, reader->rgba) != 0) {
+            return -1;
+        }
+        rgba_to_ycbcr(reader->rgba, luma, cb + r * width, cr + r * width, width);
+        luma[plane_width - 1] = luma[width - 1]; // odd widths repeat the last pixel
+    }
+    int half = plane_width / 2;
+    const uint8_t *cb_b = cb + (rows - 1) * width, *cr_b = cr + (rows - 1) * width;
+    uint8_t *out = reader->planes + (size_t)rows * plane_width;
+    for (int x = 0; x < half; x++) {
+        int x0 = 2 * x, x1 = 2 * x + 1 < width ? 2 * x + 1 : width - 1;
+        out[x] = (uint8_t)((cb[x0] + cb[x1] + cb_b[x0] + cb_b[x1] + 2) >> 2);
+        out[half + x] = (uint8_t)((cr[x0] + cr[x1] + cr_b[x0] + cr_b[x1] + 2) >> 2);
+    }
+    reader->rows_read += rows;
+    reader->planes_ready = rows + 1;
+    reader->planes_next = 0;
+    return 0;
+}
+
+// Read the next row as width * channels bytes (RGBA unless opened native), or the next plane row
+int image_reader_read_row(ImageReader *reader, uint8_t *row) {
+    if (reader->color == COLOR_GRAY) {
+        return image_reader_read_pixels(reader, row);
+    }
+    if (reader->planes_next == reader->planes_ready && image_reader_read_planes(reader) != 0) {
+        return -1;
+    }
+    memcpy(row, reader->planes + (size_t)reader->planes_next++ * reader->plane_width, reader->plane_width);
+    return 0;
+}
+
+void image_reader_close(ImageReader *reader) {
+    if (reader) {
+        png_destroy_read_struct(&reader->png, &reader->info, NULL);
+        free(reader->whole);
+        free(reader->rgba);
+        free(reader->chroma);
+        free(reader->planes);
+        free(reader);
+    }
+}
+
+// Write the PNG header, libpng errors jump back here
+static int image_writer_start(ImageWriter *writer, ByteSink *sink) {
+    if (setjmp(png_jmpbuf(writer->png))) {
+        conversion_error("Couldn't encode PNG data.\n");
+        return -1;
+    }
+
+    png_set_write_fn(writer->png, sink, png_write_to_sink, png_flush_sink);
+    int color_type = writer->channels == 4 ? PNG_COLOR_TYPE_RGB_ALPHA
+                   : writer->channels == 3 ? PNG_COLOR_TYPE_RGB : PNG_COLOR_TYPE_GRAY;
+    png_set_IHDR(writer->png, writer->info, writer->region.width, writer->region.height, 8, color_type, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    png_write_info(writer->png, writer->info);
+    return 0;
+}
+
+static void image_writer_free(ImageWriter *writer) {
+    free(writer->planes);
+    free(writer->rgb);
+    free(writer->chroma);
+    free(writer->above);
+    free(writer->below);
+    free(writer->upscaled);
+    free(writer->x_first);
+    free(writer->x_weight);
+    free(writer);
+}
+
+// Upscale the width x height image rows to full_width x full_height, at least as large in both directions
+static int image_writer_set_upscale(ImageWriter *writer, int full_width, int full_height) {
+    size_t stride = (size_t)writer->width * writer->channels;
+    writer->above = (uint8_t *)malloc(stride);
+    writer->below = (uint8_t *)malloc(stride);
+    writer->upscaled = (uint8_t *)malloc((size_t)full_width * writer->channels);
+    writer->x_first = (int *)malloc((size_t)full_width * sizeof(int));
+    writer->x_weight = (int *)malloc((size_t)full_width * sizeof(int));
+    if (writer->above == NULL || writer->below == NULL || writer->upscaled == NULL || writer->x_first == NULL ||
+        writer->x_weight == NULL) {
+        return -1;
+    }
+    for (int x = 0; x < full_width; x++) {
+        double source = (x + 0.5) * writer->width / full_width - 0.5;
+        source = source < 0 ? 0 : source;
+        writer->x_first[x] = (int)source;
+        writer->x_weight[x] = (int)((source - (int)source) * 256 + 0.5);
+    }
+    writer->full_width = full_width;
+    writer->full_height = full_height;
+    return 0;
+}
+
+// A region of NULL writes the whole image. With a full size other than width x height the rows are upscaled
+// to it and the region is part of the upscaled image.
+static ImageWriter *image_writer_create(ByteSink *sink, int width, int height, int color, int channels,
+                                        const ImageRegion *region, int full_width, int full_height) {
+    ImageWriter *writer = (ImageWriter *)calloc(1, sizeof(ImageWriter));
+    if (!writer) {
+        conversion_error("Couldn't allocate memory for the PNG writer.\n");
+        return NULL;
+    }
+    writer->color = color;
+    writer->channels = channels;
+    if (color != COLOR_GRAY) {
+        int plane_height;
+        if (color_plane_size(color, width, height, &writer->plane_width, &plane_height) != 0) {
+            free(writer);
+            conversion_error("Invalid colour image size.\n");
+            return NULL;
+        }
+        writer->planes = (uint8_t *)malloc((size_t)writer->plane_width * 4);
+        writer->rgb = (uint8_t *)malloc((size_t)width * 4);
+        writer->chroma = (uint8_t *)malloc((size_t)width * 2);
+        if (writer->planes == NULL || writer->rgb == NULL || writer->chroma == NULL) {
+            image_writer_free(writer);
+            conversion_error("Couldn't allocate memory for the PNG writer.\n");
+            return NULL;
+        }
+    }
+
+    writer->png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    if (!writer->png) {
+        image_writer_free(writer);
+        conversion_error("Couldn't initialize PNG write struct.\n");
+        return NULL;
+    }
+
+    writer->info = png_create_info_struct(writer->png);
+    if (!writer->info) {
+        png_destroy_write_struct(&writer->png, NULL);
+        image_writer_free(writer);
+        conversion_error("Couldn't initialize PNG info struct.\n");
+        return NULL;
+    }
+
+    writer->width = width;
+    writer->height = height;
+    writer->full_width = width;
+    writer->full_height = height;
+    if ((full_width != width || full_height != height) &&
+        image_writer_set_upscale(writer, full_width, full_height) != 0) {
+        png_destroy_write_struct(&writer->png, &writer->info);
+        image_writer_free(writer);
+        conversion_error("Couldn't allocate memory for upscaling.\n");
+        return NULL;
+    }
+    writer->region = region ? *region : (ImageRegion){ 0, 0, full_width, full_height };
+    if (image_writer_start(writer, sink) != 0) {
+        png_destroy_write_struct(&writer->png, &writer->info);
+        image_writer_free(writer);
+        return NULL;
+    }
+    return writer;
+}
+
+// Start encoding a grayscale PNG
+ImageWriter *image_writer_open(ByteSink *sink, int width, int height) {
+    return image_writer_create(sink, width, height, COLOR_GRAY, 1, NULL, width, height);
+}
+
+// Start encoding an RGB (RGBA for COLOR_RGBA) PNG of width x height from plane rows in a COLOR_ layout,
+// written one at a time with image_writer_write_row as image_reader_set_color hands them out
+ImageWriter *image_writer_open_color(ByteSink *sink, int width, int height, int color) {
+    return image_writer_create(sink, width, height, color, color == COLOR_RGBA ? 4 : 3, NULL, width, height);
+}
+
+// Start encoding a PNG taking rows of 1 (gray), 3 (RGB) or 4 (RGBA) bytes per pixel as they are
+ImageWriter *image_writer_open_native(ByteSink *sink, int width, int height, int channels) {
+    return image_writer_create(sink, width, height, COLOR_GRAY, channels, NULL, width, height);
+}
+
+static int image_writer_write_pixels(ImageWriter *writer, const uint8_t *row) {
+    int y = writer->rows_seen++;
+    if (y < writer->region.y || y >= writer->region.y + writer->region.height) {
+        return 0;
+    }
+    if (setjmp(png_jmpbuf(writer->png))) {
+        conversion_error("Couldn't encode PNG row.\n");
+        return -1;
+    }
+    png_write_row(writer->png, (png_const_bytep)(row + (size_t)writer->region.x * writer->channels));
+    return 0;
+}
+
+// Pass an image row on, or when upscaling the full size rows that lie up to it. Those are blended from
+// the two rows around them and between the two pixels around each of theirs, rows outside the region skipped.
+static int image_writer_emit(ImageWriter *writer, const uint8_t *row) {
+    if (writer->full_width == writer->width && writer->full_height == writer->height) {
+        return image_writer_write_pixels(writer, row);
+    }
+    int channels = writer->channels;
+    size_t stride = (size_t)writer->width * channels;
+    uint8_t *swap = writer->above;
+    writer->above = writer->below;
+    writer->below = swap;
+    memcpy(writer->below, row, stride);
+    int taken = writer->rows_taken++;
+    if (taken == 0) {
+        memcpy(writer->above, row, stride);
+    }
+    bool last = writer->rows_taken == writer->height;
+    while (writer->rows_seen < writer->full_height) {
+        int y = writer->rows_seen;
+        double source = (y + 0.5) * writer->height / writer->full_height - 0.5;
+        source = source < 0 ? 0 : source;
+        int first = (int)source;
+        if (first + 1 > taken && !last) {
+            break;
+        }
+        if (y >= writer->region.y && y < writer->region.y + writer->region.height) {
+            const uint8_t *top = first < taken ? writer->above : writer->below, *bottom = writer->below;
+            int fy = first < taken ? (int)((source - first) * 256 + 0.5) : 0;
+            for (int x = 0; x < writer->full_width; x++) {
+                int x0 = writer->x_first[x], x1 = x0 + 1 < writer->width ? x0 + 1 : x0, fx = writer->x_weight[x];
+                for (int c = 0; c < channels; c++) {
+                    int left = top[x0 * channels + c] * (256 - fy) + bottom[x0 * channels + c] * fy;
+                    int right = top[x1 * channels + c] * (256 - fy) + bottom[x1 * channels + c] * fy;
+                    writer->upscaled[(size_t)x * channels + c] = (uint8_t)((left * (256 - fx) + right * fx + 32768) >> 16);
+                }
+            }
+        }
+        if (image_writer_write_pixels(writer, writer->upscaled) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Collect a group of plane rows, then write the image rows it holds with the chroma repeated over 2x2
+static int image_writer_write_planes(ImageWriter *writer, const uint8_t *row) {
+    int width = writer->width, plane_width = writer->plane_width;
+    int luma_rows = writer->color == COLOR_YCBCR420 && writer->height - writer->rows_written >= 2 ? 2 : 1;
+    int group = writer->color == COLOR_YCBCR420 ? luma_rows + 1 : color_planes(writer->color);
+    memcpy(writer->planes + (size_t)writer->planes_count++ * plane_width, row, plane_width);
+    if (writer->planes_count < group) {
+        return 0;
+    }
+    writer->planes_count = 0;
+
+    if (writer->color == COLOR_RGB || writer->color == COLOR_RGBA) {
+        for (int p = 0; p < group; p++) {
+            const uint8_t *plane = writer->planes + (size_t)p * plane_width;
+            for (int x = 0; x < width; x++) {
+                writer->rgb[x * group + p] = plane[x];
+            }
+        }
+        writer->rows_written++;
+        return image_writer_emit(writer, writer->rgb);
+    }
+
+    const uint8_t *cb = writer->planes + plane_width, *cr = writer->planes + 2 * plane_width;
+    if (writer->color == COLOR_YCBCR420) {
+        const uint8_t *chroma = writer->planes + (size_t)luma_rows * plane_width;
+        uint8_t *up_cb = writer->chroma, *up_cr = writer->chroma + width;
+        for (int x = 0; x < width; x++) {
+            up_cb[x] = chroma[x / 2];
+            up_cr[x] = chroma[plane_width / 2 + x / 2];
+        }
+        cb = up_cb;
+        cr = up_cr;
+    }
+    for (int r = 0; r < luma_rows && writer->rows_written < writer->height; r++) {
+        ycbcr_to_rgb(writer->planes + (size_t)r * plane_width, cb, cr, writer->rgb, width);
+        if (image_writer_emit(writer, writer->rgb) != 0) {
+            return -1;
+        }
+        writer->rows_written++;
+    }
+    return 0;
+}
+
+// Write the next row of width grayscale bytes (width * channels for a native writer), or the next plane row
+// of a colour writer
+int image_writer_write_row(ImageWriter *writer, const uint8_t *row) {
+    return writer->color != COLOR_GRAY ? image_writer_write_planes(writer, row) : image_writer_emit(writer, row);
+}
+
+static int image_writer_end(ImageWriter *writer) {
+    if (setjmp(png_jmpbuf(writer->png))) {
+        conversion_error("Couldn't finish PNG data.\n");
+        return -1;
+    }
+    png_write_end(writer->png, NULL);
+    return 0;
+}
+
+// Finish the PNG (all rows must have been written) and free the writer
+int image_writer_close(ImageWriter *writer) {
+    if (!writer) {
+        return -1;
+    }
+    int result = image_writer_end(writer);
+    png_destroy_write_struct(&writer->png, &writer->info);
+    image_writer_free(writer);
+    return result;
+}
+
+// The region of a width x height image the options ask for, -1 when it lies outside the image
+static int image_region(const ConversionOptions *options, int width, int height, ImageRegion *region) {
+    if (options->region_x >= width || options->region_y >= height) {
+        conversion_error("The region at %d,%d lies outside the %dx%d image.\n", options->region_x,
+                options->region_y, width, height);
+        return -1;
+    }
+    region->x = options->region_x;
+    region->y = options->region_y;
+    region->width = options->region_width > 0 && options->region_width < width - region->x
+                  ? options->region_width : width - region->x;
+    region->height = options->region_height > 0 && options->region_height < height - region->y
+                   ? options->region_height : height - region->y;
+    return 0;
+}
+
+// Whether decoding scales the image back up to the size recorded before a duration limit shrank it
+static bool decoded_upscaled(const ConversionContext *ctx) {
+    const ImageMetadata *meta = &ctx->metadata;
+    return ctx->options.upscale && meta->version >= 10 && meta->original_width > 0 && meta->original_height > 0 &&
+           meta->original_width <= (1 << 24) && meta->original_height <= (1 << 24);
+}
+
+// PNG output of a decoder for images of width x height pixels of channels bytes, upscaled when asked to and
+// cut to the region of the options
+static ImageWriter *decoded_writer_open(ConversionContext *ctx, ByteSink *output, int width, int height, int color,
+                                        int channels) {
+    int full_width = width, full_height = height;
+    if (decoded_upscaled(ctx) && (int)ctx->metadata.original_width >= width &&
+        (int)ctx->metadata.original_height >= height) {
+        full_width = (int)ctx->metadata.original_width;
+        full_height = (int)ctx->metadata.original_height;
+    }
+    ImageRegion region;
+    if (image_region(&ctx->options, full_width, full_height, &region) != 0) {
+        return NULL;
+    }
+    return image_writer_create(output, width, height, color, channels, &region, full_width, full_height);
+}
+
+// PNG output of a decoder: width x height grayscale rows as they come, or the colour image rebuilt from
+// them when the "w2im" chunk says they are colour planes
+static ImageWriter *decoded_image_open(ConversionContext *ctx, ByteSink *output, int width, int height) {
+    const ImageMetadata *meta = &ctx->metadata;
+    if (meta->version < 4 || meta->color == COLOR_GRAY) {
+        return decoded_writer_open(ctx, output, width, height, COLOR_GRAY, 1);
+    }
+    int plane_width, plane_height;
+    if (meta->color > COLOR_RGBA || meta->image_width > INT32_MAX || meta->image_height > INT32_MAX ||
+        color_plane_size((int)meta->color, (int)meta->image_width, (int)meta->image_height, &plane_width,
+                         &plane_height) != 0 ||
+        plane_width != width || plane_height != height) {
+        conversion_error("Invalid colour planes in the audio description.\n");
+        return NULL;
+    }
+    return decoded_writer_open(ctx, output, (int)meta->image_width, (int)meta->image_height, (int)meta->color,
+                               meta->color == COLOR_RGBA ? 4 : 3);
+}
+
+// Read a whole PNG into RGBA pixels
+static int read_png_source(ByteSource *source, int *width, int *height, uint8_t **pixels) {
+    ImageReader *reader = image_reader_open(source);
+    if (!reader) {
+        return -1;
+    }
+    image_reader_size(reader, width, height);
+
+    *pixels = (uint8_t *)malloc((size_t)*width * *height * 4);
+    if (*pixels == NULL) {
+        image_reader_close(reader);
+        conversion_error("Couldn't allocate memory for pixels.\n");
+        return -1;
+    }
+
+    for (int y = 0; y < *height; y++) {
+        if (image_reader_read_row(reader, (*pixels) + (size_t)y * (*width) * 4) != 0) {
+            image_reader_close(reader);
+            free(*pixels);
+            *pixels = NULL;
+            return -1;
+        }
+    }
+
+    image_reader_close(reader);
+    return 0;
+}
+
+// Write grayscale pixels as a whole PNG
+static int write_png_sink(ByteSink *sink, int width, int height, const uint8_t *pixels) {
+    ImageWriter *writer = image_writer_open(sink, width, height);
+    if (!writer) {
+        return -1;
+    }
+    for (int y = 0; y < height; y++) {
+        if (image_writer_write_row(writer, pixels + (size_t)y * width) != 0) { // Use grayscale intensity directly
+            image_writer_close(writer);
+            return -1;
+        }
+    }
+    return image_writer_close(writer);
+}
+
+// Function to read PNG file and convert to grayscale intensity - img - wav -
+int read_png_file(const char *filename, int *width, int *height, uint8_t **pixels) {
+    FILE *fp = open_input_file(filename);
+    if (!fp) {
+        conversion_error("Couldn't open file %s for reading.\n", filename);
+        return -1;
+    }
+
+    ByteSource source;
+    byte_source_file(&source, fp);
+    int result = read_png_source(&source, width, height, pixels);
+
+    close_file(fp);
+    return result;
+}
+
+// Decode PNG bytes held in memory to RGBA pixels
+int read_png_buffer(const uint8_t *data, size_t size, int *width, int *height, uint8_t **pixels) {
+    ByteSource source;
+    byte_source_memory(&source, data, size);
+    return read_png_source(&source, width, height, pixels);
+}
+
+// Function to write a PNG file from pixel data - wav - img -
+int write_png_file(const char *filename, int width, int height, const uint8_t *pixels) {
+    FILE *fp = open_output_file(filename);
+    if (!fp) {
+        conversion_error("Couldn't open file %s for writing.\n", filename);
+        return -1;
+    }
+
+    ByteSink sink;
+    byte_sink_file(&sink, fp);
+    int result = write_png_sink(&sink, width, height, pixels);
+
+    if (close_file(fp) != 0) {
+        result = -1;
+    }
+    return result;
+}
+
+// Encode grayscale pixels to PNG bytes in memory, *out is allocated with malloc
+int write_png_buffer(int width, int height, const uint8_t *pixels, uint8_t **out, size_t *out_size) {
+    ByteSink sink;
+    byte_sink_memory(&sink);
+    if (write_png_sink(&sink, width, height, pixels) != 0) {
+        free(sink.data);
+        return -1;
+    }
+    *out = sink.data;
+    *out_size = sink.size;
+    return 0;
+}
+
+// Image to audio ==========================================================================================
+
+// Node for Linked List, Stack, and Queue
+typedef struct Node {
+    int16_t data;
+    struct Node *next;
+} Node;
+
+// Stack functions
+static void push_to_stack(Node **stack, int16_t value) {
+    Node *new_node = (Node *)malloc(sizeof(Node));
+    new_node->data = value;
+    new_node->next = *stack;
+    *stack = new_node;
+}
+
+// Queue functions, the Linked List appends at its tail the same way
+static void enqueue_to_queue(Node **rear, Node **front, int16_t value) {
+    Node *new_node = (Node *)malloc(sizeof(Node));
+    new_node->data = value;
+    new_node->next = NULL;
+
+    if (*rear == NULL) {
+        *front = *rear = new_node;
+    } else {
+        (*rear)->next = new_node;
+        *rear = new_node;
+    }
+}
+
+// Copy all samples from a structure to a buffer, returns how many were copied
+static int read_samples_from_structure(Node *head, int mode, int16_t *samples) {
+    Node *current = head;
+    int count = 0;
+    if (mode == MODE_STACK) { // If stack, reverse the order
+        Node *prev = NULL, *next = NULL;
+        while (current) {
+            next = current->next;
+            current->next = prev;
+            prev = current;
+            current = next;
+        }
+        current = prev;
+    }
+
+    while (current) {
+        samples[count++] = current->data;
+        Node *temp = current;
+        current = current->next;
+        free(temp); // Free memory
+    }
+    return count;
+}
+
+// -------------------------------------------------------------------------------------------------------- kernels
+// Pixel -> sample kernels are generated at compile time for every combination of input layout,
+// output sample format and container. A job picks its kernel once with select_pixel_kernel(), so the
+// inner loops carry no per-pixel mode or layout branches and the Array variants can be vectorized.
+
+// Output of a kernel: an array of samples or one of the node structures
+typedef struct {
+    void *samples;      // Array container, count samples already stored
+    int count;
+    Node *head;         // Linked List / Queue front, or Stack top
+    Node *tail;         // Linked List / Queue rear
+} KernelOutput;
+
+typedef void (*PixelKernel)(const uint8_t *pixels, int count, KernelOutput *out);
+
+// Input layouts: grayscale intensity of one pixel
+#define INTENSITY_GRAY(p) ((p)[0])
+#define INTENSITY_GA(p)   ((p)[0])                              // alpha is ignored
+#define INTENSITY_RGB(p)  (((p)[0] + (p)[1] + (p)[2]) / 3)      // average of red, green and blue
+#define INTENSITY_RGBA(p) INTENSITY_RGB(p)
+
+// Sample formats: intensity 0-255 to one sample
+#define SAMPLE_S16(intensity) ((int16_t)(((intensity) - 128) * 256)) // signed 16-bit audio
+#define SAMPLE_U8(intensity)  ((uint8_t)(intensity))                   // intensity for a modulator
+
+// Containers: where each sample goes
+#define EMIT_ARRAY(out, dst, i, sample) ((dst)[i] = (sample))
+#define EMIT_LIST(out, dst, i, sample)  enqueue_to_queue(&(out)->tail, &(out)->head, (sample)) // append at the tail
+#define EMIT_STACK(out, dst, i, sample) push_to_stack(&(out)->head, (sample))
+#define EMIT_QUEUE(out, dst, i, sample) enqueue_to_queue(&(out)->tail, &(out)->head, (sample))
+
+#define DEFINE_PIXEL_KERNEL(name, CHANNELS, INTENSITY, SAMPLE_TYPE, TO_SAMPLE, EMIT)               \
+    static void name(const uint8_t *restrict pixels, int count, KernelOutput *restrict out) {    \
+        SAMPLE_TYPE *restrict dst = out->samples ? (SAMPLE_TYPE *)out->samples + out->count : NULL; \
+        (void)dst;                                                                                \
+        for (int i = 0; i < count; i++) {                                                         \
+            const uint8_t *p = pixels + (size_t)i * (CHANNELS);                                   \
+            EMIT(out, dst, i, TO_SAMPLE(INTENSITY(p)));                                           \
+        }                                                                                         \
+        out->count += count;                                                                      \
+    }
+
+// One kernel per input layout for a sample format and container
+#define DEFINE_LAYOUT_KERNELS(format, SAMPLE_TYPE, TO_SAMPLE, container, EMIT)                                   \
+    DEFINE_PIXEL_KERNEL(kernel_gray_##format##_##container, 1, INTENSITY_GRAY, SAMPLE_TYPE, TO_SAMPLE, EMIT) \
+    DEFINE_PIXEL_KERNEL(kernel_ga_##format##_##container, 2, INTENSITY_GA, SAMPLE_TYPE, TO_SAMPLE, EMIT)     \
+    DEFINE_PIXEL_KERNEL(kernel_rgb_##format##_##container, 3, INTENSITY_RGB, SAMPLE_TYPE, TO_SAMPLE, EMIT)   \
+    DEFINE_PIXEL_KERNEL(kernel_rgba_##format##_##container, 4, INTENSITY_RGBA, SAMPLE_TYPE, TO_SAMPLE, EMIT)
+
+#define LAYOUT_KERNELS(format, container) \
+    { kernel_gray_##format##_##container, kernel_ga_##format##_##container, \
+      kernel_rgb_##format##_##container, kernel_rgba_##format##_##container }
+
+DEFINE_LAYOUT_KERNELS(s16, int16_t, SAMPLE_S16, array, EMIT_ARRAY)
+DEFINE_LAYOUT_KERNELS(s16, int16_t, SAMPLE_S16, list, EMIT_LIST)
+DEFINE_LAYOUT_KERNELS(s16, int16_t, SAMPLE_S16, stack, EMIT_STACK)
+DEFINE_LAYOUT_KERNELS(s16, int16_t, SAMPLE_S16, queue, EMIT_QUEUE)
+DEFINE_LAYOUT_KERNELS(u8, uint8_t, SAMPLE_U8, array, EMIT_ARRAY)
+
+#define CONTAINER_ARRAY 0
+#define CONTAINER_LIST 1
+#define CONTAINER_STACK 2
+#define CONTAINER_QUEUE 3
+
+// [sample format][container][channels - 1]
+static const PixelKernel pixel_kernels[SAMPLE_FORMAT_COUNT][4][4] = {
+    [SAMPLE_FORMAT_S16] = {
+        [CONTAINER_ARRAY] = LAYOUT_KERNELS(s16, array),
+        [CONTAINER_LIST] = LAYOUT_KERNELS(s16, list),
+        [CONTAINER_STACK] = LAYOUT_KERNELS(s16, stack),
+        [CONTAINER_QUEUE] = LAYOUT_KERNELS(s16, queue),
+    },
+    [SAMPLE_FORMAT_U8] = {
+        [CONTAINER_ARRAY] = LAYOUT_KERNELS(u8, array), // modulators work row by row, no structures
+    },
+};
+
+static int mode_container(int mode) {
+    switch (mode) {
+        case MODE_LINKED_LIST: return CONTAINER_LIST;
+        case MODE_STACK: return CONTAINER_STACK;
+        case MODE_QUEUE: return CONTAINER_QUEUE;
+        default: return CONTAINER_ARRAY; // Array and Pipeline
+    }
+}
+
+// Pick the kernel for a whole job, NULL if the combination doesn't exist
+static PixelKernel select_pixel_kernel(int sample_format, int mode, int channels) {
+    if (sample_format < 0 || sample_format >= SAMPLE_FORMAT_COUNT || channels < 1 || channels > 4) {
+        return NULL;
+    }
+    return pixel_kernels[sample_format][mode_container(mode)][channels - 1];
+}
+
+// Convert pixels to 16-bit PCM using the data structure selected in the context
+int pixels_to_samples(ConversionContext *ctx, const uint8_t *pixels, int width, int height, int channels,
+                      int16_t **samples_out, int *num_samples) {
+    conversion_begin(ctx);
+    int mode = ctx->options.mode;
+    int num_pixels = width * height;
+    int progress_step = num_pixels / 50 > 0 ? num_pixels / 50 : 1; // Update progress every 2% of the total
+
+    PixelKernel kernel = select_pixel_kernel(SAMPLE_FORMAT_S16, mode, channels);
+    if (kernel == NULL) {
+        conversion_error("Unsupported pixel layout with %d channels.\n", channels);
+        return conversion_end(ctx, CONVERSION_ERROR);
+    }
+
+    // Allocate a buffer for audio samples
+    int16_t *samples = (int16_t *)malloc(num_pixels * sizeof(int16_t));
+    if (samples == NULL) {
+        conversion_error("Couldn't allocate memory for audio samples.\n");
+        return conversion_end(ctx, CONVERSION_ERROR);
+    }
+
+    // Initialize data structure (the Array container writes straight into samples)
+    KernelOutput out = { mode_container(mode) == CONTAINER_ARRAY ? samples : NULL, 0, NULL, NULL };
+
+    // Convert in steps of 2% so progress and cancellation are checked between kernel calls
+    bool cancelled = false;
+    for (int i = 0; i < num_pixels; i += progress_step) {
+        int count = num_pixels - i < progress_step ? num_pixels - i : progress_step;
+        kernel(pixels + (size_t)i * channels, count, &out);
+
+        if (conversion_cancelled(ctx)) {
+            cancelled = true;
+            break;
+        }
+        conversion_report(ctx, (double)(i + count) / num_pixels); // Progress as a fraction (0.0 - 1.0)
+    }
+
+    // Copy data from the chosen structure (also frees the nodes)
+    if (out.samples == NULL) {
+        read_samples_from_structure(out.head, mode, samples);
+    }
+
+    if (cancelled) {
+        free(samples);
+        return conversion_end(ctx, CONVERSION_CANCELLED);
+    }
+
+    *samples_out = samples;
+    *num_samples = num_pixels;
+    return conversion_end(ctx, CONVERSION_OK);
+}
+
+// Map signed 16-bit audio sample back to grayscale intensity
+static uint8_t sample_to_pixel(int16_t sample) {
+    int intensity = (sample / 256) + 128; // Revert mapping
+    // Clamp the intensity to [0, 255]
+    if (intensity < 0) intensity = 0;
+    if (intensity > 255) intensity = 255;
+    return (uint8_t)intensity;
+}
+
+// Convert 16-bit PCM back to grayscale pixels, missing samples stay black
+int samples_to_pixels(ConversionContext *ctx, const int16_t *samples, int num_samples, int width, int height,
+                      uint8_t **pixels_out) {
+    conversion_begin(ctx);
+    if (width <= 0 || height <= 0 || num_samples > width * height) {
+        conversion_error("Invalid image size in WAV data.\n");
+        return conversion_end(ctx, CONVERSION_ERROR);
+    }
+
+    uint8_t *pixels = (uint8_t *)calloc((size_t)width * height, sizeof(uint8_t));
+    if (pixels == NULL) {
+        conversion_error("Couldn't allocate memory for pixels.\n");
+        return conversion_end(ctx, CONVERSION_ERROR);
+    }
+
+    int progress_step = num_samples / 50 > 0 ? num_samples / 50 : 1;
+
+    // Convert audio samples back to grayscale intensities
+    for (int i = 0; i < num_samples; i++) {
+        pixels[i] = sample_to_pixel(samples[i]);
+
+        if (i % progress_step == 0) {
+            if (conversion_cancelled(ctx)) {
+                free(pixels);
+                return conversion_end(ctx, CONVERSION_CANCELLED);
+            }
+            conversion_report(ctx, (double)i / num_samples);
+        }
+    }
+
+    *pixels_out = pixels;
+    return conversion_end(ctx, CONVERSION_OK);
+}
+
+// -------------------------------------------------------------------------------------------------------- workers
+
+// Work split into items, function(job, worker, from, to) handles items [from, to) on one thread
+typedef void (*WorkerFunction)(void *job, int worker, int from, int to);
+
+// Threads worth starting for data parallel work, one per core up to WORKER_THREADS_MAX
+static int worker_count(void) {
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    long cores = (long)info.dwNumberOfProcessors;
+#else
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    return cores < 1 ? 1 : cores > WORKER_THREADS_MAX ? WORKER_THREADS_MAX : (int)cores;
+}
+
+typedef struct {
+    WorkerFunction function;
+    void *job;
+    int worker;
+    int from;
+    int to;
+} WorkerSlice;
+
+static void *worker_main(void *arg) {
+    WorkerSlice *slice = (WorkerSlice *)arg;
+    slice->function(slice->job, slice->worker, slice->from, slice->to);
+    return NULL;
+}
+
+// Split items over at most workers threads, the calling thread taking the first slice, and wait for all.
+// A thread that can't be started leaves its slice to the calling thread.
+static void run_workers(WorkerFunction function, void *job, int items, int workers) {
+    WorkerSlice slices[WORKER_THREADS_MAX];
+    pthread_t threads[WORKER_THREADS_MAX];
+    bool started[WORKER_THREADS_MAX] = { false };
+    if (workers > items) {
+        workers = items;
+    }
+    if (workers < 1) {
+        return;
+    }
+    for (int w = 0; w < workers; w++) {
+        slices[w] = (WorkerSlice){ function, job, w, (int)((int64_t)items * w / workers),
+                                   (int)((int64_t)items * (w + 1) / workers) };
+    }
+    for (int w = 1; w < workers; w++) {
+        started[w] = pthread_create(&threads[w], NULL, worker_main, &slices[w]) == 0;
+    }
+    worker_main(&slices[0]);
+    for (int w = 1; w < workers; w++) {
+        if (started[w]) {
+            pthread_join(threads[w], NULL);
+        } else {
+            worker_main(&slices[w]);
+        }
+    }
+}
+
+// -------------------------------------------------------------------------------------------------------- scale
+
+// Area filter of a whole image, the output rows split over the workers
+typedef struct {
+    const uint8_t *pixels;
+    uint8_t *scaled;
+    int width;
+    int channels;
+    int scaled_width;
+    const AreaAxis *x_axis;
+    const AreaAxis *y_axis;
+    float *sums;            // a row of sums per worker
+} AreaScale;
+
+static void area_scale_rows(void *job, int worker, int from, int to) {
+    AreaScale *scale = (AreaScale *)job;
+    const AreaAxis *y_axis = scale->y_axis;
+    size_t stride = (size_t)scale->width * scale->channels;
+    float *sums = scale->sums + (size_t)worker * stride;
+    for (int y = from; y < to; y++) {
+        const float *weights = y_axis->weights + (size_t)y * y_axis->taps;
+        memset(sums, 0, stride * sizeof(float));
+        for (int k = 0; k < y_axis->taps && weights[k] != 0.0f; k++) {
+            accumulate_row_u8(scale->pixels + (size_t)(y_axis->first[y] + k) * stride, weights[k], sums, stride);
+        }
+        area_filter_row(scale->x_axis, sums, scale->channels,
+                        scale->scaled + (size_t)y * scale->scaled_width * scale->channels, scale->scaled_width);
+    }
+}
+
+// Shrink the image of a reader to width x height before any row is read or colour planes are asked for.
+// The whole image is decoded, filtered on every core and then handed out from memory.
+static int image_reader_scale(ImageReader *reader, int width, int height) {
+    size_t stride = (size_t)reader->width * reader->channels;
+    uint8_t *pixels = reader->whole;
+    reader->whole = NULL;
+    if (pixels == NULL && (pixels = (uint8_t *)malloc(stride * reader->height)) != NULL) {
+        for (int y = 0; y < reader->height; y++) {
+            if (image_reader_read_pixels(reader, pixels + (size_t)y * stride) != 0) {
+                free(pixels);
+                return -1;
+            }
+        }
+    }
+
+    int workers = worker_count();
+    AreaAxis x_axis = { 0, NULL, NULL }, y_axis = { 0, NULL, NULL };
+    AreaScale scale = { pixels, (uint8_t *)malloc((size_t)width * height * reader->channels), reader->width,
+                        reader->channels, width, &x_axis, &y_axis,
+                        (float *)malloc((size_t)workers * stride * sizeof(float)) };
+    int result = 0;
+    if (pixels == NULL || scale.scaled == NULL || scale.sums == NULL ||
+        area_axis_init(&x_axis, reader->width, width) != 0 || area_axis_init(&y_axis, reader->height, height) != 0) {
+        conversion_error("Couldn't allocate memory for shrinking the image.\n");
+        free(scale.scaled);
+        result = -1;
+    } else {
+        run_workers(area_scale_rows, &scale, height, workers);
+        reader->whole = scale.scaled;
+        reader->next_row = 0;
+        reader->width = width;
+        reader->height = height;
+    }
+    area_axis_free(&x_axis);
+    area_axis_free(&y_axis);
+    free(scale.sums);
+    free(pixels);
+    return result;
+}
+
+// -------------------------------------------------------------------------------------------------------- flac
+// FLAC output is encoded FLAC_BATCH_BLOCKS blocks at a time, the blocks of a batch spread over the workers
+// and written in order. Input goes the other way: frame starts are found by their headers, the frames in
+// between decoded in parallel and handed out as the bytes of the equivalent WAV data chunk, so the decoders
+// read both containers the same way.
+
+typedef struct {
+    ByteSink *sink;
+    size_t streaminfo_offset;
+    FlacStreamInfo info;
+    int workers;
+    int16_t *pending;           // samples of the batch, signed and in the stream's sample size
+    int pending_count;
+    uint8_t *frames;            // one flac_frame_capacity slot per block of the batch
+    size_t *frame_sizes;
+    uint8_t *work;              // flac_work_size bytes per worker
+    uint64_t frame_number;      // of the first block of the batch
+    uint64_t written;           // samples
+} FlacWriter;
+
+static void flac_writer_free(FlacWriter *writer) {
+    free(writer->pending);
+    free(writer->frames);
+    free(writer->frame_sizes);
+    free(writer->work);
+    free(writer);
+}
+
+// Start a FLAC stream: STREAMINFO, then the "w2im" metadata in an APPLICATION block when there is some.
+// A negative num_samples leaves the total unknown until flac_writer_close.
+static FlacWriter *flac_writer_open(ByteSink *sink, int sample_rate, int bits, int64_t num_samples,
+                                    const ImageMetadata *metadata) {
+    FlacWriter *writer = (FlacWriter *)calloc(1, sizeof(FlacWriter));
+    if (writer == NULL) {
+        conversion_error("Couldn't allocate memory for the FLAC encoder.\n");
+        return NULL;
+    }
+    writer->sink = sink;
+    writer->workers = worker_count();
+    writer->pending = (int16_t *)malloc((size_t)FLAC_BATCH_BLOCKS * FLAC_BLOCK_SIZE * sizeof(int16_t));
+    writer->frames = (uint8_t *)malloc(FLAC_BATCH_BLOCKS * flac_frame_capacity(FLAC_BLOCK_SIZE));
+    writer->frame_sizes = (size_t *)malloc(FLAC_BATCH_BLOCKS * sizeof(size_t));
+    writer->work = (uint8_t *)malloc((size_t)writer->workers * flac_work_size(FLAC_BLOCK_SIZE));
+    if (writer->pending == NULL || writer->frames == NULL || writer->frame_sizes == NULL || writer->work == NULL) {
+        flac_writer_free(writer);
+        conversion_error("Couldn't allocate memory for the FLAC encoder.\n");
+        return NULL;
+    }
+    writer->info = (FlacStreamInfo){ FLAC_BLOCK_SIZE, FLAC_BLOCK_SIZE, 0, 0, sample_rate, 1, bits,
+                                     num_samples < 0 ? 0 : (uint64_t)num_samples };
+
+    bool described = metadata && metadata->version != 0;
+    uint8_t block[4 + FLAC_STREAMINFO_SIZE] = { described ? FLAC_BLOCK_STREAMINFO : 0x80 | FLAC_BLOCK_STREAMINFO,
+                                                0, 0, FLAC_STREAMINFO_SIZE };
+    flac_write_streaminfo(&writer->info, block + 4);
+    byte_sink_write(sink, "fLaC", 4);
+    writer->streaminfo_offset = sink->size + 4;
+    byte_sink_write(sink, block, sizeof(block));
+    if (described) {
+        uint32_t size = 4 + sizeof(ImageMetadata);
+        uint8_t application[4] = { 0x80 | FLAC_BLOCK_APPLICATION, (uint8_t)(size >> 16), (uint8_t)(size >> 8),
+                                    (uint8_t)size };
+        byte_sink_write(sink, application, 4);
+        byte_sink_write(sink, FLAC_APPLICATION_ID, 4);
+        byte_sink_write(sink, metadata, sizeof(ImageMetadata));
+    }
+    if (sink->failed) {
+        flac_writer_free(writer);
+        return NULL;
+    }
+    return writer;
+}
+
+static void flac_encode_items(void *job, int worker, int from, int to) {
+    FlacWriter *writer = (FlacWriter *)job;
+    size_t capacity = flac_frame_capacity(FLAC_BLOCK_SIZE);
+    uint8_t *work = writer->work + (size_t)worker * flac_work_size(FLAC_BLOCK_SIZE);
+    for (int b = from; b < to; b++) {
+        int first = b * FLAC_BLOCK_SIZE;
+        int count = writer->pending_count - first < FLAC_BLOCK_SIZE ? writer->pending_count - first : FLAC_BLOCK_SIZE;
+        writer->frame_sizes[b] = flac_encode_frame(&writer->info, writer->pending + first, count,
+                                                   writer->frame_number + b, writer->frames + b * capacity, work);
+    }
+}
+
+// Encode the pending samples, a short last block only at the end of the stream
+static int flac_writer_flush(FlacWriter *writer) {
+    int blocks = (writer->pending_count + FLAC_BLOCK_SIZE - 1) / FLAC_BLOCK_SIZE;
+    size_t capacity = flac_frame_capacity(FLAC_BLOCK_SIZE);
+    run_workers(flac_encode_items, writer, blocks, writer->workers);
+    for (int b = 0; b < blocks; b++) {
+        uint32_t size = (uint32_t)writer->frame_sizes[b];
+        writer->info.min_frame = writer->info.min_frame == 0 || size < writer->info.min_frame ? size : writer->info.min_frame;
+        writer->info.max_frame = size > writer->info.max_frame ? size : writer->info.max_frame;
+        if (byte_sink_write(writer->sink, writer->frames + b * capacity, size) != 0) {
+            return -1;
+        }
+    }
+    writer->frame_number += blocks;
+    writer->pending_count = 0;
+    return 0;
+}
+
+// 16-bit samples into the stream, 8-bit streams get them rounded as unsigned 8-bit PCM would, minus 128
+static int flac_writer_write(FlacWriter *writer, const int16_t *samples, int count) {
+    int batch = FLAC_BATCH_BLOCKS * FLAC_BLOCK_SIZE;
+    while (count > 0) {
+        int take = batch - writer->pending_count < count ? batch - writer->pending_count : count;
+        int16_t *pending = writer->pending + writer->pending_count;
+        if (writer->info.bits == 8) {
+            for (int i = 0; i < take; i++) {
+                int value = (samples[i] + 128) >> 8;
+                pending[i] = (int16_t)(value > 127 ? 127 : value);
+            }
+        } else {
+            memcpy(pending, samples, (size_t)take * sizeof(int16_t));
+        }
+        writer->pending_count += take;
+        writer->written += take;
+        samples += take;
+        count -= take;
+        if (writer->pending_count == batch && flac_writer_flush(writer) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Encode what is left and fix STREAMINFO (total and frame sizes) when complete and the sink can seek
+static int flac_writer_close(FlacWriter *writer, bool complete) {
+    int result = 0;
+    if (complete) {
+        result = writer->pending_count > 0 ? flac_writer_flush(writer) : 0;
+        uint8_t streaminfo[FLAC_STREAMINFO_SIZE];
+        writer->info.total_samples = writer->written;
+        flac_write_streaminfo(&writer->info, streaminfo);
+        byte_sink_patch(writer->sink, writer->streaminfo_offset, streaminfo, sizeof(streaminfo));
+    }
+    flac_writer_free(writer);
+    return result;
+}
+
+typedef struct {
+    ByteSource *source;
+    FlacStreamInfo info;
+    int workers;
+    int batch;                  // frames decoded per batch
+    uint8_t *buffer;            // compressed bytes, [offset, count) not decoded yet
+    size_t offset;
+    size_t count;
+    size_t capacity;
+    bool ended;                 // the rest of the source is in the buffer
+    bool failed;                // a damaged frame ended the stream early
+    size_t *starts;             // frame starts of a batch from offset, then the end of its last frame
+    int *decoded_counts;        // samples of each frame, -1 when it didn't end where the next one starts
+    int32_t *decoded;           // max_block samples per frame of a batch
+    uint8_t *pcm;               // the samples as WAV data bytes, [pcm_offset, pcm_count) not handed out
+    size_t pcm_offset;
+    size_t pcm_count;
+} FlacReader;
+
+static void flac_reader_free(FlacReader *reader) {
+    free(reader->buffer);
+    free(reader->starts);
+    free(reader->decoded_counts);
+    free(reader->decoded);
+    free(reader->pcm);
+    free(reader);
+}
+
+// Read the metadata blocks after the "fLaC" tag and describe the stream as the WAV header it would have
+// had. Totals a WAV can't hold (or unknown ones) leave the data size unknown, it is read to the end.
+static FlacReader *flac_reader_open(ByteSource *source, WavHeader *header, ImageMetadata *metadata) {
+    FlacStreamInfo info;
+    bool have_info = false, last = false;
+    while (!last) {
+        uint8_t block[4], data[FLAC_STREAMINFO_SIZE];
+        if (byte_source_read(source, block, 4) != 4) {
+            break;
+        }
+        last = (block[0] & 0x80) != 0;
+        int type = block[0] & 0x7F;
+        uint32_t size = (uint32_t)block[1] << 16 | block[2] << 8 | block[3];
+        bool ok;
+        if (type == FLAC_BLOCK_STREAMINFO && size == FLAC_STREAMINFO_SIZE) {
+            ok = byte_source_read(source, data, size) == size && flac_read_streaminfo(&info, data) == 0;
+            have_info = ok;
+        } else if (type == FLAC_BLOCK_APPLICATION && size >= 4) {
+            ok = byte_source_read(source, data, 4) == 4;
+            size -= 4;
+            if (ok && memcmp(data, FLAC_APPLICATION_ID, 4) == 0) {
+                size_t known = size < sizeof(ImageMetadata) ? size : sizeof(ImageMetadata);
+                ok = byte_source_read(source, metadata, known) == known;
+                size -= (uint32_t)known;
+            }
+            ok = ok && byte_source_skip(source, size);
+        } else {
+            ok = byte_source_skip(source, size);
+        }
+        if (!ok) {
+            have_info = false;
+            break;
+        }
+    }
+    if (!have_info || !last) {
+        conversion_error("Couldn't read the FLAC metadata blocks.\n");
+        return NULL;
+    }
+
+    int bytes = (info.bits + 7) / 8;
+    uint64_t total = info.total_samples;
+    fill_wav_header_bits(header, total == 0 ? -1 : (int64_t)total, info.sample_rate, bytes * 8);
+    header->channels = info.channels;
+    header->bits_per_sample = info.bits;
+    if (!wav_format_supported(header, 1)) {
+        return NULL;
+    }
+
+    FlacReader *reader = (FlacReader *)calloc(1, sizeof(FlacReader));
+    if (reader == NULL) {
+        conversion_error("Couldn't allocate memory for the FLAC decoder.\n");
+        return NULL;
+    }
+    reader->source = source;
+    reader->info = info;
+    reader->workers = worker_count();
+    reader->batch = FLAC_BATCH_BLOCKS * FLAC_BLOCK_SIZE / info.max_block;
+    reader->batch = reader->batch < 1 ? 1 : reader->batch;
+    reader->capacity = (reader->batch + 1) * flac_frame_capacity(info.max_block);
+    reader->buffer = (uint8_t *)malloc(reader->capacity);
+    reader->starts = (size_t *)malloc((reader->batch + 1) * sizeof(size_t));
+    reader->decoded_counts = (int *)malloc(reader->batch * sizeof(int));
+    reader->decoded = (int32_t *)malloc((size_t)reader->batch * info.max_block * sizeof(int32_t));
+    reader->pcm = (uint8_t *)malloc((size_t)reader->batch * info.max_block * bytes);
+    if (reader->buffer == NULL || reader->starts == NULL || reader->decoded_counts == NULL ||
+        reader->decoded == NULL || reader->pcm == NULL) {
+        flac_reader_free(reader);
+        conversion_error("Couldn't allocate memory for the FLAC decoder.\n");
+        return NULL;
+    }
+    return reader;
+}
+
+// A frame header this stream's buffers can take
+static bool flac_frame_fits(const FlacReader *reader, const FlacFrameHeader *frame) {
+    return frame->block_size <= reader->info.max_block && (frame->bits == 0 || frame->bits == reader->info.bits);
+}
+
+// Start of the frame after the one at start (its header in *frame, replaced by the next one's): the first
+// valid header numbered right after it, or 0 when the buffer holds none
+static size_t flac_next_frame(const FlacReader *reader, size_t start, FlacFrameHeader *frame) {
+    const uint8_t *data = reader->buffer + reader->offset;
+    size_t size = reader->count - reader->offset;
+    uint64_t number = frame->number + (frame->variable ? (uint64_t)frame->block_size : 1);
+    for (size_t at = start + frame->size; at + 1 < size; at++) {
+        const uint8_t *sync = (const uint8_t *)memchr(data + at, 0xFF, size - 1 - at);
+        if (sync == NULL) {
+            break;
+        }
+        at = (size_t)(sync - data);
+        FlacFrameHeader next;
+        if ((sync[1] & 0xFE) == 0xF8 && flac_frame_header(sync, size - at, &next) == 0 &&
+            next.number == number && next.variable == frame->variable && flac_frame_fits(reader, &next)) {
+            *frame = next;
+            return at;
+        }
+    }
+    return 0;
+}
+
+static void flac_decode_items(void *job, int worker, int from, int to) {
+    FlacReader *reader = (FlacReader *)job;
+    (void)worker;
+    for (int f = from; f < to; f++) {
+        size_t size = reader->starts[f + 1] - reader->starts[f], used;
+        int count = flac_decode_frame(&reader->info, reader->buffer + reader->offset + reader->starts[f], size,
+                                      reader->decoded + (size_t)f * reader->info.max_block, &used);
+        reader->decoded_counts[f] = count >= 0 && used == size ? count : -1;
+    }
+}
+
+// Decode the next batch of frames into pcm, false at the end of the stream
+static bool flac_reader_batch(FlacReader *reader) {
+    memmove(reader->buffer, reader->buffer + reader->offset, reader->count - reader->offset);
+    reader->count -= reader->offset;
+    reader->offset = 0;
+    if (!reader->ended) {
+        size_t wanted = reader->capacity - reader->count;
+        size_t got = byte_source_read(reader->source, reader->buffer + reader->count, wanted);
+        reader->count += got;
+        reader->ended = got < wanted;
+    }
+    if (reader->count == 0) {
+        return false;
+    }
+
+    FlacFrameHeader frame;
+    int frames = 0;
+    if (flac_frame_header(reader->buffer, reader->count, &frame) == 0 && flac_frame_fits(reader, &frame)) {
+        reader->starts[0] = 0;
+        while (frames < reader->batch) {
+            size_t next = flac_next_frame(reader, reader->starts[frames], &frame);
+            if (next == 0 && !reader->ended && frames > 0) {
+                break; // the last frame may not be in the buffer whole yet
+            }
+            reader->starts[++frames] = next ? next : reader->count;
+            if (next == 0) {
+                break;
+            }
+        }
+        run_workers(flac_decode_items, reader, frames, reader->workers);
+    }
+
+    int good = 0;
+    while (good < frames && reader->decoded_counts[good] >= 0) {
+        good++;
+    }
+    size_t end = reader->starts[good];
+    if (good == 0) {
+        // The first frame didn't end where a header seemed to start (or had none): decode it on its own
+        int count = flac_decode_frame(&reader->info, reader->buffer, reader->count, reader->decoded, &end);
+        if (count < 0 || count > reader->info.max_block) {
+            conversion_error("Damaged FLAC frame, the audio ends early.\n");
+            reader->failed = true;
+            return false;
+        }
+        reader->decoded_counts[0] = count;
+        good = 1;
+    }
+    reader->offset = end;
+
+    size_t n = 0;
+    for (int f = 0; f < good; f++) {
+        const int32_t *samples = reader->decoded + (size_t)f * reader->info.max_block;
+        int count = reader->decoded_counts[f];
+        if (reader->info.bits == 8) {
+            for (int i = 0; i < count; i++) {
+                reader->pcm[n++] = (uint8_t)(samples[i] + 128);
+            }
+        } else {
+            int16_t *pcm = (int16_t *)reader->pcm;
+            for (int i = 0; i < count; i++) {
+                pcm[n++] = (int16_t)samples[i];
+            }
+        }
+    }
+    reader->pcm_offset = 0;
+    reader->pcm_count = n * (reader->info.bits / 8);
+    return true;
+}
+
+// ByteSource callback handing out the decoded samples
+static size_t flac_reader_read(void *state, void *out, size_t size) {
+    FlacReader *reader = (FlacReader *)state;
+    size_t given = 0;
+    while (given < size) {
+        if (reader->pcm_offset == reader->pcm_count) {
+            if (reader->failed || !flac_reader_batch(reader)) {
+                break;
+            }
+            continue;
+        }
+        size_t take = reader->pcm_count - reader->pcm_offset < size - given ? reader->pcm_count - reader->pcm_offset
+                                                                            : size - given;
+        memcpy((uint8_t *)out + given, reader->pcm + reader->pcm_offset, take);
+        reader->pcm_offset += take;
+        given += take;
+    }
+    return given;
+}
+
+// Release the decoder, -1 when a damaged frame cut the audio short
+static int flac_reader_close(FlacReader *reader) {
+    int result = reader->failed ? -1 : 0;
+    flac_reader_free(reader);
+    return result;
+}
+
+// Read the header of a WAV or FLAC stream into ctx. Returns the source the samples come from, as WAV data
+// bytes: input itself for a WAV, *pcm decoding the FLAC stream otherwise (*flac is set, and closed with
+// flac_reader_close). NULL when the input is neither.
+static ByteSource *read_audio_header(ConversionContext *ctx, ByteSource *input, ByteSource *pcm, FlacReader **flac) {
+    char magic[4];
+    *flac = NULL;
+    memset(&ctx->header, 0, sizeof(ctx->header));
+    memset(&ctx->metadata, 0, sizeof(ctx->metadata));
+    size_t got = byte_source_read(input, magic, 4);
+    if (got == 4 && memcmp(magic, "RIFF", 4) == 0) {
+        return read_wav_chunks(input, &ctx->header, &ctx->metadata, NULL) == 0 ? input : NULL;
+    }
+    if (got != 4 || memcmp(magic, "fLaC", 4) != 0) {
+        conversion_error("The input is neither a WAV nor a FLAC file.\n");
+        return NULL;
+    }
+    if ((*flac = flac_reader_open(input, &ctx->header, &ctx->metadata)) == NULL) {
+        return NULL;
+    }
+    memset(pcm, 0, sizeof(*pcm));
+    pcm->read = flac_reader_read;
+    pcm->state = *flac;
+    return pcm;
+}
+
+// -------------------------------------------------------------------------------------------------------- sync
+// Framed raw rows: every group of rows starts with SYNC_MARKER_SAMPLES of a fixed two level pattern and
+// the index of its first row, 24 bits and a CRC-8, every chip and bit SYNC_CHIP_SAMPLES long. Decoders
+// find the markers by correlation wherever they are, so lost or extra samples only damage the group they
+// fall in, and the groups between markers can be decoded independently.
+
+#define SYNC_LEVEL 24576            // both levels are exact in 8-bit PCM too
+#define SYNC_PATTERN 0x4C391FD2u    // 16 ones, off-peak autocorrelation at most 4 of 32
+#define SYNC_THRESHOLD_PERCENT 70   // of the correlation of a clean marker
+#define SYNC_FRAME_SAMPLES (SYNC_MARKER_SAMPLES + SYNC_INDEX_SAMPLES)
+
+static uint8_t sync_crc8(uint32_t row) {
+    uint8_t crc = 0;
+    for (int i = 23; i >= 0; i--) {
+        bool bit = ((row >> i) & 1) != (uint32_t)(crc >> 7);
+        crc = (uint8_t)((crc << 1) ^ (bit ? 0x07 : 0));
+    }
+    return crc;
+}
+
+// Marker and index opening the group that starts at row, SYNC_FRAME_SAMPLES samples
+static void sync_frame_header(int16_t *out, uint32_t row) {
+    uint32_t index = row << 8 | sync_crc8(row);
+    for (int k = 0; k < SYNC_MARKER_SAMPLES; k++) {
+        out[k] = (SYNC_PATTERN >> (31 - k / SYNC_CHIP_SAMPLES)) & 1 ? SYNC_LEVEL : -SYNC_LEVEL;
+    }
+    for (int k = 0; k < SYNC_INDEX_SAMPLES; k++) {
+        out[SYNC_MARKER_SAMPLES + k] = (index >> (31 - k / SYNC_CHIP_SAMPLES)) & 1 ? SYNC_LEVEL : -SYNC_LEVEL;
+    }
+}
+
+typedef struct {
+    size_t position;        // first sample of the marker in the search buffer
+    uint32_t row;
+} SyncMark;
+
+// Markers in a buffer of samples, searched by several workers over consecutive ranges of positions
+typedef struct {
+    const int16_t *samples;
+    int16_t pattern[SYNC_MARKER_SAMPLES];   // +-1
+    int32_t threshold;
+    SyncMark *marks;        // room for positions / SYNC_FRAME_SAMPLES + WORKER_THREADS_MAX marks
+    int first[WORKER_THREADS_MAX];
+    int found[WORKER_THREADS_MAX];
+} SyncSearch;
+
+static void sync_search_init(SyncSearch *search) {
+    memset(search, 0, sizeof(*search));
+    for (int k = 0; k < SYNC_MARKER_SAMPLES; k++) {
+        search->pattern[k] = (SYNC_PATTERN >> (31 - k / SYNC_CHIP_SAMPLES)) & 1 ? 1 : -1;
+    }
+    search->threshold = (int32_t)((int64_t)SYNC_LEVEL * SYNC_MARKER_SAMPLES * SYNC_THRESHOLD_PERCENT / 100);
+}
+
+// Markers with a valid index starting at positions [from, to). Each worker fills its own part of marks,
+// large enough since a marker found skips the samples it spans.
+static void sync_search_items(void *arg, int worker, int from, int to) {
+    SyncSearch *search = (SyncSearch *)arg;
+    int first = from / SYNC_FRAME_SAMPLES + worker, found = 0;
+    for (int p = from; p < to; p++) {
+        const int16_t *x = search->samples + p;
+        if (correlate_s16(x, search->pattern, SYNC_MARKER_SAMPLES) < search->threshold) {
+            continue;
+        }
+        uint32_t index = 0;
+        for (int k = 0; k < SYNC_INDEX_SAMPLES; k += SYNC_CHIP_SAMPLES) {
+            int32_t bit = 0;
+            for (int c = 0; c < SYNC_CHIP_SAMPLES; c++) {
+                bit += x[SYNC_MARKER_SAMPLES + k + c];
+            }
+            index = index << 1 | (bit > 0);
+        }
+        if (sync_crc8(index >> 8) != (index & 0xFF)) {
+            continue;
+        }
+        search->marks[first + found++] = (SyncMark){ (size_t)p, index >> 8 };
+        p += SYNC_FRAME_SAMPLES - 1;
+    }
+    search->first[worker] = first;
+    search->found[worker] = found;
+}
+
+// -------------------------------------------------------------------------------------------------------- fec
+// Reed-Solomon coded raw pixels. The pixels are cut into blocks of RS_LANES codewords: RS_LANES pixels
+// to a row, the 255 - parity data rows go out unchanged and the parity rows follow them, so a burst of
+// wrong samples is shared out over all the codewords of its block. The last block is shortened to the
+// pixels left, its last row padded with black.
+
+// Samples carrying pixels with parity symbols per codeword
+static size_t fec_stream_samples(size_t pixels, int parity) {
+    size_t block = (size_t)(255 - parity) * RS_LANES;
+    size_t rest = pixels % block;
+    return pixels / block * 255 * RS_LANES + (rest ? ((rest + RS_LANES - 1) / RS_LANES + parity) * RS_LANES : 0);
+}
+
+// Consecutive blocks of a stream, laid out as they are sent: full blocks of 255 rows, then maybe a short one
+typedef struct {
+    const RsCode *code;
+    uint8_t *symbols;
+    size_t count;           // symbols of the batch, data and parity
+    const int16_t *samples; // decoding: the samples the symbols are rounded from
+    int failed[WORKER_THREADS_MAX]; // decoding: codewords with more errors than the code corrects
+} FecBatch;
+
+static int fec_block_rows(const FecBatch *batch, int block) {
+    size_t start = (size_t)block * 255 * RS_LANES;
+    size_t left = batch->count - start;
+    return left < 255 * RS_LANES ? (int)(left / RS_LANES) : 255;
+}
+
+static void fec_encode_items(void *arg, int worker, int from, int to) {
+    FecBatch *batch = (FecBatch *)arg;
+    (void)worker;
+    for (int b = from; b < to; b++) {
+        uint8_t *block = batch->symbols + (size_t)b * 255 * RS_LANES;
+        int rows = fec_block_rows(batch, b) - batch->code->parity;
+        rs_encode(batch->code, block, rows, block + (size_t)rows * RS_LANES);
+    }
+}
+
+static void fec_decode_items(void *arg, int worker, int from, int to) {
+    FecBatch *batch = (FecBatch *)arg;
+    int failed = 0;
+    for (int b = from; b < to; b++) {
+        size_t start = (size_t)b * 255 * RS_LANES;
+        int rows = fec_block_rows(batch, b);
+        pcm_s16_to_u8(batch->samples + start, batch->symbols + start, (size_t)rows * RS_LANES);
+        failed += rs_decode(batch->code, batch->symbols + start, rows);
+    }
+    batch->failed[worker] = failed;
+}
+
+// -------------------------------------------------------------------------------------------------------- order
+// Raw pixels in another order than rows. The encoder holds the whole image and gathers its samples in the
+// order chunk by chunk, the decoder puts them back into a whole frame as they arrive.
+
+// Adam7 passes: first pixel, spacing, and the block a pixel of the pass stands in for until later passes come
+static const uint8_t adam7_passes[7][6] = {
+    // x0, y0, dx, dy, block width, block height
+    { 0, 0, 8, 8, 8, 8 }, { 4, 0, 8, 8, 4, 8 }, { 0, 4, 4, 8, 4, 4 }, { 2, 0, 4, 4, 2, 4 },
+    { 0, 2, 2, 4, 2, 2 }, { 1, 0, 2, 2, 1, 2 }, { 0, 1, 1, 2, 1, 1 },
+};
+
+// Morton and Hilbert curves through one ORDER_TILE x ORDER_TILE tile, as y << ORDER_TILE_BITS | x per step
+static uint16_t morton_curve[ORDER_TILE * ORDER_TILE];
+static uint16_t hilbert_curve[ORDER_TILE * ORDER_TILE];
+static pthread_once_t curves_once = PTHREAD_ONCE_INIT;
+
+static void fill_curves(void) {
+    for (int d = 0; d < ORDER_TILE * ORDER_TILE; d++) {
+        // Morton: x in the even bits of the step, y in the odd ones
+        int x = 0, y = 0;
+        for (int b = 0; b < ORDER_TILE_BITS; b++) {
+            x |= ((d >> (2 * b)) & 1) << b;
+            y |= ((d >> (2 * b + 1)) & 1) << b;
+        }
+        morton_curve[d] = (uint16_t)(y << ORDER_TILE_BITS | x);
+
+        // Hilbert: quadrant by quadrant from the top, rotated so the curve runs from (0, 0) to (tile - 1, 0)
+        x = y = 0;
+        for (int size = 1, t = d; size < ORDER_TILE; size *= 2, t /= 4) {
+            int rx = 1 & (t / 2), ry = 1 & (t ^ rx);
+            if (ry == 0) {
+                if (rx == 1) {
+                    x = size - 1 - x;
+                    y = size - 1 - y;
+                }
+                int swap = x;
+                x = y;
+                y = swap;
+            }
+            x += size * rx;
+            y += size * ry;
+        }
+        hilbert_curve[d] = (uint16_t)(y << ORDER_TILE_BITS | x);
+    }
+}
+
+// Position in the sequence of pixels of an ORDER_
+typedef struct {
+    int order;
+    int width;
+    int height;
+    int pass;               // Adam7 pass of the next pixel, 7 at the end
+    int x;                  // next pixel of a row order, origin of the next tile of a curve
+    int y;
+    int step;               // along the curve through the tile
+    const uint16_t *curve;  // NULL for the row orders
+} PixelOrder;
+
+static void pixel_order_init(PixelOrder *order, int kind, int width, int height) {
+    order->order = kind;
+    order->width = width;
+    order->height = height;
+    order->pass = kind == ORDER_ADAM7 ? 0 : 7;
+    order->x = 0;
+    order->y = 0;
+    order->step = 0;
+    order->curve = NULL;
+    if (kind == ORDER_MORTON || kind == ORDER_HILBERT) {
+        pthread_once(&curves_once, fill_curves);
+        order->curve = kind == ORDER_MORTON ? morton_curve : hilbert_curve;
+    }
+}
+
+// The next pixels of the passes of ORDER_ADAM7
+static size_t adam7_next(PixelOrder *order, uint32_t *offsets, size_t count) {
+    size_t n = 0;
+    while (n < count && order->pass < 7) {
+        const uint8_t *pass = adam7_passes[order->pass];
+        if (order->y >= order->height) {
+            if (++order->pass < 7) {
+                order->x = adam7_passes[order->pass][0];
+                order->y = adam7_passes[order->pass][1];
+            }
+            continue;
+        }
+        if (order->x >= order->width) {
+            order->x = pass[0];
+            order->y += pass[3];
+            continue;
+        }
+        // Along one row of the pass, so the gather stays within one image row
+        uint32_t row = (uint32_t)order->y * order->width;
+        int x = order->x, dx = pass[2];
+        while (n < count && x < order->width) {
+            offsets[n++] = row + x;
+            x += dx;
+        }
+        order->x = x;
+    }
+    return n;
+}
+
+// The next pixels of ORDER_BOUSTROPHEDON: rows left to right and right to left in turn
+static size_t boustrophedon_next(PixelOrder *order, uint32_t *offsets, size_t count) {
+    size_t n = 0;
+    int width = order->width;
+    while (n < count && order->y < order->height) {
+        uint32_t row = (uint32_t)order->y * width;
+        size_t take = (size_t)(width - order->x) < count - n ? (size_t)(width - order->x) : count - n;
+        if (order->y & 1) {
+            for (size_t i = 0; i < take; i++) {
+                offsets[n + i] = row + (width - 1 - order->x - (int)i);
+            }
+        } else {
+            for (size_t i = 0; i < take; i++) {
+                offsets[n + i] = row + order->x + (int)i;
+            }
+        }
+        n += take;
+        order->x += (int)take;
+        if (order->x == width) {
+            order->x = 0;
+            order->y++;
+        }
+    }
+    return n;
+}
+
+// The next pixels of a curve order: the image in tiles of ORDER_TILE, the curve through each, steps off the
+// image skipped in the tiles on its right and bottom edges. Hilbert tiles go back and forth along the rows of
+// tiles, mirrored on the way back, so the curve runs on from the end of one tile into the next.
+static size_t curve_next(PixelOrder *order, uint32_t *offsets, size_t count) {
+    size_t n = 0;
+    int width = order->width;
+    int tiles_across = (width + ORDER_TILE - 1) / ORDER_TILE;
+    while (n < count && order->y < order->height) {
+        int tile_y = order->y / ORDER_TILE;
+        bool back = order->order == ORDER_HILBERT && (tile_y & 1);
+        int origin = back ? (tiles_across - 1 - order->x / ORDER_TILE) * ORDER_TILE : order->x;
+        int columns = width - origin < ORDER_TILE ? width - origin : ORDER_TILE;
+        int rows = order->height - order->y < ORDER_TILE ? order->height - order->y : ORDER_TILE;
+        uint32_t base = (uint32_t)order->y * width + origin;
+        while (n < count && order->step < ORDER_TILE * ORDER_TILE) {
+            uint16_t at = order->curve[order->step++];
+            int x = at & (ORDER_TILE - 1), y = at >> ORDER_TILE_BITS;
+            if (back) {
+                x = ORDER_TILE - 1 - x;
+            }
+            if (x < columns && y < rows) {
+                offsets[n++] = base + (uint32_t)y * width + x;
+            }
+        }
+        if (order->step == ORDER_TILE * ORDER_TILE) {
+            order->step = 0;
+            order->x += ORDER_TILE;
+            if (order->x >= width) {
+                order->x = 0;
+                order->y += ORDER_TILE;
+            }
+        }
+    }
+    return n;
+}
+
+// Image offsets (y * width + x) of the next count pixels, fewer only at the end of the image
+static size_t pixel_order_next(PixelOrder *order, uint32_t *offsets, size_t count) {
+    switch (order->order) {
+        case ORDER_ADAM7: return adam7_next(order, offsets, count);
+        case ORDER_BOUSTROPHEDON: return boustrophedon_next(order, offsets, count);
+        default: return curve_next(order, offsets, count);
+    }
+}
+
+// Adam7 pass of every pixel of an 8 x 8 block, [y][x]
+static const uint8_t adam7_pass_of[8][8] = {
+    { 0, 5, 3, 5, 1, 5, 3, 5 }, { 6, 6, 6, 6, 6, 6, 6, 6 }, { 4, 5, 4, 5, 4, 5, 4, 5 }, { 6, 6, 6, 6, 6, 6, 6, 6 },
+    { 2, 5, 3, 5, 2, 5, 3, 5 }, { 6, 6, 6, 6, 6, 6, 6, 6 }, { 4, 5, 4, 5, 4, 5, 4, 5 }, { 6, 6, 6, 6, 6, 6, 6, 6 },
+};
+
+// A received Adam7 pixel into the frame, standing in for the block of pixels later passes will send. The
+// frame is a whole image at any point of the stream, sharpening pass by pass.
+static void adam7_put(uint8_t *frame, int width, int height, uint32_t offset, uint8_t value) {
+    int x = (int)(offset % (uint32_t)width), y = (int)(offset / (uint32_t)width);
+    const uint8_t *pass = adam7_passes[adam7_pass_of[y & 7][x & 7]];
+    int columns = width - x < pass[4] ? width - x : pass[4];
+    int rows = height - y < pass[5] ? height - y : pass[5];
+    for (int r = 0; r < rows; r++) {
+        memset(frame + offset + (size_t)r * width, value, columns);
+    }
+}
+
+// -------------------------------------------------------------------------------------------------------- samples
+// Raw pixels are clocked at their own rate. When the WAV runs at another rate, samples pass through a
+// polyphase resampler on the way out and on the way back in, so the image keeps its timing.
+// Samples are 16-bit everywhere in between; 8-bit and float WAV data is packed and unpacked at the file.
+
+// Samples on their way into the WAV or FLAC data
+typedef struct {
+    ByteSink *sink;
+    int bits;               // 16, 8 for unsigned 8-bit PCM or 32 for float
+    FlacWriter *flac;       // NULL for WAV
+    size_t header_offset;
+    const ImageMetadata *metadata;
+    Resampler resampler;
+    bool resampling;
+    int16_t *converted;     // room for one BUFFER_SIZE chunk or the final flush
+    uint8_t *packed;        // one BUFFER_SIZE chunk of 8-bit or float samples
+    uint64_t written;       // samples written to the sink
+    int frame_rows;         // rows per sync framed group, 0 without framing
+    int frame_samples;      // samples of a group
+    int frame_left;         // samples still to come in the current group
+    uint32_t frame_row;     // first row of the next group
+    RsCode *fec;            // Reed-Solomon code of the pixels, NULL without FEC
+    uint8_t *fec_symbols;   // FEC_BATCH_BLOCKS blocks as they are sent, data rows filled as pixels come in
+    int16_t *fec_samples;   // one BUFFER_SIZE chunk of coded samples
+    size_t fec_fill;        // pixels in the batch
+    size_t fec_left;        // pixels still to come
+    int fec_workers;
+    bool checksums;         // WAV data is hashed for the "w2ck" chunk
+    ChecksumState checksum;
+    bool indexed;           // rows are hashed tile by tile for the "w2ix" chunk
+    RowIndexState index;
+    int predictor;          // PREDICT_ of the rows, PREDICT_NONE without prediction
+    int predict_width;
+    int predict_fill;       // pixels of the row being collected
+    uint8_t *predict_rows;  // the row being collected, the row above it, and residuals of two predictors
+    int16_t *predicted;     // the samples of a predicted row, its predictor first
+} SampleOutput;
+
+static int sample_output_close(SampleOutput *out, ConversionContext *ctx, bool complete);
+
+// Start the audio with its WAV or FLAC header (ctx->header gets the WAV one either way). Samples written at
+// pixel_rate come out at the sample rate and size of the options. Several channels are written interleaved,
+// as WAV only and without resampling; num_samples counts the samples of all of them. A negative
+// num_samples leaves the sizes provisional until sample_output_close.
+static int sample_output_open(SampleOutput *out, ConversionContext *ctx, ByteSink *sink, int pixel_rate,
+                              int channels, int64_t num_samples, const ImageMetadata *metadata) {
+    int sample_rate = ctx->options.sample_rate;
+    int bits = ctx->options.bits_per_sample;
+    memset(out, 0, sizeof(*out));
+    out->sink = sink;
+    out->bits = bits;
+    out->header_offset = sink->size;
+    out->metadata = metadata;
+    if (channels > 1 && ctx->options.container != CONTAINER_WAV) {
+        conversion_error("FLAC output is mono, write multi-channel audio as a WAV.\n");
+        return -1;
+    }
+    if (bits == 32 && ctx->options.container != CONTAINER_WAV) {
+        conversion_error("FLAC holds integer samples, write float audio as a WAV.\n");
+        return -1;
+    }
+    if (channels > 1 && pixel_rate != sample_rate) {
+        conversion_error("Multi-channel audio can't be resampled, use the same pixel and sample rate.\n");
+        return -1;
+    }
+    if (num_samples >= 0 && !audio_size_fits(&ctx->options, (uint64_t)num_samples)) {
+        conversion_error("The audio would be too long for a %s.\n",
+                         ctx->options.container == CONTAINER_WAV ? "WAV file" : "FLAC stream");
+        return -1;
+    }
+    fill_wav_header_bits(&ctx->header, num_samples, sample_rate, bits);
+    wav_header_set_channels(&ctx->header, channels);
+    out->checksums = ctx->options.container == CONTAINER_WAV;
+    if (out->checksums && metadata_chunk_size(metadata) > 0) {
+        out->checksum.check.metadata_crc = crc32c_update(0, metadata, sizeof(ImageMetadata));
+    }
+    if (out->checksums && ctx->header.data_size != WAV_SIZE_UNKNOWN) {
+        ctx->header.file_size += (uint32_t)checksum_chunk_size(ctx->header.data_size);
+    }
+    if (ctx->options.container == CONTAINER_FLAC) {
+        if ((out->flac = flac_writer_open(sink, sample_rate, bits, num_samples, metadata)) == NULL) {
+            return -1;
+        }
+    } else {
+        write_wav_stream_header(sink, &ctx->header, metadata);
+        if (bits != 16 && (out->packed = (uint8_t *)malloc((size_t)BUFFER_SIZE * (bits / 8))) == NULL) {
+            sample_output_close(out, ctx, false);
+            conversion_error("Couldn't allocate memory for %d-bit samples.\n", bits);
+            return -1;
+        }
+    }
+    if (pixel_rate == sample_rate) {
+        return 0;
+    }
+    if (resampler_init(&out->resampler, pixel_rate, sample_rate) != 0) {
+        sample_output_close(out, ctx, false);
+        return -1;
+    }
+    out->resampling = true;
+    size_t chunk = resampler_capacity(&out->resampler, BUFFER_SIZE);
+    size_t flush = resampler_capacity(&out->resampler, out->resampler.taps);
+    out->converted = (int16_t *)malloc((chunk > flush ? chunk : flush) * sizeof(int16_t));
+    if (out->converted == NULL) {
+        sample_output_close(out, ctx, false);
+        conversion_error("Couldn't allocate memory for resampling.\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Bytes of WAV data into the sink, hashed on the way
+static int sample_output_data(SampleOutput *out, const void *data, size_t size) {
+    if (out->checksums && checksum_update(&out->checksum, data, size) != 0) {
+        return -1;
+    }
+    if (out->indexed) {
+        row_index_update(&out->index, data, size);
+    }
+    return byte_sink_write(out->sink, data, size);
+}
+
+// Append the "w2ck" chunk and the "w2ix" one of indexed rows, and correct the RIFF size for them when the
+// header can still be changed
+static int sample_output_checksums(SampleOutput *out, ConversionContext *ctx) {
+    ChecksumHeader *check = &out->checksum.check;
+    if (checksum_finish(&out->checksum) != 0) {
+        return -1;
+    }
+    uint32_t size = (uint32_t)(sizeof(ChecksumHeader) + check->blocks * sizeof(uint32_t));
+    uint8_t pad = 0;
+    if (check->data_bytes & 1) {
+        byte_sink_write(out->sink, &pad, 1);
+    }
+    byte_sink_write(out->sink, "w2ck", 4);
+    byte_sink_write(out->sink, &size, 4);
+    byte_sink_write(out->sink, check, sizeof(ChecksumHeader));
+    if (check->blocks > 0) {
+        byte_sink_write(out->sink, out->checksum.block_crcs, check->blocks * sizeof(uint32_t));
+    }
+    // The index only speeds up region decodes, a file at the limit of the RIFF size goes without it
+    const RowIndexHeader *index = &out->index.index;
+    uint64_t index_size = sizeof(RowIndexHeader) + (uint64_t)index->tiles * sizeof(uint32_t);
+    if (out->indexed && (uint64_t)out->sink->size - out->header_offset + index_size > UINT32_MAX) {
+        out->indexed = false;
+    }
+    if (out->indexed) {
+        size = (uint32_t)index_size;
+        byte_sink_write(out->sink, "w2ix", 4);
+        byte_sink_write(out->sink, &size, 4);
+        byte_sink_write(out->sink, index, sizeof(RowIndexHeader));
+        byte_sink_write(out->sink, out->index.tile_crcs, index->tiles * sizeof(uint32_t));
+    }
+    if (out->sink->failed) {
+        return -1;
+    }
+    if (out->sink->seekable) {
+        ctx->header.file_size = (uint32_t)(out->sink->size - out->header_offset - 8);
+        return byte_sink_patch(out->sink, out->header_offset + offsetof(WavHeader, file_size),
+                               &ctx->header.file_size, 4);
+    }
+    return 0;
+}
+
+// Samples at the WAV rate into the sink, in the file's sample size
+static int sample_output_emit(SampleOutput *out, const int16_t *samples, int count) {
+    out->written += count;
+    if (out->flac) {
+        return flac_writer_write(out->flac, samples, count);
+    }
+    if (out->bits == 16) {
+        return sample_output_data(out, samples, (size_t)count * sizeof(int16_t));
+    }
+    for (int done = 0; done < count; done += BUFFER_SIZE) {
+        int chunk = count - done < BUFFER_SIZE ? count - done : BUFFER_SIZE;
+        if (out->bits == 8) {
+            pcm_s16_to_u8(samples + done, out->packed, chunk);
+        } else {
+            pcm_s16_to_f32(samples + done, (float *)out->packed, chunk);
+        }
+        if (sample_output_data(out, out->packed, (size_t)chunk * (out->bits / 8)) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Samples at the pixel rate through the resampler when there is one
+static int sample_output_resample(SampleOutput *out, const int16_t *samples, int count) {
+    if (!out->resampling) {
+        return sample_output_emit(out, samples, count);
+    }
+
+    while (count > 0) {
+        int chunk = count < BUFFER_SIZE ? count : BUFFER_SIZE;
+        int produced = resampler_process(&out->resampler, samples, chunk, out->converted);
+        if (produced < 0 || sample_output_emit(out, out->converted, produced) != 0) {
+            return -1;
+        }
+        samples += chunk;
+        count -= chunk;
+    }
+    return 0;
+}
+
+// Put a sync marker and row index before every frame_rows rows of width samples written from now on
+static void sample_output_set_frames(SampleOutput *out, int width, int frame_rows) {
+    out->frame_rows = frame_rows;
+    out->frame_samples = width * frame_rows;
+    out->frame_left = 0;
+    out->frame_row = 0;
+}
+
+// Index the rows of width x height pixels written from now on in a "w2ix" chunk. Only raw grayscale rows in a
+// WAV at the pixel rate lie at fixed offsets, and the chunk is only added to a file that can still be changed.
+static int sample_output_set_index(SampleOutput *out, int width, int height) {
+    if (!out->checksums || !out->sink->seekable || out->resampling || out->frame_rows > 0 || out->fec) {
+        return 0;
+    }
+    if (row_index_init(&out->index, width, height, out->bits / 8, out->checksum.check.data_bytes) != 0) {
+        return -1;
+    }
+    out->indexed = true;
+    return 0;
+}
+
+// Code the pixels written from now on, num_pixels of them, with parity Reed-Solomon symbols per codeword
+static int sample_output_set_fec(SampleOutput *out, int parity, size_t num_pixels) {
+    out->fec = (RsCode *)malloc(sizeof(RsCode));
+    out->fec_symbols = (uint8_t *)malloc((size_t)FEC_BATCH_BLOCKS * 255 * RS_LANES);
+    out->fec_samples = (int16_t *)malloc(BUFFER_SIZE * sizeof(int16_t));
+    if (out->fec == NULL || out->fec_symbols == NULL || out->fec_samples == NULL) {
+        conversion_error("Couldn't allocate memory for error correction.\n");
+        return -1;
+    }
+    if (rs_init(out->fec, parity) != 0) {
+        return -1;
+    }
+    out->fec_fill = 0;
+    out->fec_left = num_pixels;
+    out->fec_workers = worker_count();
+    return 0;
+}
+
+// Parity for the pixels of the batch, over all cores, then the whole batch out as samples
+static int sample_output_fec_flush(SampleOutput *out) {
+    int parity = out->fec->parity;
+    size_t data = (size_t)(255 - parity) * RS_LANES;
+    int blocks = (int)((out->fec_fill + data - 1) / data);
+    if (blocks == 0) {
+        return 0;
+    }
+    size_t last = out->fec_fill - (size_t)(blocks - 1) * data;
+    size_t rows = (last + RS_LANES - 1) / RS_LANES;
+    uint8_t *tail = out->fec_symbols + (size_t)(blocks - 1) * 255 * RS_LANES;
+    memset(tail + last, 0, rows * RS_LANES - last);
+
+    FecBatch batch = { out->fec, out->fec_symbols, (size_t)(blocks - 1) * 255 * RS_LANES + (rows + parity) * RS_LANES,
+                       NULL, { 0 } };
+    run_workers(fec_encode_items, &batch, blocks, out->fec_workers);
+    for (size_t done = 0; done < batch.count; done += BUFFER_SIZE) {
+        size_t chunk = batch.count - done < BUFFER_SIZE ? batch.count - done : BUFFER_SIZE;
+        pcm_u8_to_s16(out->fec_symbols + done, out->fec_samples, chunk);
+        if (sample_output_resample(out, out->fec_samples, (int)chunk) != 0) {
+            return -1;
+        }
+    }
+    out->fec_fill = 0;
+    return 0;
+}
+
+// Pixels into the data rows of the batch, which goes out when it is full or the image complete
+static int sample_output_fec_write(SampleOutput *out, const int16_t *samples, int count) {
+    size_t data = (size_t)(255 - out->fec->parity) * RS_LANES;
+    while (count > 0) {
+        size_t offset = out->fec_fill % data;
+        size_t take = data - offset < (size_t)count ? data - offset : (size_t)count;
+        pcm_s16_to_u8(samples, out->fec_symbols + out->fec_fill / data * 255 * RS_LANES + offset, take);
+        out->fec_fill += take;
+        out->fec_left = out->fec_left > take ? out->fec_left - take : 0;
+        samples += take;
+        count -= (int)take;
+        if ((out->fec_fill == FEC_BATCH_BLOCKS * data || out->fec_left == 0) && sample_output_fec_flush(out) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Send the residuals of rows of width pixels written from now on instead of the pixels. PREDICT_ADAPTIVE tries
+// every predictor on each row and keeps the one with the smallest residuals.
+static int sample_output_set_prediction(SampleOutput *out, int width, int predictor) {
+    out->predict_rows = (uint8_t *)calloc((size_t)width, 4);
+    out->predicted = (int16_t *)malloc(((size_t)width + 1) * sizeof(int16_t));
+    if (out->predict_rows == NULL || out->predicted == NULL) {
+        conversion_error("Couldn't allocate memory for prediction.\n");
+        return -1;
+    }
+    out->predictor = predictor;
+    out->predict_width = width;
+    out->predict_fill = 0;
+    return 0;
+}
+
+// The collected row out as its predictor and residuals, then it becomes the row above
+static int sample_output_predict_row(SampleOutput *out) {
+    size_t width = out->predict_width;
+    uint8_t *row = out->predict_rows, *prev = row + width, *trial = prev + width, *best = trial + width;
+    int predictor = out->predictor;
+    if (predictor == PREDICT_ADAPTIVE) {
+        uint32_t best_cost = UINT32_MAX;
+        for (int p = PREDICT_NONE; p < PREDICT_FILTERS; p++) {
+            predict_row(p, row, prev, trial, width);
+            uint32_t cost = residual_cost(trial, width);
+            if (cost < best_cost) {
+                uint8_t *swap = best;
+                best = trial;
+                trial = swap;
+                best_cost = cost;
+                predictor = p;
+            }
+        }
+    } else {
+        predict_row(predictor, row, prev, best, width);
+    }
+    out->predicted[0] = (int16_t)(predictor * 256);
+    pcm_u8_to_s16(best, out->predicted + 1, width);
+    memcpy(prev, row, width);
+    return sample_output_resample(out, out->predicted, (int)width + 1);
+}
+
+static int sample_output_predict_write(SampleOutput *out, const int16_t *samples, int count) {
+    while (count > 0) {
+        int take = out->predict_width - out->predict_fill < count ? out->predict_width - out->predict_fill : count;
+        pcm_s16_to_u8(samples, out->predict_rows + out->predict_fill, take);
+        out->predict_fill += take;
+        samples += take;
+        count -= take;
+        if (out->predict_fill == out->predict_width) {
+            out->predict_fill = 0;
+            if (sample_output_predict_row(out) != 0) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+static int sample_output_write(SampleOutput *out, const int16_t *samples, int count) {
+    if (out->predictor != PREDICT_NONE) {
+        return sample_output_predict_write(out, samples, count);
+    }
+    if (out->fec) {
+        return sample_output_fec_write(out, samples, count);
+    }
+    while (out->frame_rows > 0 && count > 0) {
+        if (out->frame_left == 0) {
+            int16_t header[SYNC_FRAME_SAMPLES];
+            sync_frame_header(header, out->frame_row);
+            if (sample_output_resample(out, header, SYNC_FRAME_SAMPLES) != 0) {
+                return -1;
+            }
+            out->frame_row += out->frame_rows;
+            out->frame_left = out->frame_samples;
+        }
+        int take = count < out->frame_left ? count : out->frame_left;
+        if (sample_output_resample(out, samples, take) != 0) {
+            return -1;
+        }
+        samples += take;
+        count -= take;
+        out->frame_left -= take;
+    }
+    return count > 0 ? sample_output_resample(out, samples, count) : 0;
+}
+
+// The samples of a whole width x height image in an ORDER_ other than rows
+static int sample_output_write_ordered(SampleOutput *out, const int16_t *samples, int width, int height, int kind) {
+    uint32_t offsets[BUFFER_SIZE];
+    int16_t gathered[BUFFER_SIZE];
+    PixelOrder order;
+    pixel_order_init(&order, kind, width, height);
+    size_t count;
+    while ((count = pixel_order_next(&order, offsets, BUFFER_SIZE)) > 0) {
+        for (size_t i = 0; i < count; i++) {
+            gathered[i] = samples[offsets[i]];
+        }
+        if (sample_output_write(out, gathered, (int)count) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Write what the resampler still holds, fix the header sizes when complete and release everything
+static int sample_output_close(SampleOutput *out, ConversionContext *ctx, bool complete) {
+    int result = 0;
+    if (out->fec && complete && sample_output_fec_flush(out) != 0) {
+        result = -1;
+    }
+    if (out->resampling) {
+        if (complete && result == 0) {
+            int produced = resampler_flush(&out->resampler, out->converted);
+            if (produced < 0 || sample_output_emit(out, out->converted, produced) != 0) {
+                result = -1;
+            }
+        }
+        resampler_free(&out->resampler);
+        out->resampling = false;
+    }
+    if (out->flac) {
+        if (flac_writer_close(out->flac, complete && result == 0) != 0) {
+            result = -1;
+        }
+        out->flac = NULL;
+    } else if (complete && result == 0) {
+        finish_wav_header(out->sink, &ctx->header, out->header_offset, out->metadata, out->written);
+        // A pipe keeps the sizes written first, the chunk only goes after data of exactly that size
+        if (out->checksums && ctx->header.data_size == out->written * (out->bits / 8) &&
+            sample_output_checksums(out, ctx) != 0) {
+            result = -1;
+        }
+    }
+    free(out->converted);
+    free(out->packed);
+    free(out->fec);
+    free(out->fec_symbols);
+    free(out->fec_samples);
+    free(out->checksum.block_crcs);
+    free(out->index.tile_crcs);
+    free(out->predict_rows);
+    free(out->predicted);
+    out->converted = NULL;
+    out->packed = NULL;
+    out->fec = NULL;
+    out->fec_symbols = NULL;
+    out->fec_samples = NULL;
+    out->checksum.block_crcs = NULL;
+    out->index.tile_crcs = NULL;
+    out->indexed = false;
+    out->predict_rows = NULL;
+    out->predicted = NULL;
+    out->predictor = PREDICT_NONE;
+    return result;
+}
+
+// Samples coming out of the WAV data, at the pixel rate
+typedef struct {
+    ByteSource *source;
+    uint64_t left;          // samples left in the data chunk
+    int bits;               // 16, 8 for unsigned 8-bit PCM or 32 for float
+    uint8_t *packed;        // one BUFFER_SIZE chunk of 8-bit or float samples
+    Resampler resampler;
+    bool resampling;
+    bool ended;
+    int16_t *input;
+    int16_t *pending;       // resampled, not handed out yet
+    size_t pending_count;
+    size_t pending_offset;
+} SampleInput;
+
+static int sample_input_init(SampleInput *in, ByteSource *source, uint64_t left, int sample_rate, int pixel_rate,
+                             int bits) {
+    memset(in, 0, sizeof(*in));
+    in->source = source;
+    in->left = left;
+    in->bits = bits;
+    if (bits != 16 && (in->packed = (uint8_t *)malloc((size_t)BUFFER_SIZE * (bits / 8))) == NULL) {
+        conversion_error("Couldn't allocate memory for %d-bit samples.\n", bits);
+        return -1;
+    }
+    in->resampling = pixel_rate != sample_rate;
+    if (!in->resampling) {
+        return 0;
+    }
+    if (resampler_init(&in->resampler, sample_rate, pixel_rate) != 0) {
+        return -1;
+    }
+    in->input = (int16_t *)malloc(BUFFER_SIZE * sizeof(int16_t));
+    in->pending = (int16_t *)malloc((resampler_capacity(&in->resampler, BUFFER_SIZE) +
+                                     resampler_capacity(&in->resampler, in->resampler.taps)) * sizeof(int16_t));
+    if (in->input == NULL || in->pending == NULL) {
+        conversion_error("Couldn't allocate memory for resampling.\n");
+        return -1;
+    }
+    return 0;
+}
+
+static size_t sample_input_raw(SampleInput *in, int16_t *out, size_t count) {
+    if (count > in->left) {
+        count = (size_t)in->left;
+    }
+    size_t got = 0;
+    if (in->bits == 16) {
+        got = count ? byte_source_read(in->source, out, count * sizeof(int16_t)) / sizeof(int16_t) : 0;
+    } else {
+        size_t bytes = in->bits / 8;
+        while (got < count) {
+            size_t chunk = count - got < BUFFER_SIZE ? count - got : BUFFER_SIZE;
+            size_t read = byte_source_read(in->source, in->packed, chunk * bytes) / bytes;
+            if (in->bits == 8) {
+                pcm_u8_to_s16(in->packed, out + got, read);
+            } else {
+                pcm_f32_to_s16((const float *)in->packed, out + got, read);
+            }
+            got += read;
+            if (read < chunk) {
+                break;
+            }
+        }
+    }
+    in->left = got < count ? 0 : in->left - got; // a short read means the stream ended
+    return got;
+}
+
+// Up to count samples at the pixel rate, fewer only at the end of the data
+static int sample_input_read(SampleInput *in, int16_t *out, int count) {
+    if (!in->resampling) {
+        return (int)sample_input_raw(in, out, count);
+    }
+
+    int given = 0;
+    while (given < count) {
+        if (in->pending_offset == in->pending_count) {
+            if (in->ended) {
+                break;
+            }
+            size_t got = sample_input_raw(in, in->input, BUFFER_SIZE);
+            int produced = resampler_process(&in->resampler, in->input, (int)got, in->pending);
+            if (produced >= 0 && got < BUFFER_SIZE) {
+                int tail = resampler_flush(&in->resampler, in->pending + produced);
+                produced = tail < 0 ? -1 : produced + tail;
+                in->ended = true;
+            }
+            if (produced < 0) {
+                in->ended = true;
+                break;
+            }
+            in->pending_count = produced;
+            in->pending_offset = 0;
+            continue;
+        }
+        size_t take = in->pending_count - in->pending_offset;
+        take = take < (size_t)(count - given) ? take : (size_t)(count - given);
+        memcpy(out + given, in->pending + in->pending_offset, take * sizeof(int16_t));
+        in->pending_offset += take;
+        given += (int)take;
+    }
+    return given;
+}
+
+static void sample_input_close(SampleInput *in) {
+    if (in->resampling) {
+        resampler_free(&in->resampler);
+    }
+    free(in->packed);
+    free(in->input);
+    free(in->pending);
+}
+
+// -------------------------------------------------------------------------------------------------------- rows
+
+// Decode, convert and write one row after the other on the calling thread
+static int encode_rows(ConversionContext *ctx, ImageReader *reader, SampleOutput *output) {
+    int width, height;
+    image_reader_size(reader, &width, &height);
+    int channels = image_reader_channels(reader);
+    PixelKernel kernel = select_pixel_kernel(SAMPLE_FORMAT_S16, MODE_ARRAY, channels);
+
+    uint8_t *row = (uint8_t *)malloc((size_t)width * channels);
+    int16_t *samples = (int16_t *)malloc((size_t)width * sizeof(int16_t));
+    if (row == NULL || samples == NULL) {
+        free(row);
+        free(samples);
+        conversion_error("Couldn't allocate memory for a row of samples.\n");
+        return CONVERSION_ERROR;
+    }
+
+    int result = CONVERSION_OK;
+    for (int y = 0; y < height && result == CONVERSION_OK; y++) {
+        if (conversion_cancelled(ctx)) {
+            result = CONVERSION_CANCELLED;
+        } else if (image_reader_read_row(reader, row) != 0) {
+            result = CONVERSION_ERROR;
+        } else {
+            KernelOutput out = { samples, 0, NULL, NULL };
+            kernel(row, width, &out);
+            if (sample_output_write(output, samples, width) != 0) {
+                result = CONVERSION_ERROR;
+            }
+            conversion_report(ctx, (double)(y + 1) / height);
+        }
+    }
+
+    free(row);
+    free(samples);
+    return result;
+}
+
+// -------------------------------------------------------------------------------------------------------- pipeline
+
+// Ring of fixed size blocks between exactly one producer thread and one consumer thread.
+// No locks: the producer only moves tail, the consumer only moves head, and a full ring
+// makes the producer wait (backpressure), so memory stays at capacity blocks.
+typedef struct {
+    uint8_t *storage;
+    size_t slot_size;
+    unsigned capacity;   // power of two
+    atomic_uint head;    // next slot to read, written by the consumer only
+    atomic_uint tail;    // next slot to write, written by the producer only
+    atomic_bool closed;  // the producer is done, nothing more will be published
+} SpscRing;
+
+// Shared state of the decode -> convert -> write pipeline
+typedef struct {
+    ImageReader *reader;
+    PixelKernel kernel;
+    int width;
+    int height;
+    SpscRing rows;      // decode -> convert, RGBA rows
+    SpscRing samples;   // convert -> write, rows of 16-bit samples
+    atomic_bool abort;  // a stage failed or the conversion was cancelled
+    atomic_bool decode_failed;
+} Pipeline;
+
+static int spsc_ring_init(SpscRing *ring, size_t slot_size, unsigned capacity) {
+    ring->storage = (uint8_t *)malloc(slot_size * capacity);
+    ring->slot_size = slot_size;
+    ring->capacity = capacity;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->closed, false);
+    return ring->storage ? 0 : -1;
+}
+
+// Producer: the next free slot, waits while the ring is full. NULL if the pipeline aborted.
+static uint8_t *spsc_ring_reserve(SpscRing *ring, atomic_bool *abort) {
+    unsigned tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    while (tail - atomic_load_explicit(&ring->head, memory_order_acquire) == ring->capacity) {
+        if (atomic_load_explicit(abort, memory_order_relaxed)) {
+            return NULL;
+        }
+        sched_yield();
+    }
+    return ring->storage + (size_t)(tail & (ring->capacity - 1)) * ring->slot_size;
+}
+
+// Producer: hand the reserved slot to the consumer
+static void spsc_ring_publish(SpscRing *ring) {
+    unsigned tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+}
+
+static void spsc_ring_close(SpscRing *ring) {
+    atomic_store_explicit(&ring->closed, true, memory_order_release);
+}
+
+// Consumer: the oldest published slot, waits while the ring is empty. NULL at the end or if the pipeline aborted.
+static const uint8_t *spsc_ring_peek(SpscRing *ring, atomic_bool *abort) {
+    unsigned head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    while (atomic_load_explicit(&ring->tail, memory_order_acquire) == head) {
+        if (atomic_load_explicit(&ring->closed, memory_order_acquire)) {
+            // Everything published before closing is visible now
+            if (atomic_load_explicit(&ring->tail, memory_order_acquire) == head) {
+                return NULL;
+            }
+            break;
+        }
+        if (atomic_load_explicit(abort, memory_order_relaxed)) {
+            return NULL;
+        }
+        sched_yield();
+    }
+    return ring->storage + (size_t)(head & (ring->capacity - 1)) * ring->slot_size;
+}
+
+// Consumer: give the peeked slot back to the producer
+static void spsc_ring_release(SpscRing *ring) {
+    unsigned head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+// Stage 1: PNG row decoding
+static void *pipeline_decode_stage(void *arg) {
+    Pipeline *pipeline = (Pipeline *)arg;
+    for (int y = 0; y < pipeline->height; y++) {
+        uint8_t *row = spsc_ring_reserve(&pipeline->rows, &pipeline->abort);
+        if (row == NULL) {
+            break;
+        }
+        if (image_reader_read_row(pipeline->reader, row) != 0) {
+            atomic_store(&pipeline->decode_failed, true);
+            atomic_store(&pipeline->abort, true);
+            break;
+        }
+        spsc_ring_publish(&pipeline->rows);
+    }
+    spsc_ring_close(&pipeline->rows);
+    return NULL;
+}
+
+// Stage 2: pixel to sample conversion
+static void *pipeline_convert_stage(void *arg) {
+    Pipeline *pipeline = (Pipeline *)arg;
+    const uint8_t *row;
+    while ((row = spsc_ring_peek(&pipeline->rows, &pipeline->abort)) != NULL) {
+        int16_t *samples = (int16_t *)spsc_ring_reserve(&pipeline->samples, &pipeline->abort);
+        if (samples == NULL) {
+            break;
+        }
+        KernelOutput out = { samples, 0, NULL, NULL };
+        pipeline->kernel(row, pipeline->width, &out);
+        spsc_ring_publish(&pipeline->samples);
+        spsc_ring_release(&pipeline->rows);
+    }
+    spsc_ring_close(&pipeline->samples);
+    return NULL;
+}
+
+// Pipeline mode: decoding, conversion and writing run on three threads connected by SPSC rings,
+// so I/O and compute overlap. Stage 3 (writing) runs on the calling thread, which also reports
+// progress, so GUI callbacks stay on the thread that started the conversion.
+static int encode_rows_pipelined(ConversionContext *ctx, ImageReader *reader, SampleOutput *output) {
+    Pipeline pipeline;
+    memset(&pipeline, 0, sizeof(pipeline));
+    pipeline.reader = reader;
+    image_reader_size(reader, &pipeline.width, &pipeline.height);
+    int channels = image_reader_channels(reader);
+    pipeline.kernel = select_pixel_kernel(SAMPLE_FORMAT_S16, MODE_ARRAY, channels);
+    atomic_init(&pipeline.abort, false);
+    atomic_init(&pipeline.decode_failed, false);
+
+    size_t row_bytes = (size_t)pipeline.width * sizeof(int16_t);
+    if (spsc_ring_init(&pipeline.rows, (size_t)pipeline.width * channels, PIPELINE_RING_SLOTS) != 0 ||
+        spsc_ring_init(&pipeline.samples, row_bytes, PIPELINE_RING_SLOTS) != 0) {
+        free(pipeline.rows.storage);
+        free(pipeline.samples.storage);
+        conversion_error("Couldn't allocate memory for the pipeline rings.\n");
+        return CONVERSION_ERROR;
+    }
+
+    pthread_t decode_thread, convert_thread;
+    if (pthread_create(&decode_thread, NULL, pipeline_decode_stage, &pipeline) != 0) {
+        free(pipeline.rows.storage);
+        free(pipeline.samples.storage);
+        conversion_error("Couldn't start the pipeline threads.\n");
+        return CONVERSION_ERROR;
+    }
+    if (pthread_create(&convert_thread, NULL, pipeline_convert_stage, &pipeline) != 0) {
+        atomic_store(&pipeline.abort, true);
+        pthread_join(decode_thread, NULL);
+        free(pipeline.rows.storage);
+        free(pipeline.samples.storage);
+        conversion_error("Couldn't start the pipeline threads.\n");
+        return CONVERSION_ERROR;
+    }
+
+    // Stage 3: writing
+    int result = CONVERSION_OK;
+    int rows_written = 0;
+    const uint8_t *samples;
+    while ((samples = spsc_ring_peek(&pipeline.samples, &pipeline.abort)) != NULL) {
+        if (sample_output_write(output, (const int16_t *)samples, pipeline.width) != 0) {
+            result = CONVERSION_ERROR;
+            atomic_store(&pipeline.abort, true);
+            break;
+        }
+        spsc_ring_release(&pipeline.samples);
+        rows_written++;
+
+        if (conversion_cancelled(ctx)) {
+            result = CONVERSION_CANCELLED;
+            atomic_store(&pipeline.abort, true);
+            break;
+        }
+        conversion_report(ctx, (double)rows_written / pipeline.height);
+    }
+
+    pthread_join(decode_thread, NULL);
+    pthread_join(convert_thread, NULL);
+    free(pipeline.rows.storage);
+    free(pipeline.samples.storage);
+
+    if (result == CONVERSION_OK && (atomic_load(&pipeline.decode_failed) || rows_written != pipeline.height)) {
+        result = CONVERSION_ERROR;
+    }
+    return result;
+}
+
+// -------------------------------------------------------------------------------------------------------- apt
+
+// Modulate every row behind a sync pulse onto the APT subcarrier. The sample count follows from the
+// image size and word rate, so the header is exact before the first row, even on a pipe.
+static int encode_apt(ConversionContext *ctx, ImageReader *reader, ByteSink *output) {
+    int width, height;
+    image_reader_size(reader, &width, &height);
+    int channels = image_reader_channels(reader);
+    PixelKernel kernel = select_pixel_kernel(SAMPLE_FORMAT_U8, MODE_ARRAY, channels);
+    int rate = ctx->options.sample_rate;
+    int pixels_per_second = ctx->options.pixels_per_second;
+
+    AptModulator *mod = (AptModulator *)malloc(sizeof(AptModulator));
+    if (mod == NULL || apt_modulator_init(mod, rate, pixels_per_second) != 0) {
+        free(mod);
+        return CONVERSION_ERROR;
+    }
+
+    int line_words = APT_SYNC_WORDS + width;
+    size_t total = apt_modulated_samples((uint64_t)line_words * height, rate, pixels_per_second);
+    if (!audio_size_fits(&ctx->options, total)) {
+        free(mod);
+        conversion_error("The APT audio would be too long for a WAV file.\n");
+        return CONVERSION_ERROR;
+    }
+
+    uint8_t *row = (uint8_t *)malloc((size_t)width * channels);
+    uint8_t *line = (uint8_t *)malloc(line_words);
+    int16_t *samples = (int16_t *)malloc((apt_modulated_samples(line_words, rate, pixels_per_second) + 1) * sizeof(int16_t));
+    if (row == NULL || line == NULL || samples == NULL) {
+        free(mod);
+        free(row);
+        free(line);
+        free(samples);
+        conversion_error("Couldn't allocate memory for a line of APT audio.\n");
+        return CONVERSION_ERROR;
+    }
+    memcpy(line, apt_sync_words(), APT_SYNC_WORDS);
+
+    ImageMetadata *meta = &ctx->metadata;
+    meta->version = METADATA_VERSION;
+    meta->encoding = ENCODING_APT;
+    meta->width = width;
+    meta->height = height;
+    meta->pixels_per_second = pixels_per_second;
+    meta->sync_words = APT_SYNC_WORDS;
+
+    SampleOutput samples_out;
+    if (sample_output_open(&samples_out, ctx, output, rate, 1, (int64_t)total, meta) != 0) {
+        free(mod);
+        free(row);
+        free(line);
+        free(samples);
+        return CONVERSION_ERROR;
+    }
+
+    int result = CONVERSION_OK;
+    for (int y = 0; y < height && result == CONVERSION_OK; y++) {
+        if (conversion_cancelled(ctx)) {
+            result = CONVERSION_CANCELLED;
+        } else if (image_reader_read_row(reader, row) != 0) {
+            result = CONVERSION_ERROR;
+        } else {
+            KernelOutput out = { line + APT_SYNC_WORDS, 0, NULL, NULL };
+            kernel(row, width, &out);
+            int count = apt_modulate(mod, line, line_words, samples);
+            if (sample_output_write(&samples_out, samples, count) != 0) {
+                result = CONVERSION_ERROR;
+            }
+            conversion_report(ctx, (double)(y + 1) / height);
+        }
+    }
+
+    if (sample_output_close(&samples_out, ctx, result == CONVERSION_OK) != 0 && result == CONVERSION_OK) {
+        result = CONVERSION_ERROR;
+    }
+    free(mod);
+    free(row);
+    free(line);
+    free(samples);
+    ctx->num_samples = samples_out.written;
+    return result;
+}
+
+// Line sync over the demodulated envelope (two values per word)
+typedef struct {
+    int width;
+    int line;           // envelope values per line
+    int first_to;       // last position searched for the first sync
+    bool timed;         // lines follow each other exactly from the start, as encode_apt writes them
+    float *envelope;
+    size_t count;
+    size_t capacity;
+    double expected;    // where the next sync should start, negative before the first line of a recording
+} AptLineSync;
+
+// Cut the next line out of the envelope once enough of it has arrived. A timed file keeps its own line
+// timing and only locks onto another sync near it that matches clearly better; a recording locks onto
+// the best match near where the previous line says it should be, to a fraction of an envelope value.
+// Pixels are read at the sync found, between envelope values. At the end of the stream a shorter
+// window is accepted.
+static bool apt_next_line(AptLineSync *sync, bool at_end, float *row) {
+    int near = (int)floor(sync->expected);
+    int from = sync->expected < 0 ? 0 : near - DEMOD_TRACK_WINDOW;
+    int to = sync->expected < 0 ? sync->first_to : near + DEMOD_TRACK_WINDOW;
+    if (from < 0) {
+        from = 0;
+    }
+    // One value past the line, for reading between values
+    if ((int)sync->count < to + sync->line + 1) {
+        if (!at_end) {
+            return false;
+        }
+        to = (int)sync->count - sync->line - 1;
+        if (to < from) {
+            return false;
+        }
+    }
+
+    float score;
+    double start = apt_find_sync(sync->envelope, from, to, &score);
+    if (sync->timed && sync->expected <= to &&
+        apt_sync_score(sync->envelope, sync->expected) >= DEMOD_RELOCK * score) {
+        start = sync->expected;
+    }
+    apt_read_line(sync->envelope, start, sync->width, row);
+
+    // Keep only what the next search can look at, with the value ahead of it
+    int drop = (int)floor(start) + sync->line - DEMOD_TRACK_WINDOW - 1;
+    drop = drop < 0 ? 0 : drop > (int)sync->count ? (int)sync->count : drop;
+    memmove(sync->envelope, sync->envelope + drop, (sync->count - drop) * sizeof(float));
+    sync->count -= drop;
+    sync->expected = start + sync->line - drop;
+    return true;
+}
+
+// Black and white levels of a recording: the 0.5% and 99.5% points of all its envelope values
+static void apt_levels(const float *values, size_t count, float *black, float *white) {
+    float low = values[0], high = values[0];
+    for (size_t i = 1; i < count; i++) {
+        low = values[i] < low ? values[i] : low;
+        high = values[i] > high ? values[i] : high;
+    }
+    *black = low;
+    *white = high;
+    if (high <= low) {
+        return;
+    }
+
+    size_t *histogram = (size_t *)calloc(4096, sizeof(size_t));
+    if (histogram == NULL) {
+        return;
+    }
+    float scale = 4095.0f / (high - low);
+    for (size_t i = 0; i < count; i++) {
+        histogram[(int)((values[i] - low) * scale)]++;
+    }
+    size_t seen = 0;
+    int bin_black = -1, bin_white = 4095;
+    for (int b = 0; b < 4096; b++) {
+        seen += histogram[b];
+        if (bin_black < 0 && seen > count / 200) {
+            bin_black = b;
+        }
+        if (seen >= count - count / 200) {
+            bin_white = b;
+            break;
+        }
+    }
+    free(histogram);
+    *black = low + bin_black / scale;
+    *white = low + bin_white / scale;
+    if (*white <= *black) {
+        *white = *black + 1e-6f;
+    }
+}
+
+// Demodulate APT audio back to an image. Files written by encode_apt describe the image in their
+// "w2im" chunk and are decoded row by row. Recordings without one are taken as satellite passes:
+// 2080 word lines, the height found at the end and the levels stretched over the whole pass.
+static int decode_apt(ConversionContext *ctx, ByteSource *input, ByteSink *output) {
+    const ImageMetadata *meta = &ctx->metadata;
+    bool described = meta->version != 0;
+    int rate = (int)ctx->header.sample_rate;
+    int pixels_per_second = described ? (int)meta->pixels_per_second : ctx->options.pixels_per_second;
+    int width = described ? (int)meta->width : APT_LINE_WORDS - APT_SYNC_WORDS;
+    int height = described ? (int)meta->height : 0;
+
+    if (described && (meta->sync_words != APT_SYNC_WORDS || meta->width == 0 || meta->height == 0 ||
+                      meta->width > (1 << 20) || meta->height > INT32_MAX / meta->width)) {
+        conversion_error("Invalid APT description in the WAV file.\n");
+        return CONVERSION_ERROR;
+    }
+
+    AptDemodulator demod;
+    if (apt_demodulator_init(&demod, rate, pixels_per_second) != 0) {
+        return CONVERSION_ERROR;
+    }
+
+    // encode_apt starts with a sync and writes whole lines, a recording's first sync is searched for
+    AptLineSync sync = { width, 2 * (APT_SYNC_WORDS + width), 0, described, NULL, 0, 0, described ? 0.0 : -1.0 };
+    sync.first_to = sync.line - 1;
+    sync.capacity = 2 * (size_t)sync.line + 2 * DEMOD_TRACK_WINDOW + 2 +
+                    apt_envelope_capacity(&demod, BUFFER_SIZE) + apt_envelope_capacity(&demod, demod.taps);
+    sync.envelope = (float *)malloc(sync.capacity * sizeof(float));
+
+    int16_t *samples = (int16_t *)malloc(BUFFER_SIZE * sizeof(int16_t));
+    float *levels = (float *)malloc((size_t)width * sizeof(float));
+    uint8_t *row = (uint8_t *)malloc(width);
+    float *kept = NULL;        // rows of a recording, until its height and levels are known
+    size_t kept_rows = 0, kept_capacity = 0;
+    ImageWriter *writer = NULL;
+
+    int result = CONVERSION_OK;
+    if (sync.envelope == NULL || samples == NULL || levels == NULL || row == NULL) {
+        conversion_error("Couldn't allocate memory for APT decoding.\n");
+        result = CONVERSION_ERROR;
+    } else if (height > 0 && (writer = decoded_image_open(ctx, output, width, height)) == NULL) {
+        conversion_error("Couldn't start the PNG output.\n");
+        result = CONVERSION_ERROR;
+    }
+
+    uint64_t total = ctx->header.data_size == WAV_SIZE_UNKNOWN ? 0 : wav_data_samples(&ctx->header);
+    SampleInput samples_in;
+    if (sample_input_init(&samples_in, input, total ? total : UINT64_MAX, rate, rate,
+                          ctx->header.bits_per_sample) != 0) {
+        result = CONVERSION_ERROR;
+    }
+
+    uint64_t consumed = 0;
+    int lines = 0;
+    bool at_end = false;
+    while (result == CONVERSION_OK && !at_end && (height == 0 || lines < height)) {
+        int count = sample_input_read(&samples_in, samples, BUFFER_SIZE);
+        consumed += count;
+        at_end = count < BUFFER_SIZE || samples_in.left == 0;
+
+        int produced = apt_demodulate(&demod, samples, count, sync.envelope + sync.count);
+        if (produced >= 0) {
+            sync.count += produced;
+            produced = at_end ? apt_demodulate_flush(&demod, sync.envelope + sync.count) : 0;
+        }
+        if (produced < 0) {
+            result = CONVERSION_ERROR;
+            break;
+        }
+        sync.count += produced;
+
+        while ((height == 0 || lines < height) && apt_next_line(&sync, at_end, levels)) {
+            if (writer) {
+                for (int x = 0; x < width; x++) {
+                    row[x] = apt_envelope_to_pixel(levels[x]);
+                }
+                if (image_writer_write_row(writer, row) != 0) {
+                    result = CONVERSION_ERROR;
+                    break;
+                }
+            } else {
+                if (kept_rows == kept_capacity) {
+                    kept_capacity = kept_capacity ? kept_capacity * 2 : 256;
+                    float *grown = (float *)realloc(kept, kept_capacity * width * sizeof(float));
+                    if (grown == NULL) {
+                        conversion_error("Couldn't allocate memory for the decoded lines.\n");
+                        result = CONVERSION_ERROR;
+                        break;
+                    }
+                    kept = grown;
+                }
+                memcpy(kept + kept_rows++ * width, levels, (size_t)width * sizeof(float));
+            }
+            lines++;
+        }
+
+        if (conversion_cancelled(ctx)) {
+            result = CONVERSION_CANCELLED;
+        } else if (total) {
+            conversion_report(ctx, (double)consumed / total);
+        } else if (height > 0) {
+            conversion_report(ctx, (double)lines / height);
+        }
+    }
+
+    if (result == CONVERSION_OK && writer) {
+        // Audio that ended early leaves the rest of the image black
+        memset(row, 0, width);
+        for (; lines < height && result == CONVERSION_OK; lines++) {
+            if (image_writer_write_row(writer, row) != 0) {
+                result = CONVERSION_ERROR;
+            }
+        }
+    } else if (result == CONVERSION_OK) {
+        if (kept_rows == 0) {
+            conversion_error("No APT lines found in the audio.\n");
+            result = CONVERSION_ERROR;
+        } else if ((writer = decoded_writer_open(ctx, output, width, (int)kept_rows, COLOR_GRAY, 1)) == NULL) {
+            conversion_error("Couldn't start the PNG output.\n");
+            result = CONVERSION_ERROR;
+        } else {
+            float black, white;
+            apt_levels(kept, kept_rows * width, &black, &white);
+            for (size_t y = 0; y < kept_rows && result == CONVERSION_OK; y++) {
+                for (int x = 0; x < width; x++) {
+                    float value = (kept[y * width + x] - black) / (white - black) * 255.0f + 0.5f;
+                    row[x] = value <= 0.0f ? 0 : value >= 255.0f ? 255 : (uint8_t)value;
+                }
+                if (image_writer_write_row(writer, row) != 0) {
+                    result = CONVERSION_ERROR;
+                }
+            }
+            height = (int)kept_rows;
+        }
+    }
+
+    if (writer && image_writer_close(writer) != 0 && result == CONVERSION_OK) {
+        result = CONVERSION_ERROR;
+    }
+    sample_input_close(&samples_in);
+    apt_demodulator_free(&demod);
+    free(sync.envelope);
+    free(samples);
+    free(levels);
+    free(row);
+    free(kept);
+
+    ctx->width = width;
+    ctx->height = height;
+    ctx->num_samples = (int)consumed;
+    if (result == CONVERSION_OK) {
+        conversion_report(ctx, 1.0);
+    }
+    return result;
+}
+
+// -------------------------------------------------------------------------------------------------------- spectrogram
+
+// Columns of one batch shared by the spectrogram workers, two columns per item (one transform)
+typedef struct {
+    const Spectrogram *sg;
+    uint8_t *image;         // grayscale, width * height
+    int width;
+    int first;              // column of item 0
+    float *frames;          // encoding: spectrogram_frame_size floats per column of the batch
+    const int16_t *samples; // decoding: column_samples per column of the batch
+    float *work;            // spectrogram_work_size floats per worker
+} SpectrogramBatch;
+
+static void spectrogram_synthesize_items(void *arg, int worker, int from, int to) {
+    SpectrogramBatch *batch = (SpectrogramBatch *)arg;
+    size_t frame_size = spectrogram_frame_size(batch->sg);
+    float *work = batch->work + (size_t)worker * spectrogram_work_size(batch->sg);
+    for (int item = from; item < to; item++) {
+        int a = batch->first + 2 * item;
+        bool pair = a + 1 < batch->width;
+        spectrogram_synthesize(batch->sg, batch->image + a, pair ? batch->image + a + 1 : NULL, batch->width,
+                               (uint64_t)a, batch->frames + 2 * item * frame_size,
+                               batch->frames + (2 * item + 1) * frame_size, work);
+    }
+}
+
+static void spectrogram_analyze_items(void *arg, int worker, int from, int to) {
+    SpectrogramBatch *batch = (SpectrogramBatch *)arg;
+    const SpectrogramLayout *layout = &batch->sg->layout;
+    size_t column_samples = (size_t)layout->fft_size + layout->guard;
+    float *work = batch->work + (size_t)worker * spectrogram_work_size(batch->sg);
+    for (int item = from; item < to; item++) {
+        int a = batch->first + 2 * item;
+        bool pair = a + 1 < batch->width;
+        // The constant part of a column follows the crossfade from the previous one
+        const int16_t *samples = batch->samples + 2 * item * column_samples + layout->guard;
+        spectrogram_analyze(batch->sg, samples, pair ? samples + column_samples : NULL,
+                            batch->image + a, pair ? batch->image + a + 1 : NULL, batch->width, work);
+    }
+}
+
+static int16_t float_to_sample(float value) {
+    long rounded = lrintf(value);
+    return (int16_t)(rounded > 32767 ? 32767 : rounded < -32768 ? -32768 : rounded);
+}
+
+// Columns per batch: an even number, enough to keep every worker busy, bounded in memory
+static int spectrogram_batch_columns(const Spectrogram *sg, int width, int workers) {
+    int columns = (int)(FFT_BATCH_SAMPLES / spectrogram_frame_size(sg)) & ~1;
+    if (columns < 2 * workers) {
+        columns = 2 * workers;
+    }
+    return columns < width ? columns : width + (width & 1);
+}
+
+// Paint the image into the spectrum. Every column is one inverse transform, the rows are tones
+// between SPECTROGRAM_LOW_HZ and 90% of Nyquist, and frames are overlap-added with a short crossfade.
+// The whole image is read first, since the audio goes column by column.
+static int encode_spectrogram(ConversionContext *ctx, ImageReader *reader, ByteSink *output) {
+    int width = ctx->width, height = ctx->height;
+    int channels = image_reader_channels(reader);
+    int rate = ctx->options.sample_rate;
+    PixelKernel kernel = select_pixel_kernel(SAMPLE_FORMAT_U8, MODE_ARRAY, channels);
+
+    SpectrogramLayout layout;
+    Spectrogram sg;
+    if (spectrogram_layout(&layout, rate, height, ctx->options.pixels_per_second) != 0 || spectrogram_init(&sg, &layout) != 0) {
+        return CONVERSION_ERROR;
+    }
+    size_t column_samples = (size_t)layout.fft_size + layout.guard;
+    uint64_t total = (uint64_t)width * column_samples + layout.guard;
+    if (!audio_size_fits(&ctx->options, total)) {
+        spectrogram_free(&sg);
+        conversion_error("The spectrogram audio would be too long for a WAV file.\n");
+        return CONVERSION_ERROR;
+    }
+
+    int workers = worker_count();
+    int batch_columns = spectrogram_batch_columns(&sg, width, workers);
+    size_t frame_size = spectrogram_frame_size(&sg);
+    uint8_t *image = (uint8_t *)malloc((size_t)width * height);
+    uint8_t *row = (uint8_t *)malloc((size_t)width * channels);
+    float *frames = (float *)malloc((size_t)batch_columns * frame_size * sizeof(float));
+    float *work = (float *)malloc((size_t)workers * spectrogram_work_size(&sg) * sizeof(float));
+    float *carry = (float *)calloc((size_t)layout.guard + 1, sizeof(float));
+    int16_t *samples = (int16_t *)malloc(column_samples * sizeof(int16_t));
+
+    ImageMetadata *meta = &ctx->metadata;
+    meta->version = METADATA_VERSION;
+    meta->encoding = ENCODING_SPECTROGRAM;
+    meta->width = width;
+    meta->height = height;
+    meta->pixels_per_second = rate;
+    meta->fft_size = layout.fft_size;
+    meta->first_bin = layout.first_bin;
+    meta->guard_samples = layout.guard;
+
+    SampleOutput samples_out;
+    int result = CONVERSION_OK;
+    if (sample_output_open(&samples_out, ctx, output, rate, 1, (int64_t)total, meta) != 0 ||
+        image == NULL || row == NULL || frames == NULL || work == NULL || carry == NULL || samples == NULL) {
+        conversion_error("Couldn't allocate memory for the spectrogram.\n");
+        result = CONVERSION_ERROR;
+    }
+
+    for (int y = 0; y < height && result == CONVERSION_OK; y++) {
+        if (image_reader_read_row(reader, row) != 0) {
+            result = CONVERSION_ERROR;
+        } else {
+            KernelOutput out = { image + (size_t)y * width, 0, NULL, NULL };
+            kernel(row, width, &out);
+        }
+    }
+
+    SpectrogramBatch batch = { &sg, image, width, 0, frames, NULL, work };
+    for (int first = 0; first < width && result == CONVERSION_OK; first += batch_columns) {
+        int columns = width - first < batch_columns ? width - first : batch_columns;
+        batch.first = first;
+        run_workers(spectrogram_synthesize_items, &batch, (columns + 1) / 2, workers);
+
+        // Overlap-add: the ramp in of a column lands on the ramp out of the one before
+        for (int c = 0; c < columns && result == CONVERSION_OK; c++) {
+            const float *frame = frames + (size_t)c * frame_size;
+            for (size_t n = 0; n < column_samples; n++) {
+                samples[n] = float_to_sample(frame[n] + (n < (size_t)layout.guard ? carry[n] : 0.0f));
+            }
+            memcpy(carry, frame + column_samples, (size_t)layout.guard * sizeof(float));
+            if (sample_output_write(&samples_out, samples, (int)column_samples) != 0) {
+                result = CONVERSION_ERROR;
+            }
+        }
+
+        if (conversion_cancelled(ctx)) {
+            result = CONVERSION_CANCELLED;
+        }
+        conversion_report(ctx, (double)(first + columns) / width);
+    }
+
+    if (result == CONVERSION_OK) {
+        // Ramp out of the last column
+        for (int n = 0; n < layout.guard; n++) {
+            samples[n] = float_to_sample(carry[n]);
+        }
+        if (sample_output_write(&samples_out, samples, layout.guard) != 0) {
+            result = CONVERSION_ERROR;
+        }
+    }
+
+    if (sample_output_close(&samples_out, ctx, result == CONVERSION_OK) != 0 && result == CONVERSION_OK) {
+        result = CONVERSION_ERROR;
+    }
+    spectrogram_free(&sg);
+    free(image);
+    free(row);
+    free(frames);
+    free(work);
+    free(carry);
+    free(samples);
+    ctx->num_samples = samples_out.written;
+    return result;
+}
+
+// Read a spectrogram back with the same frames: one forward transform per two columns over the constant
+// part of each, every tone measured against the pilot. Audio resampled since is brought back to the
+// rate the frames were built at.
+static int decode_spectrogram(ConversionContext *ctx, ByteSource *input, ByteSink *output) {
+    const ImageMetadata *meta = &ctx->metadata;
+    SpectrogramLayout layout = { (int)meta->pixels_per_second, (int)meta->height, (int)meta->fft_size,
+                                 (int)meta->first_bin, (int)meta->guard_samples };
+    int width = (int)meta->width, height = layout.height;
+    if (meta->width == 0 || meta->width > (1 << 20) || meta->height > (1 << 20)) {
+        conversion_error("Invalid image size in WAV data.\n");
+        return CONVERSION_ERROR;
+    }
+    if (spectrogram_layout_check(&layout) != 0) {
+        return CONVERSION_ERROR;
+    }
+
+    Spectrogram sg;
+    if (spectrogram_init(&sg, &layout) != 0) {
+        return CONVERSION_ERROR;
+    }
+    int workers = worker_count();
+    int batch_columns = spectrogram_batch_columns(&sg, width, workers);
+    size_t column_samples = (size_t)layout.fft_size + layout.guard;
+    size_t batch_samples = (size_t)batch_columns * column_samples;
+
+    SampleInput samples_in;
+    uint8_t *image = (uint8_t *)calloc((size_t)width * height, 1);
+    int16_t *samples = (int16_t *)malloc(batch_samples * sizeof(int16_t));
+    float *work = (float *)malloc((size_t)workers * spectrogram_work_size(&sg) * sizeof(float));
+    ImageWriter *writer = NULL;
+    int result = CONVERSION_OK;
+    if (sample_input_init(&samples_in, input, wav_data_samples(&ctx->header), (int)ctx->header.sample_rate,
+                          layout.sample_rate, ctx->header.bits_per_sample) != 0 ||
+        image == NULL || samples == NULL || work == NULL) {
+        conversion_error("Couldn't allocate memory for the spectrogram.\n");
+        result = CONVERSION_ERROR;
+    }
+
+    SpectrogramBatch batch = { &sg, image, width, 0, NULL, samples, work };
+    uint64_t decoded = 0;
+    for (int first = 0; first < width && result == CONVERSION_OK; first += batch_columns) {
+        int columns = width - first < batch_columns ? width - first : batch_columns;
+        size_t wanted = (size_t)columns * column_samples;
+        // Audio that ended early leaves the rest of the image black
+        int count = sample_input_read(&samples_in, samples, (int)wanted);
+        memset(samples + count, 0, (batch_samples - count) * sizeof(int16_t));
+        decoded += count;
+
+        batch.first = first;
+        run_workers(spectrogram_analyze_items, &batch, (columns + 1) / 2, workers);
+
+        if (conversion_cancelled(ctx)) {
+            result = CONVERSION_CANCELLED;
+        }
+        conversion_report(ctx, (double)(first + columns) / width);
+    }
+
+    if (result == CONVERSION_OK && (writer = decoded_image_open(ctx, output, width, height)) == NULL) {
+        conversion_error("Couldn't start the PNG output.\n");
+        result = CONVERSION_ERROR;
+    }
+    for (int y = 0; y < height && result == CONVERSION_OK; y++) {
+        if (image_writer_write_row(writer, image + (size_t)y * width) != 0) {
+            result = CONVERSION_ERROR;
+        }
+    }
+    if (writer && image_writer_close(writer) != 0 && result == CONVERSION_OK) {
+        result = CONVERSION_ERROR;
+    }
+
+    sample_input_close(&samples_in);
+    spectrogram_free(&sg);
+    free(image);
+    free(samples);
+    free(work);
+    ctx->width = width;
+    ctx->height = height;
+    ctx->num_samples = (int)decoded;
+    if (result == CONVERSION_OK) {
+        conversion_report(ctx, 1.0);
+    }
+    return result;
+}
+
+// -------------------------------------------------------------------------------------------------------- ofdm
+
+// Symbols of one batch shared by the OFDM workers, two symbols per item (one transform).
+// A batch starts on a training symbol.
+typedef struct {
+    const Ofdm *ofdm;
+    int symbols;
+    const uint8_t *pixels;  // encoding: pixels of the batch's data symbols
+    int16_t *samples;       // ofdm_symbol_samples per symbol
+    float *values;          // decoding: 2 * carriers per symbol
+    float *work;            // ofdm_work_size floats per worker
+} OfdmBatch;
+
+// Pixels a symbol of the batch sends, NULL for a training symbol
+static const uint8_t *ofdm_symbol_data(const OfdmBatch *batch, int symbol) {
+    int interval = batch->ofdm->layout.training_interval;
+    int group = symbol / (interval + 1), position = symbol % (interval + 1);
+    if (position == 0) {
+        return NULL;
+    }
+    return batch->pixels + ((size_t)group * interval + position - 1) * ofdm_symbol_pixels(batch->ofdm);
+}
+
+static void ofdm_modulate_items(void *arg, int worker, int from, int to) {
+    OfdmBatch *batch = (OfdmBatch *)arg;
+    size_t symbol_samples = ofdm_symbol_samples(batch->ofdm);
+    float *work = batch->work + (size_t)worker * ofdm_work_size(batch->ofdm);
+    for (int item = from; item < to; item++) {
+        int a = 2 * item;
+        bool pair = a + 1 < batch->symbols;
+        ofdm_modulate(batch->ofdm, ofdm_symbol_data(batch, a), pair ? ofdm_symbol_data(batch, a + 1) : NULL, pair,
+                      batch->samples + a * symbol_samples, batch->samples + (a + 1) * symbol_samples, work);
+    }
+}
+
+static void ofdm_demodulate_items(void *arg, int worker, int from, int to) {
+    OfdmBatch *batch = (OfdmBatch *)arg;
+    size_t symbol_samples = ofdm_symbol_samples(batch->ofdm);
+    size_t symbol_values = 2 * (size_t)batch->ofdm->layout.carriers;
+    float *work = batch->work + (size_t)worker * ofdm_work_size(batch->ofdm);
+    for (int item = from; item < to; item++) {
+        int a = 2 * item;
+        bool pair = a + 1 < batch->symbols;
+        ofdm_demodulate(batch->ofdm, batch->samples + a * symbol_samples,
+                        pair ? batch->samples + (a + 1) * symbol_samples : NULL,
+                        batch->values + a * symbol_values, batch->values + (a + 1) * symbol_values, work);
+    }
+}
+
+// Training groups (a training symbol and its data symbols) per batch, at least one per worker
+static int ofdm_batch_groups(const Ofdm *ofdm, int workers) {
+    size_t group_samples = (size_t)(ofdm->layout.training_interval + 1) * ofdm_symbol_samples(ofdm);
+    int groups = (int)(FFT_BATCH_SAMPLES / group_samples);
+    return groups < workers ? workers : groups;
+}
+
+// Send the pixels in raster order, two per subcarrier and hundreds of subcarriers per symbol, each
+// symbol one inverse transform with a cyclic prefix. Rows are read as the symbols need them.
+static int encode_ofdm(ConversionContext *ctx, ImageReader *reader, ByteSink *output) {
+    int width = ctx->width, height = ctx->height;
+    int channels = image_reader_channels(reader);
+    int rate = ctx->options.sample_rate;
+    PixelKernel kernel = select_pixel_kernel(SAMPLE_FORMAT_U8, MODE_ARRAY, channels);
+
+    OfdmLayout layout;
+    Ofdm ofdm;
+    if (ofdm_layout(&layout, rate) != 0 || ofdm_init(&ofdm, &layout) != 0) {
+        return CONVERSION_ERROR;
+    }
+    int interval = layout.training_interval;
+    size_t symbol_pixels = ofdm_symbol_pixels(&ofdm);
+    size_t symbol_samples = ofdm_symbol_samples(&ofdm);
+    uint64_t data_symbols = ((uint64_t)width * height + symbol_pixels - 1) / symbol_pixels;
+    uint64_t total_symbols = data_symbols + (data_symbols + interval - 1) / interval;
+    uint64_t total = total_symbols * symbol_samples;
+    if (!audio_size_fits(&ctx->options, total)) {
+        ofdm_free(&ofdm);
+        conversion_error("The OFDM audio would be too long for a WAV file.\n");
+        return CONVERSION_ERROR;
+    }
+
+    int workers = worker_count();
+    int groups = ofdm_batch_groups(&ofdm, workers);
+    size_t batch_symbols = (size_t)groups * (interval + 1);
+    size_t batch_pixels = (size_t)groups * interval * symbol_pixels;
+    uint8_t *row = (uint8_t *)malloc((size_t)width * channels);
+    uint8_t *gray = (uint8_t *)malloc(width);
+    uint8_t *pixels = (uint8_t *)malloc(batch_pixels);
+    int16_t *samples = (int16_t *)malloc(batch_symbols * symbol_samples * sizeof(int16_t));
+    float *work = (float *)malloc((size_t)workers * ofdm_work_size(&ofdm) * sizeof(float));
+
+    ImageMetadata *meta = &ctx->metadata;
+    meta->version = METADATA_VERSION;
+    meta->encoding = ENCODING_OFDM;
+    meta->width = width;
+    meta->height = height;
+    meta->pixels_per_second = rate;
+    meta->fft_size = layout.fft_size;
+    meta->first_bin = layout.first_bin;
+    meta->guard_samples = layout.prefix;
+    meta->carriers = layout.carriers;
+    meta->training_interval = interval;
+
+    SampleOutput samples_out;
+    int result = CONVERSION_OK;
+    if (sample_output_open(&samples_out, ctx, output, rate, 1, (int64_t)total, meta) != 0 ||
+        row == NULL || gray == NULL || pixels == NULL || samples == NULL || work == NULL) {
+        conversion_error("Couldn't allocate memory for OFDM.\n");
+        result = CONVERSION_ERROR;
+    }
+
+    OfdmBatch batch = { &ofdm, 0, pixels, samples, NULL, work };
+    uint64_t data_left = data_symbols;
+    int rows_read = 0, gray_used = width;
+    while (data_left > 0 && result == CONVERSION_OK) {
+        size_t data = data_left < (uint64_t)groups * interval ? (size_t)data_left : (size_t)groups * interval;
+        size_t wanted = data * symbol_pixels, filled = 0;
+        while (filled < wanted && result == CONVERSION_OK) {
+            if (gray_used == width) {
+                if (rows_read == height) {
+                    break;
+                }
+                if (image_reader_read_row(reader, row) != 0) {
+                    result = CONVERSION_ERROR;
+                    break;
+                }
+                KernelOutput out = { gray, 0, NULL, NULL };
+                kernel(row, width, &out);
+                rows_read++;
+                gray_used = 0;
+            }
+            size_t take = (size_t)(width - gray_used) < wanted - filled ? (size_t)(width - gray_used) : wanted - filled;
+            memcpy(pixels + filled, gray + gray_used, take);
+            filled += take;
+            gray_used += (int)take;
+        }
+        memset(pixels + filled, 128, wanted - filled); // the last symbol is padded with zeros
+        if (result != CONVERSION_OK) {
+            break;
+        }
+
+        batch.symbols = (int)(data + (data + interval - 1) / interval);
+        run_workers(ofdm_modulate_items, &batch, (batch.symbols + 1) / 2, workers);
+        size_t count = (size_t)batch.symbols * symbol_samples;
+        if (sample_output_write(&samples_out, samples, (int)count) != 0) {
+            result = CONVERSION_ERROR;
+        }
+        data_left -= data;
+
+        if (conversion_cancelled(ctx)) {
+            result = CONVERSION_CANCELLED;
+        }
+        conversion_report(ctx, (double)(data_symbols - data_left) / data_symbols);
+    }
+
+    if (sample_output_close(&samples_out, ctx, result == CONVERSION_OK) != 0 && result == CONVERSION_OK) {
+        result = CONVERSION_ERROR;
+    }
+    ofdm_free(&ofdm);
+    free(row);
+    free(gray);
+    free(pixels);
+    free(samples);
+    free(work);
+    ctx->num_samples = samples_out.written;
+    return result;
+}
+
+// Demodulate OFDM symbols back to rows: every symbol one forward transform, then every carrier corrected
+// by the latest training symbol, which takes out the gain and phase the audio path added.
+static int decode_ofdm(ConversionContext *ctx, ByteSource *input, ByteSink *output) {
+    const ImageMetadata *meta = &ctx->metadata;
+    OfdmLayout layout = { (int)meta->pixels_per_second, (int)meta->fft_size, (int)meta->first_bin,
+                          (int)meta->carriers, (int)meta->guard_samples, (int)meta->training_interval };
+    int width = (int)meta->width, height = (int)meta->height;
+    if (width <= 0 || height <= 0 || meta->width > (1 << 20) || width > INT32_MAX / height) {
+        conversion_error("Invalid image size in WAV data.\n");
+        return CONVERSION_ERROR;
+    }
+    Ofdm ofdm;
+    if (ofdm_layout_check(&layout) != 0 || ofdm_init(&ofdm, &layout) != 0) {
+        return CONVERSION_ERROR;
+    }
+
+    int interval = layout.training_interval;
+    int workers = worker_count();
+    int groups = ofdm_batch_groups(&ofdm, workers);
+    size_t batch_symbols = (size_t)groups * (interval + 1);
+    size_t symbol_pixels = ofdm_symbol_pixels(&ofdm);
+    size_t symbol_samples = ofdm_symbol_samples(&ofdm);
+    size_t symbol_values = 2 * (size_t)layout.carriers;
+
+    SampleInput samples_in;
+    int16_t *samples = (int16_t *)malloc(batch_symbols * symbol_samples * sizeof(int16_t));
+    float *values = (float *)malloc(batch_symbols * symbol_values * sizeof(float));
+    float *correction = (float *)calloc(symbol_values, sizeof(float));
+    float *work = (float *)malloc((size_t)workers * ofdm_work_size(&ofdm) * sizeof(float));
+    uint8_t *decoded = (uint8_t *)malloc(symbol_pixels);
+    uint8_t *row = (uint8_t *)calloc(width, 1);
+    ImageWriter *writer = NULL;
+    int result = CONVERSION_OK;
+    if (sample_input_init(&samples_in, input, wav_data_samples(&ctx->header), (int)ctx->header.sample_rate,
+                          layout.sample_rate, ctx->header.bits_per_sample) != 0 ||
+        samples == NULL || values == NULL || correction == NULL || work == NULL || decoded == NULL || row == NULL) {
+        conversion_error("Couldn't allocate memory for OFDM.\n");
+        result = CONVERSION_ERROR;
+    } else if ((writer = decoded_image_open(ctx, output, width, height)) == NULL) {
+        conversion_error("Couldn't start the PNG output.\n");
+        result = CONVERSION_ERROR;
+    }
+
+    OfdmBatch batch = { &ofdm, 0, NULL, samples, values, work };
+    int rows = 0, row_used = 0;
+    bool at_end = false;
+    while (rows < height && !at_end && result == CONVERSION_OK) {
+        int count = sample_input_read(&samples_in, samples, (int)(batch_symbols * symbol_samples));
+        batch.symbols = (int)(count / symbol_samples);
+        at_end = (size_t)batch.symbols < batch_symbols;
+        run_workers(ofdm_demodulate_items, &batch, (batch.symbols + 1) / 2, workers);
+
+        for (int s = 0; s < batch.symbols && rows < height && result == CONVERSION_OK; s++) {
+            const float *symbol = values + s * symbol_values;
+            if (s % (interval + 1) == 0) {
+                ofdm_train(&ofdm, symbol, correction);
+                continue;
+            }
+            ofdm_equalize(&ofdm, symbol, correction, decoded);
+            for (size_t used = 0; used < symbol_pixels && rows < height && result == CONVERSION_OK;) {
+                size_t take = (size_t)(width - row_used) < symbol_pixels - used ? (size_t)(width - row_used)
+                                                                                 : symbol_pixels - used;
+                memcpy(row + row_used, decoded + used, take);
+                used += take;
+                row_used += (int)take;
+                if (row_used == width) {
+                    if (image_writer_write_row(writer, row) != 0) {
+                        result = CONVERSION_ERROR;
+                    }
+                    rows++;
+                    row_used = 0;
+                }
+            }
+        }
+
+        if (conversion_cancelled(ctx)) {
+            result = CONVERSION_CANCELLED;
+        }
+        conversion_report(ctx, (double)rows / height);
+    }
+
+    if (result == CONVERSION_OK) {
+        // Audio that ended early leaves the rest of the image black
+        memset(row + row_used, 0, width - row_used);
+        for (; rows < height && result == CONVERSION_OK; rows++) {
+            if (image_writer_write_row(writer, row) != 0) {
+                result = CONVERSION_ERROR;
+            }
+            memset(row, 0, width);
+        }
+    }
+    if (writer && image_writer_close(writer) != 0 && result == CONVERSION_OK) {
+        result = CONVERSION_ERROR;
+    }
+
+    sample_input_close(&samples_in);
+    ofdm_free(&ofdm);
+    free(samples);
+    free(values);
+    free(correction);
+    free(work);
+    free(decoded);
+    free(row);
+    ctx->width = width;
+    ctx->height = height;
+    if (result == CONVERSION_OK) {
+        conversion_report(ctx, 1.0);
+    }
+    return result;
+}
+
+// -------------------------------------------------------------------------------------------------------- rle
+
+// Tokens of a run-length coded image as they are found, runs carrying on from one row into the next
+typedef struct {
+    uint8_t *tokens;
+    size_t size;
+    size_t capacity;
+    size_t literal_start;   // offset of the count of the open literal token, SIZE_MAX when none is open
+    int literal_count;
+    uint8_t run_value;      // pixel of the run being extended
+    size_t run_length;      // 0 when no run is open
+    bool failed;            // out of memory, tokens stop growing
+} RleEncoder;
+
+static bool rle_reserve(RleEncoder *rle, size_t more) {
+    if (rle->failed) {
+        return false;
+    }
+    if (rle->size + more > rle->capacity) {
+        size_t capacity = rle->capacity ? rle->capacity * 2 : (size_t)1 << 16;
+        while (capacity < rle->size + more) {
+            capacity *= 2;
+        }
+        uint8_t *tokens = (uint8_t *)realloc(rle->tokens, capacity);
+        if (tokens == NULL) {
+            rle->failed = true;
+            return false;
+        }
+        rle->tokens = tokens;
+        rle->capacity = capacity;
+    }
+    return true;
+}
+
+static void rle_literals(RleEncoder *rle, const uint8_t *pixels, size_t count) {
+    while (count > 0) {
+        if (rle->literal_start == SIZE_MAX) {
+            if (!rle_reserve(rle, 1)) {
+                return;
+            }
+            rle->literal_start = rle->size++;
+            rle->literal_count = 0;
+        }
+        size_t take = (size_t)(RLE_LITERALS - rle->literal_count) < count ? (size_t)(RLE_LITERALS - rle->literal_count)
+                                                                         : count;
+        if (!rle_reserve(rle, take)) {
+            return;
+        }
+        memcpy(rle->tokens + rle->size, pixels, take);
+        rle->size += take;
+        rle->literal_count += (int)take;
+        rle->tokens[rle->literal_start] = (uint8_t)(rle->literal_count - 1);
+        if (rle->literal_count == RLE_LITERALS) {
+            rle->literal_start = SIZE_MAX;
+        }
+        pixels += take;
+        count -= take;
+    }
+}
+
+// The open run as run tokens, or as literals when it is too short for one
+static void rle_flush_run(RleEncoder *rle) {
+    size_t length = rle->run_length;
+    rle->run_length = 0;
+    while (length >= RLE_MIN_RUN) {
+        size_t take = length < RLE_MAX_RUN ? length : RLE_MAX_RUN;
+        size_t code = take - RLE_MIN_RUN;
+        if (!rle_reserve(rle, 3)) {
+            return;
+        }
+        rle->tokens[rle->size++] = (uint8_t)(128 + (code >> 8));
+        rle->tokens[rle->size++] = (uint8_t)(code & 0xFF);
+        rle->tokens[rle->size++] = rle->run_value;
+        rle->literal_start = SIZE_MAX;
+        length -= take;
+    }
+    uint8_t rest[RLE_MIN_RUN];
+    memset(rest, rle->run_value, length);
+    rle_literals(rle, rest, length);
+}
+
+// Code count more pixels. Literals are skipped up to the next pair of equal pixels and runs extended over
+// the pixels equal to theirs, both 16 at a time; the last pixel stays an open run the next row may continue.
+static void rle_encode(RleEncoder *rle, const uint8_t *pixels, size_t count) {
+    size_t i = 0;
+    while (i < count) {
+        if (rle->run_length > 0) {
+            if (pixels[i] == rle->run_value) {
+                size_t length = byte_run(pixels + i, count - i);
+                rle->run_length += length;
+                i += length;
+                continue;
+            }
+            rle_flush_run(rle);
+        }
+        size_t literals = byte_repeat(pixels + i, count - i);
+        if (literals == count - i) {
+            literals--;
+        }
+        rle_literals(rle, pixels + i, literals);
+        i += literals;
+        rle->run_value = pixels[i++];
+        rle->run_length = 1;
+    }
+}
+
+// Gray or plane rows run-length coded at the WAV rate. The tokens are gathered first, a fraction of the
+// pixels for images with large uniform areas, so the exact length goes into the header even for a pipe.
+static int encode_rle(ConversionContext *ctx, ImageReader *reader, ByteSink *output) {
+    int width = ctx->width, height = ctx->height;
+    int channels = image_reader_channels(reader);
+    int rate = ctx->options.sample_rate;
+    PixelKernel kernel = select_pixel_kernel(SAMPLE_FORMAT_U8, MODE_ARRAY, channels);
+
+    RleEncoder rle = { NULL, 0, 0, SIZE_MAX, 0, 0, 0, false };
+    uint8_t *row = (uint8_t *)malloc((size_t)width * channels);
+    uint8_t *gray = (uint8_t *)malloc(width);
+    int16_t *samples = (int16_t *)malloc(BUFFER_SIZE * sizeof(int16_t));
+    int result = CONVERSION_OK;
+    if (row == NULL || gray == NULL || samples == NULL) {
+        conversion_error("Couldn't allocate memory for a row of pixels.\n");
+        result = CONVERSION_ERROR;
+    }
+    for (int y = 0; y < height && result == CONVERSION_OK; y++) {
+        if (conversion_cancelled(ctx)) {
+            result = CONVERSION_CANCELLED;
+        } else if (image_reader_read_row(reader, row) != 0) {
+            result = CONVERSION_ERROR;
+        } else {
+            KernelOutput out = { gray, 0, NULL, NULL };
+            kernel(row, width, &out);
+            rle_encode(&rle, gray, width);
+            conversion_report(ctx, 0.8 * (y + 1) / height);
+        }
+    }
+    free(row);
+    free(gray);
+    if (result == CONVERSION_OK) {
+        rle_flush_run(&rle);
+        if (rle.failed) {
+            conversion_error("Couldn't allocate memory for run-length tokens.\n");
+            result = CONVERSION_ERROR;
+        } else if (!audio_size_fits(&ctx->options, rle.size)) {
+            conversion_error("The audio would be too long for a WAV file.\n");
+            result = CONVERSION_ERROR;
+        }
+    }
+    if (result != CONVERSION_OK) {
+        free(rle.tokens);
+        free(samples);
+        return result;
+    }
+
+    ImageMetadata *meta = &ctx->metadata;
+    meta->version = METADATA_VERSION;
+    meta->encoding = ENCODING_RLE;
+    meta->width = width;
+    meta->height = height;
+    meta->pixels_per_second = rate;
+
+    SampleOutput samples_out;
+    if (sample_output_open(&samples_out, ctx, output, rate, 1, (int64_t)rle.size, meta) != 0) {
+        free(rle.tokens);
+        free(samples);
+        return CONVERSION_ERROR;
+    }
+    for (size_t done = 0; done < rle.size && result == CONVERSION_OK;) {
+        size_t count = rle.size - done < BUFFER_SIZE ? rle.size - done : BUFFER_SIZE;
+        pcm_u8_to_s16(rle.tokens + done, samples, count);
+        if (sample_output_write(&samples_out, samples, (int)count) != 0) {
+            result = CONVERSION_ERROR;
+        }
+        done += count;
+        conversion_report(ctx, 0.8 + 0.2 * done / rle.size);
+    }
+    if (sample_output_close(&samples_out, ctx, result == CONVERSION_OK) != 0 && result == CONVERSION_OK) {
+        result = CONVERSION_ERROR;
+    }
+    free(rle.tokens);
+    free(samples);
+    ctx->num_samples = samples_out.written;
+    return result;
+}
+
+// Rows rebuilt from run-length tokens, written as they fill up
+typedef struct {
+    ImageWriter *writer;
+    uint8_t *row;
+    int width;
+    int height;
+    int used;               // pixels of the row filled so far
+    int rows;               // rows written
+    int uniform;            // pixel the whole row holds after a run covered it, -1 otherwise
+} RleRows;
+
+static int rle_rows_put(RleRows *rows, const uint8_t *pixels, size_t count) {
+    while (count > 0 && rows->rows < rows->height) {
+        size_t take = (size_t)(rows->width - rows->used) < count ? (size_t)(rows->width - rows->used) : count;
+        memcpy(rows->row + rows->used, pixels, take);
+        rows->uniform = -1;
+        rows->used += (int)take;
+        pixels += take;
+        count -= take;
+        if (rows->used == rows->width) {
+            if (image_writer_write_row(rows->writer, rows->row) != 0) {
+                return -1;
+            }
+            rows->rows++;
+            rows->used = 0;
+        }
+    }
+    return 0;
+}
+
+// A run is expanded with memset, which the C library does with the widest stores the CPU has; a run over
+// whole rows fills the row once and writes it again for every further row.
+static int rle_rows_fill(RleRows *rows, uint8_t value, size_t count) {
+    while (count > 0 && rows->rows < rows->height) {
+        size_t take = (size_t)(rows->width - rows->used) < count ? (size_t)(rows->width - rows->used) : count;
+        bool whole = rows->used == 0 && take == (size_t)rows->width;
+        if (!whole || rows->uniform != value) {
+            memset(rows->row + rows->used, value, take);
+        }
+        rows->uniform = whole ? value : -1;
+        rows->used += (int)take;
+        count -= take;
+        if (rows->used == rows->width) {
+            if (image_writer_write_row(rows->writer, rows->row) != 0) {
+                return -1;
+            }
+            rows->rows++;
+            rows->used = 0;
+        }
+    }
+    return 0;
+}
+
+// Expand run-length tokens back to rows. Tokens may be split anywhere between sample buffers, so the
+// decoder keeps the token it is in the middle of; audio that ends early leaves the rest of the image black.
+static int decode_rle(ConversionContext *ctx, ByteSource *input, ByteSink *output) {
+    const ImageMetadata *meta = &ctx->metadata;
+    int width = (int)meta->width, height = (int)meta->height;
+    if (width <= 0 || height <= 0 || meta->width > (1 << 24) || width > INT32_MAX / height ||
+        (int)meta->pixels_per_second <= 0) {
+        conversion_error("Invalid image size in WAV data.\n");
+        return CONVERSION_ERROR;
+    }
+
+    SampleInput samples_in;
+    int16_t *samples = (int16_t *)malloc(BUFFER_SIZE * sizeof(int16_t));
+    uint8_t *tokens = (uint8_t *)malloc(BUFFER_SIZE);
+    RleRows rows = { NULL, (uint8_t *)calloc(width, 1), width, height, 0, 0, -1 };
+    int result = CONVERSION_OK;
+    if (sample_input_init(&samples_in, input, wav_data_samples(&ctx->header), (int)ctx->header.sample_rate,
+                          (int)meta->pixels_per_second, ctx->header.bits_per_sample) != 0 ||
+        samples == NULL || tokens == NULL || rows.row == NULL) {
+        conversion_error("Couldn't allocate memory for run-length decoding.\n");
+        result = CONVERSION_ERROR;
+    } else if ((rows.writer = decoded_image_open(ctx, output, width, height)) == NULL) {
+        conversion_error("Couldn't start the PNG output.\n");
+        result = CONVERSION_ERROR;
+    }
+
+    size_t literals = 0, run_length = 0, decoded = 0;
+    int run_high = -1;      // high bits of a run length whose low byte is still to come
+    int count;
+    while (result == CONVERSION_OK && rows.rows < height &&
+           (count = sample_input_read(&samples_in, samples, BUFFER_SIZE)) > 0) {
+        pcm_s16_to_u8(samples, tokens, count);
+        for (int t = 0; t < count && rows.rows < height && result == CONVERSION_OK;) {
+            if (literals > 0) {
+                size_t take = (size_t)(count - t) < literals ? (size_t)(count - t) : literals;
+                if (rle_rows_put(&rows, tokens + t, take) != 0) {
+                    result = CONVERSION_ERROR;
+                }
+                t += (int)take;
+                literals -= take;
+            } else if (run_high >= 0) {
+                run_length = RLE_MIN_RUN + ((size_t)run_high << 8 | tokens[t++]);
+                run_high = -1;
+            } else if (run_length > 0) {
+                if (rle_rows_fill(&rows, tokens[t++], run_length) != 0) {
+                    result = CONVERSION_ERROR;
+                }
+                run_length = 0;
+            } else if (tokens[t] < 128) {
+                literals = (size_t)tokens[t++] + 1;
+            } else {
+                run_high = tokens[t++] - 128;
+            }
+        }
+        decoded += count;
+        if (conversion_cancelled(ctx)) {
+            result = CONVERSION_CANCELLED;
+        }
+        conversion_report(ctx, (double)rows.rows / height);
+    }
+
+    if (result == CONVERSION_OK) {
+        memset(rows.row + rows.used, 0, width - rows.used);
+        for (; rows.rows < height && result == CONVERSION_OK; rows.rows++) {
+            if (image_writer_write_row(rows.writer, rows.row) != 0) {
+                result = CONVERSION_ERROR;
+            }
+            memset(rows.row, 0, width);
+        }
+    }
+    if (rows.writer && image_writer_close(rows.writer) != 0 && result == CONVERSION_OK) {
+        result = CONVERSION_ERROR;
+    }
+
+    sample_input_close(&samples_in);
+    free(samples);
+    free(tokens);
+    free(rows.row);
+    ctx->width = width;
+    ctx->height = height;
+    ctx->num_samples = (int)decoded;
+    if (result == CONVERSION_OK) {
+        conversion_report(ctx, 1.0);
+    }
+    return result;
+}
+
+// -------------------------------------------------------------------------------------------------------- raw
+
+// Samples of the raw audio of a width x height image: the pixels with their sync markers, error correction
+// or row predictors, resampled to the WAV rate
+static size_t raw_samples(const ConversionOptions *options, int width, int height) {
+    int frame_rows = options->frame_rows < height ? options->frame_rows : height;
+    size_t num_pixels = (size_t)width * height;
+    size_t frames = frame_rows > 0 ? (size_t)(height + frame_rows - 1) / frame_rows : 0;
+    size_t stream = options->fec_parity > 0 ? fec_stream_samples(num_pixels, options->fec_parity)
+                                            : num_pixels + frames * SYNC_FRAME_SAMPLES;
+    if (options->predictor != PREDICT_NONE) {
+        stream += height;
+    }
+    return options->pixels_per_second != options->sample_rate
+         ? resampled_samples(stream, options->pixels_per_second, options->sample_rate) : stream;
+}
+
+// Intensities as samples. Array mode converts rows as they are decoded, so memory stays at one row,
+// and Pipeline mode does the same with decoding, conversion and writing on separate threads.
+// The data structure modes need every sample before writing and read the whole image first.
+// A 16-bit WAV at the pixel rate keeps the original layout with width and height at the start of the data;
+// anything else gets a "w2im" chunk recording them together with the pixel rate. With frame_rows set, a
+// sync marker and row index go before every frame_rows rows; with fec_parity set, the pixels are sent
+// as Reed-Solomon blocks. Any order but ORDER_RASTER needs the whole image first, like the data structure
+// modes. With a predictor every row goes as its predictor followed by the residuals of its pixels.
+// Otherwise grayscale rows at the WAV rate sit at fixed offsets, and a file gets the "w2ix" index of
+// them for decoding regions.
+// The reader is closed on return.
+static int encode_raw(ConversionContext *ctx, ImageReader *reader, ByteSink *output) {
+    int width = ctx->width, height = ctx->height;
+    int num_pixels = width * height;
+    int sample_rate = ctx->options.sample_rate;
+    int pixel_rate = ctx->options.pixels_per_second;
+    int bits = ctx->options.bits_per_sample;
+    int frame_rows = ctx->options.frame_rows < height ? ctx->options.frame_rows : height;
+    int fec_parity = ctx->options.fec_parity;
+    int order = ctx->options.order;
+    int predictor = ctx->options.predictor;
+    bool described = pixel_rate != sample_rate || bits != 16 || ctx->options.container != CONTAINER_WAV ||
+                     ctx->metadata.color != COLOR_GRAY || frame_rows > 0 || fec_parity > 0 ||
+                     order != ORDER_RASTER || predictor != PREDICT_NONE || ctx->metadata.original_width != 0;
+    if (frame_rows > 0 && (height > SYNC_MAX_ROWS || (int64_t)frame_rows * width > INT32_MAX / 8)) {
+        image_reader_close(reader);
+        conversion_error("The image is too large for sync framing.\n");
+        return CONVERSION_ERROR;
+    }
+
+    // The sample count is known from the PNG header, so even a pipe gets exact sizes
+    size_t num_samples = raw_samples(&ctx->options, width, height);
+    if (!audio_size_fits(&ctx->options, num_samples)) {
+        image_reader_close(reader);
+        conversion_error("The audio would be too long for a WAV file.\n");
+        return CONVERSION_ERROR;
+    }
+    if (described) {
+        ImageMetadata *meta = &ctx->metadata;
+        meta->version = METADATA_VERSION;
+        meta->encoding = ENCODING_RAW;
+        meta->width = width;
+        meta->height = height;
+        meta->pixels_per_second = pixel_rate;
+        meta->frame_rows = frame_rows;
+        meta->fec_parity = fec_parity;
+        meta->fec_depth = fec_parity > 0 ? RS_LANES : 0;
+        meta->order = order;
+        meta->predictor = predictor;
+    }
+
+    SampleOutput samples_out;
+    if (sample_output_open(&samples_out, ctx, output, pixel_rate, 1, (int64_t)num_samples,
+                           described ? &ctx->metadata : NULL) != 0) {
+        image_reader_close(reader);
+        return CONVERSION_ERROR;
+    }
+    sample_output_set_frames(&samples_out, width, frame_rows);
+    if (fec_parity > 0 && sample_output_set_fec(&samples_out, fec_parity, num_pixels) != 0) {
+        sample_output_close(&samples_out, ctx, false);
+        image_reader_close(reader);
+        return CONVERSION_ERROR;
+    }
+    if (!described) {
+        sample_output_data(&samples_out, &ctx->width, sizeof(int));
+        sample_output_data(&samples_out, &ctx->height, sizeof(int));
+    }
+    if (predictor != PREDICT_NONE ? sample_output_set_prediction(&samples_out, width, predictor) != 0
+        : ctx->metadata.color == COLOR_GRAY && order == ORDER_RASTER &&
+          sample_output_set_index(&samples_out, width, height) != 0) {
+        sample_output_close(&samples_out, ctx, false);
+        image_reader_close(reader);
+        return CONVERSION_ERROR;
+    }
+
+    int result = CONVERSION_OK;
+    if (ctx->options.mode <= MODE_QUEUE || order != ORDER_RASTER) {
+        int channels = image_reader_channels(reader);
+        free(ctx->pixels);
+        ctx->pixels = (uint8_t *)malloc((size_t)num_pixels * channels);
+        if (ctx->pixels == NULL) {
+            conversion_error("Couldn't allocate memory for pixels.\n");
+            result = CONVERSION_ERROR;
+        }
+        for (int y = 0; y < height && result == CONVERSION_OK; y++) {
+            if (image_reader_read_row(reader, ctx->pixels + (size_t)y * width * channels) != 0) {
+                result = CONVERSION_ERROR;
+            }
+        }
+        image_reader_close(reader);
+
+        int count = 0;
+        if (result == CONVERSION_OK) {
+            free(ctx->samples);
+            ctx->samples = NULL;
+            result = pixels_to_samples(ctx, ctx->pixels, width, height, channels, &ctx->samples, &count);
+            ctx->num_samples = count;
+        }
+        if (result == CONVERSION_OK &&
+            (order == ORDER_RASTER ? sample_output_write(&samples_out, ctx->samples, count)
+                                   : sample_output_write_ordered(&samples_out, ctx->samples, width, height, order)) != 0) {
+            result = CONVERSION_ERROR;
+        }
+    } else {
+        result = ctx->options.mode == MODE_PIPELINE
+            ? encode_rows_pipelined(ctx, reader, &samples_out)
+            : encode_rows(ctx, reader, &samples_out);
+        image_reader_close(reader);
+    }
+
+    if (sample_output_close(&samples_out, ctx, result == CONVERSION_OK) != 0 && result == CONVERSION_OK) {
+        result = CONVERSION_ERROR;
+    }
+    if (ctx->options.mode > MODE_QUEUE && order == ORDER_RASTER) {
+        ctx->num_samples = samples_out.written;
+    }
+    return result;
+}
+
+// Groups of rows found between sync markers, converted to pixels by several workers
+typedef struct {
+    const int16_t *samples;
+    const SyncMark *marks;  // accepted markers in stream order
+    const size_t *ends;     // where the samples of each group end at the latest
+    size_t group;           // pixel samples of a whole group
+    uint8_t *pixels;        // group bytes per marker
+} SyncGroups;
+
+static void sync_decode_items(void *arg, int worker, int from, int to) {
+    SyncGroups *groups = (SyncGroups *)arg;
+    (void)worker;
+    for (int i = from; i < to; i++) {
+        size_t start = groups->marks[i].position + SYNC_FRAME_SAMPLES;
+        size_t count = groups->ends[i] > start ? groups->ends[i] - start : 0;
+        count = count < groups->group ? count : groups->group;
+        uint8_t *pixels = groups->pixels + (size_t)i * groups->group;
+        for (size_t x = 0; x < count; x++) {
+            pixels[x] = sample_to_pixel(groups->samples[start + x]);
+        }
+        memset(pixels + count, 0, groups->group - count); // samples lost in the group leave black
+    }
+}
+
+// Sync framed raw rows. Batches of samples are searched for markers over all cores, the groups between
+// them decoded in parallel and written in row order. A group is cut short by the next marker or takes
+// its full length, whatever samples were lost or added inside it; rows without a group stay black.
+static int decode_framed(ConversionContext *ctx, ByteSource *input, ByteSink *output, int pixel_rate) {
+    int width = ctx->width, height = ctx->height;
+    int frame_rows = (int)ctx->metadata.frame_rows;
+    if (frame_rows <= 0 || frame_rows > height || (int64_t)frame_rows * width > INT32_MAX / 8) {
+        conversion_error("Invalid sync framing in the audio description.\n");
+        return CONVERSION_ERROR;
+    }
+    size_t group = (size_t)frame_rows * width;
+    size_t frame = SYNC_FRAME_SAMPLES + group;
+    size_t capacity = 4 * frame > SYNC_BATCH_SAMPLES ? 4 * frame : SYNC_BATCH_SAMPLES;
+    int max_groups = (int)(capacity / frame) + 2;
+    int workers = worker_count();
+
+    SampleInput samples_in;
+    SyncSearch search;
+    sync_search_init(&search);
+    int16_t *samples = (int16_t *)malloc(capacity * sizeof(int16_t));
+    search.marks = (SyncMark *)malloc((capacity / SYNC_FRAME_SAMPLES + WORKER_THREADS_MAX + 1) * sizeof(SyncMark));
+    SyncMark *marks = (SyncMark *)malloc(max_groups * sizeof(SyncMark));
+    size_t *ends = (size_t *)malloc(max_groups * sizeof(size_t));
+    uint8_t *pixels = (uint8_t *)malloc(max_groups * group);
+    uint8_t *black = (uint8_t *)calloc(width, 1);
+    ImageWriter *writer = NULL;
+    if (sample_input_init(&samples_in, input, wav_data_samples(&ctx->header), (int)ctx->header.sample_rate,
+                          pixel_rate, ctx->header.bits_per_sample) == 0 &&
+        samples && search.marks && marks && ends && pixels && black) {
+        writer = decoded_image_open(ctx, output, width, height);
+    }
+    if (writer == NULL) {
+        sample_input_close(&samples_in);
+        free(samples);
+        free(search.marks);
+        free(marks);
+        free(ends);
+        free(pixels);
+        free(black);
+        conversion_error("Couldn't start the PNG output.\n");
+        return CONVERSION_ERROR;
+    }
+
+    int result = CONVERSION_OK;
+    size_t have = 0;
+    bool at_end = false;
+    int next_row = 0;
+    int64_t last_row = -1;
+    int decoded = 0;
+    while (result == CONVERSION_OK) {
+        if (!at_end) {
+            int got = sample_input_read(&samples_in, samples + have, (int)(capacity - have));
+            at_end = (size_t)got < capacity - have;
+            have += got;
+            decoded += got;
+        }
+
+        // Markers anywhere in the buffer, then those that continue the image in order
+        int positions = have >= SYNC_FRAME_SAMPLES ? (int)(have - SYNC_FRAME_SAMPLES + 1) : 0;
+        memset(search.found, 0, sizeof(search.found));
+        search.samples = samples;
+        run_workers(sync_search_items, &search, positions, workers);
+
+        int count = 0;
+        bool deferred = false;
+        size_t keep = at_end ? have : have > SYNC_FRAME_SAMPLES - 1 ? have - (SYNC_FRAME_SAMPLES - 1) : 0;
+        for (int w = 0; w < WORKER_THREADS_MAX && !deferred; w++) {
+            for (int m = 0; m < search.found[w]; m++) {
+                SyncMark mark = search.marks[search.first[w] + m];
+                if ((count > 0 && mark.position < marks[count - 1].position + SYNC_FRAME_SAMPLES) ||
+                    mark.row >= (uint32_t)height || mark.row % frame_rows != 0 || (int64_t)mark.row <= last_row) {
+                    continue;
+                }
+                if ((!at_end && mark.position + frame > have) || count == max_groups) {
+                    keep = mark.position; // the group continues in the next batch
+                    deferred = true;
+                    break;
+                }
+                marks[count++] = mark;
+                last_row = mark.row;
+            }
+        }
+        for (int i = 0; i < count; i++) {
+            ends[i] = i + 1 < count ? marks[i + 1].position : deferred ? keep : have;
+        }
+
+        SyncGroups groups = { samples, marks, ends, group, pixels };
+        run_workers(sync_decode_items, &groups, count, workers);
+        for (int i = 0; i < count && result == CONVERSION_OK; i++) {
+            for (; next_row < (int)marks[i].row && result == CONVERSION_OK; next_row++) {
+                result = image_writer_write_row(writer, black) == 0 ? CONVERSION_OK : CONVERSION_ERROR;
+            }
+            for (int r = 0; r < frame_rows && next_row < height && result == CONVERSION_OK; r++, next_row++) {
+                result = image_writer_write_row(writer, pixels + (size_t)i * group + (size_t)r * width) == 0
+                    ? CONVERSION_OK : CONVERSION_ERROR;
+            }
+        }
+
+        memmove(samples, samples + keep, (have - keep) * sizeof(int16_t));
+        have -= keep;
+        if (at_end && have == 0) {
+            break;
+        }
+        if (result == CONVERSION_OK && conversion_cancelled(ctx)) {
+            result = CONVERSION_CANCELLED;
+        }
+        conversion_report(ctx, (double)next_row / height);
+    }
+    for (; next_row < height && result == CONVERSION_OK; next_row++) {
+        result = image_writer_write_row(writer, black) == 0 ? CONVERSION_OK : CONVERSION_ERROR;
+    }
+
+    if (image_writer_close(writer) != 0 && result == CONVERSION_OK) {
+        result = CONVERSION_ERROR;
+    }
+    sample_input_close(&samples_in);
+    free(samples);
+    free(search.marks);
+    free(marks);
+    free(ends);
+    free(pixels);
+    free(black);
+    ctx->num_samples = decoded;
+
+    if (result == CONVERSION_OK) {
+        conversion_report(ctx, 1.0);
+    }
+    return result;
+}
+
+// Reed-Solomon coded raw pixels. Batches of blocks are rounded to symbols and corrected over all cores,
+// then their data rows written as image rows. Codewords beyond correction keep the pixels as received.
+static int decode_fec(ConversionContext *ctx, ByteSource *input, ByteSink *output, int pixel_rate) {
+    int width = ctx->width, height = ctx->height;
+    int parity = (int)ctx->metadata.fec_parity;
+    RsCode code;
+    if (ctx->metadata.fec_depth != RS_LANES || rs_init(&code, parity) != 0) {
+        conversion_error("Invalid error correction in the audio description.\n");
+        return CONVERSION_ERROR;
+    }
+    size_t pixels = (size_t)width * height;
+    size_t stream = fec_stream_samples(pixels, parity);
+    size_t data = (size_t)(255 - parity) * RS_LANES;
+    size_t capacity = (size_t)FEC_BATCH_BLOCKS * 255 * RS_LANES;
+    int workers = worker_count();
+
+    SampleInput samples_in;
+    int16_t *samples = (int16_t *)malloc(capacity * sizeof(int16_t));
+    uint8_t *symbols = (uint8_t *)malloc(capacity);
+    uint8_t *row = (uint8_t *)malloc(width);
+    ImageWriter *writer = NULL;
+    if (sample_input_init(&samples_in, input, wav_data_samples(&ctx->header), (int)ctx->header.sample_rate,
+                          pixel_rate, ctx->header.bits_per_sample) == 0 &&
+        samples && symbols && row) {
+        writer = decoded_image_open(ctx, output, width, height);
+    }
+    if (writer == NULL) {
+        sample_input_close(&samples_in);
+        free(samples);
+        free(symbols);
+        free(row);
+        conversion_error("Couldn't start the PNG output.\n");
+        return CONVERSION_ERROR;
+    }
+
+    int result = CONVERSION_OK;
+    size_t sent = 0, written = 0;
+    int decoded = 0, failed = 0, filled = 0, y = 0;
+    while (sent < stream && result == CONVERSION_OK) {
+        // Samples lost at the end read as black
+        size_t count = stream - sent < capacity ? stream - sent : capacity;
+        int got = sample_input_read(&samples_in, samples, (int)count);
+        for (size_t i = got; i < count; i++) {
+            samples[i] = INT16_MIN;
+        }
+        decoded += got;
+        sent += count;
+
+        FecBatch batch = { &code, symbols, count, samples, { 0 } };
+        int blocks = (int)((count + 255 * RS_LANES - 1) / (255 * RS_LANES));
+        run_workers(fec_decode_items, &batch, blocks, workers);
+        for (int w = 0; w < WORKER_THREADS_MAX; w++) {
+            failed += batch.failed[w];
+        }
+
+        // Data rows of every block to image rows
+        for (int b = 0; b < blocks && result == CONVERSION_OK; b++) {
+            const uint8_t *block = symbols + (size_t)b * 255 * RS_LANES;
+            size_t take = (size_t)(fec_block_rows(&batch, b) - parity) * RS_LANES;
+            take = take < data ? take : data;
+            take = take < pixels - written ? take : pixels - written;
+            written += take;
+            while (take > 0 && result == CONVERSION_OK) {
+                size_t part = take < (size_t)(width - filled) ? take : (size_t)(width - filled);
+                memcpy(row + filled, block, part);
+                block += part;
+                take -= part;
+                filled += (int)part;
+                if (filled == width) {
+                    result = image_writer_write_row(writer, row) == 0 ? CONVERSION_OK : CONVERSION_ERROR;
+                    filled = 0;
+                    y++;
+                }
+            }
+        }
+        if (result == CONVERSION_OK && conversion_cancelled(ctx)) {
+            result = CONVERSION_CANCELLED;
+        }
+        conversion_report(ctx, (double)y / height);
+    }
+    if (failed > 0 && result == CONVERSION_OK) {
+        conversion_warning(ctx, "%d codewords had more errors than the code corrects.\n", failed);
+    }
+
+    if (image_writer_close(writer) != 0 && result == CONVERSION_OK) {
+        result = CONVERSION_ERROR;
+    }
+    sample_input_close(&samples_in);
+    free(samples);
+    free(symbols);
+    free(row);
+    ctx->num_samples = decoded;
+
+    if (result == CONVERSION_OK) {
+        conversion_report(ctx, 1.0);
+    }
+    return result;
+}
+
+// Pixels in an ORDER_ other than rows, put back into a whole frame as they arrive. Pixels a short stream
+// never sent stay black, or in Adam7 order show the lower resolution image of those that came.
+static int decode_ordered(ConversionContext *ctx, ByteSource *input, ByteSink *output, int pixel_rate) {
+    int width = ctx->width, height = ctx->height;
+    size_t num_pixels = (size_t)width * height;
+    SampleInput samples_in;
+    uint8_t *frame = (uint8_t *)calloc(num_pixels, 1);
+    uint32_t *offsets = (uint32_t *)malloc(BUFFER_SIZE * sizeof(uint32_t));
+    int16_t *samples = (int16_t *)malloc(BUFFER_SIZE * sizeof(int16_t));
+    if (sample_input_init(&samples_in, input, wav_data_samples(&ctx->header), (int)ctx->header.sample_rate,
+                          pixel_rate, ctx->header.bits_per_sample) != 0 ||
+        frame == NULL || offsets == NULL || samples == NULL) {
+        sample_input_close(&samples_in);
+        free(frame);
+        free(offsets);
+        free(samples);
+        conversion_error("Couldn't allocate memory for the image.\n");
+        return CONVERSION_ERROR;
+    }
+
+    int result = CONVERSION_OK;
+    PixelOrder order;
+    pixel_order_init(&order, (int)ctx->metadata.order, width, height);
+    size_t decoded = 0, count;
+    while (result == CONVERSION_OK && (count = pixel_order_next(&order, offsets, BUFFER_SIZE)) > 0) {
+        int got = sample_input_read(&samples_in, samples, (int)count);
+        if (ctx->metadata.order == ORDER_ADAM7) {
+            for (int i = 0; i < got; i++) {
+                adam7_put(frame, width, height, offsets[i], sample_to_pixel(samples[i]));
+            }
+        } else {
+            for (int i = 0; i < got; i++) {
+                frame[offsets[i]] = sample_to_pixel(samples[i]);
+            }
+        }
+        decoded += got;
+        if (conversion_cancelled(ctx)) {
+            result = CONVERSION_CANCELLED;
+        }
+        conversion_report(ctx, 0.9 * decoded / num_pixels);
+        if ((size_t)got < count) {
+            break;
+        }
+    }
+    sample_input_close(&samples_in);
+    free(offsets);
+    free(samples);
+
+    ImageWriter *writer = result == CONVERSION_OK ? decoded_image_open(ctx, output, width, height) : NULL;
+    if (result == CONVERSION_OK && writer == NULL) {
+        conversion_error("Couldn't start the PNG output.\n");
+        result = CONVERSION_ERROR;
+    }
+    for (int y = 0; y < height && result == CONVERSION_OK; y++) {
+        if (image_writer_write_row(writer, frame + (size_t)y * width) != 0) {
+            result = CONVERSION_ERROR;
+        }
+    }
+    if (writer && image_writer_close(writer) != 0 && result == CONVERSION_OK) {
+        result = CONVERSION_ERROR;
+    }
+    free(frame);
+    ctx->num_samples = (int)decoded;
+
+    if (result == CONVERSION_OK) {
+        conversion_report(ctx, 1.0);
+    }
+    return result;
+}
+
+// Rows sent as their predictor followed by residuals, rebuilt from the row above one at a time. A damaged
+// predictor counts as PREDICT_NONE, and residuals a short stream never sent leave the prediction as it is.
+static int decode_predicted(ConversionContext *ctx, ByteSource *input, ByteSink *output, int pixel_rate) {
+    int width = ctx->width, height = ctx->height;
+    SampleInput samples_in;
+    int16_t *samples = (int16_t *)malloc(((size_t)width + 1) * sizeof(int16_t));
+    uint8_t *rows = (uint8_t *)calloc((size_t)width, 3);
+    ImageWriter *writer = NULL;
+    if (sample_input_init(&samples_in, input, wav_data_samples(&ctx->header), (int)ctx->header.sample_rate,
+                          pixel_rate, ctx->header.bits_per_sample) == 0 &&
+        samples && rows) {
+        writer = decoded_image_open(ctx, output, width, height);
+    }
+    if (writer == NULL) {
+        sample_input_close(&samples_in);
+        free(samples);
+        free(rows);
+        conversion_error("Couldn't start the PNG output.\n");
+        return CONVERSION_ERROR;
+    }
+
+    int result = CONVERSION_OK;
+    uint8_t *residuals = rows, *prev = rows + width, *row = prev + width;
+    size_t decoded = 0;
+    for (int y = 0; y < height && result == CONVERSION_OK; y++) {
+        int got = sample_input_read(&samples_in, samples, width + 1);
+        int predictor = PREDICT_NONE;
+        if (got > 0) {
+            uint8_t id;
+            pcm_s16_to_u8(samples, &id, 1);
+            predictor = id >= 128 && id < 128 + PREDICT_FILTERS ? id - 128 : PREDICT_NONE;
+        }
+        int sent = got > 1 ? got - 1 : 0;
+        pcm_s16_to_u8(samples + 1, residuals, sent);
+        memset(residuals + sent, 128, width - sent);
+        unpredict_row(predictor, residuals, prev, row, width);
+        if (image_writer_write_row(writer, row) != 0) {
+            result = CONVERSION_ERROR;
+        }
+        uint8_t *swap = prev;
+        prev = row;
+        row = swap;
+        decoded += got;
+        if (conversion_cancelled(ctx)) {
+            result = CONVERSION_CANCELLED;
+        }
+        conversion_report(ctx, (double)y / height);
+    }
+    if (image_writer_close(writer) != 0 && result == CONVERSION_OK) {
+        result = CONVERSION_ERROR;
+    }
+    sample_input_close(&samples_in);
+    free(samples);
+    free(rows);
+    ctx->num_samples = (int)decoded;
+
+    if (result == CONVERSION_OK) {
+        conversion_report(ctx, 1.0);
+    }
+    return result;
+}
+
+// The tile checksums of the "w2ix" chunk among the chunks from trailer on, when it describes the rows of index.
+// NULL when there is none or it doesn't match.
+static uint32_t *read_row_index(ConversionContext *ctx, ByteSource *input, size_t trailer,
+                                const RowIndexHeader *index) {
+    uint8_t chunk[8];
+    if (!byte_source_seek(input, trailer)) {
+        return NULL;
+    }
+    while (byte_source_read(input, chunk, 8) == 8) {
+        uint32_t size;
+        memcpy(&size, chunk + 4, 4);
+        if (memcmp(chunk, "w2ix", 4) != 0) {
+            if (!byte_source_seek(input, input->offset + size + (size & 1))) {
+                return NULL;
+            }
+            continue;
+        }
+        RowIndexHeader found;
+        size_t bytes = (size_t)index->tiles * sizeof(uint32_t);
+        uint32_t *tiles = NULL;
+        if (size < sizeof(found) + bytes || byte_source_read(input, &found, sizeof(found)) != sizeof(found) ||
+            memcmp(&found, index, sizeof(found)) != 0 || (tiles = (uint32_t *)malloc(bytes)) == NULL ||
+            byte_source_read(input, tiles, bytes) != bytes) {
+            conversion_warning(ctx, "The row index doesn't fit the audio, the region isn't checked.\n");
+            free(tiles);
+            return NULL;
+        }
+        return tiles;
+    }
+    return NULL;
+}
+
+// The region alone from a raw grayscale WAV at the pixel rate that can be seeked: rows lie at fixed offsets
+// in the data, so only the columns of the region are read from each of its rows. With a "w2ix" chunk the
+// whole tiles under the region are read instead and checked against their checksums. data_start is where
+// the data chunk contents begin.
+static int decode_region(ConversionContext *ctx, ByteSource *input, ByteSink *output, size_t data_start) {
+    int width = ctx->width, height = ctx->height;
+    int sample_bytes = ctx->header.bits_per_sample / 8;
+    uint32_t row_offset = ctx->metadata.version == 0 ? 2 * sizeof(int) : 0;
+    ImageRegion region;
+    if (image_region(&ctx->options, width, height, &region) != 0) {
+        return CONVERSION_ERROR;
+    }
+
+    // A WAV streamed without its size is read up to its end and has no index
+    uint64_t data_bytes = ctx->header.data_size == WAV_SIZE_UNKNOWN ? UINT64_MAX
+                                                                    : (uint64_t)row_offset + ctx->header.data_size;
+    RowIndexHeader index;
+    row_index_header(&index, width, height, sample_bytes, row_offset);
+    uint32_t *tiles = data_bytes == UINT64_MAX ? NULL
+                    : read_row_index(ctx, input, data_start + data_bytes + (data_bytes & 1), &index);
+    int tile = tiles ? INDEX_TILE : 1;
+    int x0 = region.x / tile * tile, y0 = region.y / tile * tile;
+    int x1 = (region.x + region.width + tile - 1) / tile * tile, y1 = (region.y + region.height + tile - 1) / tile * tile;
+    x1 = x1 < width ? x1 : width;
+    y1 = y1 < height ? y1 : height;
+    int columns = x1 - x0, tiles_across = (width + INDEX_TILE - 1) / INDEX_TILE;
+
+    size_t row_bytes = (size_t)columns * sample_bytes;
+    uint8_t *packed = (uint8_t *)malloc(row_bytes);
+    int16_t *samples = (int16_t *)malloc((size_t)columns * sizeof(int16_t));
+    uint8_t *row = (uint8_t *)malloc(columns);
+    uint32_t *crcs = (uint32_t *)calloc(tiles_across, sizeof(uint32_t));
+    ImageWriter *writer = NULL;
+    if (packed && samples && row && crcs) {
+        writer = image_writer_open(output, region.width, region.height);
+    }
+    if (writer == NULL) {
+        free(tiles);
+        free(packed);
+        free(samples);
+        free(row);
+        free(crcs);
+        conversion_error("Couldn't start the PNG output.\n");
+        return CONVERSION_ERROR;
+    }
+
+    int result = CONVERSION_OK;
+    int damaged = 0, damaged_x = 0, damaged_y = 0;
+    size_t decoded = 0;
+    for (int y = y0; y < y1 && result == CONVERSION_OK; y++) {
+        uint64_t start = (uint64_t)row_offset + ((uint64_t)y * width + x0) * sample_bytes;
+        size_t got = 0;
+        if (start < data_bytes && byte_source_seek(input, data_start + (size_t)start)) {
+            got = byte_source_read(input, packed, data_bytes - start < row_bytes ? (size_t)(data_bytes - start) : row_bytes);
+        }
+        int count = (int)(got / sample_bytes);
+        decoded += count;
+
+        if (tiles) {
+            for (int t = x0 / tile; t * tile < x1; t++) {
+                size_t from = (size_t)(t * tile - x0) * sample_bytes;
+                size_t to = (size_t)((t + 1) * tile < x1 ? (t + 1) * tile - x0 : columns) * sample_bytes;
+                if (from < got) {
+                    crcs[t] = crc32c_update(crcs[t], packed + from, (to < got ? to : got) - from);
+                }
+            }
+            if (y % tile == tile - 1 || y == height - 1) {
+                for (int t = x0 / tile; t * tile < x1; t++) {
+                    if (crcs[t] != tiles[(size_t)(y / tile) * tiles_across + t] && damaged++ == 0) {
+                        damaged_x = t * tile;
+                        damaged_y = y / tile * tile;
+                    }
+                    crcs[t] = 0;
+                }
+            }
+        }
+        if (y < region.y || y >= region.y + region.height) {
+            continue;
+        }
+
+        // Missing samples stay black, as when decoding the whole image
+        if (sample_bytes == 2) {
+            memcpy(samples, packed, (size_t)count * sizeof(int16_t));
+        } else if (sample_bytes == 1) {
+            pcm_u8_to_s16(packed, samples, count);
+        } else {
+            pcm_f32_to_s16((const float *)packed, samples, count);
+        }
+        for (int x = 0; x < count; x++) {
+            row[x] = sample_to_pixel(samples[x]);
+        }
+        memset(row + count, 0, columns - count);
+
+        if (conversion_cancelled(ctx)) {
+            result = CONVERSION_CANCELLED;
+        } else if (image_writer_write_row(writer, row + (region.x - x0)) != 0) {
+            result = CONVERSION_ERROR;
+        }
+        conversion_report(ctx, (double)(y - y0 + 1) / (y1 - y0));
+    }
+    if (result == CONVERSION_OK && damaged > 0) {
+        conversion_warning(ctx, "%d tiles of the region don't match their checksums, the first at pixels %d,%d.\n",
+                           damaged, damaged_x, damaged_y);
+    }
+
+    if (image_writer_close(writer) != 0 && result == CONVERSION_OK) {
+        result = CONVERSION_ERROR;
+    }
+    free(tiles);
+    free(packed);
+    free(samples);
+    free(row);
+    free(crcs);
+    ctx->num_samples = (int)decoded;
+
+    if (result == CONVERSION_OK) {
+        conversion_report(ctx, 1.0);
+    }
+    return result;
+}
+
+// Colour planes side by side: every pixel is one frame of R, G, B (and alpha) or Y, Cb and Cr samples,
+// interleaved straight from the RGBA rows, so the WAV lasts as long as the gray one. There is nothing to
+// collect for the data structure modes, every mode converts row by row. The reader is closed on return.
+static int encode_channels(ConversionContext *ctx, ImageReader *reader, ByteSink *output) {
+    int width = ctx->width, height = ctx->height;
+    int color = ctx->options.color;
+    int channels = color_planes(color);
+    size_t num_samples = (size_t)width * height * channels;
+    if (!audio_size_fits(&ctx->options, num_samples)) {
+        image_reader_close(reader);
+        conversion_error("The audio would be too long for a WAV file.\n");
+        return CONVERSION_ERROR;
+    }
+    ImageMetadata *meta = &ctx->metadata;
+    meta->version = METADATA_VERSION;
+    meta->encoding = ENCODING_RAW;
+    meta->width = width;
+    meta->height = height;
+    meta->pixels_per_second = ctx->options.pixels_per_second;
+    meta->channels = channels;
+
+    SampleOutput samples_out;
+    uint8_t *rgba = (uint8_t *)malloc((size_t)width * 4);
+    uint8_t *planes = (uint8_t *)malloc((size_t)width * 3);
+    int16_t *samples = (int16_t *)malloc((size_t)width * channels * sizeof(int16_t));
+    if (rgba == NULL || planes == NULL || samples == NULL) {
+        conversion_error("Couldn't allocate memory for colour channels.\n");
+        image_reader_close(reader);
+        free(rgba);
+        free(planes);
+        free(samples);
+        return CONVERSION_ERROR;
+    }
+    if (sample_output_open(&samples_out, ctx, output, ctx->options.pixels_per_second, channels, (int64_t)num_samples,
+                           meta) != 0) {
+        image_reader_close(reader);
+        free(rgba);
+        free(planes);
+        free(samples);
+        return CONVERSION_ERROR;
+    }
+
+    int result = CONVERSION_OK;
+    for (int y = 0; y < height && result == CONVERSION_OK; y++) {
+        if (image_reader_read_row(reader, rgba) != 0) {
+            result = CONVERSION_ERROR;
+            break;
+        }
+        if (color == COLOR_YCBCR) {
+            rgba_to_ycbcr(rgba, planes, planes + width, planes + 2 * width, width);
+            planes_to_channels(planes, planes + width, planes + 2 * width, samples, width);
+        } else {
+            rgba_to_channels(rgba, samples, width, channels);
+        }
+
+        if (sample_output_write(&samples_out, samples, width * channels) != 0) {
+            result = CONVERSION_ERROR;
+        } else if (conversion_cancelled(ctx)) {
+            result = CONVERSION_CANCELLED;
+        }
+        conversion_report(ctx, (double)(y + 1) / height);
+    }
+    image_reader_close(reader);
+
+    if (sample_output_close(&samples_out, ctx, result == CONVERSION_OK) != 0 && result == CONVERSION_OK) {
+        result = CONVERSION_ERROR;
+    }
+    ctx->num_samples = samples_out.written;
+    free(rgba);
+    free(planes);
+    free(samples);
+    return result;
+}
+
+// Colour channels back to an RGB(A) PNG, de-interleaved as each row of frames is unpacked
+static int decode_channels(ConversionContext *ctx, ByteSource *input, ByteSink *output) {
+    const ImageMetadata *meta = &ctx->metadata;
+    int channels = (int)meta->channels;
+    int color = (int)meta->color;
+    if (meta->encoding != ENCODING_RAW || (color != COLOR_YCBCR && color != COLOR_RGB && color != COLOR_RGBA) ||
+        color_planes(color) != channels ||
+        meta->image_width != meta->width || meta->image_height != meta->height) {
+        conversion_error("Invalid colour channels in the audio description.\n");
+        return CONVERSION_ERROR;
+    }
+    int width = (int)meta->width, height = (int)meta->height;
+    if (width <= 0 || height <= 0 || width > INT32_MAX / channels / height) {
+        conversion_error("Invalid image size in WAV data.\n");
+        return CONVERSION_ERROR;
+    }
+    if (meta->pixels_per_second != ctx->header.sample_rate) {
+        conversion_error("Multi-channel audio can't be resampled.\n");
+        return CONVERSION_ERROR;
+    }
+    ctx->width = width;
+    ctx->height = height;
+
+    int row_samples = width * channels;
+    SampleInput samples_in;
+    int16_t *samples = (int16_t *)malloc((size_t)row_samples * sizeof(int16_t));
+    uint8_t *bytes = (uint8_t *)malloc(row_samples);
+    uint8_t *planes = (uint8_t *)malloc((size_t)width * 3);
+    uint8_t *rgb = (uint8_t *)malloc((size_t)width * 3);
+    ImageWriter *writer = NULL;
+    if (sample_input_init(&samples_in, input, wav_data_samples(&ctx->header), (int)ctx->header.sample_rate,
+                          (int)ctx->header.sample_rate, ctx->header.bits_per_sample) == 0 &&
+        samples && bytes && planes && rgb) {
+        writer = decoded_writer_open(ctx, output, width, height, COLOR_GRAY, color == COLOR_RGBA ? 4 : 3);
+    }
+    if (writer == NULL) {
+        sample_input_close(&samples_in);
+        free(samples);
+        free(bytes);
+        free(planes);
+        free(rgb);
+        conversion_error("Couldn't start the PNG output.\n");
+        return CONVERSION_ERROR;
+    }
+
+    int result = CONVERSION_OK;
+    int decoded = 0;
+    for (int y = 0; y < height && result == CONVERSION_OK; y++) {
+        int count = sample_input_read(&samples_in, samples, row_samples);
+        decoded += count;
+
+        // Samples to intensities, missing ones stay black
+        pcm_s16_to_u8(samples, bytes, count);
+        for (int x = count; x < row_samples; x++) {
+            bytes[x] = color == COLOR_YCBCR && x % 3 != 0 ? 128 : 0;
+        }
+        const uint8_t *row = bytes;
+        if (color == COLOR_YCBCR) {
+            split_channels(bytes, planes, planes + width, planes + 2 * width, width);
+            ycbcr_to_rgb(planes, planes + width, planes + 2 * width, rgb, width);
+            row = rgb;
+        }
+
+        if (conversion_cancelled(ctx)) {
+            result = CONVERSION_CANCELLED;
+        } else if (image_writer_write_row(writer, row) != 0) {
+            result = CONVERSION_ERROR;
+        }
+        conversion_report(ctx, (double)(y + 1) / height);
+    }
+
+    if (image_writer_close(writer) != 0 && result == CONVERSION_OK) {
+        result = CONVERSION_ERROR;
+    }
+    sample_input_close(&samples_in);
+    free(samples);
+    free(bytes);
+    free(planes);
+    free(rgb);
+    ctx->num_samples = decoded;
+
+    if (result == CONVERSION_OK) {
+        conversion_report(ctx, 1.0);
+    }
+    return result;
+}
+
+// -------------------------------------------------------------------------------------------------------- streaming
+
+// Sample frames a width x height image becomes with the options, for run-length coding the most it can
+// take. UINT64_MAX when no audio holds it, 0 when the options can't encode any image.
+static uint64_t encoded_frames(const ConversionOptions *options, bool channels, int width, int height) {
+    int rate = options->sample_rate;
+    if (channels) {
+        return (uint64_t)width * height;
+    }
+    if (options->color != COLOR_GRAY && color_plane_size(options->color, width, height, &width, &height) != 0) {
+        return UINT64_MAX;
+    }
+    uint64_t pixels = (uint64_t)width * height;
+    if (options->encoding == ENCODING_APT) {
+        return apt_modulated_samples((uint64_t)(APT_SYNC_WORDS + width) * height, rate, options->pixels_per_second);
+    }
+    if (options->encoding == ENCODING_SPECTROGRAM) {
+        SpectrogramLayout layout;
+        if (height > spectrogram_max_height(rate)) {
+            return UINT64_MAX;
+        }
+        if (spectrogram_layout(&layout, rate, height, options->pixels_per_second) != 0) {
+            return 0;
+        }
+        return (uint64_t)width * (layout.fft_size + layout.guard) + layout.guard;
+    }
+    if (options->encoding == ENCODING_OFDM) {
+        OfdmLayout layout;
+        if (ofdm_layout(&layout, rate) != 0) {
+            return 0;
+        }
+        uint64_t data_symbols = (pixels + 2 * layout.carriers - 1) / (2 * layout.carriers);
+        uint64_t symbols = data_symbols + (data_symbols + layout.training_interval - 1) / layout.training_interval;
+        return symbols * (layout.fft_size + layout.prefix);
+    }
+    if (options->encoding == ENCODING_RLE) {
+        return pixels + (pixels + RLE_LITERALS - 1) / RLE_LITERALS;
+    }
+    return raw_samples(options, width, height);
+}
+
+// Shrink the image of a reader, keeping its aspect ratio, to the largest size whose audio stays within the
+// duration limit of the options. The size of the audio grows with that of the image, so the longer side is
+// bisected. Nothing happens to an image that already fits.
+static int fit_duration(ConversionContext *ctx, ImageReader *reader, bool channels) {
+    const ConversionOptions *options = &ctx->options;
+    uint64_t budget = options->max_samples > 0 ? (uint64_t)options->max_samples : UINT64_MAX;
+    if (options->max_seconds > 0 && options->max_seconds * options->sample_rate < (double)budget) {
+        budget = (uint64_t)(options->max_seconds * options->sample_rate);
+    }
+    int width, height;
+    image_reader_size(reader, &width, &height);
+    uint64_t frames = encoded_frames(options, channels, width, height);
+    if (budget == UINT64_MAX || frames == 0 || frames <= budget) {
+        return 0;
+    }
+
+    int longer = width > height ? width : height;
+    int low = 0, high = longer; // the longer side at low fits (0 before one is found), at high it doesn't
+    int fit_width = 0, fit_height = 0;
+    while (high - low > 1) {
+        int side = low + (high - low) / 2;
+        int w = width > height ? side : (int)(((int64_t)width * side + height / 2) / height);
+        int h = width > height ? (int)(((int64_t)height * side + width / 2) / width) : side;
+        w = w < 1 ? 1 : w;
+        h = h < 1 ? 1 : h;
+        if (encoded_frames(options, channels, w, h) <= budget) {
+            low = side;
+            fit_width = w;
+            fit_height = h;
+        } else {
+            high = side;
+        }
+    }
+    if (low == 0) {
+        conversion_error("Not even a single pixel of the image fits in %llu samples.\n",
+                (unsigned long long)budget);
+        return -1;
+    }
+    if (image_reader_scale(reader, fit_width, fit_height) != 0) {
+        return -1;
+    }
+    ctx->metadata.original_width = width;
+    ctx->metadata.original_height = height;
+    return 0;
+}
+
+// Convert a PNG stream to a WAV stream with the encoding chosen in the options
+int encode_stream(ConversionContext *ctx, ByteSource *input, ByteSink *output) {
+    conversion_begin(ctx);
+    int color = ctx->options.color;
+    ImageReader *reader = color != COLOR_GRAY ? image_reader_open(input) : image_reader_open_native(input);
+    if (!reader) {
+        return conversion_end(ctx, CONVERSION_ERROR);
+    }
+
+    // Colour goes out as plane rows, every encoding takes them as a taller grayscale image, or as channels
+    // taken from the RGBA rows
+    bool channels = color != COLOR_GRAY && ctx->options.color_layout == COLOR_LAYOUT_CHANNELS;
+    memset(&ctx->metadata, 0, sizeof(ctx->metadata));
+    if (channels && (ctx->options.encoding != ENCODING_RAW || color == COLOR_YCBCR420)) {
+        image_reader_close(reader);
+        conversion_error("Colour channels carry raw YCbCr, RGB or RGBA pixels only.\n");
+        return conversion_end(ctx, CONVERSION_ERROR);
+    }
+    if (ctx->options.frame_rows > 0 && (ctx->options.encoding != ENCODING_RAW || channels)) {
+        image_reader_close(reader);
+        conversion_error("Sync markers frame raw mono rows only.\n");
+        return conversion_end(ctx, CONVERSION_ERROR);
+    }
+    if (ctx->options.fec_parity > 0 && (ctx->options.encoding != ENCODING_RAW || channels ||
+                                        ctx->options.frame_rows > 0)) {
+        image_reader_close(reader);
+        conversion_error("Error correction codes raw mono pixels without sync markers only.\n");
+        return conversion_end(ctx, CONVERSION_ERROR);
+    }
+    if (ctx->options.order != ORDER_RASTER && (ctx->options.encoding != ENCODING_RAW || channels ||
+                                               ctx->options.frame_rows > 0 || ctx->options.fec_parity > 0)) {
+        image_reader_close(reader);
+        conversion_error("Pixel orders apply to raw mono pixels without sync markers or error correction.\n");
+        return conversion_end(ctx, CONVERSION_ERROR);
+    }
+    if (ctx->options.predictor != PREDICT_NONE && (ctx->options.encoding != ENCODING_RAW || channels ||
+                                                   ctx->options.frame_rows > 0 || ctx->options.fec_parity > 0 ||
+                                                   ctx->options.order != ORDER_RASTER)) {
+        image_reader_close(reader);
+        conversion_error("Prediction applies to raw mono rows without sync markers, error correction or "
+                        "pixel orders.\n");
+        return conversion_end(ctx, CONVERSION_ERROR);
+    }
+    if (ctx->options.predictor != PREDICT_NONE && ctx->options.pixels_per_second != ctx->options.sample_rate) {
+        image_reader_close(reader);
+        conversion_error("Predicted rows need the WAV at the pixel rate, resampling would spread its errors "
+                        "along them.\n");
+        return conversion_end(ctx, CONVERSION_ERROR);
+    }
+    if (fit_duration(ctx, reader, channels) != 0) {
+        image_reader_close(reader);
+        return conversion_end(ctx, CONVERSION_ERROR);
+    }
+    if (color != COLOR_GRAY) {
+        int width, height;
+        image_reader_size(reader, &width, &height);
+        if (!channels && image_reader_set_color(reader, color) != 0) {
+            image_reader_close(reader);
+            return conversion_end(ctx, CONVERSION_ERROR);
+        }
+        ctx->metadata.color = color;
+        ctx->metadata.image_width = width;
+        ctx->metadata.image_height = height;
+    }
+    image_reader_size(reader, &ctx->width, &ctx->height);
+
+    int result;
+    if (channels) {
+        result = encode_channels(ctx, reader, output);
+    } else if (ctx->options.encoding == ENCODING_APT) {
+        result = encode_apt(ctx, reader, output);
+        image_reader_close(reader);
+    } else if (ctx->options.encoding == ENCODING_SPECTROGRAM) {
+        result = encode_spectrogram(ctx, reader, output);
+        image_reader_close(reader);
+    } else if (ctx->options.encoding == ENCODING_OFDM) {
+        result = encode_ofdm(ctx, reader, output);
+        image_reader_close(reader);
+    } else if (ctx->options.encoding == ENCODING_RLE) {
+        result = encode_rle(ctx, reader, output);
+        image_reader_close(reader);
+    } else if (ctx->options.encoding == ENCODING_RAW) {
+        result = encode_raw(ctx, reader, output);
+    } else {
+        image_reader_close(reader);
+        conversion_error("Unknown encoding %d.\n", ctx->options.encoding);
+        result = CONVERSION_ERROR;
+    }
+    if (result != CONVERSION_OK) {
+        return conversion_end(ctx, result);
+    }
+
+    if (output->failed) {
+        conversion_error("Couldn't write WAV data.\n");
+        return conversion_end(ctx, CONVERSION_ERROR);
+    }
+    conversion_report(ctx, 1.0);
+    return conversion_end(ctx, CONVERSION_OK);
+}
+
+// Decode the samples after the header in ctx with the encoding they hold
+static int decode_samples(ConversionContext *ctx, ByteSource *input, ByteSink *output) {
+    if (ctx->metadata.version >= 11 && ctx->metadata.archive_frames > 0) {
+        conversion_error("This WAV is an archive of %u images, extract its frames instead.\n",
+                ctx->metadata.archive_frames);
+        return CONVERSION_ERROR;
+    }
+    bool channels = ctx->metadata.version >= 5 && ctx->metadata.channels > 1;
+    if (!wav_format_supported(&ctx->header, channels ? (int)ctx->metadata.channels : 1)) {
+        return CONVERSION_ERROR;
+    }
+
+    // The "w2im" chunk says how the image was encoded, plain recordings go by the chosen encoding
+    int encoding = ctx->metadata.version != 0 ? (int)ctx->metadata.encoding : ctx->options.encoding;
+    if (channels) {
+        return decode_channels(ctx, input, output);
+    }
+    if (encoding == ENCODING_APT) {
+        return decode_apt(ctx, input, output);
+    }
+    if (encoding == ENCODING_SPECTROGRAM) {
+        if (ctx->metadata.version < 2) {
+            conversion_error("A spectrogram can only be decoded from a file written by Wave2Image.\n");
+            return CONVERSION_ERROR;
+        }
+        return decode_spectrogram(ctx, input, output);
+    }
+    if (encoding == ENCODING_OFDM) {
+        if (ctx->metadata.version < 3) {
+            conversion_error("OFDM can only be decoded from a file written by Wave2Image.\n");
+            return CONVERSION_ERROR;
+        }
+        return decode_ofdm(ctx, input, output);
+    }
+    if (encoding == ENCODING_RLE) {
+        if (ctx->metadata.version == 0) {
+            conversion_error("Run-length coded audio can only be decoded from a file written by Wave2Image.\n");
+            return CONVERSION_ERROR;
+        }
+        return decode_rle(ctx, input, output);
+    }
+    if (encoding != ENCODING_RAW) {
+        conversion_error("This audio holds encoding %d, which can't be decoded.\n", encoding);
+        return CONVERSION_ERROR;
+    }
+
+    int width = 0, height = 0;
+    int pixel_rate = (int)ctx->header.sample_rate;
+    size_t data_start = input->offset;
+
+    if (ctx->metadata.version != 0) {
+        // Described raw audio, possibly at another rate than its pixels
+        width = (int)ctx->metadata.width;
+        height = (int)ctx->metadata.height;
+        pixel_rate = (int)ctx->metadata.pixels_per_second;
+    } else if (ctx->header.bits_per_sample != 16 ||
+               byte_source_read(input, &width, sizeof(int)) != sizeof(int) ||
+               byte_source_read(input, &height, sizeof(int)) != sizeof(int)) {
+        width = height = 0; // Width and height stored after a 16-bit WAV header
+    }
+    if (width <= 0 || height <= 0 || width > INT32_MAX / height || pixel_rate <= 0) {
+        conversion_error("Invalid image size in WAV data.\n");
+        return CONVERSION_ERROR;
+    }
+    ctx->width = width;
+    ctx->height = height;
+    if (ctx->metadata.version >= 6 && ctx->metadata.frame_rows > 0) {
+        return decode_framed(ctx, input, output, pixel_rate);
+    }
+    if (ctx->metadata.version >= 7 && ctx->metadata.fec_parity > 0) {
+        return decode_fec(ctx, input, output, pixel_rate);
+    }
+    if (ctx->metadata.version >= 8 && ctx->metadata.order != ORDER_RASTER) {
+        if (ctx->metadata.order > ORDER_HILBERT) {
+            conversion_error("This audio holds pixel order %u, which can't be decoded.\n", ctx->metadata.order);
+            return CONVERSION_ERROR;
+        }
+        return decode_ordered(ctx, input, output, pixel_rate);
+    }
+    if (ctx->metadata.version >= 9 && ctx->metadata.predictor != PREDICT_NONE) {
+        return decode_predicted(ctx, input, output, pixel_rate);
+    }
+    // A region of rows at fixed offsets is read where it lies, when the input can seek
+    const ConversionOptions *options = &ctx->options;
+    if ((options->region_x > 0 || options->region_y > 0 || options->region_width > 0 || options->region_height > 0) &&
+        pixel_rate == (int)ctx->header.sample_rate && (ctx->metadata.version < 4 || ctx->metadata.color == COLOR_GRAY) &&
+        !decoded_upscaled(ctx) &&
+        byte_source_seek(input, input->offset)) {
+        return decode_region(ctx, input, output, data_start);
+    }
+
+    SampleInput samples_in;
+    int16_t *samples = (int16_t *)malloc((size_t)width * sizeof(int16_t));
+    uint8_t *row = (uint8_t *)malloc(width);
+    ImageWriter *writer = NULL;
+    if (sample_input_init(&samples_in, input, wav_data_samples(&ctx->header), (int)ctx->header.sample_rate,
+                          pixel_rate, ctx->header.bits_per_sample) == 0 &&
+        samples && row) {
+        writer = decoded_image_open(ctx, output, width, height);
+    }
+    if (writer == NULL) {
+        sample_input_close(&samples_in);
+        free(samples);
+        free(row);
+        conversion_error("Couldn't start the PNG output.\n");
+        return CONVERSION_ERROR;
+    }
+
+    int result = CONVERSION_OK;
+    int decoded = 0;
+    for (int y = 0; y < height && result == CONVERSION_OK; y++) {
+        int count = sample_input_read(&samples_in, samples, width);
+        decoded += count;
+
+        // Convert audio samples back to grayscale intensities, missing samples stay black
+        for (int x = 0; x < count; x++) {
+            row[x] = sample_to_pixel(samples[x]);
+        }
+        memset(row + count, 0, width - count);
+
+        if (conversion_cancelled(ctx)) {
+            result = CONVERSION_CANCELLED;
+        } else if (image_writer_write_row(writer, row) != 0) {
+            result = CONVERSION_ERROR;
+        }
+        conversion_report(ctx, (double)(y + 1) / height);
+    }
+
+    if (image_writer_close(writer) != 0 && result == CONVERSION_OK) {
+        result = CONVERSION_ERROR;
+    }
+    sample_input_close(&samples_in);
+    free(samples);
+    free(row);
+    ctx->num_samples = decoded;
+
+    if (result == CONVERSION_OK) {
+        conversion_report(ctx, 1.0);
+    }
+    return result;
+}
+
+// Convert a WAV or FLAC stream back to a PNG stream one row at a time, without seeking.
+// A data chunk of unknown size (written to a pipe) is read until the end of the stream.
+int decode_stream(ConversionContext *ctx, ByteSource *input, ByteSink *output) {
+    conversion_begin(ctx);
+    ByteSource pcm;
+    FlacReader *flac;
+    ByteSource *data = read_audio_header(ctx, input, &pcm, &flac);
+    if (data == NULL) {
+        return conversion_end(ctx, CONVERSION_ERROR);
+    }
+    int result = decode_samples(ctx, data, output);
+    if (flac && flac_reader_close(flac) != 0 && result == CONVERSION_OK) {
+        result = CONVERSION_ERROR;
+    }
+    return conversion_end(ctx, result);
+}
+
+// -------------------------------------------------------------------------------------------------------- resample
+
+// Resample the samples after the header in ctx
+static int resample_samples(ConversionContext *ctx, ByteSource *input, ByteSink *output) {
+    if (ctx->metadata.version >= 11 && ctx->metadata.archive_frames > 0) {
+        conversion_error("An archive can't be resampled, its index points at the bytes of its frames.\n");
+        return CONVERSION_ERROR;
+    }
+    if (!wav_format_supported(&ctx->header, 1)) {
+        return CONVERSION_ERROR;
+    }
+
+    int in_rate = (int)ctx->header.sample_rate;
+    int out_rate = ctx->options.sample_rate;
+    uint64_t available = wav_data_samples(&ctx->header);
+    int16_t lead[4];        // first samples, unless they were an old raw size
+    int lead_count = 0;
+
+    if (ctx->metadata.version == 0 && ctx->options.encoding == ENCODING_RAW && ctx->header.bits_per_sample == 16) {
+        int size[2] = { 0, 0 };
+        size_t got = byte_source_read(input, size, sizeof(size));
+        bool legacy = got == sizeof(size) && size[0] > 0 && size[1] > 0 && size[0] <= (1 << 20) &&
+                      size[1] <= INT32_MAX / size[0] &&
+                      (available == UINT64_MAX || available == (uint64_t)size[0] * size[1]);
+        if (legacy) {
+            ctx->metadata.version = METADATA_VERSION;
+            ctx->metadata.encoding = ENCODING_RAW;
+            ctx->metadata.width = size[0];
+            ctx->metadata.height = size[1];
+            ctx->metadata.pixels_per_second = in_rate;
+        } else {
+            memcpy(lead, size, got);
+            lead_count = (int)(got / sizeof(int16_t));
+            available = available == UINT64_MAX || available < (uint64_t)lead_count ? available : available - lead_count;
+        }
+    }
+    ImageMetadata *meta = ctx->metadata.version != 0 ? &ctx->metadata : NULL;
+
+    int64_t num_samples = available == UINT64_MAX
+        ? -1 : (int64_t)resampled_samples(available + lead_count, in_rate, out_rate);
+    int in_bits = ctx->header.bits_per_sample;
+
+    SampleInput samples_in;
+    SampleOutput samples_out;
+    int16_t *samples = (int16_t *)malloc(BUFFER_SIZE * sizeof(int16_t));
+    if (samples == NULL || sample_input_init(&samples_in, input, available, in_rate, in_rate, in_bits) != 0 ||
+        sample_output_open(&samples_out, ctx, output, in_rate, 1, num_samples, meta) != 0) {
+        if (samples) {
+            sample_input_close(&samples_in);
+        }
+        free(samples);
+        conversion_error("Couldn't start resampling.\n");
+        return CONVERSION_ERROR;
+    }
+
+    int result = sample_output_write(&samples_out, lead, lead_count) == 0 ? CONVERSION_OK : CONVERSION_ERROR;
+    uint64_t done = 0;
+    while (result == CONVERSION_OK && samples_in.left > 0) {
+        int count = sample_input_read(&samples_in, samples, BUFFER_SIZE);
+        if (sample_output_write(&samples_out, samples, count) != 0) {
+            result = CONVERSION_ERROR;
+        }
+        done += count;
+
+        if (conversion_cancelled(ctx)) {
+            result = CONVERSION_CANCELLED;
+        } else if (available != UINT64_MAX) {
+            conversion_report(ctx, (double)done / available);
+        }
+    }
+
+    if (sample_output_close(&samples_out, ctx, result == CONVERSION_OK) != 0 && result == CONVERSION_OK) {
+        result = CONVERSION_ERROR;
+    }
+    sample_input_close(&samples_in);
+    free(samples);
+    ctx->num_samples = samples_out.written;
+
+    if (result == CONVERSION_OK) {
+        if (output->failed) {
+            conversion_error("Couldn't write WAV data.\n");
+            result = CONVERSION_ERROR;
+        } else {
+            conversion_report(ctx, 1.0);
+        }
+    }
+    return result;
+}
+
+// Convert a WAV or FLAC stream to the sample rate, size and container in the options, keeping what it
+// describes. Old raw files (width and height at the start of the data) get a "w2im" chunk instead, since
+// those eight bytes can't go through a filter. Anything else is treated as plain audio.
+int resample_stream(ConversionContext *ctx, ByteSource *input, ByteSink *output) {
+    conversion_begin(ctx);
+    ByteSource pcm;
+    FlacReader *flac;
+    ByteSource *data = read_audio_header(ctx, input, &pcm, &flac);
+    if (data == NULL) {
+        return conversion_end(ctx, CONVERSION_ERROR);
+    }
+    int result = resample_samples(ctx, data, output);
+    if (flac && flac_reader_close(flac) != 0 && result == CONVERSION_OK) {
+        result = CONVERSION_ERROR;
+    }
+    return conversion_end(ctx, result);
+}
+
+// -------------------------------------------------------------------------------------------------------- verify
+// Files are checked without decoding them: WAV data streams through in blocks of CHECKSUM_BLOCK_SIZE and is
+// hashed with CRC-32C as it arrives, so a check runs as fast as the disk, then compared with the "w2ck"
+// chunk behind it. FLAC frames carry their own CRC-16, a FLAC stream is checked by decoding its frames
+// over all cores.
+
+static int verify_flac(ConversionContext *ctx, ByteSource *input) {
+    FlacReader *flac = flac_reader_open(input, &ctx->header, &ctx->metadata);
+    uint8_t *buffer = (uint8_t *)malloc(CHECKSUM_BLOCK_SIZE);
+    if (flac == NULL || buffer == NULL) {
+        if (flac) {
+            flac_reader_close(flac);
+            conversion_error("Couldn't allocate memory for checking.\n");
+        }
+        free(buffer);
+        return CONVERSION_ERROR;
+    }
+    ByteSource pcm;
+    memset(&pcm, 0, sizeof(pcm));
+    pcm.read = flac_reader_read;
+    pcm.state = flac;
+
+    int result = CONVERSION_OK;
+    uint64_t expected = ctx->header.data_size == WAV_SIZE_UNKNOWN ? UINT64_MAX : ctx->header.data_size;
+    uint64_t bytes = 0;
+    size_t got;
+    while (result == CONVERSION_OK && (got = byte_source_read(&pcm, buffer, CHECKSUM_BLOCK_SIZE)) > 0) {
+        bytes += got;
+        if (conversion_cancelled(ctx)) {
+            result = CONVERSION_CANCELLED;
+        } else if (expected != UINT64_MAX) {
+            conversion_report(ctx, (double)bytes / expected);
+        }
+    }
+    if (flac_reader_close(flac) != 0 && result == CONVERSION_OK) {
+        result = CONVERSION_ERROR;
+    }
+    if (result == CONVERSION_OK && expected != UINT64_MAX && bytes != expected) {
+        int size = ctx->header.bits_per_sample / 8;
+        conversion_error("The FLAC stream holds %llu of its %llu samples.\n",
+                (unsigned long long)(bytes / size), (unsigned long long)(expected / size));
+        result = CONVERSION_ERROR;
+    }
+    free(buffer);
+    return result;
+}
+
+// The checksums recorded after the data against those of the data read
+static int verify_checksums(const ChecksumState *read, const ChecksumHeader *check, const uint32_t *blocks,
+                            uint32_t metadata_crc) {
+    int result = CONVERSION_OK;
+    if (check->data_bytes != read->check.data_bytes) {
+        conversion_error("The WAV data is %u bytes long, its checksums cover %u.\n",
+                read->check.data_bytes, check->data_bytes);
+        return CONVERSION_ERROR;
+    }
+    if (check->metadata_crc != metadata_crc) {
+        conversion_error("The \"w2im\" description is damaged.\n");
+        result = CONVERSION_ERROR;
+    }
+    if (check->block_size == CHECKSUM_BLOCK_SIZE && check->blocks == read->check.blocks) {
+        for (uint32_t b = 0; b < check->blocks; b++) {
+            if (blocks[b] != read->block_crcs[b]) {
+                unsigned long long first = (unsigned long long)b * CHECKSUM_BLOCK_SIZE;
+                unsigned long long last = first + CHECKSUM_BLOCK_SIZE < read->check.data_bytes
+                    ? first + CHECKSUM_BLOCK_SIZE - 1 : read->check.data_bytes - 1;
+                conversion_error("Data bytes %llu to %llu are damaged.\n", first, last);
+                result = CONVERSION_ERROR;
+            }
+        }
+    }
+    if (check->data_crc != read->check.data_crc && result == CONVERSION_OK) {
+        conversion_error("The WAV data is damaged.\n");
+        result = CONVERSION_ERROR;
+    }
+    return result;
+}
+
+// Check a WAV or FLAC stream, never seeking it. Damage fails the check with its message in ctx->error.
+int verify_stream(ConversionContext *ctx, ByteSource *input) {
+    conversion_begin(ctx);
+    char magic[4];
+    memset(&ctx->header, 0, sizeof(ctx->header));
+    memset(&ctx->metadata, 0, sizeof(ctx->metadata));
+    size_t got = byte_source_read(input, magic, 4);
+    if (got == 4 && memcmp(magic, "fLaC", 4) == 0) {
+        return conversion_end(ctx, verify_flac(ctx, input));
+    }
+    uint32_t metadata_crc = 0;
+    if (got != 4 || memcmp(magic, "RIFF", 4) != 0) {
+        conversion_error("The input is neither a WAV nor a FLAC file.\n");
+        return conversion_end(ctx, CONVERSION_ERROR);
+    }
+    if (read_wav_chunks(input, &ctx->header, &ctx->metadata, &metadata_crc) != 0) {
+        return conversion_end(ctx, CONVERSION_ERROR);
+    }
+    if (ctx->header.data_size == WAV_SIZE_UNKNOWN) {
+        conversion_error("The WAV was streamed without its size, so it has no checksums.\n");
+        return conversion_end(ctx, CONVERSION_ERROR);
+    }
+
+    ChecksumState read;
+    memset(&read, 0, sizeof(read));
+    uint8_t *buffer = (uint8_t *)malloc(CHECKSUM_BLOCK_SIZE);
+    if (buffer == NULL) {
+        conversion_error("Couldn't allocate memory for checking.\n");
+        return conversion_end(ctx, CONVERSION_ERROR);
+    }
+    int result = CONVERSION_OK;
+    size_t data_bytes = ctx->header.data_size;
+    while (read.check.data_bytes < data_bytes && result == CONVERSION_OK) {
+        size_t left = data_bytes - read.check.data_bytes;
+        size_t want = left < CHECKSUM_BLOCK_SIZE ? left : CHECKSUM_BLOCK_SIZE;
+        if (byte_source_read(input, buffer, want) != want) {
+            conversion_error("The WAV data ends after %u of its %zu bytes.\n", read.check.data_bytes, data_bytes);
+            result = CONVERSION_ERROR;
+        } else if (checksum_update(&read, buffer, want) != 0) {
+            result = CONVERSION_ERROR;
+        } else if (conversion_cancelled(ctx)) {
+            result = CONVERSION_CANCELLED;
+        }
+        conversion_report(ctx, (double)read.check.data_bytes / data_bytes);
+    }
+    if (result == CONVERSION_OK && (data_bytes & 1) && !byte_source_skip(input, 1)) {
+        result = CONVERSION_ERROR;
+    }
+
+    // Chunks behind the data up to "w2ck". A raw WAV in the original layout has its last 8 data bytes
+    // here, data_size doesn't count the width and height ahead of the samples.
+    ChecksumHeader check;
+    uint32_t *blocks = NULL;
+    bool found = false, legacy = ctx->metadata.version == 0 && ctx->header.bits_per_sample == 16;
+    uint8_t chunk[8];
+    while (result == CONVERSION_OK && !found && byte_source_read(input, chunk, 8) == 8) {
+        uint32_t size;
+        memcpy(&size, chunk + 4, 4);
+        if (memcmp(chunk, "w2ck", 4) == 0) {
+            size_t known = size < sizeof(check) ? size : sizeof(check);
+            memset(&check, 0, sizeof(check));
+            if (byte_source_read(input, &check, known) != known || check.version == 0 ||
+                (size_t)check.blocks > data_bytes / CHECKSUM_BLOCK_SIZE + 2 ||
+                size < sizeof(check) + (size_t)check.blocks * sizeof(uint32_t) ||
+                (blocks = (uint32_t *)malloc(((size_t)check.blocks + 1) * sizeof(uint32_t))) == NULL ||
+                byte_source_read(input, blocks, (size_t)check.blocks * sizeof(uint32_t)) !=
+                    (size_t)check.blocks * sizeof(uint32_t)) {
+                conversion_error("The checksum chunk is damaged.\n");
+                result = CONVERSION_ERROR;
+            }
+            found = true;
+        } else if (legacy) {
+            result = checksum_update(&read, chunk, 8) == 0 ? CONVERSION_OK : CONVERSION_ERROR;
+        } else if (!byte_source_skip(input, size + (size & 1))) {
+            break;
+        }
+        legacy = false;
+    }
+    if (result == CONVERSION_OK && !found) {
+        conversion_error("The WAV has no checksums.\n");
+        result = CONVERSION_ERROR;
+    }
+
+    if (result == CONVERSION_OK && checksum_finish(&read) != 0) {
+        result = CONVERSION_ERROR;
+    }
+    if (result == CONVERSION_OK) {
+        result = verify_checksums(&read, &check, blocks, metadata_crc);
+    }
+    free(buffer);
+    free(blocks);
+    free(read.block_crcs);
+    if (result == CONVERSION_OK) {
+        conversion_report(ctx, 1.0);
+    }
+    return conversion_end(ctx, result);
+}
+
+// -------------------------------------------------------------------------------------------------------- archive
+// An archive holds many images in one WAV. Each is encoded on its own with the options, a batch of them at a
+// time spread over the workers, and the data bytes of its WAV appended to the data chunk of the archive; one
+// "w2ck" chunk covers all of them. The "w2ar" chunk after it records where every frame lies, its checksum and
+// its "w2im" chunk, so a reader seeks to one frame and decodes it alone, or hands the frames to workers.
+
+// Frames encoded at once, every one kept in memory until it's appended
+typedef struct {
+    const ConversionOptions *options;
+    ByteSource *inputs;           // PNG of every frame, or NULL to open paths
+    const char *const *paths;
+    int first;                    // frame of item 0
+    ByteSink *encoded;            // WAV of every item
+    int *results;
+    char (*errors)[CONVERSION_ERROR_SIZE]; // message of every item that failed
+    ArchiveEntry *entries;        // of all frames, the image sizes are filled in here
+} ArchiveBatch;
+
+static void archive_encode_items(void *arg, int worker, int from, int to) {
+    ArchiveBatch *batch = (ArchiveBatch *)arg;
+    (void)worker;
+    for (int i = from; i < to; i++) {
+        int frame = batch->first + i;
+        ByteSource file_source;
+        ByteSource *source = batch->inputs ? &batch->inputs[frame] : &file_source;
+        FILE *file = NULL;
+        byte_sink_memory(&batch->encoded[i]);
+        if (batch->inputs == NULL) {
+            if ((file = fopen(batch->paths[frame], "rb")) == NULL) {
+                conversion_error("Couldn't open file %s for reading.\n", batch->paths[frame]);
+                snprintf(batch->errors[i], CONVERSION_ERROR_SIZE, "Couldn't open file %s for reading.",
+                         batch->paths[frame]);
+                batch->results[i] = CONVERSION_ERROR;
+                continue;
+            }
+            byte_source_file(&file_source, file);
+        }
+
+        ConversionContext ctx;
+        conversion_context_init(&ctx, batch->options, NULL, NULL);
+        ctx.options.container = CONTAINER_WAV;
+        batch->results[i] = encode_stream(&ctx, source, &batch->encoded[i]);
+        memcpy(batch->errors[i], ctx.error, CONVERSION_ERROR_SIZE);
+        ArchiveEntry *entry = &batch->entries[frame];
+        entry->width = ctx.metadata.color != COLOR_GRAY ? ctx.metadata.image_width : (uint32_t)ctx.width;
+        entry->height = ctx.metadata.color != COLOR_GRAY ? ctx.metadata.image_height : (uint32_t)ctx.height;
+        conversion_context_free(&ctx);
+        if (file) {
+            fclose(file);
+        }
+    }
+}
+
+// Append the data of a frame encoded on its own to the archive, which starts with the first frame
+static int archive_append(SampleOutput *out, ConversionContext *ctx, ByteSink *output, const ImageMetadata *metadata,
+                          const ByteSink *encoded, ArchiveEntry *entry, int frame) {
+    ByteSource source;
+    WavHeader header;
+    byte_source_memory(&source, encoded->data, encoded->size);
+    if (read_wav_stream_header(&source, &header, &entry->metadata) != 0) {
+        return -1;
+    }
+    if (entry->metadata.version == 0) {
+        // The original raw layout: its width and height leave the data for the "w2im" chunk of the entry
+        int size[2];
+        if (byte_source_read(&source, size, sizeof(size)) != sizeof(size)) {
+            conversion_error("Frame %d came out without its image size.\n", frame);
+            return -1;
+        }
+        entry->metadata.version = METADATA_VERSION;
+        entry->metadata.encoding = ENCODING_RAW;
+        entry->metadata.width = size[0];
+        entry->metadata.height = size[1];
+        entry->metadata.pixels_per_second = header.sample_rate;
+    }
+    if (header.data_size > encoded->size - source.offset) {
+        conversion_error("Frame %d came out shorter than its header says.\n", frame);
+        return -1;
+    }
+
+    if (frame == 0 && sample_output_open(out, ctx, output, (int)header.sample_rate, header.channels, -1,
+                                         metadata) != 0) {
+        return -1;
+    }
+    if (header.sample_rate != ctx->header.sample_rate || header.channels != ctx->header.channels ||
+        header.bits_per_sample != ctx->header.bits_per_sample) {
+        conversion_error("Frame %d came out in another audio format than the archive.\n", frame);
+        return -1;
+    }
+    uint32_t offset = out->checksum.check.data_bytes;
+    if ((uint64_t)offset + header.data_size > INT32_MAX) {
+        conversion_error("The archive outgrows the 2 GB of data a WAV can hold here, at frame %d.\n", frame);
+        return -1;
+    }
+    const uint8_t *data = encoded->data + source.offset;
+    entry->data_offset = offset;
+    entry->data_bytes = header.data_size;
+    entry->crc = crc32c_update(0, data, header.data_size);
+    out->written += header.data_size / (header.bits_per_sample / 8);
+    return sample_output_data(out, data, header.data_size);
+}
+
+// Encode the images of inputs, or of the files at paths, into one archive
+static int archive_write(ConversionContext *ctx, ByteSource *inputs, const char *const *paths, int count,
+                         ByteSink *output) {
+    if (count <= 0) {
+        conversion_error("An archive needs at least one image.\n");
+        return CONVERSION_ERROR;
+    }
+    if (ctx->options.container != CONTAINER_WAV) {
+        conversion_error("Archives are WAV files, write the archive as a WAV.\n");
+        return CONVERSION_ERROR;
+    }
+    if (!output->seekable) {
+        conversion_error("An archive is written to a file, its sizes are fixed up once all frames are in.\n");
+        return CONVERSION_ERROR;
+    }
+
+    int workers = worker_count();
+    ArchiveEntry *entries = (ArchiveEntry *)calloc(count, sizeof(ArchiveEntry));
+    ByteSink *encoded = (ByteSink *)calloc(workers, sizeof(ByteSink));
+    int *results = (int *)calloc(workers, sizeof(int));
+    char (*errors)[CONVERSION_ERROR_SIZE] = (char (*)[CONVERSION_ERROR_SIZE])calloc(workers, CONVERSION_ERROR_SIZE);
+    if (entries == NULL || encoded == NULL || results == NULL || errors == NULL) {
+        free(entries);
+        free(encoded);
+        free(results);
+        free(errors);
+        conversion_error("Couldn't allocate memory for the archive.\n");
+        return CONVERSION_ERROR;
+    }
+
+    ImageMetadata metadata;
+    memset(&metadata, 0, sizeof(metadata));
+    metadata.version = METADATA_VERSION;
+    metadata.pixels_per_second = ctx->options.sample_rate;
+    metadata.archive_frames = count;
+
+    SampleOutput out;
+    bool opened = false;
+    int result = CONVERSION_OK;
+    memset(&out, 0, sizeof(out));
+    for (int first = 0; first < count && result == CONVERSION_OK; first += workers) {
+        int items = count - first < workers ? count - first : workers;
+        ArchiveBatch batch = { &ctx->options, inputs, paths, first, encoded, results, errors, entries };
+        run_workers(archive_encode_items, &batch, items, workers);
+        for (int i = 0; i < items; i++) {
+            if (result == CONVERSION_OK && results[i] != CONVERSION_OK) {
+                result = results[i];
+                snprintf(ctx->error, sizeof(ctx->error), "Frame %d: %s", first + i, errors[i]);
+            } else if (result == CONVERSION_OK) {
+                if (archive_append(&out, ctx, output, &metadata, &encoded[i], &entries[first + i], first + i) != 0) {
+                    result = CONVERSION_ERROR;
+                }
+                opened = true;
+            }
+            free(encoded[i].data);
+        }
+
+        if (result == CONVERSION_OK && conversion_cancelled(ctx)) {
+            result = CONVERSION_CANCELLED;
+        } else if (result == CONVERSION_OK) {
+            conversion_report(ctx, (double)(first + items) / count);
+        }
+    }
+    if (opened && sample_output_close(&out, ctx, result == CONVERSION_OK) != 0 && result == CONVERSION_OK) {
+        result = CONVERSION_ERROR;
+    }
+
+    // The index goes last, the RIFF size grows by it once more
+    if (result == CONVERSION_OK) {
+        ArchiveHeader archive = { ARCHIVE_VERSION, (uint32_t)count, sizeof(ArchiveEntry) };
+        uint32_t size = (uint32_t)(sizeof(archive) + (size_t)count * sizeof(ArchiveEntry));
+        byte_sink_write(output, "w2ar", 4);
+        byte_sink_write(output, &size, 4);
+        byte_sink_write(output, &archive, sizeof(archive));
+        byte_sink_write(output, entries, (size_t)count * sizeof(ArchiveEntry));
+        ctx->header.file_size = (uint32_t)(output->size - out.header_offset - 8);
+        if (output->failed || byte_sink_patch(output, out.header_offset + offsetof(WavHeader, file_size),
+                                              &ctx->header.file_size, 4) != 0) {
+            conversion_error("Couldn't write WAV data.\n");
+            result = CONVERSION_ERROR;
+        }
+        ctx->metadata = metadata;
+        ctx->num_samples = out.written;
+    }
+    free(entries);
+    free(encoded);
+    free(results);
+    free(errors);
+    if (result == CONVERSION_OK) {
+        conversion_report(ctx, 1.0);
+    }
+    return result;
+}
+
+// Encode PNG streams into one archive, each a frame in that order. The output has to seek.
+int archive_stream(ConversionContext *ctx, ByteSource *inputs, int count, ByteSink *output) {
+    conversion_begin(ctx);
+    return conversion_end(ctx, archive_write(ctx, inputs, NULL, count, output));
+}
+
+// Read the header of an archive and the entries of its "w2ar" chunk into *entries (allocated with malloc),
+// leaving the archive's header and metadata in ctx. *data_start is where its data chunk contents begin.
+static int archive_read_index(ConversionContext *ctx, ByteSource *input, ArchiveEntry **entries, size_t *data_start) {
+    *entries = NULL;
+    if (read_wav_stream_header(input, &ctx->header, &ctx->metadata) != 0) {
+        return CONVERSION_ERROR;
+    }
+    uint32_t frames = ctx->metadata.archive_frames;
+    if (ctx->metadata.version < 11 || frames == 0) {
+        conversion_error("This WAV is not an archive of images.\n");
+        return CONVERSION_ERROR;
+    }
+    if (ctx->header.data_size == WAV_SIZE_UNKNOWN) {
+        conversion_error("The archive was streamed without its size, its index can't be found.\n");
+        return CONVERSION_ERROR;
+    }
+    *data_start = input->offset;
+    size_t trailer = *data_start + ctx->header.data_size + (ctx->header.data_size & 1);
+    if (!byte_source_seek(input, trailer)) {
+        conversion_error("Frames are read from an archive by seeking, which this input can't do.\n");
+        return CONVERSION_ERROR;
+    }
+
+    uint8_t chunk[8];
+    while (byte_source_read(input, chunk, 8) == 8) {
+        uint32_t size;
+        memcpy(&size, chunk + 4, 4);
+        if (memcmp(chunk, "w2ar", 4) != 0) {
+            if (!byte_source_seek(input, input->offset + size + (size & 1))) {
+                break;
+            }
+            continue;
+        }
+
+        // Entries close the chunk, a header of a newer version may be longer
+        ArchiveHeader archive;
+        size_t start = input->offset;
+        size_t known = size < sizeof(archive) ? size : sizeof(archive);
+        size_t entry_known;
+        memset(&archive, 0, sizeof(archive));
+        if (byte_source_read(input, &archive, known) != known || archive.version == 0 || archive.frames != frames ||
+            archive.entry_size < offsetof(ArchiveEntry, metadata) + sizeof(uint32_t) ||
+            (uint64_t)archive.entry_size * frames > size - known ||
+            (*entries = (ArchiveEntry *)calloc(frames, sizeof(ArchiveEntry))) == NULL ||
+            !byte_source_seek(input, start + size - (size_t)archive.entry_size * frames)) {
+            conversion_error("The archive index is damaged.\n");
+            free(*entries);
+            *entries = NULL;
+            return CONVERSION_ERROR;
+        }
+        entry_known = archive.entry_size < sizeof(ArchiveEntry) ? archive.entry_size : sizeof(ArchiveEntry);
+        for (uint32_t frame = 0; frame < frames; frame++) {
+            ArchiveEntry *entry = &(*entries)[frame];
+            if (byte_source_read(input, entry, entry_known) != entry_known ||
+                !byte_source_seek(input, input->offset + archive.entry_size - entry_known) ||
+                (uint64_t)entry->data_offset + entry->data_bytes > ctx->header.data_size ||
+                entry->metadata.version == 0) {
+                conversion_error("The archive index is damaged at frame %u.\n", frame);
+                free(*entries);
+                *entries = NULL;
+                return CONVERSION_ERROR;
+            }
+        }
+        return CONVERSION_OK;
+    }
+    conversion_error("The archive has no index.\n");
+    return CONVERSION_ERROR;
+}
+
+// Decode one frame of an archive, its data read with a seek. A frame that doesn't match its checksum is
+// decoded all the same, with a warning.
+static int archive_decode_frame(ConversionContext *ctx, ByteSource *input, size_t data_start,
+                                const ArchiveEntry *entry, int frame, ByteSink *output) {
+    uint8_t *data = (uint8_t *)malloc(entry->data_bytes > 0 ? entry->data_bytes : 1);
+    if (data == NULL) {
+        conversion_error("Couldn't allocate memory for frame %d.\n", frame);
+        return CONVERSION_ERROR;
+    }
+    if (!byte_source_seek(input, data_start + entry->data_offset) ||
+        byte_source_read(input, data, entry->data_bytes) != entry->data_bytes) {
+        free(data);
+        conversion_error("Frame %d of the archive is cut short.\n", frame);
+        return CONVERSION_ERROR;
+    }
+    if (crc32c_update(0, data, entry->data_bytes) != entry->crc) {
+        conversion_warning(ctx, "Frame %d doesn't match its checksum, it may be damaged.\n", frame);
+    }
+
+    // The frame decodes as the WAV it was on its own
+    ConversionContext frame_ctx;
+    ByteSource source;
+    conversion_context_init(&frame_ctx, &ctx->options, NULL, NULL);
+    frame_ctx.header = ctx->header;
+    frame_ctx.header.data_size = entry->data_bytes;
+    frame_ctx.metadata = entry->metadata;
+    byte_source_memory(&source, data, entry->data_bytes);
+    int result = decode_samples(&frame_ctx, &source, output);
+    if (atomic_load(&frame_ctx.warnings) > 0) {
+        conversion_warning(ctx, "Frame %d: %s\n", frame, frame_ctx.warning);
+    }
+    conversion_context_free(&frame_ctx);
+    free(data);
+    return result;
+}
+
+// Decode frame (counted from 0) of an archive to a PNG stream. The input has to seek.
+int extract_stream(ConversionContext *ctx, ByteSource *input, int frame, ByteSink *output) {
+    conversion_begin(ctx);
+    ArchiveEntry *entries;
+    size_t data_start;
+    int result = archive_read_index(ctx, input, &entries, &data_start);
+    if (result != CONVERSION_OK) {
+        return conversion_end(ctx, result);
+    }
+    if (frame < 0 || (uint32_t)frame >= ctx->metadata.archive_frames) {
+        conversion_error("The archive holds frames 0 to %u, there is no frame %d.\n",
+                ctx->metadata.archive_frames - 1, frame);
+        result = CONVERSION_ERROR;
+    } else {
+        result = archive_decode_frame(ctx, input, data_start, &entries[frame], frame, output);
+    }
+    free(entries);
+    if (result == CONVERSION_OK) {
+        conversion_report(ctx, 1.0);
+    }
+    return conversion_end(ctx, result);
+}
+
+// -------------------------------------------------------------------------------------------------------- buffers
+
+// Convert PNG bytes to WAV bytes, *wav is allocated with malloc
+int image_to_audio_buffer(ConversionContext *ctx, const uint8_t *png, size_t png_size,
+                          uint8_t **wav, size_t *wav_size) {
+    ByteSource source;
+    ByteSink sink;
+    byte_source_memory(&source, png, png_size);
+    byte_sink_memory(&sink);
+
+    int result = encode_stream(ctx, &source, &sink);
+    if (result != CONVERSION_OK) {
+        free(sink.data);
+        return result;
+    }
+    *wav = sink.data;
+    *wav_size = sink.size;
+    return CONVERSION_OK;
+}
+
+// Convert WAV bytes written by image_to_audio_buffer back to PNG bytes, *png is allocated with malloc
+int audio_to_image_buffer(ConversionContext *ctx, const uint8_t *wav, size_t wav_size,
+                          uint8_t **png, size_t *png_size) {
+    ByteSource source;
+    ByteSink sink;
+    byte_source_memory(&source, wav, wav_size);
+    byte_sink_memory(&sink);
+
+    int result = decode_stream(ctx, &source, &sink);
+    if (result != CONVERSION_OK) {
+        free(sink.data);
+        return result;
+    }
+    *png = sink.data;
+    *png_size = sink.size;
+    return CONVERSION_OK;
+}
+
+// -------------------------------------------------------------------------------------------------------- files
+
+// Image to audio between files, "-" is stdin or stdout
+int main_image_to_audio(ConversionContext *ctx, const char *input_path, const char *output_path){
+    conversion_begin(ctx);
+    FILE *image_file = open_input_file(input_path);
+    if (!image_file) {
+        conversion_error("Couldn't open file %s for reading.\n", input_path);
+        return conversion_end(ctx, CONVERSION_ERROR);
+    }
+
+    FILE *audio_file = open_output_file(output_path);
+    if (!audio_file) {
+        close_file(image_file);
+        conversion_error("Couldn't open file %s for writing.\n", output_path);
+        return conversion_end(ctx, CONVERSION_ERROR);
+    }
+
+    ByteSource source;
+    ByteSink sink;
+    byte_source_file(&source, image_file);
+    byte_sink_file(&sink, audio_file);
+
+    int result = encode_stream(ctx, &source, &sink);
+
+    close_file(image_file);
+    result = close_output_file(audio_file, output_path, result);
+    return conversion_end(ctx, result);
+}
+
+// =========================================================================================================== wav - img
+int main_audio_to_image(ConversionContext *ctx, const char *input_path, const char *output_path) {
+    conversion_begin(ctx);
+    FILE *audio_file = open_input_file(input_path);
+    if (!audio_file) {
+        conversion_error("Couldn't open file %s for reading.\n", input_path);
+        return conversion_end(ctx, CONVERSION_ERROR);
+    }
+
+    FILE *image_file = open_output_file(output_path);
+    if (!image_file) {
+        close_file(audio_file);
+        conversion_error("Couldn't open file %s for writing.\n", output_path);
+        return conversion_end(ctx, CONVERSION_ERROR);
+    }
+
+    ByteSource source;
+    ByteSink sink;
+    byte_source_file(&source, audio_file);
+    byte_sink_file(&sink, image_file);
+
+    int result = decode_stream(ctx, &source, &sink);
+
+    close_file(audio_file);
+    result = close_output_file(image_file, output_path, result);
+    return conversion_end(ctx, result);
+}
+
+// Resample a WAV file to the rate in the options, "-" is stdin or stdout
+int main_resample_audio(ConversionContext *ctx, const char *input_path, const char *output_path) {
+    conversion_begin(ctx);
+    FILE *input_file = open_input_file(input_path);
+    if (!input_file) {
+        conversion_error("Couldn't open file %s for reading.\n", input_path);
+        return conversion_end(ctx, CONVERSION_ERROR);
+    }
+
+    FILE *output_file = open_output_file(output_path);
+    if (!output_file) {
+        close_file(input_file);
+        conversion_error("Couldn't open file %s for writing.\n", output_path);
+        return conversion_end(ctx, CONVERSION_ERROR);
+    }
+
+    ByteSource source;
+    ByteSink sink;
+    byte_source_file(&source, input_file);
+    byte_sink_file(&sink, output_file);
+
+    int result = resample_stream(ctx, &source, &sink);
+
+    close_file(input_file);
+    result = close_output_file(output_file, output_path, result);
+    return conversion_end(ctx, result);
+}
+
+// Check the checksums of a WAV or the frames of a FLAC file, "-" is stdin
+int main_verify_audio(ConversionContext *ctx, const char *input_path) {
+    conversion_begin(ctx);
+    FILE *input_file = open_input_file(input_path);
+    if (!input_file) {
+        conversion_error("Couldn't open file %s for reading.\n", input_path);
+        return conversion_end(ctx, CONVERSION_ERROR);
+    }
+
+    ByteSource source;
+    byte_source_file(&source, input_file);
+    int result = verify_stream(ctx, &source);
+
+    close_file(input_file);
+    return conversion_end(ctx, result);
+}
+
+// Encode PNG files into one archive WAV, frames in the order of the paths. The output has to be a file.
+int main_archive_images(ConversionContext *ctx, const char *const *input_paths, int count, const char *output_path) {
+    conversion_begin(ctx);
+    FILE *audio_file = open_output_file(output_path);
+    if (!audio_file) {
+        conversion_error("Couldn't open file %s for writing.\n", output_path);
+        return conversion_end(ctx, CONVERSION_ERROR);
+    }
+
+    ByteSink sink;
+    byte_sink_file(&sink, audio_file);
+    int result = archive_write(ctx, NULL, input_paths, count, &sink);
+
+    result = close_output_file(audio_file, output_path, result);
+    return conversion_end(ctx, result);
+}
+
+// The path of a frame from a pattern holding its number once as %d or %0<digits>d, "%%" being a percent
+// sign. False when the pattern holds no number or the path doesn't fit.
+static bool archive_frame_path(const char *pattern, int frame, char *path, size_t size) {
+    size_t length = 0;
+    bool numbered = false;
+    for (const char *p = pattern; *p; p++) {
+        char piece[32];
+        int count = 1;
+        piece[0] = *p;
+        if (*p == '%' && p[1] == '%') {
+            p++;
+        } else if (*p == '%') {
+            const char *digits = p + 1;
+            int width = 0;
+            while (*digits >= '0' && *digits <= '9' && width < 100) {
+                width = width * 10 + (*digits++ - '0');
+            }
+            if (*digits != 'd' || numbered || width > 16 || (width > 0 && p[1] != '0')) {
+                return false;
+            }
+            count = snprintf(piece, sizeof(piece), "%0*d", width, frame);
+            numbered = true;
+            p = digits;
+        }
+        if (length + count >= size) {
+            return false;
+        }
+        memcpy(path + length, piece, count);
+        length += count;
+    }
+    path[length] = '\0';
+    return numbered;
+}
+
+// All frames of an archive decoded at once, each worker reading through its own handle on the file
+typedef struct {
+    ConversionContext *ctx;
+    const char *input_path;
+    const char *output_pattern;
+    const ArchiveEntry *entries;
+    size_t data_start;
+    int frames;
+    atomic_int done;
+    atomic_int result;            // CONVERSION_OK until a frame fails
+} ArchiveExtraction;
+
+// Stop the extraction at the first failure, its message (kept on the worker's thread) going to the context
+static void archive_extraction_failed(ArchiveExtraction *job, int result) {
+    int expected = CONVERSION_OK;
+    if (atomic_compare_exchange_strong(&job->result, &expected, result) && result == CONVERSION_ERROR) {
+        snprintf(job->ctx->error, sizeof(job->ctx->error), "%s", thread_error);
+    }
+}
+
+static void archive_extract_items(void *arg, int worker, int from, int to) {
+    ArchiveExtraction *job = (ArchiveExtraction *)arg;
+    FILE *audio_file = fopen(job->input_path, "rb");
+    if (!audio_file) {
+        conversion_error("Couldn't open file %s for reading.\n", job->input_path);
+        archive_extraction_failed(job, CONVERSION_ERROR);
+        return;
+    }
+    ByteSource source;
+    byte_source_file(&source, audio_file);
+
+    for (int frame = from; frame < to && atomic_load(&job->result) == CONVERSION_OK; frame++) {
+        char path[FILENAME_MAX];
+        archive_frame_path(job->output_pattern, frame, path, sizeof(path));
+        FILE *image_file = open_output_file(path);
+        int result;
+        if (!image_file) {
+            conversion_error("Couldn't open file %s for writing.\n", path);
+            result = CONVERSION_ERROR;
+        } else {
+            ByteSink sink;
+            byte_sink_file(&sink, image_file);
+            result = archive_decode_frame(job->ctx, &source, job->data_start, &job->entries[frame], frame, &sink);
+            result = close_output_file(image_file, path, result);
+        }
+        if (result == CONVERSION_OK && conversion_cancelled(job->ctx)) {
+            result = CONVERSION_CANCELLED;
+        }
+        if (result != CONVERSION_OK) {
+            archive_extraction_failed(job, result);
+        }
+        // Progress goes out from the calling thread only
+        int done = atomic_fetch_add(&job->done, 1) + 1;
+        if (worker == 0) {
+            conversion_report(job->ctx, (double)done / job->frames);
+        }
+    }
+    fclose(audio_file);
+}
+
+// Decode frame (counted from 0) of an archive WAV to a PNG file, or all its frames when frame is negative,
+// to the paths output_pattern numbers with %d or %04d. The input has to be a file, it is read by seeking.
+int main_extract_images(ConversionContext *ctx, const char *input_path, const char *output_pattern, int frame) {
+    conversion_begin(ctx);
+    char path[FILENAME_MAX];
+    bool numbered = archive_frame_path(output_pattern, frame < 0 ? 0 : frame, path, sizeof(path));
+    if (strcmp(input_path, "-") == 0) {
+        conversion_error("Frames are read from an archive by seeking, give its file rather than stdin.\n");
+        return conversion_end(ctx, CONVERSION_ERROR);
+    }
+    if (frame < 0 && !numbered) {
+        conversion_error("The output name needs a %%d or %%04d for the frame number, e.g. frame%%04d.png.\n");
+        return conversion_end(ctx, CONVERSION_ERROR);
+    }
+    FILE *audio_file = fopen(input_path, "rb");
+    if (!audio_file) {
+        conversion_error("Couldn't open file %s for reading.\n", input_path);
+        return conversion_end(ctx, CONVERSION_ERROR);
+    }
+    ByteSource source;
+    byte_source_file(&source, audio_file);
+
+    // One frame, to the name as given when it holds no number
+    if (frame >= 0) {
+        const char *output_path = numbered ? path : output_pattern;
+        FILE *image_file = open_output_file(output_path);
+        if (!image_file) {
+            fclose(audio_file);
+            conversion_error("Couldn't open file %s for writing.\n", output_path);
+            return conversion_end(ctx, CONVERSION_ERROR);
+        }
+        ByteSink sink;
+        byte_sink_file(&sink, image_file);
+        int result = extract_stream(ctx, &source, frame, &sink);
+        fclose(audio_file);
+        result = close_output_file(image_file, output_path, result);
+        return conversion_end(ctx, result);
+    }
+
+    ArchiveEntry *entries;
+    size_t data_start;
+    int result = archive_read_index(ctx, &source, &entries, &data_start);
+    fclose(audio_file);
+    if (result != CONVERSION_OK) {
+        return conversion_end(ctx, result);
+    }
+    ArchiveExtraction job;
+    job.ctx = ctx;
+    job.input_path = input_path;
+    job.output_pattern = output_pattern;
+    job.entries = entries;
+    job.data_start = data_start;
+    job.frames = (int)ctx->metadata.archive_frames;
+    atomic_init(&job.done, 0);
+    atomic_init(&job.result, CONVERSION_OK);
+    run_workers(archive_extract_items, &job, job.frames, worker_count());
+    result = atomic_load(&job.result);
+    free(entries);
+    if (result == CONVERSION_OK) {
+        conversion_report(ctx, 1.0);
+    }
+    return conversion_end(ctx, result);
+}
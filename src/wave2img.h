@@ -0,0 +1,395 @@
+// Wave2Image conversion library
+// Image <-> audio conversion without any GTK dependency, usable from the app or from other programs.
+#ifndef WAVE2IMG_H
+#define WAVE2IMG_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdatomic.h>
+
+#define SAMPLE_RATE 44100
+#define DURATION 0.05 // Duration for each pixel in seconds
+#define BUFFER_SIZE 4096 // Buffer size for writing samples
+#define BITS_PER_SAMPLE 32
+
+// Data structure modes (values match the "Mode" combo box mapping)
+#define MODE_NONE 0
+#define MODE_LINKED_LIST 1
+#define MODE_STACK 2
+#define MODE_QUEUE 3
+#define MODE_ARRAY 4
+#define MODE_PIPELINE 5 // Array on three threads: PNG decode -> convert -> write
+
+// How the image is carried by the audio
+#define ENCODING_RAW 0 // pixel intensities written directly as PCM amplitudes
+#define ENCODING_APT 1 // NOAA APT style: 2400 Hz AM subcarrier with a sync pulse before every line
+#define ENCODING_SPECTROGRAM 2 // image painted into the spectrum, one column per FFT frame
+#define ENCODING_OFDM 3 // pixels in raster order on hundreds of subcarriers at once, two per carrier
+#define ENCODING_RLE 4  // raw pixels run-length coded at the WAV rate: a sample h below 128 (as a pixel)
+                        // leads h + 1 literal pixels, one from 128 up leads the low 8 bits of a run length
+                        // then the pixel repeated RLE_MIN_RUN + ((h - 128) << 8 | low) times
+
+// How the samples are stored
+#define CONTAINER_WAV 0  // RIFF/WAVE PCM
+#define CONTAINER_FLAC 1 // lossless FLAC, the "w2im" chunk carried in an APPLICATION block
+
+// Colour carried by the audio
+#define COLOR_GRAY 0      // one intensity per pixel, red, green and blue averaged
+#define COLOR_YCBCR 1     // Y, Cb and Cr rows of every image row, three times the audio of gray
+#define COLOR_YCBCR420 2  // two Y rows, then their Cb and Cr averaged over 2x2 pixels side by side: 1.5 times
+#define COLOR_RGB 3       // R, G and B rows, three times the audio of gray
+#define COLOR_RGBA 4      // R, G, B and alpha rows, four times
+
+// How the colour planes share the audio
+#define COLOR_LAYOUT_ROWS 0     // one after the other as rows of a taller grayscale image
+#define COLOR_LAYOUT_CHANNELS 1 // side by side as the channels of a multi-channel WAV, raw encoding only:
+                                // every pixel is one frame, so the audio lasts as long as gray
+
+// Order of raw pixels in the audio
+#define ORDER_RASTER 0 // row after row, left to right
+#define ORDER_ADAM7 1  // seven passes over ever denser grids as in interlaced PNGs: the first sends every 8th
+                       // pixel of every 8th row, so a partial stream decodes to the whole image at a lower
+                       // resolution
+#define ORDER_BOUSTROPHEDON 2 // rows left to right and right to left in turn, no jump between rows
+#define ORDER_MORTON 3        // Z-order curve through square tiles of ORDER_TILE, tiles row after row
+#define ORDER_HILBERT 4       // Hilbert curve through the tiles, which go back and forth along the rows of
+                              // tiles so every step is to a neighbouring pixel but those between rows of tiles
+
+// Prediction of raw rows, numbered as PNG's filter types: residuals go out instead of the pixels, each row led by
+// a sample naming the predictor used for it
+#define PREDICT_NONE 0     // the pixels themselves
+#define PREDICT_LEFT 1     // from the pixel on the left
+#define PREDICT_UP 2       // from the pixel above
+#define PREDICT_AVERAGE 3  // from the average of both
+#define PREDICT_PAETH 4    // from the left, upper or upper left pixel, whichever is closest to left + up - upper left
+#define PREDICT_ADAPTIVE 5 // the one with the smallest residuals, row by row
+
+#define APT_PIXELS_PER_SECOND 4160 // word rate of the NOAA satellites, two 2080 word lines per second
+#define SPECTROGRAM_PIXELS_PER_SECOND 8000 // upper bound, columns last a whole power of two of samples
+
+// Sample formats the pixel kernels can produce
+#define SAMPLE_FORMAT_S16 0 // signed 16-bit PCM
+#define SAMPLE_FORMAT_U8 1  // grayscale intensity bytes, input of the modulators
+#define SAMPLE_FORMAT_COUNT 2
+
+#define PIPELINE_RING_SLOTS 64 // rows in flight between two pipeline stages, power of two
+#define WORKER_THREADS_MAX 16  // threads for data parallel stages (FFT frames), at most one per core
+#define FFT_BATCH_SAMPLES (1 << 21) // frame samples transformed per batch (spectrogram columns, OFDM symbols)
+#define FLAC_BATCH_BLOCKS 64   // FLAC blocks encoded or decoded per batch, split over the workers
+#define FEC_BATCH_BLOCKS 64    // Reed-Solomon blocks coded or corrected per batch, split over the workers
+
+// Sync framing of raw rows: every group of rows starts with a marker and the index of its first row
+#define SYNC_MARKER_SAMPLES 64  // 32 chip pseudo-random pattern of two levels the decoder correlates against
+#define SYNC_INDEX_SAMPLES 64   // 24-bit row index and its CRC-8
+#define SYNC_CHIP_SAMPLES 2     // samples per chip or bit, so markers survive the resampler's low-pass
+#define SYNC_MAX_ROWS (1 << 24) // rows a framed image may have
+#define SYNC_BATCH_SAMPLES (1 << 20) // samples searched for markers and decoded per batch
+
+#define CHECKSUM_BLOCK_SIZE (1 << 20) // WAV data bytes covered by each block checksum
+#define ORDER_TILE_BITS 6
+#define ORDER_TILE (1 << ORDER_TILE_BITS) // pixels per side of the tiles curve orders go through, 8 KB tables
+#define INDEX_TILE 64                 // pixels per side of the square tiles the row index checksums
+#define RLE_LITERALS 128              // most pixels after a literal token
+#define RLE_MIN_RUN 4                 // shortest repeat given a run token, shorter ones stay literal
+#define RLE_MAX_RUN (RLE_MIN_RUN + 0x7FFF) // longest run a token holds
+
+// Size written in the RIFF and data fields when the length isn't known yet (streaming to a pipe)
+#define WAV_SIZE_UNKNOWN 0xFFFFFFFFu
+
+// Format codes of the "fmt " chunk
+#define WAV_FORMAT_PCM 1
+#define WAV_FORMAT_IEEE_FLOAT 3       // 32-bit float samples, full scale at +-1.0
+#define WAV_FORMAT_EXTENSIBLE 0xFFFE  // the real code leads the subformat GUID
+
+// Conversion results
+#define CONVERSION_OK 0
+#define CONVERSION_ERROR 1
+#define CONVERSION_CANCELLED 2
+#define CONVERSION_ERROR_SIZE 256     // bytes kept of the message of a failed conversion
+
+// Progress callback, fraction is between 0.0 and 1.0
+typedef void (*ProgressCallback)(double fraction, void *user_data);
+
+// Options chosen by the user for one conversion
+typedef struct {
+    int sample_rate;
+    int mode;
+    int encoding;           // ENCODING_RAW unless set
+    int pixels_per_second;  // pixel clock: APT word rate, raw pixels per second (the WAV is resampled
+                            // when it differs from sample_rate) or the most a spectrogram may send.
+                            // 0 picks APT_PIXELS_PER_SECOND / SAMPLE_RATE / SPECTROGRAM_PIXELS_PER_SECOND
+    int bits_per_sample;    // 16, or 8 for unsigned 8-bit PCM: half the size, and raw pixels are stored
+                            // exactly as their intensities, or 32 for IEEE float WAVs. 0 picks 16
+    int container;          // CONTAINER_WAV unless set; decoding and resampling read either one
+    int color;              // COLOR_GRAY unless set, decoding rebuilds an RGB(A) PNG from the planes
+    int color_layout;       // COLOR_LAYOUT_ROWS unless set
+    int frame_rows;         // raw encoding: a sync marker and row index before every frame_rows rows, so
+                            // decoding survives lost or extra samples and splits over threads. 0 for none
+    int fec_parity;         // raw encoding: Reed-Solomon parity symbols per codeword of 255, which corrects
+                            // fec_parity / 2 wrong samples in each. 0 for none
+    int order;              // raw encoding: ORDER_ the pixels are sent in, ORDER_RASTER unless set
+    int predictor;          // raw encoding: PREDICT_ of the rows, PREDICT_NONE unless set. Needs the WAV at the
+                            // pixel rate, resampling errors would spread along the rows
+    int region_x;           // decoding: the part of the image written to the PNG, from its top left corner.
+    int region_y;           // A width or height of 0 reaches to the right or bottom edge, all 0 is the
+    int region_width;       // whole image. Raw grayscale WAVs at the pixel rate read only the rows and
+    int region_height;      // columns of the region from a file, anything else is decoded and cropped
+    double max_seconds;     // encoding: the longest the audio may play, or as max_samples the most sample frames
+    int max_samples;        // it may take. The image is shrunk with an area filter until it fits. 0 for no limit
+    int upscale;            // decoding: 1 to scale a shrunk image back to its recorded original size
+} ConversionOptions;
+
+// --------------------------------------------------------------------------------------------------------
+// WAV file header structure
+typedef struct {
+    char riff[4];
+    uint32_t file_size;
+    char wave[4];
+    char fmt[4];
+    uint32_t fmt_size;
+    uint16_t fmt_tag;
+    uint16_t channels;
+    uint32_t sample_rate;
+    uint32_t byte_rate;
+    uint16_t block_align;
+    uint16_t bits_per_sample;
+    char data[4];
+    uint32_t data_size;
+} WavHeader;
+// --------------------------------------------------------------------------------------------------------
+
+#define METADATA_VERSION 11
+
+// "w2im" chunk written before the data chunk by every encoding except ENCODING_RAW, which keeps the
+// original layout (width and height at the start of the data). Fields are only ever appended:
+// readers copy what the chunk holds and leave newer fields zero, version 0 means no chunk was found.
+typedef struct {
+    uint32_t version;
+    uint32_t encoding;
+    uint32_t width;
+    uint32_t height;
+    uint32_t pixels_per_second;   // pixel clock, the APT word rate or the raw pixel rate; for spectrograms,
+                                  // OFDM and run-length coding the sample rate the frames were built at
+    uint32_t sync_words;          // words of sync pulse before every line
+    // Version 2
+    uint32_t fft_size;            // spectrogram frame length, OFDM symbol length without its prefix
+    uint32_t first_bin;           // spectrogram bin of the bottom row, first OFDM subcarrier
+    uint32_t guard_samples;       // spectrogram crossfade between columns, OFDM cyclic prefix
+    // Version 3
+    uint32_t carriers;            // OFDM subcarriers
+    uint32_t training_interval;   // OFDM data symbols after each training symbol
+    // Version 4
+    uint32_t color;               // COLOR_GRAY, or width and height above are those of the colour planes
+    uint32_t image_width;         // colour image the planes rebuild
+    uint32_t image_height;
+    // Version 5
+    uint32_t channels;            // WAV channels carrying the planes side by side, 0 or 1 when they are rows
+    // Version 6
+    uint32_t frame_rows;          // raw rows after every sync marker, 0 without markers
+    // Version 7
+    uint32_t fec_parity;          // Reed-Solomon parity symbols per codeword, 0 without FEC
+    uint32_t fec_depth;           // codewords interleaved in every block
+    // Version 8
+    uint32_t order;               // ORDER_ of the raw pixels
+    // Version 9
+    uint32_t predictor;           // PREDICT_ the raw rows were sent with, each led by its own predictor
+    // Version 10
+    uint32_t original_width;      // image size before a duration limit shrank it, 0 when it wasn't
+    uint32_t original_height;
+    // Version 11
+    uint32_t archive_frames;      // images one after the other in the data of an archive, 0 for a single one
+} ImageMetadata;
+
+#define CHECKSUM_VERSION 1
+
+// "w2ck" chunk after the data chunk of every WAV written with a known size: CRC-32C checksums of the data,
+// whole and per block, and of the "w2im" chunk, so a damaged file is found without decoding it. The
+// checksums of blocks blocks follow. A raw WAV in the original layout has its width and height in
+// the data before the samples data_size counts; data_bytes includes them.
+typedef struct {
+    uint32_t version;
+    uint32_t block_size;          // data bytes per block checksum, the last block may be shorter
+    uint32_t blocks;
+    uint32_t data_bytes;          // bytes between the data chunk header and this chunk, pad byte excluded
+    uint32_t data_crc;            // CRC-32C of all of them
+    uint32_t metadata_crc;        // CRC-32C of the "w2im" chunk contents, 0 when there is none
+} ChecksumHeader;
+
+#define INDEX_VERSION 1
+
+// "w2ix" chunk after "w2ck" in a raw grayscale WAV at the pixel rate written to a file or memory: where the
+// image rows lie in the data, so a region is decoded with positioned reads, and the CRC-32C of every tile
+// of INDEX_TILE x INDEX_TILE pixels, so the region is checked without reading the rest. The checksums of
+// tiles tiles follow, a row of tiles after the other from the top left.
+typedef struct {
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    uint32_t row_offset;          // data bytes ahead of row 0, the width and height of the original layout
+    uint32_t row_bytes;           // data bytes from the start of one row to the next
+    uint32_t sample_bytes;        // data bytes of a pixel
+    uint32_t tile;                // pixels per side of a tile, those on the right and bottom edges may be cut
+    uint32_t tiles;
+} RowIndexHeader;
+
+#define ARCHIVE_VERSION 1
+
+// "w2ar" chunk ending an archive, after its "w2ck": where the data of each frame lies and how to decode it,
+// so one frame is read with a seek. The entries of frames frames follow, entry_size bytes each: newer
+// writers may append fields to them, readers copy the part they know.
+typedef struct {
+    uint32_t version;
+    uint32_t frames;
+    uint32_t entry_size;
+} ArchiveHeader;
+
+typedef struct {
+    uint32_t data_offset;         // data bytes ahead of the frame
+    uint32_t data_bytes;          // data bytes of the frame, the data_size of the WAV it was on its own
+    uint32_t width;               // image the frame decodes to
+    uint32_t height;
+    uint32_t crc;                 // CRC-32C of the frame's data bytes
+    ImageMetadata metadata;       // the "w2im" chunk of the frame, an old raw layout turned into one
+} ArchiveEntry;
+
+// Everything one conversion needs, so several conversions can run at once
+typedef struct {
+    ConversionOptions options;    // copied in at start, never read from the UI while running
+    ProgressCallback progress;    // may be NULL
+    void *progress_data;          // passed back to progress
+    atomic_int cancel_requested;  // set from any thread with conversion_cancel()
+
+    // Buffers owned by the context, released by conversion_context_free()
+    uint8_t *pixels;
+    int width;
+    int height;
+    int16_t *samples;
+    int64_t num_samples;          // of samples, or written to the audio by a streamed conversion
+
+    WavHeader header;             // header of the last WAV written or read
+    ImageMetadata metadata;       // its "w2im" chunk, version 0 if it had none
+    char error[CONVERSION_ERROR_SIZE]; // why the last conversion returned CONVERSION_ERROR, empty otherwise
+    atomic_int warnings;          // damage the last conversion got past, such as codewords or tiles it couldn't trust
+    char warning[CONVERSION_ERROR_SIZE]; // the first of those, empty without any
+} ConversionContext;
+
+// Byte stream read from a FILE, from memory or from a decoder
+typedef struct {
+    FILE *file;          // NULL for memory
+    const uint8_t *data;
+    size_t size;
+    size_t offset;       // bytes consumed so far
+    size_t (*read)(void *state, void *out, size_t size); // bytes produced by a decoder instead, or NULL
+    void *state;
+} ByteSource;
+
+// Byte stream written to a FILE or to a growing malloc'd buffer
+typedef struct {
+    FILE *file;          // NULL for memory
+    bool seekable;       // false for pipes, headers can't be fixed up afterwards
+    bool failed;         // set after the first write error
+    uint8_t *data;       // memory sinks only, owned by the caller once done
+    size_t size;         // bytes written so far
+    size_t capacity;
+} ByteSink;
+
+// Row by row PNG decoding (RGBA rows) and encoding (grayscale rows), or colour plane rows both ways
+typedef struct ImageReader ImageReader;
+typedef struct ImageWriter ImageWriter;
+
+// The functions below are what the shared library exports, everything else in it is built hidden
+#ifdef __GNUC__
+#pragma GCC visibility push(default)
+#endif
+
+// Conversion context
+void conversion_context_init(ConversionContext *ctx, const ConversionOptions *options,
+                             ProgressCallback progress, void *progress_data);
+void conversion_context_free(ConversionContext *ctx);
+void conversion_cancel(ConversionContext *ctx);
+
+// Files and streams, the path "-" means stdin or stdout
+FILE *open_input_file(const char *path);
+FILE *open_output_file(const char *path);
+int close_file(FILE *file);
+void byte_source_file(ByteSource *source, FILE *file);
+void byte_source_memory(ByteSource *source, const uint8_t *data, size_t size);
+size_t byte_source_read(ByteSource *source, void *out, size_t size);
+bool byte_source_skip(ByteSource *source, size_t size);
+bool byte_source_seek(ByteSource *source, size_t offset);
+void byte_sink_file(ByteSink *sink, FILE *file);
+void byte_sink_memory(ByteSink *sink);
+int byte_sink_write(ByteSink *sink, const void *data, size_t size);
+int byte_sink_patch(ByteSink *sink, size_t offset, const void *data, size_t size);
+
+// WAV header
+int read_wav_stream_header(ByteSource *source, WavHeader *header, ImageMetadata *metadata);
+int read_wav_header(FILE *file, WavHeader *header);
+void fill_wav_header(WavHeader *header, int64_t num_samples, int sample_rate);
+void fill_wav_header_bits(WavHeader *header, int64_t num_samples, int sample_rate, int bits_per_sample);
+void write_wav_header(FILE *file, int64_t num_samples, int sample_rate);
+int write_wav_stream_header(ByteSink *sink, WavHeader *header, const ImageMetadata *metadata);
+void finish_wav_header(ByteSink *sink, WavHeader *header, size_t header_offset,
+                       const ImageMetadata *metadata, int64_t num_samples);
+
+// PNG rows
+ImageReader *image_reader_open(ByteSource *source);
+ImageReader *image_reader_open_native(ByteSource *source);
+int image_reader_set_color(ImageReader *reader, int color);
+void image_reader_size(const ImageReader *reader, int *width, int *height);
+int image_reader_channels(const ImageReader *reader);
+int image_reader_read_row(ImageReader *reader, uint8_t *row);
+void image_reader_close(ImageReader *reader);
+ImageWriter *image_writer_open(ByteSink *sink, int width, int height);
+ImageWriter *image_writer_open_color(ByteSink *sink, int width, int height, int color);
+ImageWriter *image_writer_open_native(ByteSink *sink, int width, int height, int channels);
+int color_planes(int color);
+int color_plane_size(int color, int width, int height, int *plane_width, int *plane_height);
+int image_writer_write_row(ImageWriter *writer, const uint8_t *row);
+int image_writer_close(ImageWriter *writer);
+
+// PNG files and in-memory PNG data, pixels are RGBA when read and grayscale when written
+int read_png_file(const char *filename, int *width, int *height, uint8_t **pixels);
+int read_png_buffer(const uint8_t *data, size_t size, int *width, int *height, uint8_t **pixels);
+int write_png_file(const char *filename, int width, int height, const uint8_t *pixels);
+int write_png_buffer(int width, int height, const uint8_t *pixels, uint8_t **out, size_t *out_size);
+
+// Raw buffers: pixels (channels per pixel) to 16-bit PCM and 16-bit PCM back to grayscale pixels.
+// Output buffers are allocated with malloc and owned by the caller.
+int pixels_to_samples(ConversionContext *ctx, const uint8_t *pixels, int width, int height, int channels,
+                      int16_t **samples, int *num_samples);
+int samples_to_pixels(ConversionContext *ctx, const int16_t *samples, int num_samples, int width, int height,
+                      uint8_t **pixels);
+
+// Encoded buffers: PNG bytes to WAV bytes and back, nothing touches the disk
+int image_to_audio_buffer(ConversionContext *ctx, const uint8_t *png, size_t png_size,
+                          uint8_t **wav, size_t *wav_size);
+int audio_to_image_buffer(ConversionContext *ctx, const uint8_t *wav, size_t wav_size,
+                          uint8_t **png, size_t *png_size);
+
+// Streams: the same conversions on any byte source / sink, never seeking the input
+int encode_stream(ConversionContext *ctx, ByteSource *input, ByteSink *output);
+int decode_stream(ConversionContext *ctx, ByteSource *input, ByteSink *output);
+int resample_stream(ConversionContext *ctx, ByteSource *input, ByteSink *output);
+int verify_stream(ConversionContext *ctx, ByteSource *input);
+
+// Archives: images encoded one after the other into one WAV with a "w2ar" index, written to a sink that
+// can seek and read back from a source that can
+int archive_stream(ConversionContext *ctx, ByteSource *inputs, int count, ByteSink *output);
+int extract_stream(ConversionContext *ctx, ByteSource *input, int frame, ByteSink *output);
+
+// Files: the same conversions reading and writing named files, "-" streams through stdin / stdout
+int main_image_to_audio(ConversionContext *ctx, const char *input_path, const char *output_path);
+int main_audio_to_image(ConversionContext *ctx, const char *input_path, const char *output_path);
+int main_resample_audio(ConversionContext *ctx, const char *input_path, const char *output_path);
+int main_verify_audio(ConversionContext *ctx, const char *input_path);
+int main_archive_images(ConversionContext *ctx, const char *const *input_paths, int count, const char *output_path);
+int main_extract_images(ConversionContext *ctx, const char *input_path, const char *output_pattern, int frame);
+
+#ifdef __GNUC__
+#pragma GCC visibility pop
+#endif
+
+#endif // WAVE2IMG_H